@@ -17,6 +17,7 @@
 #define IDM_DORENDER			110
 #define IDM_OPENFILE			111
 #define IDM_SAVEFILE			112
+#define IDM_CANCELRENDER		113
 
 // -- Custom Stuff Ends! ----------------------------------------------
 #define IDC_MYICON				2
@@ -0,0 +1,1043 @@
+#include "stdafx.h"
+
+#include "accel.h"
+#include "morton.h"
+#include "parallel.h"
+#include "profile.h"
+
+#include <algorithm>
+#include <float.h>
+#include <typeinfo>
+#include <emmintrin.h> // SSE2
+
+using namespace raytracer;
+
+#define RAYTRACER_BVH_STACK		512	// Traversal stack, build keeps depth well below that
+#define RAYTRACER_BVH_SAHDEPTH	64	// Past this depth splits are plain halves, so depth stays logarithmic
+//---------------------------------------------------------------
+// Build helpers
+//---------------------------------------------------------------
+static float HalfArea(vector bmin, vector bmax)
+{
+	vector e = bmax-bmin;
+	return e.x*e.y + e.y*e.z + e.z*e.x;
+}
+
+static float Axis(vector &v, int a)
+{
+	return a==0?v.x:(a==1?v.y:v.z);
+}
+
+// Primitive boxes, padded a little: hit points are computed in float and may poke out of exact bounds
+struct BoundsJob
+{
+	Renderable	**prims;
+	vector		*bmins, *bmaxs, *centers;
+	int			count, chunk;
+	void operator()(int c)
+	{
+		for (int i = c*chunk; i<min(count,(c+1)*chunk); i++)
+		{
+			vector lo, hi;
+			prims[i]->GetBounds(lo, hi);
+			vector e = hi-lo;
+			float pad = (max(max(e.x,e.y),e.z) + max(max(abs(lo.x),abs(lo.y)),abs(lo.z)) + max(max(abs(hi.x),abs(hi.y)),abs(hi.z)))*1e-5f;
+			bmins[i]	= lo-vector(pad,pad,pad);
+			bmaxs[i]	= hi+vector(pad,pad,pad);
+			centers[i]	= (bmins[i]+bmaxs[i])*0.5;
+		}
+	}
+};
+
+// Forces float rounding of both steps, so that x87 code builds the same boxes SSE traversal reads
+static float Dequantize(float origin, float scale, int q)
+{
+	volatile float m = (float)q*scale;
+	volatile float r = origin+m;
+	return r;
+}
+
+void Accel::Clear()
+{
+	prims.clear();
+	bvh.clear();
+	qbvh.clear();
+	soa.clear();
+	soastride = 0;
+	format = ACCEL_NONE;
+	stats.nodes = stats.prims = stats.maxleaf = 0;
+	stats.bytes = 0;
+}
+
+void Accel::Build(std::vector<Renderable*> &objects, AccelFormat fmt, AccelBuild quality)
+{
+	RAYTRACER_PROFILE_SCOPE("Accel::Build");
+	LARGE_INTEGER freq, start, end;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+
+	Clear();
+	prims	= objects;
+	format	= fmt;
+	stats.prims = (int)prims.size();
+	if (prims.empty() || fmt==ACCEL_NONE)
+	{
+		BuildSoA(); // Flat list is tested in lane groups too
+		return;
+	}
+
+	std::vector<vector> bmins(prims.size()), bmaxs(prims.size()), centers(prims.size());
+	BoundsJob bj;
+	bj.prims	= &prims[0];
+	bj.bmins	= &bmins[0];
+	bj.bmaxs	= &bmaxs[0];
+	bj.centers	= &centers[0];
+	bj.count	= (int)prims.size();
+	bj.chunk	= 16384;
+	ParallelFor((bj.count+bj.chunk-1)/bj.chunk, bj);
+
+	bvh.reserve(prims.size()*2/RAYTRACER_BVH_LEAFSIZE+1);
+	if (quality==ACCEL_FASTTRACE)
+		BuildBVH(0, (int)prims.size(), 0, bmins, bmaxs, centers);
+	else
+		BuildLBVH(quality==ACCEL_BALANCED, bmins, bmaxs, centers);
+
+	if (fmt==ACCEL_QBVH)
+	{
+		BuildQBVH();
+		// Binary tree was just scaffolding
+		std::vector<BVHNode>().swap(bvh);
+		stats.nodes = (int)qbvh.size();
+		stats.bytes = qbvh.size()*sizeof(QBVHNode);
+	}
+	else
+	{
+		stats.nodes = (int)bvh.size();
+		stats.bytes = bvh.size()*sizeof(BVHNode);
+	}
+	BuildSoA();
+	QueryPerformanceCounter(&end);
+	stats.buildms = (end.QuadPart-start.QuadPart)*1000.0/freq.QuadPart;
+}
+
+//---------------------------------------------------------------
+// Binary BVH, binned SAH
+//---------------------------------------------------------------
+int Accel::BuildBVH(int first, int count, int depth, std::vector<vector> &bmins, std::vector<vector> &bmaxs, std::vector<vector> &centers)
+{
+	int index = (int)bvh.size();
+	bvh.push_back(BVHNode());
+
+	vector lo = bmins[first], hi = bmaxs[first];
+	vector clo = centers[first], chi = centers[first];
+	for (int i = first+1; i<first+count; i++)
+	{
+		lo	= vector(min(lo.x,bmins[i].x), min(lo.y,bmins[i].y), min(lo.z,bmins[i].z));
+		hi	= vector(max(hi.x,bmaxs[i].x), max(hi.y,bmaxs[i].y), max(hi.z,bmaxs[i].z));
+		clo	= vector(min(clo.x,centers[i].x), min(clo.y,centers[i].y), min(clo.z,centers[i].z));
+		chi	= vector(max(chi.x,centers[i].x), max(chi.y,centers[i].y), max(chi.z,centers[i].z));
+	}
+	BVHNode &n = bvh[index];
+	n.bmin[0] = lo.x; n.bmin[1] = lo.y; n.bmin[2] = lo.z;
+	n.bmax[0] = hi.x; n.bmax[1] = hi.y; n.bmax[2] = hi.z;
+
+	if (count<=RAYTRACER_BVH_LEAFSIZE)
+	{
+		n.first = first;
+		n.count = count;
+		n.left	= n.right = -1;
+		stats.maxleaf = max(stats.maxleaf, count);
+		return index;
+	}
+
+	// Find cheapest split plane among bin borders of all 3 axes
+	int		bestaxis = -1, bestbin = 0;
+	float	bestcost = 1e30f;
+	if (depth<RAYTRACER_BVH_SAHDEPTH)
+	{
+		for (int a = 0; a<3; a++)
+		{
+			float cmin = Axis(clo,a), extent = Axis(chi,a)-cmin;
+			if (extent<=0.f) continue;
+			float k = RAYTRACER_BVH_BINS/extent;
+
+			int		bincount[RAYTRACER_BVH_BINS];
+			vector	binlo[RAYTRACER_BVH_BINS], binhi[RAYTRACER_BVH_BINS];
+			for (int b = 0; b<RAYTRACER_BVH_BINS; b++)
+			{
+				bincount[b] = 0;
+				binlo[b] = vector(1e30f,1e30f,1e30f);
+				binhi[b] = vector(-1e30f,-1e30f,-1e30f);
+			}
+			for (int i = first; i<first+count; i++)
+			{
+				int b = min(RAYTRACER_BVH_BINS-1, (int)((Axis(centers[i],a)-cmin)*k));
+				bincount[b]++;
+				binlo[b] = vector(min(binlo[b].x,bmins[i].x), min(binlo[b].y,bmins[i].y), min(binlo[b].z,bmins[i].z));
+				binhi[b] = vector(max(binhi[b].x,bmaxs[i].x), max(binhi[b].y,bmaxs[i].y), max(binhi[b].z,bmaxs[i].z));
+			}
+			// Sweep from the right to get right side areas, then from the left to evaluate
+			float	rightarea[RAYTRACER_BVH_BINS];
+			int		rightcount[RAYTRACER_BVH_BINS];
+			vector	rlo(1e30f,1e30f,1e30f), rhi(-1e30f,-1e30f,-1e30f);
+			int		rc = 0;
+			for (int b = RAYTRACER_BVH_BINS-1; b>0; b--)
+			{
+				rlo = vector(min(rlo.x,binlo[b].x), min(rlo.y,binlo[b].y), min(rlo.z,binlo[b].z));
+				rhi = vector(max(rhi.x,binhi[b].x), max(rhi.y,binhi[b].y), max(rhi.z,binhi[b].z));
+				rc += bincount[b];
+				rightarea[b]	= rc?HalfArea(rlo,rhi):0.f;
+				rightcount[b]	= rc;
+			}
+			vector	llo(1e30f,1e30f,1e30f), lhi(-1e30f,-1e30f,-1e30f);
+			int		lc = 0;
+			for (int b = 0; b<RAYTRACER_BVH_BINS-1; b++)
+			{
+				llo = vector(min(llo.x,binlo[b].x), min(llo.y,binlo[b].y), min(llo.z,binlo[b].z));
+				lhi = vector(max(lhi.x,binhi[b].x), max(lhi.y,binhi[b].y), max(lhi.z,binhi[b].z));
+				lc += bincount[b];
+				if (lc==0 || rightcount[b+1]==0) continue;
+				float cost = lc*HalfArea(llo,lhi) + rightcount[b+1]*rightarea[b+1];
+				if (cost<bestcost)
+				{
+					bestcost	= cost;
+					bestaxis	= a;
+					bestbin		= b;
+				}
+			}
+		}
+	}
+
+	// Partition primitives in place, keeping all four arrays in step
+	int mid = first+count/2;
+	if (bestaxis>=0)
+	{
+		float cmin = Axis(clo,bestaxis);
+		float k = RAYTRACER_BVH_BINS/(Axis(chi,bestaxis)-cmin);
+		int i = first, j = first+count-1;
+		while (i<=j)
+		{
+			if (min(RAYTRACER_BVH_BINS-1, (int)((Axis(centers[i],bestaxis)-cmin)*k))<=bestbin) i++;
+			else
+			{
+				std::swap(prims[i], prims[j]);
+				std::swap(bmins[i], bmins[j]);
+				std::swap(bmaxs[i], bmaxs[j]);
+				std::swap(centers[i], centers[j]);
+				j--;
+			}
+		}
+		mid = i;
+	}
+	// All centers in one spot(or too deep): just halve the list
+	if (mid==first || mid==first+count) mid = first+count/2;
+
+	int l = BuildBVH(first, mid-first, depth+1, bmins, bmaxs, centers);
+	int r = BuildBVH(mid, first+count-mid, depth+1, bmins, bmaxs, centers);
+	bvh[index].left		= l;	// n may be dangling now, vector could have grown
+	bvh[index].right	= r;
+	bvh[index].first	= -1;
+	bvh[index].count	= 0;
+	return index;
+}
+
+//---------------------------------------------------------------
+// Linear BVH
+//---------------------------------------------------------------
+// Primitives are sorted along Morton curve of their centers, then every node splits its range
+// where the highest differing code bit flips. Sorted list is cut into clusters first,
+// clusters are built on all cores, then levels above them are made either the same way
+// or, when refining, with SAH over cluster boxes, which is where SAH pays off the most.
+static vector BoxMin(vector a, vector b){return vector(min(a.x,b.x), min(a.y,b.y), min(a.z,b.z));}
+static vector BoxMax(vector a, vector b){return vector(max(a.x,b.x), max(a.y,b.y), max(a.z,b.z));}
+
+// Morton keys of centers inside centers' bounding box
+struct MortonJob
+{
+	vector			*centers;
+	unsigned int	*keys, *vals;
+	vector			origin, scale;
+	int				count, chunk;
+	void operator()(int c)
+	{
+		for (int i = c*chunk; i<min(count,(c+1)*chunk); i++)
+		{
+			vector p = (centers[i]-origin)*scale;
+			keys[i] = Morton3D(p.x, p.y, p.z);
+			vals[i] = i;
+		}
+	}
+};
+
+// LSD radix sort, 8 bits per pass. Every chunk counts its digits, then scatters
+// into its own slice of every bucket, so passes stay stable across threads.
+struct RadixCountJob
+{
+	unsigned int	*keys;
+	unsigned int	*hist;	// [chunk][256]
+	int				shift, count, chunk;
+	void operator()(int c)
+	{
+		unsigned int *h = hist+c*256;
+		memset(h, 0, 256*sizeof(unsigned int));
+		for (int i = c*chunk; i<min(count,(c+1)*chunk); i++)
+			h[(keys[i]>>shift)&255]++;
+	}
+};
+
+struct RadixScatterJob
+{
+	unsigned int	*keys, *vals, *outkeys, *outvals;
+	unsigned int	*offs;	// [chunk][256], first free slot
+	int				shift, count, chunk;
+	void operator()(int c)
+	{
+		unsigned int *o = offs+c*256;
+		for (int i = c*chunk; i<min(count,(c+1)*chunk); i++)
+		{
+			unsigned int p = o[(keys[i]>>shift)&255]++;
+			outkeys[p] = keys[i];
+			outvals[p] = vals[i];
+		}
+	}
+};
+
+static void RadixSort(std::vector<unsigned int> &keys, std::vector<unsigned int> &vals, int bits)
+{
+	int count	= (int)keys.size();
+	int chunk	= max(16384, count/(GetWorkerCount()*4)+1);
+	int chunks	= (count+chunk-1)/chunk;
+	std::vector<unsigned int> tmpkeys(count), tmpvals(count), hist(chunks*256);
+
+	RadixCountJob	cj;
+	RadixScatterJob	sj;
+	cj.hist		= sj.offs	= &hist[0];
+	cj.count	= sj.count	= count;
+	cj.chunk	= sj.chunk	= chunk;
+	unsigned int *k = &keys[0], *v = &vals[0], *tk = &tmpkeys[0], *tv = &tmpvals[0];
+	for (int shift = 0; shift<bits; shift+=8)
+	{
+		cj.keys		= k;
+		cj.shift	= sj.shift = shift;
+		ParallelFor(chunks, cj);
+		// Digit-major prefix sum turns counts into write positions
+		unsigned int sum = 0;
+		for (int d = 0; d<256; d++)
+			for (int c = 0; c<chunks; c++)
+			{
+				unsigned int n = hist[c*256+d];
+				hist[c*256+d] = sum;
+				sum += n;
+			}
+		sj.keys		= k;	sj.vals		= v;
+		sj.outkeys	= tk;	sj.outvals	= tv;
+		ParallelFor(chunks, sj);
+		std::swap(k, tk);
+		std::swap(v, tv);
+	}
+	if (k!=&keys[0])
+	{
+		memcpy(&keys[0], k, count*sizeof(unsigned int));
+		memcpy(&vals[0], v, count*sizeof(unsigned int));
+	}
+}
+
+// Puts primitives and their boxes into sorted order
+struct GatherJob
+{
+	unsigned int	*order;
+	Renderable		**src, **dst;
+	vector			*srclo, *srchi, *dstlo, *dsthi;
+	int				count, chunk;
+	void operator()(int c)
+	{
+		for (int i = c*chunk; i<min(count,(c+1)*chunk); i++)
+		{
+			dst[i]		= src[order[i]];
+			dstlo[i]	= srclo[order[i]];
+			dsthi[i]	= srchi[order[i]];
+		}
+	}
+};
+
+struct LBVHCluster
+{
+	int						first, count;
+	std::vector<BVHNode>	nodes;	// Local indices, root is first
+	int						maxleaf;
+};
+
+struct LBVHBuilder
+{
+	unsigned int	*keys;
+	vector			*bmins, *bmaxs;
+	std::vector<LBVHCluster>	*clusters;
+
+	// First index of the upper half of [first,first+count), split on highest differing key bit
+	int Split(int first, int count)
+	{
+		unsigned int a = keys[first], b = keys[first+count-1];
+		if (a==b) return first+count/2;	// Same cell, nothing to tell them apart
+		int bit = 31;
+		while (!(((a^b)>>bit)&1)) bit--;
+		int lo = first, hi = first+count-1; // keys[hi] has the bit, keys[lo] doesn't
+		while (hi-lo>1)
+		{
+			int m = (lo+hi)/2;
+			if ((keys[m]>>bit)&1) hi = m; else lo = m;
+		}
+		return hi;
+	}
+
+	int Emit(std::vector<BVHNode> &nodes, int first, int count, int &maxleaf)
+	{
+		int index = (int)nodes.size();
+		nodes.push_back(BVHNode());
+		if (count<=RAYTRACER_BVH_LEAFSIZE)
+		{
+			vector lo = bmins[first], hi = bmaxs[first];
+			for (int i = first+1; i<first+count; i++)
+			{
+				lo = BoxMin(lo, bmins[i]);
+				hi = BoxMax(hi, bmaxs[i]);
+			}
+			BVHNode &n = nodes[index];
+			n.bmin[0] = lo.x; n.bmin[1] = lo.y; n.bmin[2] = lo.z;
+			n.bmax[0] = hi.x; n.bmax[1] = hi.y; n.bmax[2] = hi.z;
+			n.first = first;
+			n.count = count;
+			n.left	= n.right = -1;
+			maxleaf = max(maxleaf, count);
+			return index;
+		}
+		int mid = Split(first, count);
+		int l = Emit(nodes, first, mid-first, maxleaf);
+		int r = Emit(nodes, mid, first+count-mid, maxleaf);
+		BVHNode &n = nodes[index];
+		for (int a = 0; a<3; a++)
+		{
+			n.bmin[a] = min(nodes[l].bmin[a], nodes[r].bmin[a]);
+			n.bmax[a] = max(nodes[l].bmax[a], nodes[r].bmax[a]);
+		}
+		n.left	= l;
+		n.right	= r;
+		n.first	= -1;
+		n.count	= 0;
+		return index;
+	}
+
+	// Cuts sorted range into clusters along the same splits Emit would make
+	void Cut(int first, int count, int limit)
+	{
+		if (count<=limit)
+		{
+			LBVHCluster c;
+			c.first		= first;
+			c.count		= count;
+			c.maxleaf	= 0;
+			clusters->push_back(c);
+			return;
+		}
+		int mid = Split(first, count);
+		Cut(first, mid-first, limit);
+		Cut(mid, first+count-mid, limit);
+	}
+
+	void operator()(int c)
+	{
+		LBVHCluster &cl = (*clusters)[c];
+		cl.nodes.reserve(cl.count*2/RAYTRACER_BVH_LEAFSIZE+1);
+		Emit(cl.nodes, cl.first, cl.count, cl.maxleaf);
+	}
+};
+
+// Upper levels over clusters [lo,hi) of order
+struct LBVHTop
+{
+	std::vector<BVHNode>		*bvh;
+	std::vector<LBVHCluster>	*clusters;
+	unsigned int				*keys;
+	bool						refine;
+	int							maxleaf;
+
+	static vector Lo(BVHNode &n){return vector(n.bmin[0],n.bmin[1],n.bmin[2]);}
+	static vector Hi(BVHNode &n){return vector(n.bmax[0],n.bmax[1],n.bmax[2]);}
+
+	// Copies cluster nodes in, shifting child indices
+	int Append(int c)
+	{
+		LBVHCluster &cl = (*clusters)[c];
+		int base = (int)bvh->size();
+		for (unsigned int i = 0; i<cl.nodes.size(); i++)
+		{
+			BVHNode n = cl.nodes[i];
+			if (n.first<0)
+			{
+				n.left	+= base;
+				n.right	+= base;
+			}
+			bvh->push_back(n);
+		}
+		maxleaf = max(maxleaf, cl.maxleaf);
+		std::vector<BVHNode>().swap(cl.nodes);
+		return base;
+	}
+
+	// Full sweep SAH over cluster boxes. There are only ~RAYTRACER_LBVH_CLUSTERS of them,
+	// so sorting on every level is cheap.
+	struct CenterLess
+	{
+		std::vector<LBVHCluster> *clusters;
+		int axis;
+		bool operator()(int a, int b)
+		{
+			BVHNode &na = (*clusters)[a].nodes[0], &nb = (*clusters)[b].nodes[0];
+			return na.bmin[axis]+na.bmax[axis] < nb.bmin[axis]+nb.bmax[axis];
+		}
+	};
+
+	int SAHSplit(std::vector<int> &order, int lo, int hi)
+	{
+		int		n = hi-lo;
+		int		bestaxis = -1, bestmid = lo+n/2;
+		float	bestcost = 1e30f;
+		std::vector<float> rightarea(n);
+		CenterLess less;
+		less.clusters = clusters;
+		for (int a = 0; a<3; a++)
+		{
+			less.axis = a;
+			std::sort(order.begin()+lo, order.begin()+hi, less);
+			vector rlo(1e30f,1e30f,1e30f), rhi(-1e30f,-1e30f,-1e30f);
+			for (int i = n-1; i>0; i--)
+			{
+				BVHNode &r = (*clusters)[order[lo+i]].nodes[0];
+				rlo = BoxMin(rlo, Lo(r));
+				rhi = BoxMax(rhi, Hi(r));
+				rightarea[i] = HalfArea(rlo, rhi)*(n-i);
+			}
+			vector llo(1e30f,1e30f,1e30f), lhi(-1e30f,-1e30f,-1e30f);
+			for (int i = 1; i<n; i++)
+			{
+				BVHNode &l = (*clusters)[order[lo+i-1]].nodes[0];
+				llo = BoxMin(llo, Lo(l));
+				lhi = BoxMax(lhi, Hi(l));
+				float cost = HalfArea(llo, lhi)*i + rightarea[i];
+				if (cost<bestcost)
+				{
+					bestcost	= cost;
+					bestaxis	= a;
+					bestmid		= lo+i;
+				}
+			}
+		}
+		less.axis = bestaxis;
+		if (bestaxis!=2) std::sort(order.begin()+lo, order.begin()+hi, less);
+		return bestmid;
+	}
+
+	// Same split as LBVHBuilder::Split, on cluster granularity
+	int MortonSplit(std::vector<int> &order, int lo, int hi)
+	{
+		unsigned int a = keys[(*clusters)[order[lo]].first];
+		LBVHCluster &last = (*clusters)[order[hi-1]];
+		unsigned int b = keys[last.first+last.count-1];
+		if (a==b) return lo+(hi-lo)/2;
+		int bit = 31;
+		while (!(((a^b)>>bit)&1)) bit--;
+		for (int i = lo+1; i<hi; i++)
+			if ((keys[(*clusters)[order[i]].first]>>bit)&1) return i;
+		return lo+(hi-lo)/2;
+	}
+
+	int Emit(std::vector<int> &order, int lo, int hi)
+	{
+		if (hi-lo==1) return Append(order[lo]);
+		int index = (int)bvh->size();
+		bvh->push_back(BVHNode());
+		int mid = refine?SAHSplit(order, lo, hi):MortonSplit(order, lo, hi);
+		int l = Emit(order, lo, mid);
+		int r = Emit(order, mid, hi);
+		BVHNode &n = (*bvh)[index];
+		for (int a = 0; a<3; a++)
+		{
+			n.bmin[a] = min((*bvh)[l].bmin[a], (*bvh)[r].bmin[a]);
+			n.bmax[a] = max((*bvh)[l].bmax[a], (*bvh)[r].bmax[a]);
+		}
+		n.left	= l;
+		n.right	= r;
+		n.first	= -1;
+		n.count	= 0;
+		return index;
+	}
+};
+
+void Accel::BuildLBVH(bool refine, std::vector<vector> &bmins, std::vector<vector> &bmaxs, std::vector<vector> &centers)
+{
+	int count = (int)prims.size();
+	int chunk = 16384;
+	int chunks = (count+chunk-1)/chunk;
+
+	// Morton grid spans centers, not boxes, so codes use all 10 bits per axis
+	vector clo = centers[0], chi = centers[0];
+	for (int i = 1; i<count; i++)
+	{
+		clo = BoxMin(clo, centers[i]);
+		chi = BoxMax(chi, centers[i]);
+	}
+	vector e = chi-clo;
+	MortonJob mj;
+	std::vector<unsigned int> keys(count), order(count);
+	mj.centers	= &centers[0];
+	mj.keys		= &keys[0];
+	mj.vals		= &order[0];
+	mj.origin	= clo;
+	mj.scale	= vector(e.x>0?1.f/e.x:0.f, e.y>0?1.f/e.y:0.f, e.z>0?1.f/e.z:0.f);
+	mj.count	= count;
+	mj.chunk	= chunk;
+	ParallelFor(chunks, mj);
+
+	RadixSort(keys, order, 30);
+
+	std::vector<Renderable*> sorted(count);
+	std::vector<vector> slo(count), shi(count);
+	GatherJob gj;
+	gj.order	= &order[0];
+	gj.src		= &prims[0];	gj.dst		= &sorted[0];
+	gj.srclo	= &bmins[0];	gj.dstlo	= &slo[0];
+	gj.srchi	= &bmaxs[0];	gj.dsthi	= &shi[0];
+	gj.count	= count;
+	gj.chunk	= chunk;
+	ParallelFor(chunks, gj);
+	prims.swap(sorted);
+
+	// Clusters on all cores
+	std::vector<LBVHCluster> clusters;
+	LBVHBuilder lb;
+	lb.keys		= &keys[0];
+	lb.bmins	= &slo[0];
+	lb.bmaxs	= &shi[0];
+	lb.clusters	= &clusters;
+	lb.Cut(0, count, max(RAYTRACER_BVH_LEAFSIZE, count/RAYTRACER_LBVH_CLUSTERS));
+	ParallelFor((int)clusters.size(), lb);
+
+	// Levels above clusters
+	LBVHTop top;
+	top.bvh			= &bvh;
+	top.clusters	= &clusters;
+	top.keys		= &keys[0];
+	top.refine		= refine;
+	top.maxleaf		= 0;
+	std::vector<int> corder(clusters.size());
+	for (unsigned int i = 0; i<corder.size(); i++) corder[i] = i;
+	// Root ends up as node 0 either way, traversal starts there
+	top.Emit(corder, 0, (int)corder.size());
+	stats.maxleaf = top.maxleaf;
+}
+
+//---------------------------------------------------------------
+// 4-wide quantized BVH
+//---------------------------------------------------------------
+// Each node pulls up to 4 descendants from the binary tree, opening biggest ones first.
+void Accel::BuildQBVH()
+{
+	qbvh.reserve(bvh.size()/2+1);
+	CollapseNode(0);
+}
+
+int Accel::CollapseNode(int bvhnode)
+{
+	int index = (int)qbvh.size();
+	qbvh.push_back(QBVHNode());
+
+	int kids[4];
+	int n = 0;
+	if (bvh[bvhnode].first>=0)
+		kids[n++] = bvhnode; // Whole tree is a single leaf
+	else
+	{
+		kids[n++] = bvh[bvhnode].left;
+		kids[n++] = bvh[bvhnode].right;
+	}
+	while (n<4)
+	{
+		int		open = -1;
+		float	area = -1.f;
+		for (int i = 0; i<n; i++)
+		{
+			BVHNode &k = bvh[kids[i]];
+			if (k.first>=0) continue;
+			float a = HalfArea(vector(k.bmin[0],k.bmin[1],k.bmin[2]), vector(k.bmax[0],k.bmax[1],k.bmax[2]));
+			if (a>area) { area = a; open = i; }
+		}
+		if (open<0) break;
+		int k = kids[open];
+		kids[open]	= bvh[k].left;
+		kids[n++]	= bvh[k].right;
+	}
+
+	// Quantization grid is the union of children boxes
+	QBVHNode q;
+	for (int a = 0; a<3; a++)
+	{
+		float lo = 1e30f, hi = -1e30f;
+		for (int i = 0; i<n; i++)
+		{
+			lo = min(lo, bvh[kids[i]].bmin[a]);
+			hi = max(hi, bvh[kids[i]].bmax[a]);
+		}
+		float scale = (hi-lo)/255.f;
+		// Top of the grid must reach the box. Tiny or denormal extents don't grow by small steps, doubling always ends.
+		for (int r = 0; Dequantize(lo, scale, 255)<hi; r++)
+			scale = r<RAYTRACER_QBVH_GROW ? scale*1.0001f : max(scale*2.f, FLT_MIN);
+		q.origin[a]	= lo;
+		q.scale[a]	= scale;
+
+		for (int i = 0; i<4; i++)
+		{
+			if (i>=n)
+			{
+				// Inverted box, never hit
+				q.qlo[a][i] = 255;
+				q.qhi[a][i] = 0;
+				continue;
+			}
+			BVHNode &k = bvh[kids[i]];
+			int ql = 0, qh = 0;
+			if (scale>0.f)
+			{
+				ql = max(0, min(255, (int)floor((k.bmin[a]-lo)/scale)));
+				qh = max(0, min(255, (int)ceil((k.bmax[a]-lo)/scale)));
+				// Dequantized box must contain the exact one
+				while (ql>0 && Dequantize(lo, scale, ql)>k.bmin[a]) ql--;
+				while (qh<255 && Dequantize(lo, scale, qh)<k.bmax[a]) qh++;
+			}
+			q.qlo[a][i] = (unsigned char)ql;
+			q.qhi[a][i] = (unsigned char)qh;
+		}
+	}
+	for (int i = 0; i<4; i++)
+	{
+		if (i>=n) { q.child[i] = RAYTRACER_QBVH_EMPTY; continue; }
+		BVHNode &k = bvh[kids[i]];
+		if (k.first>=0)
+			q.child[i] = ~((k.first<<4)|k.count);
+		else
+			q.child[i] = CollapseNode(kids[i]);
+	}
+	qbvh[index] = q;
+	return index;
+}
+
+//---------------------------------------------------------------
+// Structure of arrays for lane group tests
+//---------------------------------------------------------------
+// Field arrays, soastride floats each. Spheres use center and radius^2, triangles first vertex,
+// both edges and edge sizes(for error bounds). Other primitives(meshes) are always handed to Draw.
+enum SoAField
+{
+	SOA_X, SOA_Y, SOA_Z,			// Sphere center, triangle first vertex
+	SOA_E1X, SOA_E1Y, SOA_E1Z,		// Sphere: SOA_E1X is radius^2
+	SOA_E2X, SOA_E2Y, SOA_E2Z,
+	SOA_E1N, SOA_E2N,				// |e1|, |e2| as sum of abs components
+	SOA_KIND,						// SOA_OTHER, SOA_SPHERE or SOA_TRIANGLE
+	SOA_FIELDS
+};
+#define SOA_OTHER		0.f
+#define SOA_SPHERE		1.f
+#define SOA_TRIANGLE	2.f
+#define SOA_TOLERANCE	1e-4f	// Relative slack of float tests, float error is some 1e-6 of the same terms
+
+void Accel::BuildSoA()
+{
+	soa.clear();
+	soastride = 0;
+#if RAYTRACER_ACCEL_SOA
+	soastride = (int)prims.size()+RAYTRACER_LANES;
+	soa.assign(SOA_FIELDS*soastride, 0.f);	// Padding is SOA_OTHER and never passes lane count
+	for (unsigned int i = 0; i<prims.size(); i++)
+	{
+		float *f = &soa[i];
+		Renderable *p = prims[i];
+		if (typeid(*p)==typeid(Sphere))
+		{
+			Sphere *sp = (Sphere*)p;
+			f[SOA_X*soastride] = sp->pos.x; f[SOA_Y*soastride] = sp->pos.y; f[SOA_Z*soastride] = sp->pos.z;
+			f[SOA_E1X*soastride] = sp->radius*sp->radius;
+			f[SOA_KIND*soastride] = SOA_SPHERE;
+		}
+		else if (typeid(*p)==typeid(Triangle))
+		{
+			Triangle *tr = (Triangle*)p;
+			vector e1 = tr->pos1-tr->pos, e2 = tr->pos2-tr->pos;
+			f[SOA_X*soastride] = tr->pos.x; f[SOA_Y*soastride] = tr->pos.y; f[SOA_Z*soastride] = tr->pos.z;
+			f[SOA_E1X*soastride] = e1.x; f[SOA_E1Y*soastride] = e1.y; f[SOA_E1Z*soastride] = e1.z;
+			f[SOA_E2X*soastride] = e2.x; f[SOA_E2Y*soastride] = e2.y; f[SOA_E2Z*soastride] = e2.z;
+			f[SOA_E1N*soastride] = abs(e1.x)+abs(e1.y)+abs(e1.z);
+			f[SOA_E2N*soastride] = abs(e2.x)+abs(e2.y)+abs(e2.z);
+			f[SOA_KIND*soastride] = SOA_TRIANGLE;
+		}
+	}
+#endif
+}
+
+//---------------------------------------------------------------
+// Traversal
+//---------------------------------------------------------------
+// Same rules as Scene::Draw always had: distance measured to hitpos, 1e9 is "nothing",
+// ties go to the object with lower id.
+#define RAYTRACER_ACCEL_TEST(p)											\
+	{																	\
+		traceresp CurR = (p)->Draw(Or,Dir);								\
+		if (CurR.hit)													\
+		{																\
+			float CurD = ~(CurR.hitpos-Or);								\
+			if (CurD<BestD || (CurD==BestD && (p)->id<BestId))			\
+			{															\
+				BestD	= CurD;											\
+				BestR	= CurR;											\
+				BestId	= (p)->id;										\
+				BestT	= BestD/dirlen*1.0001f;							\
+			}															\
+		}																\
+	}
+
+// Ray broadcast to all lanes
+struct raytracer::SoARay
+{
+	vector8	o, d;
+	float8	a;		// d.d
+	float8	dn;		// |d| as sum of abs components, for error bounds
+	SoARay(vector Or, vector Dir): o(Or), d(Dir)
+	{
+		a	= float8(Dir%Dir);
+		dn	= float8(abs(Dir.x)+abs(Dir.y)+abs(Dir.z));
+	};
+};
+
+// Bit i set if primitive first+i may be hit no farther than BestT(in units of Dir). Misses of float
+// tests are widened by SOA_TOLERANCE of the terms involved, so a lane is dropped only if Draw could
+// not hit it either, or would hit it farther than the best so far. Draw gets the final word.
+int Accel::SoACandidates(int first, int count, const SoARay &r, float BestT)
+{
+	const float *f = &soa[first];
+	float8 kind = float8::LoadU(f+SOA_KIND*soastride);
+	float8 zero(0.f), eps(SOA_TOLERANCE), bestt(BestT);
+	int valid = (1<<count)-1;
+	int spheres = MoveMask((kind>float8(0.5f)) & (kind<float8(1.5f))) & valid;
+	int triangles = MoveMask(kind>float8(1.5f)) & valid;
+	int bits = valid & ~(spheres|triangles);
+	vector8 p(float8::LoadU(f+SOA_X*soastride), float8::LoadU(f+SOA_Y*soastride), float8::LoadU(f+SOA_Z*soastride));
+	if (spheres)
+	{
+		float8 rr = float8::LoadU(f+SOA_E1X*soastride);
+		vector8 oc = r.o-p;
+		float8 b = Dot(oc, r.d), occ = Dot(oc, oc);
+		float8 disc = b*b-r.a*(occ-rr);
+		float8 s2 = r.a*(occ+rr);
+		float8 sq = Sqrt(Max(disc, zero)), tol = eps*Sqrt(s2);
+		// Roots are (-b-sq)/a and (-b+sq)/a: far one must be ahead, near one not past best hit
+		float8 hit = (disc>=zero-eps*(b*b+s2)) & (sq-b>=zero-tol) & (zero-b-sq-tol<=r.a*bestt);
+		bits |= MoveMask(hit) & spheres;
+	}
+	if (triangles)
+	{
+		vector8 e1(float8::LoadU(f+SOA_E1X*soastride), float8::LoadU(f+SOA_E1Y*soastride), float8::LoadU(f+SOA_E1Z*soastride));
+		vector8 e2(float8::LoadU(f+SOA_E2X*soastride), float8::LoadU(f+SOA_E2Y*soastride), float8::LoadU(f+SOA_E2Z*soastride));
+		float8 e1n = float8::LoadU(f+SOA_E1N*soastride), e2n = float8::LoadU(f+SOA_E2N*soastride);
+		// Moller-Trumbore scaled by det, so nothing is divided and parallel rays need no special case
+		vector8 P = Cross(r.d, e2), T = r.o-p, Q = Cross(T, e1);
+		float8 det = Dot(e1, P), u = Dot(T, P), v = Dot(r.d, Q), t = Dot(e2, Q);
+		float8 neg = det<zero, w = Abs(det);
+		u = Select(neg, zero-u, u);
+		v = Select(neg, zero-v, v);
+		t = Select(neg, zero-t, t);
+		float8 tn = Abs(T.x)+Abs(T.y)+Abs(T.z);
+		float8 tolu = eps*tn*r.dn*e2n, tolv = eps*tn*r.dn*e1n, tolt = eps*tn*e1n*e2n, tolw = eps*r.dn*e1n*e2n;
+		float8 hit = (u>=zero-tolu) & (v>=zero-tolv) & (u+v<=w+tolu+tolv+tolw) & (t>=zero-tolt) & (t-tolt<=bestt*(w+tolw));
+		bits |= MoveMask(hit) & triangles;
+	}
+	return bits;
+}
+
+// Primitives [first, first+count) of a leaf or flat list
+#if RAYTRACER_ACCEL_SOA
+#define RAYTRACER_ACCEL_LEAF(first, count)										\
+	for (int c = (first); c<(first)+(count); c += RAYTRACER_LANES)				\
+	{																			\
+		int bits = SoACandidates(c, min((first)+(count)-c, RAYTRACER_LANES), ray, BestT);	\
+		for (int l = 0; bits; l++, bits >>= 1)									\
+			if (bits&1) RAYTRACER_ACCEL_TEST(prims[c+l]);						\
+	}
+#else
+#define RAYTRACER_ACCEL_LEAF(first, count)										\
+	for (int l = (first); l<(first)+(count); l++)								\
+		RAYTRACER_ACCEL_TEST(prims[l]);
+#endif
+
+traceresp Accel::Intersect(vector Or, vector Dir)
+{
+	switch (format)
+	{
+	case ACCEL_BVH2:	return IntersectBVH2(Or, Dir);
+	case ACCEL_QBVH:	return IntersectQBVH(Or, Dir);
+	default:			return IntersectLinear(Or, Dir);
+	}
+}
+
+traceresp Accel::IntersectLinear(vector Or, vector Dir)
+{
+	traceresp	BestR(false);
+	float		BestD = 1e9;
+	int			BestId = 0x7FFFFFFF;
+	float		dirlen = ~Dir;
+	if (dirlen<=0.f) dirlen = 1.f;	// Degenerate ray, BestT is then only a loose bound and every lane passes anyway
+	float		BestT = BestD/dirlen;
+	SoARay		ray(Or, Dir);
+	RAYTRACER_ACCEL_LEAF(0, (int)prims.size());
+	return BestR;
+}
+
+// Zero direction components become tiny ones, so slabs never see 0*inf
+static float SafeInverse(float d)
+{
+	return 1.f/(abs(d)<1e-30f?(d<0.f?-1e-30f:1e-30f):d);
+}
+
+traceresp Accel::IntersectBVH2(vector Or, vector Dir)
+{
+	traceresp	BestR(false);
+	float		BestD = 1e9;
+	int			BestId = 0x7FFFFFFF;
+	float		dirlen = ~Dir;
+	if (dirlen<=0.f || bvh.empty()) return BestR;
+	float		BestT = BestD/dirlen;
+	SoARay		ray(Or, Dir);
+
+	float	o[3]	= {Or.x, Or.y, Or.z};
+	float	id[3]	= {SafeInverse(Dir.x), SafeInverse(Dir.y), SafeInverse(Dir.z)};
+	int		stack[RAYTRACER_BVH_STACK];
+	int		sp = 0;
+	stack[sp++] = 0;
+	while (sp>0)
+	{
+		BVHNode &n = bvh[stack[--sp]];
+		// Near/far planes picked by direction sign
+		float t0 = 0.f, t1 = BestT;
+		for (int a = 0; a<3; a++)
+		{
+			float tn = ((id[a]<0.f?n.bmax[a]:n.bmin[a])-o[a])*id[a];
+			float tf = ((id[a]<0.f?n.bmin[a]:n.bmax[a])-o[a])*id[a];
+			t0 = tn>t0?tn:t0;
+			t1 = tf<t1?tf:t1;
+		}
+		if (t0>t1) continue;
+
+		if (n.first>=0)
+		{
+			RAYTRACER_ACCEL_LEAF(n.first, n.count);
+			continue;
+		}
+		// Visit child on the ray's side first
+		BVHNode &l = bvh[n.left];
+		BVHNode &r = bvh[n.right];
+		float dl = (l.bmin[0]+l.bmax[0]-r.bmin[0]-r.bmax[0])*Dir.x
+				 + (l.bmin[1]+l.bmax[1]-r.bmin[1]-r.bmax[1])*Dir.y
+				 + (l.bmin[2]+l.bmax[2]-r.bmin[2]-r.bmax[2])*Dir.z;
+		if (dl<0.f) { stack[sp++] = n.right; stack[sp++] = n.left; }
+		else		{ stack[sp++] = n.left; stack[sp++] = n.right; }
+	}
+	return BestR;
+}
+
+// 4 bytes of one axis -> 4 floats
+static __m128 UnpackQ(const unsigned char *q)
+{
+	__m128i b = _mm_cvtsi32_si128(*(const int*)q);
+	__m128i z = _mm_setzero_si128();
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(b, z), z));
+}
+
+traceresp Accel::IntersectQBVH(vector Or, vector Dir)
+{
+	traceresp	BestR(false);
+	float		BestD = 1e9;
+	int			BestId = 0x7FFFFFFF;
+	float		dirlen = ~Dir;
+	if (dirlen<=0.f || qbvh.empty()) return BestR;
+	float		BestT = BestD/dirlen;
+	SoARay		ray(Or, Dir);
+
+	float	o[3]	= {Or.x, Or.y, Or.z};
+	float	id[3]	= {SafeInverse(Dir.x), SafeInverse(Dir.y), SafeInverse(Dir.z)};
+	__m128	so[3], sid[3];
+	for (int a = 0; a<3; a++)
+	{
+		so[a]	= _mm_set1_ps(o[a]);
+		sid[a]	= _mm_set1_ps(id[a]);
+	}
+
+	// Entries are node indices or leaf codes, with entry distance to skip ones that got occluded
+	int		stack[RAYTRACER_BVH_STACK];
+	float	stackt[RAYTRACER_BVH_STACK];
+	int		sp = 0;
+	stack[sp] = 0; stackt[sp] = 0.f; sp++;
+	while (sp>0)
+	{
+		sp--;
+		if (stackt[sp]>BestT) continue;
+		int code = stack[sp];
+		if (code<0)
+		{
+			int first = (~code)>>4, count = (~code)&15;
+			RAYTRACER_ACCEL_LEAF(first, count);
+			continue;
+		}
+
+		// All 4 children at once
+		QBVHNode &n = qbvh[code];
+		__m128 t0 = _mm_setzero_ps();
+		__m128 t1 = _mm_set1_ps(BestT);
+		for (int a = 0; a<3; a++)
+		{
+			__m128 org = _mm_set1_ps(n.origin[a]);
+			__m128 scl = _mm_set1_ps(n.scale[a]);
+			__m128 lo = _mm_add_ps(org, _mm_mul_ps(UnpackQ(n.qlo[a]), scl));
+			__m128 hi = _mm_add_ps(org, _mm_mul_ps(UnpackQ(n.qhi[a]), scl));
+			__m128 tlo = _mm_mul_ps(_mm_sub_ps(lo, so[a]), sid[a]);
+			__m128 thi = _mm_mul_ps(_mm_sub_ps(hi, so[a]), sid[a]);
+			if (id[a]<0.f)
+			{
+				t0 = _mm_max_ps(t0, thi);
+				t1 = _mm_min_ps(t1, tlo);
+			}
+			else
+			{
+				t0 = _mm_max_ps(t0, tlo);
+				t1 = _mm_min_ps(t1, thi);
+			}
+		}
+		int mask = _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+		if (!mask) continue;
+
+		float tn[4];
+		_mm_storeu_ps(tn, t0);
+		// Push far to near, so nearest child pops first
+		int		order[4];
+		int		hits = 0;
+		for (int i = 0; i<4; i++)
+		{
+			if (!(mask&(1<<i)) || n.child[i]==RAYTRACER_QBVH_EMPTY) continue;
+			int j = hits++;
+			while (j>0 && tn[order[j-1]]<tn[i]) { order[j] = order[j-1]; j--; }
+			order[j] = i;
+		}
+		for (int i = 0; i<hits; i++)
+		{
+			stack[sp]	= n.child[order[i]];
+			stackt[sp]	= tn[order[i]];
+			sp++;
+		}
+	}
+	return BestR;
+}
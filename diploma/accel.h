@@ -0,0 +1,119 @@
+#pragma once
+
+#include "raytracer.h"
+
+#include <vector>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Acceleration structures
+//---------------------------------------------------------------
+// Only bounded primitives go here, infinite planes are tested by the Scene separately.
+// Format is picked when Scene::Init builds it:
+//  ACCEL_NONE	- plain list, every ray tests every primitive. Kept for reference.
+//  ACCEL_BVH2	- binary hierarchy with full float boxes, 40 bytes per node.
+//  ACCEL_QBVH	- 4-wide hierarchy, child boxes stored as 8-bit offsets inside parent box,
+//				  64 bytes(one cache line) per node, all 4 children tested with one SSE slab test.
+enum AccelFormat
+{
+	ACCEL_NONE,
+	ACCEL_BVH2,
+	ACCEL_QBVH
+};
+#ifndef RAYTRACER_DEFAULT_ACCEL	// Can be set from compiler command line
+#define RAYTRACER_DEFAULT_ACCEL	ACCEL_QBVH
+#endif
+// How much time to spend on building, picked by Scene::accelbuild or `accel` .scene token.
+// All of them give the same picture, only speed differs.
+enum AccelBuild
+{
+	ACCEL_FASTBUILD,	// Linear BVH: Morton codes, radix sort, splits on code bits. All cores, for previews.
+	ACCEL_BALANCED,		// Same, but levels above Morton clusters are rebuilt with SAH
+	ACCEL_FASTTRACE		// Binned SAH on every level, single threaded. For final renders of moderate scenes.
+};
+#ifndef RAYTRACER_DEFAULT_ACCELBUILD
+#define RAYTRACER_DEFAULT_ACCELBUILD	ACCEL_BALANCED
+#endif
+#define RAYTRACER_BVH_BINS		16	// SAH bins per axis
+#define RAYTRACER_LBVH_CLUSTERS	1024	// Roughly how many Morton clusters are built in parallel
+// Spheres and triangles are also kept as structure of arrays in prims order. Leaves and flat lists
+// are then tested RAYTRACER_LANES primitives at a time in float, and only lanes that may hit closer
+// than the best hit so far go on to Draw. Test is conservative, so picture is exactly the same.
+#ifndef RAYTRACER_ACCEL_SOA
+#define RAYTRACER_ACCEL_SOA		1
+#endif
+#if RAYTRACER_ACCEL_SOA
+#define RAYTRACER_BVH_LEAFSIZE	RAYTRACER_LANES	// Max primitives per leaf, one lane group
+#else
+#define RAYTRACER_BVH_LEAFSIZE	4
+#endif
+
+struct BVHNode
+{
+	float	bmin[3], bmax[3];
+	int		left;	// Inner: left child index, right one is right after left's subtree(see right)
+	int		right;	// Inner: right child index
+	int		first;	// Leaf: first primitive, inner: -1
+	int		count;	// Leaf: primitive count
+};
+
+// Empty child slots are RAYTRACER_QBVH_EMPTY(leaf of no primitives, 0 is the root) and also have inverted box,
+// traversal skips them by child, box alone is not enough on flat axes.
+#define RAYTRACER_QBVH_EMPTY	(~0)
+#define RAYTRACER_QBVH_GROW		64	// Small steps widening grid to reach parent box top, doubling after that
+struct QBVHNode
+{
+	float			origin[3];	// Parent box minimum
+	float			scale[3];	// Parent box extent/255
+	unsigned char	qlo[3][4];	// Per axis, per child quantized box
+	unsigned char	qhi[3][4];
+	int				child[4];	// >=0 inner node, <0 leaf: ~((first<<4)|count), RAYTRACER_QBVH_EMPTY unused
+};
+
+struct SoARay;
+
+struct AccelStats
+{
+	int		nodes;		// Node count of the format in use
+	size_t	bytes;		// Node memory
+	int		prims;		// Bounded primitives
+	int		maxleaf;	// Biggest leaf
+	double	buildms;	// Wall time of last Build
+};
+
+class Accel
+{
+public:
+	Accel(){format = ACCEL_NONE; soastride = 0; stats.nodes = stats.prims = stats.maxleaf = 0; stats.bytes = 0; stats.buildms = 0;};
+
+	// Takes bounded primitives. Primitive order is kept in prims, hierarchy references it.
+	void Build(std::vector<Renderable*> &objects, AccelFormat fmt, AccelBuild quality = RAYTRACER_DEFAULT_ACCELBUILD);
+	void Clear();
+
+	// Closest hit among bounded primitives. On equal distance lower Renderable::id wins,
+	// which is exactly what the old linear scan over id-ordered map did.
+	traceresp Intersect(vector Or, vector Dir);
+
+	AccelFormat	GetFormat(){return format;};
+	AccelStats	GetStats(){return stats;};
+private:
+	int  BuildBVH(int first, int count, int depth, std::vector<vector> &bmins, std::vector<vector> &bmaxs, std::vector<vector> &centers);
+	void BuildLBVH(bool refine, std::vector<vector> &bmins, std::vector<vector> &bmaxs, std::vector<vector> &centers);
+	void BuildQBVH();
+	int  CollapseNode(int bvhnode);
+	void BuildSoA();
+	int  SoACandidates(int first, int count, const SoARay &ray, float BestT);
+
+	traceresp IntersectLinear(vector Or, vector Dir);
+	traceresp IntersectBVH2(vector Or, vector Dir);
+	traceresp IntersectQBVH(vector Or, vector Dir);
+
+	AccelFormat					format;
+	AccelStats					stats;
+	std::vector<Renderable*>	prims;
+	std::vector<BVHNode>		bvh;
+	std::vector<QBVHNode>		qbvh;
+	std::vector<float>			soa;		// SOA_FIELDS arrays of soastride floats each, see BuildSoA
+	int							soastride;	// prims plus a lane group of padding, so loads never run off
+};
+};
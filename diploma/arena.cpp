@@ -0,0 +1,76 @@
+#include "stdafx.h"
+
+#include "arena.h"
+
+#include <new>
+
+using namespace raytracer;
+
+// Block header is padded so that first allocation is aligned too
+#define RAYTRACER_ARENA_HEADER	((sizeof(Block)+RAYTRACER_ARENA_ALIGN-1)&~(RAYTRACER_ARENA_ALIGN-1))
+
+SceneArena::SceneArena()
+{
+	first = current = NULL;
+	pos = end = NULL;
+	used = reserved = 0;
+}
+
+SceneArena::~SceneArena()
+{
+	while (first)
+	{
+		Block *next = first->next;
+		_aligned_free(first);
+		first = next;
+	}
+}
+
+void* SceneArena::Alloc(size_t size)
+{
+	size = (size+RAYTRACER_ARENA_ALIGN-1)&~(size_t)(RAYTRACER_ARENA_ALIGN-1);
+	if (size>(size_t)(end-pos))
+	{
+		// Next block, either reused from the chain or a new one spliced in after current
+		Block *b = current?current->next:first;
+		if (!b || b->size<size)
+		{
+			size_t bsize = size>RAYTRACER_ARENA_BLOCK?size:RAYTRACER_ARENA_BLOCK;
+			b = (Block*)_aligned_malloc(RAYTRACER_ARENA_HEADER+bsize, RAYTRACER_ARENA_ALIGN);
+			if (!b) throw std::bad_alloc(); // As plain new would, constructor mustn't run on NULL
+			b->size = bsize;
+			reserved += bsize;
+			// Splice in after current, a skipped too-small block is still there for later scenes
+			b->next = current?current->next:first;
+			if (current) current->next = b; else first = b;
+		}
+		current	= b;
+		pos		= (char*)b+RAYTRACER_ARENA_HEADER;
+		end		= pos+b->size;
+	}
+	void *p = pos;
+	pos += size;
+	used += size;
+	return p;
+}
+
+void SceneArena::Swap(SceneArena &other)
+{
+	Block *b;	char *c;	size_t s;
+	b = first;		first		= other.first;		other.first		= b;
+	b = current;	current		= other.current;	other.current	= b;
+	c = pos;		pos			= other.pos;		other.pos		= c;
+	c = end;		end			= other.end;		other.end		= c;
+	s = used;		used		= other.used;		other.used		= s;
+	s = reserved;	reserved	= other.reserved;	other.reserved	= s;
+}
+
+void SceneArena::Reset()
+{
+	// Blocks are kept and filled again from the first one, so a reload costs no system calls
+	// and memory stays at what the biggest scene needed
+	current	= first;
+	pos		= first?(char*)first+RAYTRACER_ARENA_HEADER:NULL;
+	end		= first?pos+first->size:NULL;
+	used	= 0;
+}
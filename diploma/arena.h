@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Scene arena
+//---------------------------------------------------------------
+// Bump allocator for scene primitives. Objects loaded one after another end up next to each other,
+// and the whole scene is dropped at once by Reset, without visiting objects one by one or freeing blocks.
+// Nothing is destructed! Only put here things that own no memory or handles of their own.
+#define RAYTRACER_ARENA_BLOCK	(4u*1024u*1024u)	// Bytes per block, bigger requests get a block of their own
+#define RAYTRACER_ARENA_ALIGN	16					// Every allocation is aligned to this
+
+class SceneArena
+{
+public:
+	SceneArena();
+	~SceneArena();
+
+	// Throws std::bad_alloc when system is out of memory, like new
+	void* Alloc(size_t size);
+	// Forgets all allocations. Blocks are kept for the next scene and only freed by destructor.
+	void Reset();
+	// Trades all blocks with other arena, objects stay where they are
+	void Swap(SceneArena &other);
+
+	size_t GetUsed(){return used;};		// Bytes handed out
+	size_t GetReserved(){return reserved;};	// Bytes taken from the system
+private:
+	struct Block
+	{
+		Block	*next;
+		size_t	size;	// Usable bytes after header
+	};
+	SceneArena(const SceneArena&);				// Not copyable
+	SceneArena& operator=(const SceneArena&);
+
+	Block	*first, *current;
+	char	*pos, *end;	// Free space in current block
+	size_t	used, reserved;
+};
+};
+
+// new (sc.arena) Sphere(...)
+inline void* operator new(size_t size, raytracer::SceneArena &arena){return arena.Alloc(size);}
+// Only called if constructor throws, memory goes away with the arena anyway
+inline void operator delete(void*, raytracer::SceneArena&){}
@@ -0,0 +1,237 @@
+#include "stdafx.h"
+
+#include "autotune.h"
+#include "parallel.h"
+#include "sceneparser.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sstream>
+#include <fstream>
+
+using namespace raytracer;
+//---------------------------------------------------------------
+// Profile file
+//---------------------------------------------------------------
+static const char *const accelnames[]	= {"none", "bvh2", "qbvh"};			// AccelFormat
+static const char *const buildnames[]	= {"fastbuild", "balanced", "fasttrace"};	// AccelBuild
+static const char *const ordernames[]	= {"rows", "morton", "hilbert"};	// PixelOrder
+
+static int FindName(const std::string &name, const char *const *names, int count)
+{
+	for (int i = 0; i<count; i++)
+		if (name==names[i]) return i;
+	return -1;
+}
+
+static std::string HostName()
+{
+	char name[256];
+	DWORD len = sizeof(name);
+	if (!GetComputerNameA(name, &len)) return "unknown";
+	return std::string(name, len);
+}
+
+static std::string ProfileName(const std::string &scenefile)
+{
+	return scenefile+".tune";
+}
+
+// Settings from one profile line, false if it isn't this host's line for this scene
+static bool ParseProfileLine(const std::string &line, const std::string &host, unsigned __int64 key, RenderSettings &out)
+{
+	std::istringstream in(line);
+	std::string tag, name, hex;
+	if (!(in >> tag >> name >> hex) || tag!="host" || name!=host) return false;
+	if (_strtoui64(hex.c_str(), NULL, 16)!=key) return false;
+
+	RenderSettings s;
+	std::string field;
+	while (in >> field)
+	{
+		std::string v, v2;
+		if (field=="tile" && in >> s.tilesize && s.tilesize>=8 && s.tilesize<=1024);
+		else if (field=="threads" && in >> s.threads && s.threads>=0);
+		else if (field=="accel" && in >> v >> v2 && (s.accelformat = FindName(v, accelnames, 3))>0 && (s.accelbuild = FindName(v2, buildnames, 3))>=0);
+		else if (field=="order" && in >> v && (s.pixelorder = FindName(v, ordernames, 3))>=0);
+		else if (field=="raster" && in >> v) s.raster = v!="0";
+		else if (field=="ms" && in >> v);
+		else return false; // Broken or from a newer build, defaults are safer
+	}
+	out = s;
+	return true;
+}
+
+bool raytracer::LoadRenderSettings(std::string scenefile, RenderSettings &out)
+{
+	std::ifstream in(ProfileName(scenefile).c_str());
+	if (!in) return false;
+	std::string host = HostName(), line;
+	unsigned __int64 key = HashSceneFile(scenefile);
+	while (std::getline(in, line))
+		if (ParseProfileLine(line, host, key, out)) return true;
+	return false;
+}
+
+bool raytracer::SaveRenderSettings(std::string scenefile, const RenderSettings &s, double expected)
+{
+	std::string file = ProfileName(scenefile), host = HostName();
+	char line[512];
+	unsigned __int64 key = HashSceneFile(scenefile);
+	_snprintf(line, sizeof(line), "host %s %08x%08x tile %d threads %d accel %s %s order %s raster %d ms %.0f",
+		host.c_str(), (unsigned int)(key>>32), (unsigned int)key, s.tilesize, s.threads, accelnames[s.accelformat], buildnames[s.accelbuild],
+		ordernames[s.pixelorder], s.raster ? 1 : 0, expected);
+	line[sizeof(line)-1] = 0;
+
+	// Lines of other hosts stay as they are
+	std::vector<std::string> lines;
+	std::ifstream in(file.c_str());
+	std::string l;
+	while (std::getline(in, l))
+	{
+		std::istringstream words(l);
+		std::string tag, name;
+		if (!(words >> tag >> name) || tag!="host" || name!=host) lines.push_back(l);
+	}
+	in.close();
+	lines.push_back(line);
+
+	// Written aside and moved over, so a /render starting meanwhile never sees half a file
+	std::string tmp = file+".tmp";
+	std::ofstream out(tmp.c_str(), std::ios::trunc);
+	for (unsigned int i = 0; i<lines.size(); i++) out << lines[i] << "\n";
+	out.close();
+	if (!out) return false;
+	return MoveFileExA(tmp.c_str(), file.c_str(), MOVEFILE_REPLACE_EXISTING)!=0;
+}
+
+void raytracer::ApplyRenderSettings(const RenderSettings &s)
+{
+	if (sc.accelformat==s.accelformat && sc.accelbuild==s.accelbuild) return;
+	sc.accelformat	= s.accelformat;
+	sc.accelbuild	= s.accelbuild;
+	sc.Init();
+}
+
+//---------------------------------------------------------------
+// Probes
+//---------------------------------------------------------------
+static int TuneFail(std::string text)
+{
+	std::wstring err = L"Autotune failed!\n";
+	err+=std::wstring(text.begin(),text.end());
+	ShowError(err, L"Autotune Failed");
+	return 1;
+}
+
+struct TuneProbe
+{
+	int		width, height;	// Of the probe
+	double	scale;			// Full render pixels over probe pixels
+};
+
+// Expected full render time with settings s, ms: best probe scaled up, plus hierarchy build
+static double ProbeMs(const TuneProbe &p, const RenderSettings &s)
+{
+	ApplyRenderSettings(s);
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	double best = -1;
+	for (int r = 0; r<RAYTRACER_TUNE_REPEATS; r++)
+	{
+		std::vector<RenderView> views(1);
+		views[0].canv		= CreateCanvas(p.width, p.height, "", s.tilesize);
+		views[0].pos		= sc.campos;
+		views[0].dir		= sc.camdir;
+		views[0].fov		= sc.camfov;
+		views[0].aspect		= sc.camaspect;
+		views[0].checkpoint	= NULL;
+		LARGE_INTEGER start, end;
+		QueryPerformanceCounter(&start);
+		DrawViews(views, &s);
+		QueryPerformanceCounter(&end);
+		delete views[0].canv;
+		double ms = (end.QuadPart-start.QuadPart)*1000.0/freq.QuadPart;
+		if (best<0 || ms<best) best = ms;
+	}
+	return best*p.scale+sc.accel->GetStats().buildms;
+}
+
+// Candidate replaces best if it's clearly faster
+static void TryProbe(const TuneProbe &p, const RenderSettings &s, RenderSettings &best, double &bestms)
+{
+	double ms = ProbeMs(p, s);
+	if (ms>=bestms*(1-RAYTRACER_TUNE_GAIN)) return;
+	bestms	= ms;
+	best	= s;
+}
+
+// Tries values of one setting on top of best
+static void TuneField(const TuneProbe &p, RenderSettings &best, double &bestms, int RenderSettings::*field, const int *values, int count)
+{
+	RenderSettings s = best;
+	for (int i = 0; i<count; i++)
+	{
+		s.*field = values[i];
+		if (s.*field!=best.*field) TryProbe(p, s, best, bestms);
+	}
+}
+
+int raytracer::RunAutotune(std::vector<std::string> &args)
+{
+	if (args.size()<1) return TuneFail("Usage: diploma.exe /tune <scene> [/size WxH]");
+	std::string scene = args[0];
+	int width = 800, height = 600;
+	for (unsigned int i = 1; i<args.size(); i++)
+	{
+		if (args[i]=="/size" && i+1<args.size())
+		{
+			std::string &v = args[++i];
+			size_t x = v.find_first_of("xX");
+			width	= atoi(v.substr(0, x).c_str());
+			height	= x==std::string::npos ? 0 : atoi(v.substr(x+1).c_str());
+			if (width<=0 || height<=0) return TuneFail("Bad /size: "+v);
+		}
+		else return TuneFail("Unknown or incomplete argument: "+args[i]);
+	}
+	// First probe runs defaults, so the hierarchy is built for it right away
+	RenderSettings best;
+	if (!LoadScene(scene, NULL, &best)) return 1; // LoadScene told why, a partial scene would render wrong
+
+	// Same aspect as the real thing, no bigger than it
+	TuneProbe p;
+	double shrink = min(1.0, sqrt((double)RAYTRACER_TUNE_PIXELS/((double)width*height)));
+	p.width		= max(1, (int)(width*shrink));
+	p.height	= max(1, (int)(height*shrink));
+	p.scale		= (double)width*height/((double)p.width*p.height);
+
+	double bestms = ProbeMs(p, best);
+
+	// Hierarchy first, everything else runs on top of it
+	static const int formats[] = {ACCEL_QBVH, ACCEL_BVH2};
+	static const int builds[] = {ACCEL_FASTBUILD, ACCEL_BALANCED, ACCEL_FASTTRACE};
+	RenderSettings s = best;
+	for (unsigned int f = 0; f<sizeof(formats)/sizeof(formats[0]); f++)
+		for (unsigned int b = 0; b<sizeof(builds)/sizeof(builds[0]); b++)
+		{
+			s.accelformat	= formats[f];
+			s.accelbuild	= builds[b];
+			if (s.accelformat!=best.accelformat || s.accelbuild!=best.accelbuild) TryProbe(p, s, best, bestms);
+		}
+
+	static const int tiles[] = {16, 32, 64, 128};
+	TuneField(p, best, bestms, &RenderSettings::tilesize, tiles, sizeof(tiles)/sizeof(tiles[0]));
+	static const int orders[] = {PIXELORDER_ROWS, PIXELORDER_MORTON, PIXELORDER_HILBERT};
+	TuneField(p, best, bestms, &RenderSettings::pixelorder, orders, sizeof(orders)/sizeof(orders[0]));
+	s = best;
+	s.raster = !best.raster;
+	TryProbe(p, s, best, bestms);
+	// Fewer threads than cores only pays off when they fight over caches or hyper-threaded cores
+	int threads[] = {GetWorkerCount()/2};
+	if (threads[0]>0) TuneField(p, best, bestms, &RenderSettings::threads, threads, 1);
+
+	if (sc.broken) return 1; // Probes were stopped, timings mean nothing. Mesh told why.
+	if (!SaveRenderSettings(scene, best, bestms)) return TuneFail("Can't write "+ProfileName(scene));
+	return 0;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "raytracer.h"
+#include "accel.h"
+#include "camera.h"
+#include "raster.h"
+
+#include <string>
+#include <vector>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Autotuner - render settings picked per scene and per machine
+//---------------------------------------------------------------
+// `diploma.exe /tune scene [/size WxH]` renders short probes of the scene's main camera, scaled down to
+// RAYTRACER_TUNE_PIXELS, and keeps the fastest RenderSettings. Settings are tuned one after another,
+// starting from defaults: hierarchy(format and build preset), tile size, pixel order, raster, threads.
+// Every candidate is rendered RAYTRACER_TUNE_REPEATS times and its best time has to beat current settings
+// by RAYTRACER_TUNE_GAIN. Probe time is scaled to the full size and hierarchy build time is added, so a slow
+// SAH build only wins when the render is long enough to pay it back.
+// Result goes to <scene>.tune, one line per host(computer name), replacing that host's old line:
+//	host <name> <HashSceneFile, hex> tile 32 threads 8 accel qbvh balanced order hilbert raster 1 ms 1234
+// where ms is the expected time of the full render. /render picks the line of its host and uses it if the
+// scene file hasn't changed since, /notune renders with defaults anyway. Settings never change the image.
+#define RAYTRACER_TUNE_PIXELS	(512*384)	// Probe size, at most
+#define RAYTRACER_TUNE_REPEATS	2
+#define RAYTRACER_TUNE_GAIN		0.03		// Candidate has to be that much faster to replace current settings, less is noise
+
+// How a render is run. Defaults are what the renderer does without a profile.
+struct RenderSettings
+{
+	RenderSettings()
+	{
+		tilesize	= RAYTRACER_TILESIZE;
+		threads		= 0;
+		accelformat	= RAYTRACER_DEFAULT_ACCEL;
+		accelbuild	= RAYTRACER_DEFAULT_ACCELBUILD;
+		pixelorder	= RAYTRACER_DEFAULT_PIXELORDER;
+		raster		= RAYTRACER_RASTER!=0;
+	};
+
+	int		tilesize;		// Canvas tile side, see CreateCanvas
+	int		threads;		// Max cores to use, 0 - all of them
+	int		accelformat;	// AccelFormat: QBVH tests 4 boxes per SSE instruction, BVH2 one
+	int		accelbuild;		// AccelBuild preset
+	int		pixelorder;		// PixelOrder inside tiles
+	bool	raster;			// Rasterize primary hits when the scene allows, see raster.h
+};
+
+// Settings in scenefile's profile for this host. False, and out untouched, if there are none
+// or the scene has changed since.
+bool LoadRenderSettings(std::string scenefile, RenderSettings &out);
+// Puts settings into profile for this host, expected is full render time in ms. False if file can't be written.
+bool SaveRenderSettings(std::string scenefile, const RenderSettings &s, double expected);
+// Rebuilds hierarchy of sc if settings want another one
+void ApplyRenderSettings(const RenderSettings &s);
+// diploma.exe /tune, see above. Returns process exit code, problems are reported with ShowError.
+int RunAutotune(std::vector<std::string> &args);
+};
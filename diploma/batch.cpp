@@ -0,0 +1,169 @@
+#include "stdafx.h"
+
+#include "batch.h"
+#include "autotune.h"
+#include "camera.h"
+#include "checkpoint.h"
+#include "sceneparser.h"
+
+#include <stdlib.h>
+
+using namespace raytracer;
+
+static int BatchFail(std::string text)
+{
+	std::wstring err = L"Batch render failed!\n";
+	err+=std::wstring(text.begin(),text.end()); // Avoid using printf with something that user can mess around with!
+	ShowError(err, L"Batch Render Failed");
+	return 1;
+}
+
+// Comma separated floats, between min and max of them
+static int BatchFloats(const std::string &s, float *out, int maxcount)
+{
+	int n = 0;
+	size_t pos = 0;
+	for (;;)
+	{
+		size_t comma = s.find(',', pos);
+		size_t len = (comma==std::string::npos ? s.size() : comma)-pos;
+		if (n==maxcount || !ParseSceneFloat(s.c_str()+pos, (int)len, out[n])) return -1;
+		n++;
+		if (comma==std::string::npos) return n;
+		pos = comma+1;
+	}
+}
+
+static void SplitNames(const std::string &s, std::vector<std::string> &out)
+{
+	size_t pos = 0;
+	for (;;)
+	{
+		size_t comma = s.find(',', pos);
+		out.push_back(s.substr(pos, comma==std::string::npos ? std::string::npos : comma-pos));
+		if (comma==std::string::npos) break;
+		pos = comma+1;
+	}
+}
+
+// shot.png + front -> shot_front.png
+static std::string ViewFileName(const std::string &file, const std::string &view)
+{
+	size_t dot = file.find_last_of('.');
+	size_t slash = file.find_last_of("/\\");
+	if (dot==std::string::npos || (slash!=std::string::npos && dot<slash)) return file+"_"+view;
+	return file.substr(0, dot)+"_"+view+file.substr(dot);
+}
+
+int raytracer::RunBatch(std::vector<std::string> &args)
+{
+	if (args.size()<2) return BatchFail("Usage: diploma.exe /render <scene> <image> [/size WxH] [/cam name x,y,z,dx,dy,dz[,fov[,aspect]]]... [/views name,...] [/checkpoint file [/resume]] [/notune]");
+	std::string scene = args[0], image = args[1];
+	int width = 800, height = 600;
+	std::vector<SceneCamera> extra;
+	std::vector<std::string> chosen;
+	std::string checkpoint;
+	bool resume = false, tune = true;
+	for (unsigned int i = 2; i<args.size(); i++)
+	{
+		if (args[i]=="/size" && i+1<args.size())
+		{
+			std::string &v = args[++i];
+			size_t x = v.find_first_of("xX");
+			width	= atoi(v.substr(0, x).c_str());
+			height	= x==std::string::npos ? 0 : atoi(v.substr(x+1).c_str());
+			if (width<=0 || height<=0) return BatchFail("Bad /size: "+v);
+		}
+		else if (args[i]=="/cam" && i+2<args.size())
+		{
+			SceneCamera cam;
+			float v[8] = {0,0,0,0,0,0,RAYTRACER_DEFAULT_FOV,0};
+			cam.name = args[++i];
+			std::string &nums = args[++i];
+			int n = BatchFloats(nums, v, 8);
+			if (n<6 || (v[3]==0 && v[4]==0 && v[5]==0) || v[6]<=0 || v[6]>=180 || v[7]<0)
+				return BatchFail("Bad /cam "+cam.name+": "+nums);
+			cam.pos		= vector(v[0],v[1],v[2]);
+			cam.dir		= !vector(v[3],v[4],v[5]);
+			cam.fov		= v[6];
+			cam.aspect	= v[7];
+			extra.push_back(cam);
+		}
+		else if (args[i]=="/views" && i+1<args.size()) SplitNames(args[++i], chosen);
+		else if (args[i]=="/checkpoint" && i+1<args.size()) checkpoint = args[++i];
+		else if (args[i]=="/resume") resume = true;
+		else if (args[i]=="/notune") tune = false;
+		else return BatchFail("Unknown or incomplete argument: "+args[i]);
+	}
+
+	// Profile made by /tune on this machine, if there is one. Hierarchy is built with it right away.
+	RenderSettings settings;
+	bool tuned = tune && LoadRenderSettings(scene, settings);
+	if (!LoadScene(scene, NULL, tuned ? &settings : NULL)) return 1; // LoadScene told why, a partial scene would render wrong
+
+	// Command line cameras override scene ones of the same name
+	std::vector<SceneCamera> cams = sc.cameras;
+	for (unsigned int i = 0; i<extra.size(); i++)
+	{
+		unsigned int c = 0;
+		while (c<cams.size() && cams[c].name!=extra[i].name) c++;
+		if (c<cams.size()) cams[c] = extra[i];
+		else cams.push_back(extra[i]);
+	}
+	SceneCamera main;
+	main.name	= "main";
+	main.pos	= sc.campos;
+	main.dir	= sc.camdir;
+	main.fov	= sc.camfov;
+	main.aspect	= sc.camaspect;
+	cams.push_back(main); // Named ones win if someone calls a view "main"
+
+	std::vector<SceneCamera> views;
+	if (chosen.empty()) views.assign(cams.begin(), cams.size()==1 ? cams.end() : cams.end()-1);
+	for (unsigned int i = 0; i<chosen.size(); i++)
+	{
+		unsigned int c = 0;
+		while (c<cams.size() && cams[c].name!=chosen[i]) c++;
+		if (c==cams.size()) return BatchFail("No such camera: "+chosen[i]);
+		views.push_back(cams[c]);
+	}
+
+	if (resume && checkpoint.empty()) return BatchFail("/resume needs /checkpoint file");
+
+	std::vector<RenderView> rv(views.size());
+	for (unsigned int i = 0; i<views.size(); i++)
+	{
+		rv[i].canv		= CreateCanvas(width, height, "", settings.tilesize);
+		rv[i].pos		= views[i].pos;
+		rv[i].dir		= views[i].dir;
+		rv[i].fov		= views[i].fov;
+		rv[i].aspect	= views[i].aspect;
+		rv[i].checkpoint	= NULL;
+		if (checkpoint.empty()) continue;
+		// Same naming as images, every view resumes on its own
+		std::string file = views.size()==1 ? checkpoint : ViewFileName(checkpoint, views[i].name);
+		rv[i].checkpoint = new Checkpoint(file, *rv[i].canv, CheckpointKey(scene, rv[i]), resume);
+		if (!rv[i].checkpoint->IsOpen())
+		{
+			for (unsigned int k = 0; k<=i; k++)
+			{
+				delete rv[k].checkpoint;
+				delete rv[k].canv;
+			}
+			return BatchFail("Can't write checkpoint: "+file);
+		}
+	}
+	DrawViews(rv, &settings);
+	bool broken = sc.broken!=0;	// Render stopped, mesh told why
+	bool healthy = true, saved = true;
+	for (unsigned int i = 0; i<views.size(); i++)
+	{
+		// Checkpoint stays: running the same command again with /resume only saves the image again
+		if (rv[i].checkpoint) healthy = rv[i].checkpoint->IsHealthy() && healthy;
+		delete rv[i].checkpoint;
+		if (!broken) saved = SaveRenderImage(views.size()==1 ? image : ViewFileName(image, views[i].name), *rv[i].canv) && saved; // Told why
+		delete rv[i].canv;
+	}
+	if (!healthy && !broken) ShowError(L"Image is complete, but writing checkpoint has failed along the way.", L"Checkpoint Failed");
+	return saved && healthy && !broken ? 0 : 1;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "raytracer.h"
+
+#include <string>
+#include <vector>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Command line batch render
+//---------------------------------------------------------------
+// diploma.exe /render <scene> <image> [/size WxH] [/cam name x,y,z,dx,dy,dz[,fov[,aspect]]]... [/views name,name,...]
+//	[/checkpoint file [/resume]] [/notune]
+// Scene is loaded once and all chosen views are rendered in one pass, see DrawViews.
+// Views are the scene's `cam` lines plus /cam ones(those replace scene ones of same name), the main `c` camera
+// is called "main" and is the only view if there are no others. /views picks some of them, in given order.
+// With more than one view, view name goes before extension: shot.png -> shot_front.png, shot_top.png...
+// /checkpoint keeps finished tiles in file(named per view the same way), /resume picks up what it has, see checkpoint.h.
+// Settings /tune found for the scene on this machine are used unless /notune is given, see autotune.h.
+// Returns process exit code, nonzero if anything failed, problems are reported with ShowError.
+int RunBatch(std::vector<std::string> &args);
+};
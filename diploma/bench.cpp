@@ -0,0 +1,435 @@
+#include "stdafx.h"
+
+#include "bench.h"
+#include "accel.h"
+
+#include <stdio.h>
+#include <typeinfo>
+#include <vector>
+
+using namespace raytracer;
+
+#define BENCH_EPSILON	0.000001	// Same as EPSILON of raytracer.cpp, reference must cut off where kernels do
+#define BENCH_MARGIN	0.0001		// Rays closer than that to a hit/miss edge are not used, see BenchRef
+
+enum BenchPrim {BENCH_SPHERE, BENCH_PLANE, BENCH_TRIANGLE};
+enum BenchMode {BENCH_ALLHIT, BENCH_ALLMISS, BENCH_HALF};
+static const char *benchmodes[] = {"all hit", "all miss", "50% hit"};
+
+//---------------------------------------------------------------
+// Double precision reference
+//---------------------------------------------------------------
+struct dvector
+{
+	double x,y,z;
+	dvector(){}
+	dvector(double l, double m, double n){x=l;y=m;z=n;}
+	dvector(vector v){x=v.x;y=v.y;z=v.z;}
+	dvector operator+(dvector r){return dvector(x+r.x, y+r.y, z+r.z);}
+	dvector operator-(dvector r){return dvector(x-r.x, y-r.y, z-r.z);}
+	dvector operator*(double r){return dvector(x*r, y*r, z*r);}
+	double operator%(dvector r){return x*r.x + y*r.y + z*r.z;}
+	dvector operator^(dvector r){return dvector(y*r.z-z*r.y, z*r.x-x*r.z, x*r.y-y*r.x);}
+};
+
+struct BenchRef
+{
+	bool	hit;
+	dvector	pos;
+	double	margin;	// How far from flipping between hit and miss, in units of the test
+};
+
+// Hit rules follow the kernels: sphere is hit only if nearest root is ahead(ray from inside misses),
+// plane and triangle reject nearly parallel rays
+static BenchRef RefSphere(Sphere &s, dvector o, dvector d)
+{
+	BenchRef r;
+	dvector oc = o-dvector(s.pos);
+	double rr = (double)s.radius*s.radius;
+	double b = oc%d, c = oc%oc-rr;
+	double disc = b*b-c;
+	r.margin = fabs(disc)/rr;
+	r.hit = false;
+	if (disc<0) return r;
+	double t = -b-sqrt(disc);
+	if (t<0) return r;
+	r.hit = true;
+	r.pos = o+d*t;
+	return r;
+}
+
+static BenchRef RefPlane(Plane &p, dvector o, dvector d)
+{
+	BenchRef r;
+	dvector n(p.norm);
+	double denom = n%d;
+	r.hit = false;
+	r.margin = fabs(denom);
+	if (fabs(denom)<=BENCH_EPSILON) return r;
+	double t = ((dvector(p.pos)-o)%n)/denom;
+	r.margin = min(r.margin, fabs(t));
+	if (t<0) return r;
+	r.hit = true;
+	r.pos = o+d*t;
+	return r;
+}
+
+static BenchRef RefTriangle(Triangle &tri, dvector o, dvector d)
+{
+	BenchRef r;
+	dvector p0(tri.pos), e1 = dvector(tri.pos1)-p0, e2 = dvector(tri.pos2)-p0;
+	dvector P = d^e2;
+	double det = e1%P;
+	r.hit = false;
+	r.margin = fabs(det);
+	if (fabs(det*1e3)<BENCH_EPSILON) return r; // Kernel tests det of Dir*1e3
+	dvector T = o-p0, Q = T^e1;
+	double u = (T%P)/det, v = (d%Q)/det, t = (e2%Q)/det;
+	r.margin = min(r.margin, fabs(min(u, min(v, 1-u-v))));
+	if (u<0 || v<0 || u+v>1 || t*1e-3<=BENCH_EPSILON) return r;
+	r.hit = true;
+	r.pos = o+d*t;
+	return r;
+}
+
+//---------------------------------------------------------------
+// Ray sets
+//---------------------------------------------------------------
+struct BenchRays
+{
+	std::vector<vector>		origins, dirs;
+	std::vector<char>		hit;		// Reference answer
+	std::vector<dvector>	refpos;		// Reference hit point
+};
+
+static float BenchRand(unsigned int &seed) // xorshift32, [0,1)
+{
+	seed ^= seed<<13;
+	seed ^= seed>>17;
+	seed ^= seed<<5;
+	return (seed>>8)*(1.f/16777216.f);
+}
+
+static dvector BenchUnit(unsigned int &seed)
+{
+	for (;;)
+	{
+		dvector v(BenchRand(seed)*2-1, BenchRand(seed)*2-1, BenchRand(seed)*2-1);
+		double l = v%v;
+		if (l>1e-4 && l<=1) return v*(1/sqrt(l));
+	}
+}
+
+// Hierarchy leaf of RAYTRACER_LANES primitives: the benchmarked one, and small ones of the same kind
+// BENCH_LEAFFAR away, which no ray of the sets comes near(mismatch column would tell). That's a leaf
+// as most rays see it: one primitive hit at most, the rest to be rejected.
+#define BENCH_LEAFFAR	1000.f
+
+struct BenchLeaf
+{
+	std::vector<Renderable*>	prims;	// prims[0] is the benchmarked primitive, the rest are owned
+	Accel						accel;	// ACCEL_NONE over prims, so Intersect is one lane group
+	~BenchLeaf(){for (unsigned int i = 1; i<prims.size(); i++) delete prims[i];};
+	void Build(Renderable *obj)
+	{
+		prims.push_back(obj);
+		for (int i = 1; i<RAYTRACER_LANES; i++)
+		{
+			vector at = obj->pos+vector((float)(i&1), (float)((i>>1)&1), (float)(i>>2))*BENCH_LEAFFAR;
+			Renderable *p;
+			if (typeid(*obj)==typeid(Sphere))
+				p = new Sphere(at, vector(0,0,0), vector(255,255,255), 0, 0, 1, 0, 0.05f);
+			else
+				p = new Triangle(at, at+vector(0.1f,0,0), at+vector(0,0.1f,0.05f), vector(255,255,255), 0, 0, 1, 0);
+			p->light = false;
+			p->id = 100+i;
+			prims.push_back(p);
+		}
+		accel.Build(prims, ACCEL_NONE);
+	};
+};
+
+struct BenchObjects
+{
+	Sphere		sphere;
+	Plane		plane;
+	Triangle	triangle;
+	BenchLeaf	sphereleaf, triangleleaf;
+	BenchObjects():
+		sphere(vector(1,2,3), vector(0,0,0), vector(255,255,255), 0, 0, 1, 0, 2.5f),
+		plane(vector(0,0,-1), vector(0.2f,0.3f,1), vector(255,255,255), 0, 0, 1, 0),
+		triangle(vector(-2,-1,0.5f), vector(3,-0.5f,1), vector(0.5f,2.5f,-0.5f), vector(255,255,255), 0, 0, 1, 0)
+	{
+		sphere.light = plane.light = triangle.light = false;
+		sphere.id = 0; plane.id = 1; triangle.id = 2;
+		sphereleaf.Build(&sphere);
+		triangleleaf.Build(&triangle);
+	};
+	BenchLeaf& Leaf(Renderable *obj){return obj==&sphere ? sphereleaf : triangleleaf;};
+	Renderable* Get(BenchPrim prim)
+	{
+		if (prim==BENCH_SPHERE) return &sphere;
+		if (prim==BENCH_PLANE) return &plane;
+		return &triangle;
+	};
+};
+
+static BenchRef BenchClassify(BenchObjects &objs, BenchPrim prim, dvector o, dvector d)
+{
+	if (prim==BENCH_SPHERE) return RefSphere(objs.sphere, o, d);
+	if (prim==BENCH_PLANE) return RefPlane(objs.plane, o, d);
+	return RefTriangle(objs.triangle, o, d);
+}
+
+// Origins are scattered around the primitive, half of candidates aim at a point on it, half go anywhere.
+// Candidates are kept if reference agrees with the wanted outcome and they aren't on an edge.
+static void MakeBenchRays(BenchObjects &objs, BenchPrim prim, BenchMode mode, BenchRays &rays, unsigned int &seed)
+{
+	dvector center;
+	if (prim==BENCH_SPHERE) center = dvector(objs.sphere.pos);
+	else if (prim==BENCH_PLANE) center = dvector(objs.plane.pos);
+	else center = (dvector(objs.triangle.pos)+dvector(objs.triangle.pos1)+dvector(objs.triangle.pos2))*(1.0/3);
+
+	rays.origins.clear(); rays.dirs.clear(); rays.hit.clear(); rays.refpos.clear();
+	while ((int)rays.origins.size()<RAYTRACER_BENCH_RAYS)
+	{
+		bool want = mode==BENCH_ALLHIT || (mode==BENCH_HALF && BenchRand(seed)<0.5f);
+		for (;;)
+		{
+			dvector o = center+BenchUnit(seed)*(10+10*BenchRand(seed)), target;
+			if (BenchRand(seed)<0.5f)
+				target = o+BenchUnit(seed);
+			else if (prim==BENCH_SPHERE)
+				target = center+BenchUnit(seed)*(objs.sphere.radius*0.95*BenchRand(seed));
+			else if (prim==BENCH_PLANE)
+			{
+				dvector n(objs.plane.norm), t = center+BenchUnit(seed)*(20*BenchRand(seed));
+				target = t-n*((t-center)%n);
+			}
+			else
+			{
+				double u = BenchRand(seed), v = BenchRand(seed);
+				if (u+v>1) {u = 1-u; v = 1-v;}
+				dvector p0(objs.triangle.pos);
+				target = p0+(dvector(objs.triangle.pos1)-p0)*u+(dvector(objs.triangle.pos2)-p0)*v;
+			}
+			dvector d = target-o;
+			d = d*(1/sqrt(d%d));
+			// Kernels get float rays, so reference works on exactly those
+			vector fo((float)o.x, (float)o.y, (float)o.z), fd((float)d.x, (float)d.y, (float)d.z);
+			fd = !fd;
+			BenchRef ref = BenchClassify(objs, prim, dvector(fo), dvector(fd));
+			if (ref.hit!=want || ref.margin<BENCH_MARGIN) continue;
+			rays.origins.push_back(fo);
+			rays.dirs.push_back(fd);
+			rays.hit.push_back(ref.hit);
+			rays.refpos.push_back(ref.hit?ref.pos:dvector(0,0,0));
+			break;
+		}
+	}
+}
+
+//---------------------------------------------------------------
+// Kernels
+//---------------------------------------------------------------
+struct BenchHit
+{
+	bool	hit;
+	vector	pos;
+};
+
+typedef void (*BenchKernelFn)(BenchObjects &objs, Renderable *obj, BenchRays &rays, BenchHit *out);
+
+// One ray at a time through the virtual call, same as Scene::Draw does it
+static void BenchScalar(BenchObjects &objs, Renderable *obj, BenchRays &rays, BenchHit *out)
+{
+	vector *o = &rays.origins[0], *d = &rays.dirs[0];
+	for (int i = 0; i<RAYTRACER_BENCH_RAYS; i++)
+	{
+		traceresp r = obj->Draw(o[i], d[i]);
+		out[i].hit = r.hit;
+		out[i].pos = r.hitpos;
+	}
+}
+
+// Triangle test straight on a record of given layout, whatever RAYTRACER_TRIANGLE_LAYOUT is
+template<class Record> static void BenchTriangleRecord(BenchObjects &objs, Renderable *obj, BenchRays &rays, BenchHit *out)
+{
+	Triangle *tri = (Triangle*)obj;
+	Record rec;
+	rec.Setup(tri->pos, tri->pos1, tri->pos2);
+	vector *o = &rays.origins[0], *d = &rays.dirs[0];
+	for (int i = 0; i<RAYTRACER_BENCH_RAYS; i++)
+	{
+		TriangleHit h;
+		out[i].hit = rec.Hit(tri->pos, tri->pos1, tri->pos2, o[i], d[i], h);
+		out[i].pos = h.hitpos;
+	}
+}
+
+// Leaf the way accel.cpp tested it before SoA: Draw on every primitive, closest hit wins
+static void BenchLeafScalar(BenchObjects &objs, Renderable *obj, BenchRays &rays, BenchHit *out)
+{
+	std::vector<Renderable*> &prims = objs.Leaf(obj).prims;
+	vector *o = &rays.origins[0], *d = &rays.dirs[0];
+	for (int i = 0; i<RAYTRACER_BENCH_RAYS; i++)
+	{
+		traceresp best(false);
+		float bestd = 1e9;
+		for (unsigned int l = 0; l<prims.size(); l++)
+		{
+			traceresp r = prims[l]->Draw(o[i], d[i]);
+			if (!r.hit) continue;
+			float dist = ~(r.hitpos-o[i]);
+			if (dist<bestd) {bestd = dist; best = r;}
+		}
+		out[i].hit = best.hit;
+		out[i].pos = best.hitpos;
+	}
+}
+
+// Same leaf through Accel, SoACandidates picks the lanes that go on to Draw
+static void BenchLeafSoA(BenchObjects &objs, Renderable *obj, BenchRays &rays, BenchHit *out)
+{
+	Accel &accel = objs.Leaf(obj).accel;
+	vector *o = &rays.origins[0], *d = &rays.dirs[0];
+	for (int i = 0; i<RAYTRACER_BENCH_RAYS; i++)
+	{
+		traceresp r = accel.Intersect(o[i], d[i]);
+		out[i].hit = r.hit;
+		out[i].pos = r.hitpos;
+	}
+}
+
+struct BenchKernel
+{
+	const char		*name;
+	BenchPrim		prim;
+	BenchKernelFn	fn;
+};
+
+static BenchKernel benchkernels[] =
+{
+	{"Sphere::Draw",	BENCH_SPHERE,	BenchScalar},
+	{"Plane::Draw",		BENCH_PLANE,	BenchScalar},
+	{"Triangle::Draw",	BENCH_TRIANGLE,	BenchScalar},
+	{"Triangle vertices",	BENCH_TRIANGLE,	BenchTriangleRecord<TriangleVertices>},
+	{"Triangle edges",		BENCH_TRIANGLE,	BenchTriangleRecord<TriangleEdges>},
+	{"Triangle Woop",		BENCH_TRIANGLE,	BenchTriangleRecord<TriangleWoop>},
+	{"Sphere leaf scalar",	BENCH_SPHERE,	BenchLeafScalar},
+	{"Sphere leaf SoA",		BENCH_SPHERE,	BenchLeafSoA},
+	{"Triangle leaf scalar",	BENCH_TRIANGLE,	BenchLeafScalar},
+	{"Triangle leaf SoA",	BENCH_TRIANGLE,	BenchLeafSoA},
+};
+
+//---------------------------------------------------------------
+// Running
+//---------------------------------------------------------------
+// Error of a hit point in ULPs of its largest coordinate. Per-coordinate ULPs blow up for coordinates
+// near zero, where float spacing is tiny but the absolute error is that of the whole point.
+static double UlpError(vector p, dvector ref)
+{
+	double scale = max(fabs(ref.x), max(fabs(ref.y), fabs(ref.z)));
+	int exp;
+	frexp(scale>0?scale:1.0, &exp);
+	double ulp = ldexp(1.0, exp-24); // Float spacing at scale
+	double err = max(fabs(p.x-ref.x), max(fabs(p.y-ref.y), fabs(p.z-ref.z)));
+	return err/ulp;
+}
+
+struct BenchResult
+{
+	double	ns;			// Per test
+	int		mismatch;	// Rays that disagree with reference on hit or miss
+	double	maxulp;
+	double	meanulp;
+};
+
+static BenchResult RunBenchKernel(BenchKernel &k, BenchObjects &objs, Renderable *obj, BenchRays &rays)
+{
+	std::vector<BenchHit> out(RAYTRACER_BENCH_RAYS);
+	k.fn(objs, obj, rays, &out[0]); // Warm up caches and predictors
+
+	LARGE_INTEGER freq, start, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+	int reps = 0;
+	do
+	{
+		k.fn(objs, obj, rays, &out[0]);
+		reps++;
+		QueryPerformanceCounter(&now);
+	} while ((now.QuadPart-start.QuadPart)*1000<RAYTRACER_BENCH_MINMS*freq.QuadPart);
+
+	BenchResult res;
+	res.ns = (now.QuadPart-start.QuadPart)*1e9/freq.QuadPart/((double)reps*RAYTRACER_BENCH_RAYS);
+	res.mismatch = 0;
+	res.maxulp = 0;
+	double sum = 0;
+	int hits = 0;
+	for (int i = 0; i<RAYTRACER_BENCH_RAYS; i++)
+	{
+		if (out[i].hit!=(rays.hit[i]!=0))
+		{
+			res.mismatch++;
+			continue;
+		}
+		if (!out[i].hit) continue;
+		double ulp = UlpError(out[i].pos, rays.refpos[i]);
+		res.maxulp = max(res.maxulp, ulp);
+		sum += ulp;
+		hits++;
+	}
+	res.meanulp = hits ? sum/hits : 0;
+	return res;
+}
+
+static int BenchFail(std::string report)
+{
+	std::wstring err = L"Raytracer engine has failed to write benchmark report: \"";
+	err+=std::wstring(report.begin(),report.end()); // Avoid using printf with something that user can mess around with!
+	err+=L"\"";
+	ShowError(err, L"Benchmark Failed");
+	return 1;
+}
+
+int raytracer::RunBench(std::string report)
+{
+	FILE *fp = fopen(report.c_str(), "w");
+	if (!fp) return BenchFail(report);
+
+	// One core and high priority, so numbers don't jump around with scheduling
+	HANDLE self = GetCurrentThread();
+	DWORD_PTR oldmask = SetThreadAffinityMask(self, 1);
+	int oldprio = GetThreadPriority(self);
+	SetThreadPriority(self, THREAD_PRIORITY_HIGHEST);
+
+	BenchObjects objs;
+	fprintf(fp, "%d rays per set, at least %d ms per measurement\n", RAYTRACER_BENCH_RAYS, RAYTRACER_BENCH_MINMS);
+	fprintf(fp, "Triangle is %d bytes, records: vertices %d, edges %d, Woop %d bytes\n\n", (int)sizeof(Triangle),
+		(int)sizeof(TriangleVertices), (int)sizeof(TriangleEdges), (int)sizeof(TriangleWoop));
+	fprintf(fp, "%-20s %-10s %10s %10s %10s %10s\n", "kernel", "rays", "ns/test", "mismatch", "max ULP", "mean ULP");
+	BenchRays rays;
+	for (int p = BENCH_SPHERE; p<=BENCH_TRIANGLE; p++)
+	{
+		for (int m = BENCH_ALLHIT; m<=BENCH_HALF; m++)
+		{
+			unsigned int seed = RAYTRACER_BENCH_SEED+p*3+m; // Same set for every kernel of this primitive
+			MakeBenchRays(objs, (BenchPrim)p, (BenchMode)m, rays, seed);
+			for (unsigned int k = 0; k<sizeof(benchkernels)/sizeof(benchkernels[0]); k++)
+			{
+				if (benchkernels[k].prim!=p) continue;
+				BenchResult res = RunBenchKernel(benchkernels[k], objs, objs.Get((BenchPrim)p), rays);
+				fprintf(fp, "%-20s %-10s %10.2f %10d %10.1f %10.2f\n", benchkernels[k].name, benchmodes[m],
+					res.ns, res.mismatch, res.maxulp, res.meanulp);
+				fflush(fp);
+			}
+		}
+	}
+
+	SetThreadPriority(self, oldprio);
+	if (oldmask) SetThreadAffinityMask(self, oldmask);
+	bool ok = !ferror(fp);
+	fclose(fp);
+	return ok ? 0 : BenchFail(report);
+}
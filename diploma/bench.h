@@ -0,0 +1,28 @@
+#pragma once
+
+#include "raytracer.h"
+
+#include <string>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Intersection kernel microbenchmark
+//---------------------------------------------------------------
+// diploma.exe /bench [report.txt] - times Sphere::Draw, Plane::Draw and Triangle::Draw on their own,
+// away from scene and hierarchy noise. Every kernel runs on fixed sets of random rays that all hit,
+// all miss, or hit half the time in random order(so branch prediction can't learn the pattern).
+// Results are checked against a double precision reference: rays that disagree on hit or miss are
+// counted, hit points are compared in float ULPs of their largest coordinate. Report gets ns per
+// test and the errors.
+// New kernel variants(SIMD, packets) are added as rows of the kernel table in bench.cpp, a kernel
+// gets the whole ray set at once, so packet ones can walk it however they like.
+// Triangle records of every layout(see trirecord.h) have rows of their own, next to Triangle::Draw.
+// Leaf rows time a hierarchy leaf of RAYTRACER_LANES primitives that only the benchmarked one can be hit in:
+// every primitive through Draw, against the SoA pre-filter of accel.h picking which ones get to Draw.
+#define RAYTRACER_BENCH_RAYS	4096		// Rays per set, small enough to stay in L1/L2
+#define RAYTRACER_BENCH_MINMS	100			// Each measurement repeats the set at least that long
+#define RAYTRACER_BENCH_SEED	0x2545F491	// Ray sets are the same on every run
+
+// Runs all kernels, writes table to report. Returns process exit code, failures are reported with ShowError.
+int RunBench(std::string report = "bench.txt");
+};
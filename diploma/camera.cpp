@@ -0,0 +1,113 @@
+#include "stdafx.h"
+
+#include "camera.h"
+#include "morton.h"
+
+#include <algorithm>
+#include <xmmintrin.h> // SSE
+
+using namespace raytracer;
+
+const float raytracer::SubsampleX[RAYTRACER_SUBSAMPLES] = {0.f, -.1f, -.1f,  .1f, .1f};
+const float raytracer::SubsampleY[RAYTRACER_SUBSAMPLES] = {0.f,  .1f, -.1f,  .1f, -.1f};
+
+Camera::Camera()
+{
+	pos		= vector(0,0,0);
+	dir		= vector(0,1,0);
+	fov		= RAYTRACER_DEFAULT_FOV;
+	aspect	= 0.f;
+}
+
+Camera::Camera(vector Pos, vector Dir, float Fov, float Aspect)
+{
+	pos		= Pos;
+	dir		= Dir;
+	fov		= Fov;
+	aspect	= Aspect;
+}
+
+void Camera::Setup(int W, int H)
+{
+	// Image plane sits at distance 1, so half of its width is tan(fov/2)
+	double halfw = tan(fov*3.14159265358979/360.0);
+	double a = aspect>0.f?aspect:(double)W/H;
+	double halfh = halfw/a;
+
+	Right	= -!(vector(0,0,1)^dir)/(W/(2*halfw)); // Getting step for frustrum's down side
+	Up		= !(dir^(-Right))/(H/(2*halfh)); // Getting step for frustrum's left side
+
+	LowLeftCorner	= (-Right*W)/2 // We want to step LEFT!
+					+ (Up*H)	 /2 
+					+ dir; 
+}
+
+void Camera::GenerateRays(const float *x, const float *y, int count, float *dx, float *dy, float *dz)
+{
+	__m128 llx = _mm_set1_ps(LowLeftCorner.x), lly = _mm_set1_ps(LowLeftCorner.y), llz = _mm_set1_ps(LowLeftCorner.z);
+	__m128 rx = _mm_set1_ps(Right.x), ry = _mm_set1_ps(Right.y), rz = _mm_set1_ps(Right.z);
+	__m128 ux = _mm_set1_ps(Up.x), uy = _mm_set1_ps(Up.y), uz = _mm_set1_ps(Up.z);
+	int i = 0;
+	for (; i+4<=count; i+=4)
+	{
+		__m128 px = _mm_loadu_ps(x+i);
+		__m128 py = _mm_loadu_ps(y+i);
+		_mm_storeu_ps(dx+i, _mm_sub_ps(_mm_add_ps(llx, _mm_mul_ps(rx, px)), _mm_mul_ps(ux, py)));
+		_mm_storeu_ps(dy+i, _mm_sub_ps(_mm_add_ps(lly, _mm_mul_ps(ry, px)), _mm_mul_ps(uy, py)));
+		_mm_storeu_ps(dz+i, _mm_sub_ps(_mm_add_ps(llz, _mm_mul_ps(rz, px)), _mm_mul_ps(uz, py)));
+	}
+	for (; i<count; i++)
+	{
+		dx[i] = LowLeftCorner.x + Right.x*x[i] - Up.x*y[i];
+		dy[i] = LowLeftCorner.y + Right.y*x[i] - Up.y*y[i];
+		dz[i] = LowLeftCorner.z + Right.z*x[i] - Up.z*y[i];
+	}
+}
+
+//---------------------------------------------------------------
+// Pixel orders
+//---------------------------------------------------------------
+struct PixelKey
+{
+	unsigned int key, pixel;
+	bool operator<(const PixelKey &r) const {return key<r.key;}
+};
+
+void raytracer::BuildPixelOrder(int TileSize, PixelOrder order, std::vector<unsigned int> &out)
+{
+	out.clear();
+	out.reserve(TileSize*TileSize);
+	if (order==PIXELORDER_ROWS)
+	{
+		for (int y = 0; y<TileSize; y++)
+			for (int x = 0; x<TileSize; x++)
+				out.push_back(x|(y<<16));
+		return;
+	}
+
+	// Curves are walked over the power of two square that holds the tile
+	unsigned int n = 1;
+	while (n<(unsigned int)TileSize) n*=2;
+	if (order==PIXELORDER_HILBERT)
+	{
+		for (unsigned int d = 0; d<n*n; d++)
+		{
+			unsigned int x, y;
+			HilbertCell(n, d, x, y);
+			if (x<(unsigned int)TileSize && y<(unsigned int)TileSize) out.push_back(x|(y<<16));
+		}
+		return;
+	}
+	std::vector<PixelKey> keys;
+	keys.reserve(TileSize*TileSize);
+	for (int y = 0; y<TileSize; y++)
+		for (int x = 0; x<TileSize; x++)
+		{
+			PixelKey k;
+			k.key	= Morton2D(x, y);
+			k.pixel	= x|(y<<16);
+			keys.push_back(k);
+		}
+	std::sort(keys.begin(), keys.end());
+	for (unsigned int i = 0; i<keys.size(); i++) out.push_back(keys[i].pixel);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "raytracer.h"
+
+#include <vector>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Camera
+//---------------------------------------------------------------
+// Pinhole camera with horizontal field of view and frame aspect. Primary rays are made in batches,
+// 4 at once with SSE, from pixel coordinates already laid out in the order they will be traced.
+#define RAYTRACER_DEFAULT_FOV	53.1301024f	// 2*atan(0.5), what the renderer always had
+#define RAYTRACER_SUBSAMPLES	5			// Primary rays per pixel
+
+// Order of pixels inside a render tile. Curves keep consecutive rays close on screen,
+// so they walk the same hierarchy nodes and geometry while it is still in cache.
+enum PixelOrder
+{
+	PIXELORDER_ROWS,	// Plain row-major
+	PIXELORDER_MORTON,	// Z-order
+	PIXELORDER_HILBERT	// Hilbert curve, no jumps at all
+};
+#ifndef RAYTRACER_DEFAULT_PIXELORDER
+#define RAYTRACER_DEFAULT_PIXELORDER	PIXELORDER_HILBERT
+#endif
+
+// Subsample offsets, in pixels(y goes down). Center first, then the 4 diagonal ones.
+extern const float SubsampleX[RAYTRACER_SUBSAMPLES];
+extern const float SubsampleY[RAYTRACER_SUBSAMPLES];
+
+class Camera
+{
+public:
+	Camera();
+	// Camera looking along Dir, which should be normalized. Fov in degrees, horizontal.
+	// Aspect is frame width/height, 0 means take it from the image, so that pixels are square.
+	Camera(vector Pos, vector Dir, float Fov = RAYTRACER_DEFAULT_FOV, float Aspect = 0.f);
+
+	// Computes image plane for W*H image. Must be called before GenerateRays.
+	void Setup(int W, int H);
+	// Directions through points (x[i],y[i]) of image plane, y goes down. Not normalized.
+	// Arrays are SoA, count doesn't have to be a multiple of 4.
+	void GenerateRays(const float *x, const float *y, int count, float *dx, float *dy, float *dz);
+
+	vector	pos, dir;
+	float	fov, aspect;
+	// Image plane: direction through pixel (x,y) is LowLeftCorner + Right*x - Up*y
+	vector	Right, Up, LowLeftCorner;
+};
+
+// Pixel visiting order for tiles of TileSize. Entries are x|(y<<16), tile-relative.
+// Covers the full TileSize*TileSize square, partial tiles skip what's outside.
+void BuildPixelOrder(int TileSize, PixelOrder order, std::vector<unsigned int> &out);
+};
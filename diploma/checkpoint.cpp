@@ -0,0 +1,198 @@
+#include "stdafx.h"
+
+#include "checkpoint.h"
+#include "camera.h"
+#include "profile.h"
+#include "sceneparser.h"
+
+#include <process.h>
+#include <string.h>
+
+using namespace raytracer;
+//---------------------------------------------------------------
+// Key
+//---------------------------------------------------------------
+unsigned __int64 raytracer::CheckpointKey(std::string scenefile, const RenderView &view)
+{
+	unsigned __int64 h = HashSceneFile(scenefile);
+	int v[3] = {view.canv->GetWidth(), view.canv->GetHeight(), RAYTRACER_SUBSAMPLES};
+	HashBytes(h, &view.pos, sizeof(view.pos));
+	HashBytes(h, &view.dir, sizeof(view.dir));
+	HashBytes(h, &view.fov, sizeof(view.fov));
+	HashBytes(h, &view.aspect, sizeof(view.aspect));
+	HashBytes(h, v, sizeof(v));
+	return h;
+}
+
+//---------------------------------------------------------------
+// File access
+//---------------------------------------------------------------
+static bool WriteAt(HANDLE file, unsigned __int64 offset, const void *data, DWORD bytes)
+{
+	OVERLAPPED o;
+	ZeroMemory(&o, sizeof(o));
+	o.Offset		= (DWORD)(offset&0xFFFFFFFF);
+	o.OffsetHigh	= (DWORD)(offset>>32);
+	DWORD written = 0;
+	return WriteFile(file, data, bytes, &written, &o) && written==bytes;
+}
+
+static bool ReadAt(HANDLE file, unsigned __int64 offset, void *data, DWORD bytes)
+{
+	OVERLAPPED o;
+	ZeroMemory(&o, sizeof(o));
+	o.Offset		= (DWORD)(offset&0xFFFFFFFF);
+	o.OffsetHigh	= (DWORD)(offset>>32);
+	DWORD got = 0;
+	return ReadFile(file, data, bytes, &got, &o) && got==bytes;
+}
+
+//---------------------------------------------------------------
+// Checkpoint
+//---------------------------------------------------------------
+Checkpoint::Checkpoint(std::string filename, CanvasData &Canv, unsigned __int64 key, bool resume)
+{
+	canv		= &Canv;
+	name		= filename;
+	restored	= 0;
+	failed		= false;
+	thread		= NULL;
+	stop		= NULL;
+	InitializeCriticalSection(&lock);
+
+	int tiles = canv->GetTilesX()*canv->GetTilesY();
+	ZeroMemory(&header, sizeof(header));
+	header.magic		= RAYTRACER_CHECKPOINT_MAGIC;
+	header.version		= RAYTRACER_CHECKPOINT_VERSION;
+	header.key			= key;
+	header.width		= canv->GetWidth();
+	header.height		= canv->GetHeight();
+	header.tilesize		= canv->GetTileSize();
+	header.tilesx		= canv->GetTilesX();
+	header.tilesy		= canv->GetTilesY();
+	header.markoffset	= sizeof(CheckpointHeader);
+	header.pixeloffset	= (header.markoffset+tiles+4095)&~4095ull;
+
+	// Opened for good, not deleted on close: surviving the process is the whole point
+	file = CreateFileA(filename.c_str(), GENERIC_READ|GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file==INVALID_HANDLE_VALUE) return;
+	if (!(resume && Restore()))
+	{
+		// Fresh start. Marks are zeroed before anything else can be written, old pixels don't matter then.
+		std::vector<char> marks(tiles, 0);
+		done.assign(tiles, 0);
+		if (!WriteAt(file, header.markoffset, &marks[0], tiles) || !WriteAt(file, 0, &header, sizeof(header)) || !FlushFileBuffers(file))
+		{
+			CloseHandle(file);
+			file = INVALID_HANDLE_VALUE;
+			return;
+		}
+	}
+	stop	= CreateEvent(NULL, TRUE, FALSE, NULL);
+	thread	= stop ? (HANDLE)_beginthreadex(NULL, 0, &Checkpoint::Writer, this, 0, NULL) : NULL;
+	if (!thread)
+	{
+		if (stop) CloseHandle(stop);
+		stop = NULL;
+		CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+	}
+}
+
+Checkpoint::~Checkpoint()
+{
+	if (thread)
+	{
+		SetEvent(stop);
+		WaitForSingleObject(thread, INFINITE); // Writer commits the rest on its way out
+		CloseHandle(thread);
+		CloseHandle(stop);
+	}
+	if (file!=INVALID_HANDLE_VALUE) CloseHandle(file);
+	DeleteCriticalSection(&lock);
+}
+
+// Reads marked tiles of a matching file into canvas, false if file is of some other render
+bool Checkpoint::Restore()
+{
+	CheckpointHeader h;
+	if (!ReadAt(file, 0, &h, sizeof(h)) || memcmp(&h, &header, sizeof(h))!=0) return false;
+	int tiles = header.tilesx*header.tilesy;
+	done.assign(tiles, 0);
+	if (!ReadAt(file, header.markoffset, &done[0], tiles)) return false;
+	unsigned __int64 slot = (unsigned __int64)header.tilesize*header.tilesize*sizeof(Pixel);
+	for (int i = 0; i<tiles; i++)
+	{
+		if (done[i]!=1)
+		{
+			done[i] = 0;
+			continue;
+		}
+		CanvasTile t = canv->LockTile(i%header.tilesx, i/header.tilesx);
+		bool ok = t.data!=NULL;
+		for (int y = 0; ok && y<t.h; y++)
+			ok = ReadAt(file, header.pixeloffset+slot*i+(unsigned __int64)y*t.w*sizeof(Pixel), t.data+y*t.stride, t.w*sizeof(Pixel));
+		canv->UnlockTile(t);
+		done[i] = ok ? 1 : 0; // Short file, render it again
+		restored += ok ? 1 : 0;
+	}
+	return true;
+}
+
+void Checkpoint::SaveTile(int tile, const CanvasTile &t)
+{
+	if (!thread || failed) return;
+	PendingTile p;
+	p.tile	= tile;
+	p.w		= t.w;
+	p.h		= t.h;
+	p.pixels.resize(t.w*t.h);
+	for (int y = 0; y<t.h; y++)
+		memcpy(&p.pixels[y*t.w], t.data+y*t.stride, t.w*sizeof(Pixel));
+	EnterCriticalSection(&lock);
+	queue.push_back(PendingTile());
+	std::swap(queue.back(), p); // Pixels aren't copied twice
+	LeaveCriticalSection(&lock);
+}
+
+void Checkpoint::Commit()
+{
+	std::vector<PendingTile> batch;
+	EnterCriticalSection(&lock);
+	batch.swap(queue);
+	LeaveCriticalSection(&lock);
+	if (batch.empty() || failed) return;
+
+	RAYTRACER_PROFILE_SCOPE_ARG("checkpoint", (int)batch.size());
+	unsigned __int64 slot = (unsigned __int64)header.tilesize*header.tilesize*sizeof(Pixel);
+	bool ok = true;
+	for (unsigned int i = 0; ok && i<batch.size(); i++)
+		ok = WriteAt(file, header.pixeloffset+slot*batch[i].tile, &batch[i].pixels[0], (DWORD)batch[i].pixels.size()*sizeof(Pixel));
+	ok = ok && FlushFileBuffers(file);
+	// Pixels are on disk, now they may be trusted
+	const char mark = 1;
+	for (unsigned int i = 0; ok && i<batch.size(); i++)
+		ok = WriteAt(file, header.markoffset+batch[i].tile, &mark, 1);
+	ok = ok && FlushFileBuffers(file);
+	if (ok) return;
+	failed = true;
+	// Right away, so a log shows when it broke and that later tiles won't be resumed
+	wchar_t code[64];
+	swprintf(code, 64, L"\" (error %u), nothing more is saved.", (unsigned int)GetLastError());
+	std::wstring err = L"Raytracer engine has failed to write checkpoint: \"";
+	err+=std::wstring(name.begin(),name.end()); // Avoid using printf with something that user can mess around with!
+	err+=code;
+	ShowError(err, L"Checkpoint Failed");
+}
+
+unsigned __stdcall Checkpoint::Writer(void *param)
+{
+	Checkpoint *c = (Checkpoint*)param;
+	ProfileThreadName("checkpoint writer");
+	for (;;)
+	{
+		bool last = WaitForSingleObject(c->stop, RAYTRACER_CHECKPOINT_MS)==WAIT_OBJECT_0;
+		c->Commit();
+		if (last) return 0;
+	}
+}
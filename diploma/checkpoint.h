@@ -0,0 +1,84 @@
+#pragma once
+
+#include "raytracer.h"
+
+#include <windows.h>
+#include <string>
+#include <vector>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Checkpoint - finished tiles kept on disk, so a killed render can go on
+//---------------------------------------------------------------
+// `diploma.exe /render scene image /checkpoint file [/resume]` writes every finished tile into file.
+// Render threads only copy the tile into a queue, a writer thread puts the queue into the file every
+// RAYTRACER_CHECKPOINT_MS: pixels first, flush, then the tiles are marked done and flushed again.
+// A tile is never marked before its pixels are on disk, so whatever is marked can be trusted after
+// a crash or a reboot. At most the last RAYTRACER_CHECKPOINT_MS of work is lost.
+// With /resume, marked tiles are read back into the canvas and not rendered again. That only happens
+// if the file was made for the same scene file contents, view, size and samples(see CheckpointKey),
+// otherwise it's started over. Files the scene pulls in(.obj, .rtm) aren't part of the key.
+// Layout: CheckpointHeader, one byte per tile(1 - done), then from pixeloffset a tilesize*tilesize
+// slot per tile, holding w*h pixels of it row after row.
+#define RAYTRACER_CHECKPOINT_MAGIC		0x4B435452	// "RTCK"
+#define RAYTRACER_CHECKPOINT_VERSION	1
+#define RAYTRACER_CHECKPOINT_MS			10000		// How often queued tiles are committed
+
+#pragma pack(push, 1)
+struct CheckpointHeader
+{
+	DWORD				magic, version;
+	unsigned __int64	key;			// CheckpointKey of the render
+	int					width, height;
+	int					tilesize, tilesx, tilesy;
+	DWORD				markoffset;		// From file start: char per tile
+	unsigned __int64	pixeloffset;	// From file start: tile slots, page aligned
+};
+#pragma pack(pop)
+
+// Identifies a render: HashSceneFile, view, canvas size and RAYTRACER_SUBSAMPLES
+unsigned __int64 CheckpointKey(std::string scenefile, const RenderView &view);
+
+class Checkpoint
+{
+public:
+	// Opens file for canvas. With resume, tiles done by an earlier run of the same key are put
+	// into canvas right away, otherwise file is started over. Canvas must outlive the checkpoint.
+	Checkpoint(std::string file, CanvasData &canv, unsigned __int64 key, bool resume);
+	// Commits what's queued and stops the writer
+	~Checkpoint();
+
+	bool IsOpen(){return file!=INVALID_HANDLE_VALUE;};
+	int  GetTilesRestored(){return restored;};
+	// False once a write has failed, nothing is committed after that. Render itself goes on.
+	// The failure is reported with ShowError when it happens, with the file and system error.
+	bool IsHealthy(){return !failed;};
+
+	// Used by tile renderer. Tile index is ty*TilesX+tx, as in CanvasData.
+	bool IsTileDone(int tile){return tile>=0 && tile<(int)done.size() && done[tile]!=0;};
+	// Copies tile, thread-safe and doesn't wait for the disk
+	void SaveTile(int tile, const CanvasTile &t);
+private:
+	struct PendingTile
+	{
+		int					tile;
+		int					w, h;
+		std::vector<Pixel>	pixels;
+	};
+	bool Restore();
+	void Commit();
+	static unsigned __stdcall Writer(void *param);
+
+	HANDLE						file;
+	std::string					name;		// For error messages
+	CanvasData					*canv;
+	CheckpointHeader			header;
+	std::vector<char>			done;		// Restored tiles only, rendered ones aren't looked at again
+	int							restored;
+	volatile bool				failed;
+	HANDLE						thread;
+	HANDLE						stop;		// Manual-reset, set by destructor
+	CRITICAL_SECTION			lock;		// Guards queue
+	std::vector<PendingTile>	queue;
+};
+};
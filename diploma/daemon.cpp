@@ -0,0 +1,651 @@
+#include "stdafx.h"
+
+#include "daemon.h"
+#include "profile.h"
+#include "renderjob.h"
+#include "sceneparser.h"
+
+#include <winsock2.h>
+#include <process.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <deque>
+#include <list>
+#include <string>
+#include <vector>
+
+#pragma comment(lib, "ws2_32.lib")
+
+using namespace raytracer;
+//---------------------------------------------------------------
+// State
+//---------------------------------------------------------------
+struct DaemonClient;
+
+struct DaemonJob
+{
+	int				id;
+	DaemonClient	*client;
+	std::string		scene;
+	int				width, height;
+	int				samples;
+	bool			camera;			// Override scene camera?
+	vector			campos, camdir;
+	float			fov;			// <=0 keeps scene fov
+	volatile LONG	cancel;
+};
+
+struct DaemonClient
+{
+	SOCKET					s;
+	CRITICAL_SECTION		sendlock;	// Whole messages go out in one piece
+	volatile LONG			alive;		// Cleared once socket fails or reader leaves
+	volatile LONG			refs;		// Reader thread + running job
+	std::deque<DaemonJob*>	jobs;		// Waiting jobs, guarded by DaemonState::lock
+};
+
+struct CachedScene
+{
+	std::string				path;
+	Scene					*scene;
+	std::vector<FILETIME>	mtimes;		// Of scene->files, in same order
+	int						objects;
+	int						hits;
+};
+
+// One daemon per process, so state is plain static
+static struct DaemonState
+{
+	CRITICAL_SECTION			lock;		// Guards everything below but listener
+	HANDLE						wake;		// Auto-reset: new job or stop
+	std::vector<DaemonClient*>	clients;
+	unsigned int				rr;			// Client to look at first, for round-robin
+	int							nextid;
+	DaemonJob					*running;
+	std::list<CachedScene>		cache;		// Most recently used first. Only render thread changes it.
+	volatile LONG				stop;
+	SOCKET						listener;
+} ds;
+
+static double ElapsedMs(LARGE_INTEGER &start)
+{
+	LARGE_INTEGER now, freq;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&freq);
+	return (double)(now.QuadPart-start.QuadPart)*1000.0/(double)freq.QuadPart;
+}
+
+//---------------------------------------------------------------
+// Sending
+//---------------------------------------------------------------
+static bool SendRaw(DaemonClient *c, const char *data, int len)
+{
+	while (len>0)
+	{
+		int sent = send(c->s, data, len, 0);
+		if (sent<=0)
+		{
+			InterlockedExchange(&c->alive, 0);
+			return false;
+		}
+		data += sent;
+		len -= sent;
+	}
+	return true;
+}
+
+// Header line and optional payload go out together, tiles from several workers don't interleave
+static bool SendReply(DaemonClient *c, const std::string &line, const char *payload = NULL, int len = 0)
+{
+	if (!c->alive) return false;
+	EnterCriticalSection(&c->sendlock);
+	bool ok = SendRaw(c, line.c_str(), (int)line.size()) && SendRaw(c, "\n", 1);
+	if (ok && payload) ok = SendRaw(c, payload, len);
+	LeaveCriticalSection(&c->sendlock);
+	return ok;
+}
+
+static std::string Format(const char *fmt, int id, const char *text = "")
+{
+	char buf[64];
+	_snprintf(buf, sizeof(buf), fmt, id);
+	buf[sizeof(buf)-1] = 0;
+	return std::string(buf)+text;
+}
+
+static void ReleaseClient(DaemonClient *c)
+{
+	if (InterlockedDecrement(&c->refs)==0)
+	{
+		closesocket(c->s);
+		DeleteCriticalSection(&c->sendlock);
+		delete c;
+	}
+}
+
+//---------------------------------------------------------------
+// Scene cache
+//---------------------------------------------------------------
+static bool GetMTime(const std::string &file, FILETIME &out)
+{
+	WIN32_FILE_ATTRIBUTE_DATA fa;
+	if (!GetFileAttributesExA(file.c_str(), GetFileExInfoStandard, &fa)) return false;
+	out = fa.ftLastWriteTime;
+	return true;
+}
+
+static bool IsFresh(CachedScene &e)
+{
+	for (unsigned int i = 0; i<e.mtimes.size(); i++)
+	{
+		FILETIME ft;
+		if (!GetMTime(e.scene->files[i], ft)) ft.dwLowDateTime = ft.dwHighDateTime = 0; // Missing then, missing now is fine
+		if (CompareFileTime(&ft, &e.mtimes[i])!=0) return false;
+	}
+	return true;
+}
+
+// Cached scene for path, loading it if needed. NULL if .scene couldn't be read.
+static CachedScene* GetScene(DaemonJob *job, bool &loaded)
+{
+	loaded = false;
+	for (std::list<CachedScene>::iterator it = ds.cache.begin(); it!=ds.cache.end(); ++it)
+	{
+		if (it->path!=job->scene) continue;
+		if (IsFresh(*it))
+		{
+			EnterCriticalSection(&ds.lock);
+			ds.cache.splice(ds.cache.begin(), ds.cache, it);
+			LeaveCriticalSection(&ds.lock);
+			return &ds.cache.front();
+		}
+		// Changed on disk, drop the old one
+		EnterCriticalSection(&ds.lock);
+		Scene *old = it->scene;
+		ds.cache.erase(it);
+		LeaveCriticalSection(&ds.lock);
+		delete old;
+		break;
+	}
+
+	// sc is empty between jobs, load right into it
+	std::vector<SceneError> errors;
+	LoadScene(job->scene, &errors);
+	for (unsigned int i = 0; i<errors.size(); i++)
+	{
+		if (errors[i].line==0)
+		{
+			SendReply(job->client, Format("error %d ", job->id, errors[i].message.c_str()));
+			sc.Clear();
+			return NULL;
+		}
+		char pos[64];
+		_snprintf(pos, sizeof(pos), "warning %d %d %d ", job->id, errors[i].line, errors[i].col);
+		pos[sizeof(pos)-1] = 0;
+		SendReply(job->client, pos+errors[i].message);
+	}
+
+	CachedScene e;
+	e.path	= job->scene;
+	e.scene	= new Scene();
+	e.scene->Swap(sc);
+	e.hits	= 0;
+	e.objects	= (int)e.scene->sceneobjects.size();
+	e.mtimes.resize(e.scene->files.size());
+	for (unsigned int i = 0; i<e.scene->files.size(); i++)
+		if (!GetMTime(e.scene->files[i], e.mtimes[i])) e.mtimes[i].dwLowDateTime = e.mtimes[i].dwHighDateTime = 0;
+
+	std::vector<Scene*> evicted;
+	EnterCriticalSection(&ds.lock);
+	ds.cache.push_front(e);
+	while (ds.cache.size()>RAYTRACER_DAEMON_SCENES)
+	{
+		evicted.push_back(ds.cache.back().scene);
+		ds.cache.pop_back();
+	}
+	LeaveCriticalSection(&ds.lock);
+	for (unsigned int i = 0; i<evicted.size(); i++) delete evicted[i];
+	loaded = true;
+	return &ds.cache.front();
+}
+
+//---------------------------------------------------------------
+// Rendering
+//---------------------------------------------------------------
+// Sends finished tile, called from render workers
+static void OnDaemonTile(RenderJob &rj, int tile, void *user)
+{
+	DaemonJob *job = (DaemonJob*)user;
+	if (!job->client->alive) return;
+	CanvasData *canv = rj.GetCanvas();
+	CanvasTile t = canv->LockTile(tile%canv->GetTilesX(), tile/canv->GetTilesX());
+	if (!t.data) return;
+	std::vector<char> rgb((size_t)t.w*t.h*3);
+	char *o = rgb.empty() ? NULL : &rgb[0];
+	for (int y = 0; y<t.h; y++)
+	{
+		for (int x = 0; x<t.w; x++)
+		{
+			Pixel p = t.data[y*t.stride+x];
+			*o++ = (char)((p>>16)&255);
+			*o++ = (char)((p>>8)&255);
+			*o++ = (char)(p&255);
+		}
+	}
+	canv->UnlockTile(t);
+
+	char head[96];
+	_snprintf(head, sizeof(head), "tile %d %d %d %d %d", job->id, t.x0, t.y0, t.w, t.h);
+	head[sizeof(head)-1] = 0;
+	SendReply(job->client, head, rgb.empty() ? NULL : &rgb[0], (int)rgb.size());
+}
+
+static void RunJob(DaemonJob *job)
+{
+	LARGE_INTEGER start;
+	QueryPerformanceCounter(&start);
+	bool loaded;
+	CachedScene *e = GetScene(job, loaded);
+	if (!e) return;
+	EnterCriticalSection(&ds.lock);
+	e->hits++;
+	LeaveCriticalSection(&ds.lock);
+	char msg[96];
+	_snprintf(msg, sizeof(msg), "started %d %s %.1f", job->id, loaded?"loaded":"cached", ElapsedMs(start));
+	msg[sizeof(msg)-1] = 0;
+	SendReply(job->client, msg);
+
+	sc.Swap(*e->scene);
+	vector	campos = sc.campos, camdir = sc.camdir;
+	float	camfov = sc.camfov;
+	if (job->camera)
+	{
+		sc.campos = job->campos;
+		sc.camdir = job->camdir;
+	}
+	if (job->fov>0) sc.camfov = job->fov;
+
+	CanvasData *canv = CreateCanvas(job->width, job->height);
+	RenderOptions opts;
+	opts.samples	= job->samples;
+	opts.ontile		= OnDaemonTile;
+	opts.user		= job;
+	RenderJob *rj = StartRender(sc, *canv, opts);
+	bool started = rj!=NULL;
+	RenderState state = RENDER_CANCELLED;
+	if (started)
+	{
+		while (!rj->Wait(50))
+			if (job->cancel || !job->client->alive || ds.stop) rj->Cancel(); // Nobody wants it any more
+		state = rj->GetState();
+		delete rj;
+	}
+	bool broken = sc.broken!=0;	// Mesh file went bad, see oocmesh.h
+
+	sc.campos = campos;
+	sc.camdir = camdir;
+	sc.camfov = camfov;
+	sc.Swap(*e->scene);
+	delete canv;
+
+	if (!started) SendReply(job->client, Format("error %d ", job->id, "could not start render"));
+	else if (broken) SendReply(job->client, Format("error %d ", job->id, "scene could not be read, load it again"));
+	else if (state==RENDER_DONE)
+	{
+		_snprintf(msg, sizeof(msg), "done %d %.1f", job->id, ElapsedMs(start));
+		msg[sizeof(msg)-1] = 0;
+		SendReply(job->client, msg);
+	}
+	else SendReply(job->client, Format("cancelled %d", job->id));
+}
+
+// Next job, round-robin over clients
+static DaemonJob* PickJob()
+{
+	DaemonJob *job = NULL;
+	EnterCriticalSection(&ds.lock);
+	unsigned int n = (unsigned int)ds.clients.size();
+	for (unsigned int i = 0; i<n && !job; i++)
+	{
+		DaemonClient *c = ds.clients[(ds.rr+i)%n];
+		if (c->jobs.empty()) continue;
+		job = c->jobs.front();
+		c->jobs.pop_front();
+		ds.rr = (ds.rr+i+1)%n;
+		InterlockedIncrement(&c->refs);
+	}
+	ds.running = job;
+	LeaveCriticalSection(&ds.lock);
+	return job;
+}
+
+static unsigned __stdcall RenderThread(void*)
+{
+	ProfileThreadName("daemon render");
+	while (!ds.stop)
+	{
+		WaitForSingleObject(ds.wake, INFINITE);
+		DaemonJob *job;
+		while (!ds.stop && (job = PickJob())!=NULL)
+		{
+			RunJob(job);
+			EnterCriticalSection(&ds.lock);
+			ds.running = NULL;
+			LeaveCriticalSection(&ds.lock);
+			ReleaseClient(job->client);
+			delete job;
+		}
+	}
+	return 0;
+}
+
+//---------------------------------------------------------------
+// Commands
+//---------------------------------------------------------------
+// Splits line on spaces, double quotes group words and are dropped
+static void SplitCommand(const std::string &line, std::vector<std::string> &out)
+{
+	std::string cur;
+	bool quoted = false, any = false;
+	for (unsigned int i = 0; i<line.size(); i++)
+	{
+		char ch = line[i];
+		if (ch=='"')
+		{
+			quoted = !quoted;
+			any = true;
+			continue;
+		}
+		if ((ch==' ' || ch=='\t') && !quoted)
+		{
+			if (any) out.push_back(cur);
+			cur.clear();
+			any = false;
+			continue;
+		}
+		cur += ch;
+		any = true;
+	}
+	if (any) out.push_back(cur);
+}
+
+static bool ParseInt(const std::string &s, int &out)
+{
+	if (s.empty()) return false;
+	char *end;
+	long v = strtol(s.c_str(), &end, 10);
+	if (*end) return false;
+	out = (int)v;
+	return true;
+}
+
+// Comma separated floats, exactly count of them
+static bool ParseFloats(const std::string &s, float *out, int count)
+{
+	int n = 0;
+	size_t pos = 0;
+	while (n<count)
+	{
+		size_t comma = s.find(',', pos);
+		size_t len = (comma==std::string::npos ? s.size() : comma)-pos;
+		if (!ParseSceneFloat(s.c_str()+pos, (int)len, out[n++])) return false;
+		if (comma==std::string::npos) break;
+		pos = comma+1;
+	}
+	return n==count && s.find(',', pos)==std::string::npos;
+}
+
+static void CommandRender(DaemonClient *c, std::vector<std::string> &args)
+{
+	DaemonJob *job = new DaemonJob();
+	job->client		= c;
+	job->width		= 800;
+	job->height		= 600;
+	job->samples	= RAYTRACER_SUBSAMPLES;
+	job->camera		= false;
+	job->fov		= 0;
+	job->cancel		= 0;
+	std::string bad;
+	for (unsigned int i = 1; i<args.size() && bad.empty(); i++)
+	{
+		size_t eq = args[i].find('=');
+		std::string key = args[i].substr(0, eq), val = eq==std::string::npos ? "" : args[i].substr(eq+1);
+		float cam[6];
+		if (key=="scene" && !val.empty()) job->scene = val;
+		else if (key=="width" && ParseInt(val, job->width) && job->width>0 && job->width<=RAYTRACER_DAEMON_MAXSIDE);
+		else if (key=="height" && ParseInt(val, job->height) && job->height>0 && job->height<=RAYTRACER_DAEMON_MAXSIDE);
+		else if (key=="quality" && val=="draft") job->samples = 1;
+		else if (key=="quality" && val=="final") job->samples = RAYTRACER_SUBSAMPLES;
+		else if (key=="fov" && ParseSceneFloat(val.c_str(), (int)val.size(), job->fov) && job->fov>0 && job->fov<180);
+		else if (key=="camera" && ParseFloats(val, cam, 6) && (cam[3]!=0 || cam[4]!=0 || cam[5]!=0))
+		{
+			job->camera = true;
+			job->campos = vector(cam[0], cam[1], cam[2]);
+			job->camdir = !vector(cam[3], cam[4], cam[5]);
+		}
+		else bad = args[i];
+	}
+	if (bad.empty() && job->scene.empty()) bad = "scene=";
+	if (!bad.empty())
+	{
+		SendReply(c, "error 0 bad argument "+bad);
+		delete job;
+		return;
+	}
+
+	// Id is sent before the job can start, so "queued" always comes first
+	EnterCriticalSection(&ds.lock);
+	job->id = ++ds.nextid;
+	int ahead = ds.running ? 1 : 0;
+	for (unsigned int i = 0; i<ds.clients.size(); i++) ahead += (int)ds.clients[i]->jobs.size();
+	LeaveCriticalSection(&ds.lock);
+	char msg[64];
+	_snprintf(msg, sizeof(msg), "queued %d %d", job->id, ahead);
+	msg[sizeof(msg)-1] = 0;
+	SendReply(c, msg);
+
+	EnterCriticalSection(&ds.lock);
+	c->jobs.push_back(job);
+	LeaveCriticalSection(&ds.lock);
+	SetEvent(ds.wake);
+}
+
+static void CommandCancel(DaemonClient *c, std::vector<std::string> &args)
+{
+	int id;
+	if (args.size()!=2 || !ParseInt(args[1], id))
+	{
+		SendReply(c, "error 0 usage: cancel <id>");
+		return;
+	}
+	DaemonJob *dropped = NULL;
+	bool found = false;
+	EnterCriticalSection(&ds.lock);
+	for (std::deque<DaemonJob*>::iterator it = c->jobs.begin(); it!=c->jobs.end(); ++it)
+	{
+		if ((*it)->id!=id) continue;
+		dropped = *it;
+		c->jobs.erase(it);
+		found = true;
+		break;
+	}
+	if (!found && ds.running && ds.running->id==id && ds.running->client==c)
+	{
+		InterlockedExchange(&ds.running->cancel, 1);
+		found = true;
+	}
+	LeaveCriticalSection(&ds.lock);
+
+	if (!found)
+	{
+		SendReply(c, Format("error %d ", id, "no such job"));
+		return;
+	}
+	SendReply(c, Format("cancelling %d", id));
+	if (dropped)
+	{
+		SendReply(c, Format("cancelled %d", id));
+		delete dropped;
+	}
+}
+
+static void CommandStats(DaemonClient *c)
+{
+	std::vector<std::string> lines;
+	EnterCriticalSection(&ds.lock);
+	for (std::list<CachedScene>::iterator it = ds.cache.begin(); it!=ds.cache.end(); ++it)
+	{
+		char buf[64];
+		_snprintf(buf, sizeof(buf), "scene %d %d ", it->hits, it->objects);
+		buf[sizeof(buf)-1] = 0;
+		lines.push_back(buf+it->path);
+	}
+	LeaveCriticalSection(&ds.lock);
+	for (unsigned int i = 0; i<lines.size(); i++) SendReply(c, lines[i]);
+	SendReply(c, "end");
+}
+
+static void Shutdown()
+{
+	InterlockedExchange(&ds.stop, 1);
+	SetEvent(ds.wake);
+	closesocket(ds.listener); // Wakes up accept
+}
+
+static void ExecuteCommand(DaemonClient *c, const std::string &line)
+{
+	std::vector<std::string> args;
+	SplitCommand(line, args);
+	if (args.empty()) return;
+	if (args[0]=="render") CommandRender(c, args);
+	else if (args[0]=="cancel") CommandCancel(c, args);
+	else if (args[0]=="stats") CommandStats(c);
+	else if (args[0]=="shutdown")
+	{
+		SendReply(c, "bye");
+		Shutdown();
+	}
+	else SendReply(c, "error 0 unknown command "+args[0]);
+}
+
+static unsigned __stdcall ClientThread(void *param)
+{
+	DaemonClient *c = (DaemonClient*)param;
+	ProfileThreadName("daemon client");
+	std::string pending;
+	char buf[RAYTRACER_DAEMON_LINE];
+	for (;;)
+	{
+		int got = recv(c->s, buf, sizeof(buf), 0);
+		if (got<=0) break;
+		pending.append(buf, got);
+		size_t nl;
+		while ((nl = pending.find('\n'))!=std::string::npos)
+		{
+			std::string line = pending.substr(0, nl);
+			pending.erase(0, nl+1);
+			if (!line.empty() && line[line.size()-1]=='\r') line.erase(line.size()-1);
+			ExecuteCommand(c, line);
+		}
+		if (pending.size()>RAYTRACER_DAEMON_LINE)
+		{
+			SendReply(c, "error 0 line too long");
+			break;
+		}
+	}
+
+	// Client is gone: drop its waiting jobs and stop the running one
+	InterlockedExchange(&c->alive, 0);
+	EnterCriticalSection(&ds.lock);
+	for (unsigned int i = 0; i<c->jobs.size(); i++) delete c->jobs[i];
+	c->jobs.clear();
+	for (unsigned int i = 0; i<ds.clients.size(); i++)
+	{
+		if (ds.clients[i]!=c) continue;
+		ds.clients.erase(ds.clients.begin()+i);
+		break;
+	}
+	LeaveCriticalSection(&ds.lock);
+	ReleaseClient(c);
+	return 0;
+}
+
+//---------------------------------------------------------------
+// Entry
+//---------------------------------------------------------------
+int raytracer::RunDaemon(int port)
+{
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2,2), &wsa)!=0)
+	{
+		ShowError(L"Unable to initialize Winsock!", L"Render Daemon Failed");
+		return 1;
+	}
+	ds.listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family			= AF_INET;
+	addr.sin_port			= htons((unsigned short)port);
+	addr.sin_addr.s_addr	= htonl(INADDR_LOOPBACK);	// Local clients only, there's no authentication
+	if (ds.listener==INVALID_SOCKET || bind(ds.listener, (sockaddr*)&addr, sizeof(addr))!=0 || listen(ds.listener, SOMAXCONN)!=0)
+	{
+		ShowError(L"Unable to listen on local port, is another daemon running?", L"Render Daemon Failed");
+		if (ds.listener!=INVALID_SOCKET) closesocket(ds.listener);
+		WSACleanup();
+		return 1;
+	}
+
+	InitializeCriticalSection(&ds.lock);
+	ds.wake		= CreateEvent(NULL, FALSE, FALSE, NULL);
+	ds.rr		= 0;
+	ds.nextid	= 0;
+	ds.running	= NULL;
+	ds.stop		= 0;
+	HANDLE render = (HANDLE)_beginthreadex(NULL, 0, RenderThread, NULL, 0, NULL);
+
+	while (!ds.stop)
+	{
+		SOCKET s = accept(ds.listener, NULL, NULL);
+		if (s==INVALID_SOCKET) continue; // Listener closed by shutdown, or a client gave up halfway
+		DaemonClient *c = new DaemonClient();
+		c->s		= s;
+		c->alive	= 1;
+		c->refs		= 1;
+		InitializeCriticalSection(&c->sendlock);
+		EnterCriticalSection(&ds.lock);
+		ds.clients.push_back(c);
+		LeaveCriticalSection(&ds.lock);
+		HANDLE th = (HANDLE)_beginthreadex(NULL, 0, ClientThread, c, 0, NULL);
+		if (th) CloseHandle(th);
+		else
+		{
+			EnterCriticalSection(&ds.lock);
+			ds.clients.pop_back();
+			LeaveCriticalSection(&ds.lock);
+			ReleaseClient(c);
+		}
+	}
+
+	if (render)
+	{
+		WaitForSingleObject(render, INFINITE);
+		CloseHandle(render);
+	}
+	// Kick remaining clients out and give their threads a moment to leave
+	EnterCriticalSection(&ds.lock);
+	for (unsigned int i = 0; i<ds.clients.size(); i++) shutdown(ds.clients[i]->s, SD_BOTH);
+	LeaveCriticalSection(&ds.lock);
+	for (int i = 0; i<100; i++)
+	{
+		EnterCriticalSection(&ds.lock);
+		bool empty = ds.clients.empty();
+		LeaveCriticalSection(&ds.lock);
+		if (empty) break;
+		Sleep(10);
+	}
+	for (std::list<CachedScene>::iterator it = ds.cache.begin(); it!=ds.cache.end(); ++it) delete it->scene;
+	ds.cache.clear();
+	CloseHandle(ds.wake);
+	WSACleanup();
+	return 0;
+}
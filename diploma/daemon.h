@@ -0,0 +1,36 @@
+#pragma once
+
+#include "raytracer.h"
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Render daemon
+//---------------------------------------------------------------
+// Long-running server, started with `diploma.exe /serve [port]`. Scenes stay loaded between jobs,
+// so repeated jobs skip process start, parsing and hierarchy building and go straight to tracing.
+// Loaded scenes are kept in LRU order, keyed by .scene path. An entry is reloaded once the mtime of
+// the .scene or of any mesh it pulls in has changed.
+// Jobs are rendered one at a time on all cores. Every connection has its own queue and queues are
+// served round-robin, so one client can't starve the others by sending hundreds of jobs.
+//
+// Line protocol over TCP on 127.0.0.1. One command per line, paths with spaces go in double quotes:
+//	render scene=<path> [width=W] [height=H] [quality=draft|final] [camera=x,y,z,dx,dy,dz] [fov=F]
+//		-> queued <id> <jobs ahead>
+//		-> warning <id> <line> <col> <message>	for bad .scene lines, job still runs
+//		-> started <id> cached|loaded <ms>		ms spent getting the scene ready
+//		-> tile <id> <x> <y> <w> <h>			followed by w*h*3 bytes, RGB, rows top to bottom
+//		-> done <id> <ms> | cancelled <id> | error <id> <message>
+//	cancel <id>			-> cancelling <id>, job then ends with cancelled <id>
+//	stats				-> scene <hits> <objects> <path> per cached scene, then end
+//	shutdown			-> bye, then the server stops
+// Anything else gets error 0 <message>. Jobs of a connection that went away are dropped.
+#define RAYTRACER_DAEMON_PORT		7878
+#ifndef RAYTRACER_DAEMON_SCENES
+#define RAYTRACER_DAEMON_SCENES		4		// Scenes kept loaded
+#endif
+#define RAYTRACER_DAEMON_MAXSIDE	16384	// Biggest width or height accepted
+#define RAYTRACER_DAEMON_LINE		4096	// Longest command line
+
+// Runs until shutdown command, returns process exit code
+int RunDaemon(int port = RAYTRACER_DAEMON_PORT);
+};
@@ -6,10 +6,19 @@
 
 // Raytracer stuffs
 #include "raytracer.h"
+#include "renderjob.h"
+#include "daemon.h"
+#include "batch.h"
+#include "autotune.h"
+#include "bench.h"
+#include "selftest.h"
+#include "profile.h"
+#include "liveview.h"
 
 // GetOpenFileName and stuff
 #include <Windows.h>
 #include <Commdlg.h>
+#include <shellapi.h>
 
 // Temporary stuff
 #define SCRWIDTH	1000
@@ -35,7 +44,82 @@ int APIENTRY _tWinMain(HINSTANCE hInstance,
                      int       nCmdShow)
 {
 	UNREFERENCED_PARAMETER(hPrevInstance);
-	UNREFERENCED_PARAMETER(lpCmdLine);
+
+	int argc;
+	LPWSTR *argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+	std::vector<std::string> args;
+	for (int i = 1; argv && i<argc; i++) // Skip exe
+	{
+		std::wstring arg(argv[i]);
+		args.push_back(std::string(arg.begin(), arg.end()));
+	}
+	LocalFree(argv);
+
+	// Modes without a window print problems instead of showing message boxes
+	unsigned int mode = 0;
+	while (mode+1<args.size() && (args[mode]=="/profile" || args[mode]=="/share")) mode += 2;
+	if (mode<args.size() && (args[mode]=="/serve" || args[mode]=="/bench" || args[mode]=="/selftest" || args[mode]=="/tune" || args[mode]=="/render"))
+		raytracer::SetHeadless();
+
+	// diploma.exe /profile <trace.json> [/serve or /render ...] - phase timings go there on exit, see profile.h
+	if (args.size()>=2 && args[0]=="/profile")
+	{
+		raytracer::StartProfiling(args[1]);
+		args.erase(args.begin(), args.begin()+2);
+	}
+	// diploma.exe /share <name> [/serve or /render ...] - canvases go to shared memory for /view, see liveview.h
+	if (args.size()>=2 && args[0]=="/share")
+	{
+		raytracer::StartSharing(args[1]);
+		args.erase(args.begin(), args.begin()+2);
+	}
+	// diploma.exe /view <name> - window that follows a render shared with /share
+	if (args.size()>=2 && args[0]=="/view")
+	{
+		int rc = raytracer::RunViewer(args[1]);
+		raytracer::StopProfiling();
+		return rc;
+	}
+	// diploma.exe /serve [port] - no window, render jobs come over local socket, see daemon.h
+	if (!args.empty() && args[0]=="/serve")
+	{
+		int port = args.size()>1 ? atoi(args[1].c_str()) : 0;
+		int rc = raytracer::RunDaemon(port>0?port:RAYTRACER_DAEMON_PORT);
+		raytracer::StopSharing();
+		raytracer::StopProfiling();
+		return rc;
+	}
+	// diploma.exe /bench [report.txt] - intersection kernels alone, see bench.h
+	if (!args.empty() && args[0]=="/bench")
+	{
+		int rc = args.size()>1 ? raytracer::RunBench(args[1]) : raytracer::RunBench();
+		raytracer::StopProfiling();
+		return rc;
+	}
+	// diploma.exe /selftest [report.txt] - built-in scenes checked for quiet breakage, see selftest.h
+	if (!args.empty() && args[0]=="/selftest")
+	{
+		int rc = args.size()>1 ? raytracer::RunSelfTest(args[1]) : raytracer::RunSelfTest();
+		raytracer::StopProfiling();
+		return rc;
+	}
+	// diploma.exe /tune <scene> [/size WxH] - probes render settings for /render, see autotune.h
+	if (!args.empty() && args[0]=="/tune")
+	{
+		args.erase(args.begin());
+		int rc = raytracer::RunAutotune(args);
+		raytracer::StopProfiling();
+		return rc;
+	}
+	// diploma.exe /render <scene> <image> [options] - no window either, see batch.h
+	if (!args.empty() && args[0]=="/render")
+	{
+		args.erase(args.begin());
+		int rc = raytracer::RunBatch(args);
+		raytracer::StopSharing();
+		raytracer::StopProfiling();
+		return rc;
+	}
 
  	// TODO: Place code here.
 	MSG msg;
@@ -64,6 +148,8 @@ int APIENTRY _tWinMain(HINSTANCE hInstance,
 		}
 	}
 
+	raytracer::StopSharing();
+	raytracer::StopProfiling();
 	return (int) msg.wParam;
 }
 
@@ -107,9 +193,30 @@ HDC hdc;
 unsigned int *imgpixels = 0;	// check for load!
 
 raytracer::CanvasData *canv = 0;
+raytracer::RenderJob *renderjob = 0;	// Render running in background, if any
 
 static char bitmapbuffer[sizeof( BITMAPINFO ) + 16];	// Hack to draw bmp on screen
 static BITMAPINFO* bh;
+
+// Repaint tiles as they come, called from render threads
+static void OnTileRendered(raytracer::RenderJob &job, int tile, void *user)
+{
+	raytracer::CanvasData *c = job.GetCanvas();
+	int ts = c->GetTileSize();
+	RECT r;
+	r.left		= (tile%c->GetTilesX())*ts;
+	r.top		= (tile/c->GetTilesX())*ts;
+	r.right		= r.left+ts;
+	r.bottom	= r.top+ts;
+	InvalidateRect((HWND)user, &r, FALSE);
+}
+
+// Scene and canvas can't be touched while render runs
+static void StopRender()
+{
+	delete renderjob; // Cancels and waits
+	renderjob = 0;
+}
 //////////////////////////////////////////
 
 
@@ -194,8 +301,16 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 			DestroyWindow(hWnd);
 			break;
 		case IDM_DORENDER:
+			{
+			StopRender();
 			InvalidateRect(hWnd, NULL, NULL);
-			raytracer::DrawRaytraced(*canv);
+			raytracer::RenderOptions opts;
+			opts.ontile	= OnTileRendered;
+			opts.user	= hWnd;
+			renderjob = raytracer::StartRender(raytracer::sc, *canv, opts);
+			break;}
+		case IDM_CANCELRENDER:
+			if (renderjob) renderjob->Cancel();
 			break;
 		case IDM_OPENFILE:
 			{OPENFILENAME ofn;       // common dialog box structure
@@ -219,12 +334,19 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 			ofn.Flags = OFN_PATHMUSTEXIST | OFN_FILEMUSTEXIST;
 			if (GetOpenFileName(&ofn)) {
 				std::wstring conv(szFile);
+				StopRender();
 				raytracer::LoadScene(std::string(conv.begin(),conv.end()));
 				// use open.whatever to get data about the selected file
 			}
 			break;}
 		case IDM_SAVEFILE:
 			{
+			// Workers still write into canvas, encoding it now would give a torn image
+			if (renderjob && renderjob->GetState()==raytracer::RENDER_RUNNING)
+			{
+				if (MessageBox(hWnd, L"Render is still running. Stop it and save what is done so far?", L"Save Image", MB_YESNO|MB_ICONQUESTION)!=IDYES) break;
+				StopRender();
+			}
 			OPENFILENAME ofn;       // common dialog box structure
 			WCHAR szFile[260];      // buffer for file name
 			HANDLE hf;              // file handle
@@ -239,7 +361,8 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 
 			ofn.lStructSize = sizeof(ofn); 
 			ofn.hwndOwner = NULL;
-			ofn.lpstrFilter = (LPCWSTR)L"Bitmap Image Files (*.bmp)\0*.bmp\0";
+			// Format is picked by extension, see imageio.h
+			ofn.lpstrFilter = (LPCWSTR)L"Bitmap Image Files (*.bmp)\0*.bmp\0PNG Image Files (*.png)\0*.png\0Netpbm Image Files (*.ppm)\0*.ppm\0Portable Float Map (*.pfm)\0*.pfm\0OpenEXR Image Files (*.exr)\0*.exr\0";
 			ofn.lpstrFile = (LPWSTR)szFile;
 			ofn.nMaxFile = MAX_PATH;
 			ofn.Flags = OFN_EXPLORER | OFN_FILEMUSTEXIST | OFN_HIDEREADONLY;
@@ -260,6 +383,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 		ValidateRect( hWnd, NULL ); // Re-draw it!
 		break;
 	case WM_DESTROY:
+		StopRender();
 		PostQuitMessage(0);
 		break;
 	default:
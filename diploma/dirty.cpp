@@ -0,0 +1,178 @@
+#include "stdafx.h"
+
+#include "dirty.h"
+
+using namespace raytracer;
+//---------------------------------------------------------------
+// TouchBuffer
+//---------------------------------------------------------------
+TouchBuffer::TouchBuffer(int W, int H, int TS)
+{
+	Width		= W;
+	Height		= H;
+	TileSize	= TS;
+	TilesX		= (W+TS-1)/TS;
+	masks.assign((size_t)W*H, 0);
+	hits.assign((size_t)W*H*RAYTRACER_SUBSAMPLES, NoHit());
+	Span none = {0, 0};
+	spans.assign((size_t)W*H, none);
+	segments.resize(TilesX*((H+TS-1)/TS));
+}
+
+void TouchBuffer::Clear()
+{
+	masks.assign(masks.size(), 0);
+	hits.assign(hits.size(), NoHit());
+	Span none = {0, 0};
+	spans.assign(spans.size(), none);
+	for (unsigned int i = 0; i<segments.size(); i++) std::vector<TouchSegment>().swap(segments[i]);
+}
+
+const TouchSegment* TouchBuffer::Segments(int x, int y, int &count)
+{
+	const Span &s = spans[(size_t)y*Width+x];
+	count = s.count;
+	return count ? &segments[(y/TileSize)*TilesX+x/TileSize][s.first] : NULL;
+}
+
+void TouchBuffer::KeepSegments(int x, int y, std::vector<TouchSegment> &tile)
+{
+	Span &s = spans[(size_t)y*Width+x];
+	const std::vector<TouchSegment> &had = segments[(y/TileSize)*TilesX+x/TileSize];
+	unsigned int first = (unsigned int)tile.size();
+	if (s.count) tile.insert(tile.end(), had.begin()+s.first, had.begin()+s.first+s.count);
+	s.first = first;
+}
+
+void TouchBuffer::SetSegments(int x, int y, std::vector<TouchSegment> &tile, const TouchSegment *segs, int count)
+{
+	Span &s = spans[(size_t)y*Width+x];
+	s.first = (unsigned int)tile.size();
+	s.count = count;
+	if (count) tile.insert(tile.end(), segs, segs+count);
+}
+
+//---------------------------------------------------------------
+// DirtyRegion
+//---------------------------------------------------------------
+DirtyRegion::DirtyRegion()
+{
+	Clear();
+}
+
+void DirtyRegion::Clear()
+{
+	objects.clear();
+	boxes.clear();
+	mask		= 0;
+	firstnew	= 0;
+	everything	= false;
+}
+
+// Bounds of obj grown a bit, so that rays grazing the surface are caught too
+static bool DirtyBounds(Renderable *obj, vector &bmin, vector &bmax)
+{
+	if (!obj->GetBounds(bmin, bmax)) return false;
+	vector e = bmax-bmin;
+	float pad = (max(max(e.x,e.y),e.z))*1e-3f+1e-3f;
+	bmin = bmin-vector(pad,pad,pad);
+	bmax = bmax+vector(pad,pad,pad);
+	return true;
+}
+
+void DirtyRegion::Add(Renderable *obj)
+{
+	objects.push_back(obj);
+	mask |= TouchBit(obj->id);
+	if (obj->light) everything = true; // Whole lighting changes
+	vector bmin, bmax;
+	if (DirtyBounds(obj, bmin, bmax))
+	{
+		boxes.push_back(bmin);
+		boxes.push_back(bmax);
+	}
+	else everything = true;
+}
+
+void DirtyRegion::Commit()
+{
+	firstnew = (int)boxes.size();
+	for (unsigned int i = 0; i<objects.size(); i++)
+	{
+		vector bmin, bmax;
+		if (DirtyBounds(objects[i], bmin, bmax))
+		{
+			boxes.push_back(bmin);
+			boxes.push_back(bmax);
+		}
+		else everything = true;
+		if (objects[i]->light) everything = true;
+	}
+	// Hierarchy and light list have to follow the edits
+	sc.Init();
+}
+
+// Slab test of segment Or+Dir*t, t in [0,tmax] against box
+static bool SegmentHitsBox(const float *o, const float *d, float tmax, const vector &lo, const vector &hi)
+{
+	const float l[3] = {lo.x, lo.y, lo.z};
+	const float h[3] = {hi.x, hi.y, hi.z};
+	float t0 = 0.f, t1 = tmax;
+	for (int a = 0; a<3; a++)
+	{
+		if (d[a]==0.f)
+		{
+			if (o[a]<l[a] || o[a]>h[a]) return false;
+			continue;
+		}
+		float tn = (l[a]-o[a])/d[a];
+		float tf = (h[a]-o[a])/d[a];
+		if (tn>tf) { float t = tn; tn = tf; tf = t; }
+		t0 = tn>t0?tn:t0;
+		t1 = tf<t1?tf:t1;
+		if (t0>t1) return false;
+	}
+	return true;
+}
+
+// Could an edited object start shadowing hit point h?
+static bool ShadowCrossesBoxes(const vector &hit, const std::vector<vector> &boxes, int firstbox)
+{
+	const float h[3] = {hit.x, hit.y, hit.z};
+	for (unsigned int l = 0; l<sc.lights.size(); l++)
+	{
+		vector tolight = sc.lights[l]->pos-hit;
+		const float s[3] = {tolight.x, tolight.y, tolight.z};
+		for (unsigned int b = firstbox; b<boxes.size(); b+=2)
+			if (SegmentHitsBox(h, s, 1.f, boxes[b], boxes[b+1])) return true;
+	}
+	return false;
+}
+
+bool DirtyRegion::Needs(unsigned __int64 touched, const vector *hits, const TouchSegment *segs, int segcount,
+	vector Or, const float *dx, const float *dy, const float *dz, int count)
+{
+	if (everything || (touched&mask)) return true;
+	const float o[3] = {Or.x, Or.y, Or.z};
+	for (int r = 0; r<count; r++)
+	{
+		// Primary ray could hit the object where it was, or where it is now
+		const float d[3] = {dx[r], dy[r], dz[r]};
+		for (unsigned int b = 0; b<boxes.size(); b+=2)
+			if (SegmentHitsBox(o, d, 1e30f, boxes[b], boxes[b+1])) return true;
+
+		// Object could start shadowing this hit point. Shadows it cast before are in touched already.
+		if (hits && hits[r].x<1e29f && ShadowCrossesBoxes(hits[r], boxes, firstnew)) return true;
+	}
+	// Reflected and refracted rays, and shadows where they landed, only care where objects are now
+	for (int i = 0; i<segcount; i++)
+	{
+		const TouchSegment &g = segs[i];
+		const float so[3] = {g.org.x, g.org.y, g.org.z};
+		const float sd[3] = {g.dir.x, g.dir.y, g.dir.z};
+		for (unsigned int b = firstnew; b<boxes.size(); b+=2)
+			if (SegmentHitsBox(so, sd, g.len, boxes[b], boxes[b+1])) return true;
+		if (g.lit && ShadowCrossesBoxes(g.org+g.dir*g.len, boxes, firstnew)) return true;
+	}
+	return false;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "raytracer.h"
+#include "camera.h"
+
+#include <vector>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Dirty region re-render
+//---------------------------------------------------------------
+// DrawRaytraced can record, per pixel, a hash set of objects hit anywhere along its paths(see TouchBit):
+// primary, reflected and refracted rays, and shadow rays of every hit. It also keeps where primary
+// rays landed and the segments of secondary rays. After an object is edited only pixels that have
+// seen it, whose primary rays cross its old or new bounds, or whose secondary or shadow rays cross its
+// new bounds are traced again. Old bounds don't matter past the primary ray: a secondary ray that hit
+// the object has it in the set already, one that didn't isn't changed by it going away.
+// Editing a light or a plane re-traces everything.
+// Only edits of existing objects are supported: adding or removing objects shifts ids, render it all again.
+//
+// Usage:
+//	TouchBuffer touch(W,H);
+//	DrawRaytraced(canv, &touch);
+//	DirtyRegion dirty;
+//	dirty.Add(obj);			// Before changing obj
+//	obj->pos = ...;
+//	dirty.Commit();			// After all changes, rebuilds acceleration structures
+//	RedrawDirty(canv, touch, dirty);
+
+// Reflected or refracted ray of a recorded path. Ones that escaped the scene have len of 1e30.
+struct TouchSegment
+{
+	vector	org, dir;
+	float	len;
+	bool	lit;	// Ends on a surface that shadow rays were traced from
+};
+
+class TouchBuffer
+{
+public:
+	// Tiles must be the canvas' ones, segments are kept per tile, so tiles can be rendered in parallel
+	TouchBuffer(int W, int H, int TileSize = RAYTRACER_TILESIZE);
+
+	int GetWidth(){return Width;};
+	int GetHeight(){return Height;};
+	int GetTileSize(){return TileSize;};
+	unsigned __int64& At(int x, int y){return masks[(size_t)y*Width+x];};
+	// RAYTRACER_SUBSAMPLES primary hit points of pixel, NoHit() where there's nothing to shadow
+	vector* Hits(int x, int y){return &hits[((size_t)y*Width+x)*RAYTRACER_SUBSAMPLES];};
+	static vector NoHit(){return vector(1e30f,1e30f,1e30f);};
+	// Secondary rays of pixel, count of them goes to count
+	const TouchSegment* Segments(int x, int y, int &count);
+	// Tile render rebuilds segments of its tile in a vector of its own: every pixel of the tile gets
+	// either KeepSegments(what it had) or SetSegments(new ones), after its Segments were looked at.
+	// EndTile then puts the vector in place. Different tiles may be rebuilt at once.
+	void KeepSegments(int x, int y, std::vector<TouchSegment> &tile);
+	void SetSegments(int x, int y, std::vector<TouchSegment> &tile, const TouchSegment *segs, int count);
+	void EndTile(int tile, std::vector<TouchSegment> &segs){segments[tile].swap(segs);};
+	void Clear();
+private:
+	struct Span
+	{
+		unsigned int first, count;	// In segments of pixel's tile
+	};
+	int Width, Height, TileSize, TilesX;
+	std::vector<unsigned __int64>	masks;	// 8 bytes per pixel
+	std::vector<vector>				hits;	// 60 bytes per pixel
+	std::vector<Span>				spans;	// 8 bytes per pixel
+	std::vector< std::vector<TouchSegment> > segments;	// Per tile, 32 bytes per secondary ray
+};
+
+class DirtyRegion
+{
+public:
+	DirtyRegion();
+
+	// Before changing obj, remembers where it was
+	void Add(Renderable *obj);
+	// After changes, remembers where objects went and updates the scene
+	void Commit();
+	void Clear();
+
+	// Does pixel with recorded touched set, primary hits, secondary rays and these primary rays need tracing again?
+	bool Needs(unsigned __int64 touched, const vector *hits, const TouchSegment *segs, int segcount,
+		vector Or, const float *dx, const float *dy, const float *dz, int count);
+	bool IsEmpty(){return objects.empty();};
+private:
+	std::vector<Renderable*>	objects;
+	std::vector<vector>			boxes;	// Pairs of bmin,bmax: old ones, then new ones after Commit
+	int							firstnew; // Index of first new box in boxes
+	unsigned __int64			mask;	// TouchBits of all edited objects
+	bool						everything; // Unbounded object was edited, any ray may be affected
+};
+};
@@ -0,0 +1,202 @@
+#include "stdafx.h"
+
+#include "raytracer.h"
+#include "framebuffer.h"
+#include "liveview.h"
+
+using namespace raytracer;
+//---------------------------------------------------------------
+// TileStore
+//---------------------------------------------------------------
+TileStore::TileStore(int W, int H, int TileSize, int BytesPerPixel, std::string filename)
+{
+	width		= W;
+	height		= H;
+	tilesize	= TileSize;
+	tilesx		= (W+TileSize-1)/TileSize;
+	tilesy		= (H+TileSize-1)/TileSize;
+	bpp			= BytesPerPixel;
+	file		= INVALID_HANDLE_VALUE;
+	mapping		= NULL;
+
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	granularity = si.dwAllocationGranularity;
+
+	DWORD flags = FILE_ATTRIBUTE_NORMAL;
+	if (filename.empty())
+	{
+		char dir[MAX_PATH], name[MAX_PATH];
+		if (!GetTempPathA(MAX_PATH, dir) || !GetTempFileNameA(dir, "rtc", 0, name)) return;
+		filename	= name;
+		// Temporary attribute keeps pages in cache if there is room, delete-on-close cleans up after crashes too
+		flags		= FILE_ATTRIBUTE_TEMPORARY|FILE_FLAG_DELETE_ON_CLOSE;
+	}
+	file = CreateFileA(filename.c_str(), GENERIC_READ|GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, flags, NULL);
+	if (file==INVALID_HANDLE_VALUE) return;
+
+	unsigned __int64 size = GetTileBytes()*tilesx*tilesy;
+	// Mapping grows the file to full size. Contents are zero, which is a black canvas.
+	mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)(size>>32), (DWORD)(size&0xFFFFFFFF), NULL);
+}
+
+TileStore::~TileStore()
+{
+	if (mapping) CloseHandle(mapping);
+	if (file!=INVALID_HANDLE_VALUE) CloseHandle(file);
+}
+
+void* TileStore::MapRange(unsigned __int64 offset, unsigned __int64 len, void **view)
+{
+	*view = NULL;
+	if (!mapping) return NULL;
+	// Views must start on allocation granularity boundary, so map a bit more in front
+	unsigned __int64 aligned	= offset - offset%granularity;
+	unsigned __int64 delta		= offset - aligned;
+	void *base = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, (DWORD)(aligned>>32), (DWORD)(aligned&0xFFFFFFFF), (SIZE_T)(len+delta));
+	if (!base) return NULL;
+	*view = base;
+	return (char*)base+delta;
+}
+
+void* TileStore::MapTile(int tx, int ty, void **view)
+{
+	return MapRange(GetTileBytes()*((unsigned __int64)ty*tilesx+tx), GetTileBytes(), view);
+}
+
+void* TileStore::MapTileRow(int ty, void **view)
+{
+	return MapRange(GetTileBytes()*((unsigned __int64)ty*tilesx), GetTileBytes()*tilesx, view);
+}
+
+void TileStore::Unmap(void *view)
+{
+	// Dirty pages are written back by the OS when it wants the memory, we don't need to flush
+	if (view) UnmapViewOfFile(view);
+}
+
+//---------------------------------------------------------------
+// CanvasData
+//---------------------------------------------------------------
+CanvasData::CanvasData(int W,int H,int TileSize)
+{
+	Width		= W;
+	Height		= H;
+	tilesize	= TileSize;
+	store		= NULL;
+	pixels		= new Pixel[W*H];
+	ShareCanvas(this);
+}
+
+CanvasData::CanvasData(int W,int H,std::string swapfile,int TileSize)
+{
+	Width		= W;
+	Height		= H;
+	tilesize	= TileSize;
+	pixels		= NULL;
+	store		= new TileStore(W, H, TileSize, sizeof(Pixel), swapfile);
+	if (!store->IsOpen())
+	{
+		std::wstring err = L"Raytracer engine has failed to create canvas swap file: \"";
+		err+=std::wstring(swapfile.begin(),swapfile.end()); // Avoid using printf with something that user can mess around with!
+		err+=L"\"";
+		ShowError(err, L"Canvas creation failed");
+	}
+	ShareCanvas(this);
+}
+
+CanvasData::~CanvasData()
+{
+	UnshareCanvas(this);
+	delete [] pixels;
+	delete store;
+}
+
+CanvasTile CanvasData::LockTile(int tx, int ty)
+{
+	CanvasTile t;
+	t.x0	= tx*tilesize;
+	t.y0	= ty*tilesize;
+	t.w		= min(tilesize, Width-t.x0);
+	t.h		= min(tilesize, Height-t.y0);
+	if (store)
+	{
+		t.data		= (Pixel*)store->MapTile(tx, ty, &t.view);
+		t.stride	= tilesize;
+	}
+	else
+	{
+		t.data		= pixels+t.y0*Width+t.x0;
+		t.stride	= Width;
+		t.view		= NULL;
+	}
+	return t;
+}
+
+void CanvasData::UnlockTile(CanvasTile &tile)
+{
+	ShareTile(this, tile); // Finished tile goes to the live view, if there is one
+	if (store) store->Unmap(tile.view);
+	tile.data = NULL;
+	tile.view = NULL;
+}
+
+bool CanvasData::ReadRows(int y0, int rows, Pixel *out)
+{
+	if (!store)
+	{
+		memcpy(out, pixels+y0*Width, sizeof(Pixel)*Width*rows);
+		return true;
+	}
+	// Map one row of tiles at a time and gather scanlines out of it
+	int y = y0;
+	while (y<y0+rows)
+	{
+		int ty = y/tilesize;
+		void *view;
+		Pixel *band = (Pixel*)store->MapTileRow(ty, &view);
+		if (!band) return false;
+		int yend = min(y0+rows, (ty+1)*tilesize);
+		for (; y<yend; y++)
+		{
+			Pixel *dst = out+(y-y0)*Width;
+			int ly = y-ty*tilesize;
+			for (int tx = 0; tx<GetTilesX(); tx++)
+			{
+				int x0 = tx*tilesize;
+				memcpy(dst+x0, band+tx*tilesize*tilesize+ly*tilesize, sizeof(Pixel)*min(tilesize, Width-x0));
+			}
+		}
+		store->Unmap(view);
+	}
+	return true;
+}
+
+void CanvasData::Clear(Pixel Color)
+{
+	if (!store)
+	{
+		for (int i = 0; i<Width*Height; i++)
+		{
+			pixels[i] = Color;
+		};
+		return;
+	}
+	for (int ty = 0; ty<GetTilesY(); ty++)
+		for (int tx = 0; tx<GetTilesX(); tx++)
+		{
+			CanvasTile t = LockTile(tx, ty);
+			if (!t.data) continue;
+			for (int y = 0; y<t.h; y++)
+				for (int x = 0; x<t.w; x++)
+					t.data[y*t.stride+x] = Color;
+			UnlockTile(t);
+		}
+}
+
+CanvasData* raytracer::CreateCanvas(int W, int H, std::string swapfile, int TileSize)
+{
+	if ((unsigned __int64)W*H*sizeof(Pixel) <= RAYTRACER_INCORE_LIMIT && swapfile.empty())
+		return new CanvasData(W, H, TileSize);
+	return new CanvasData(W, H, swapfile, TileSize);
+}
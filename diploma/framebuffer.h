@@ -0,0 +1,44 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// TileStore - image split into square tiles kept in a memory-mapped file
+//---------------------------------------------------------------
+// Tiles are laid out tile-row after tile-row, every tile padded to full TileSize*TileSize,
+// so that one tile is one contiguous range and one row of tiles is one contiguous range too.
+// Only tiles that are currently mapped cost address space and(dirty) RAM, the rest lives
+// in the file and is paged by the OS. Works for any pixel size, so float layers fit as well.
+class TileStore
+{
+public:
+	// Empty file name means an anonymous temporary file that is deleted on close
+	TileStore(int W, int H, int TileSize, int BytesPerPixel, std::string file = "");
+	~TileStore();
+
+	bool IsOpen(){return mapping!=NULL;};
+
+	// Returns pointer to the tile(row stride is TileSize pixels), NULL on failure.
+	// view must be given back to Unmap once done. Safe to call from several threads.
+	void* MapTile(int tx, int ty, void **view);
+	// Same, but whole row of tiles at once: TilesX tiles one after another
+	void* MapTileRow(int ty, void **view);
+	void Unmap(void *view);
+
+	int GetTileSize(){return tilesize;};
+	int GetTilesX(){return tilesx;};
+	int GetTilesY(){return tilesy;};
+	unsigned __int64 GetTileBytes(){return (unsigned __int64)tilesize*tilesize*bpp;};
+private:
+	void* MapRange(unsigned __int64 offset, unsigned __int64 len, void **view);
+
+	int		width, height;
+	int		tilesize, tilesx, tilesy;
+	int		bpp;			// Bytes per pixel
+	HANDLE	file;
+	HANDLE	mapping;
+	DWORD	granularity;	// View offsets must be aligned to this(64K usually)
+};
+};
@@ -0,0 +1,75 @@
+#include "stdafx.h"
+
+#include "gbuffer.h"
+
+using namespace raytracer;
+//---------------------------------------------------------------
+// GBuffer
+//---------------------------------------------------------------
+GBuffer::GBuffer(int W, int H)
+{
+	Width	= W;
+	Height	= H;
+	samples.resize((size_t)W*H*RAYTRACER_SUBSAMPLES);
+	filled	= false;
+	objects	= 0;
+	camfov	= camaspect = 0;
+}
+
+bool GBuffer::Matches(Camera &cam)
+{
+	return filled && objects==sc.sceneobjects.size() &&
+		campos.x==cam.pos.x && campos.y==cam.pos.y && campos.z==cam.pos.z &&
+		camdir.x==cam.dir.x && camdir.y==cam.dir.y && camdir.z==cam.dir.z &&
+		camfov==cam.fov && camaspect==cam.aspect;
+}
+
+void GBuffer::Fill(Camera &cam)
+{
+	filled		= true;
+	objects		= sc.sceneobjects.size();
+	campos		= cam.pos;
+	camdir		= cam.dir;
+	camfov		= cam.fov;
+	camaspect	= cam.aspect;
+}
+
+void GBuffer::Store(GSample &s, traceresp &rez)
+{
+	s.hitpos	= rez.hitpos;
+	s.hitnormal	= rez.hitnormal;
+	s.id		= rez.obj?rez.obj->id:RAYTRACER_GBUFFER_BACKGROUND;
+	s.intout	= rez.intout;
+}
+
+traceresp GBuffer::Shade(GSample &s, vector Or, vector Dir)
+{
+	Dir = !Dir; // Same as ColorRaytraceSample does
+	Renderable *obj = s.id==RAYTRACER_GBUFFER_BACKGROUND ? NULL : sc.sceneobjects[s.id];
+
+	// Lights are visible objects, they could have moved into or out of view
+	bool retrace = obj && obj->light;
+	for (unsigned int i = 0; i<sc.lights.size() && !retrace; i++)
+	{
+		traceresp lt = sc.lights[i]->Draw(Or, Dir);
+		if (!lt.hit) continue;
+		if (!obj) retrace = true; // Floor or sky might be covered now
+		else retrace = ~(lt.hitpos-Or) <= ~(s.hitpos-Or);
+	}
+	if (retrace)
+	{
+		traceresp rez = ColorRaytraceSample(Or, Dir);
+		Store(s, rez);
+		return rez;
+	}
+
+	traceresp rez;
+	if (!obj) rez = GetBackground(Or, Dir); // Cheap, no point caching it
+	else
+	{
+		// Same what primitives' Draw would return, material comes fresh from the object
+		rez = traceresp(true, s.hitpos, s.hitnormal, Dir, s.intout!=0, ~(s.hitpos-Or),
+						obj->color, obj->refl, obj->refr, obj->light, obj);
+	}
+	return ShadeHit(rez, Dir);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "raytracer.h"
+#include "camera.h"
+
+#include <vector>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// G-buffer, first hit cache for relighting
+//---------------------------------------------------------------
+// DrawRaytraced can keep the primary hit of every sample: position, normals and object.
+// Material is read back from the object, so colors, refl/refr and diff/spec may be changed freely,
+// Relight picks the shading variant for them anew.
+// Relight then shades from the cache, only shadow and secondary rays are traced.
+// Lights may be moved too(call sc.Init() afterwards, as they live in the hierarchy):
+// samples that hit a light or may now be blocked by one are traced again from the camera.
+// Any other change of geometry or camera needs a full DrawRaytraced.
+// 32 bytes per sample, RAYTRACER_SUBSAMPLES samples per pixel.
+//
+// Usage:
+//	GBuffer gbuf(W,H);
+//	DrawRaytraced(canv, NULL, &gbuf);
+//	light->pos = ...; sc.Init();
+//	obj->diff = ...;
+//	Relight(canv, gbuf);
+#define RAYTRACER_GBUFFER_BACKGROUND	-1	// GSample::id of floor or sky
+
+struct GSample
+{
+	vector	hitpos;
+	vector	hitnormal;
+	int		id;		// Renderable::id, or RAYTRACER_GBUFFER_BACKGROUND
+	int		intout;	// traceresp::intout
+};
+
+class GBuffer
+{
+public:
+	GBuffer(int W, int H);
+
+	int GetWidth(){return Width;};
+	int GetHeight(){return Height;};
+	// RAYTRACER_SUBSAMPLES samples of pixel
+	GSample* At(int x, int y){return &samples[((size_t)y*Width+x)*RAYTRACER_SUBSAMPLES];};
+
+	// Is cache filled, for this camera and scene size?
+	bool Matches(Camera &cam);
+	void Fill(Camera &cam);	// Marks cache as filled for cam
+	void Invalidate(){filled = false;};
+
+	// Remembers primary hit of shaded sample
+	void Store(GSample &s, traceresp &rez);
+	// Shades sample from cache, tracing it again if lights have moved in the way
+	traceresp Shade(GSample &s, vector Or, vector Dir);
+private:
+	int						Width, Height;
+	std::vector<GSample>	samples;
+	bool					filled;
+	vector					campos, camdir;		// Camera cache was made for
+	float					camfov, camaspect;
+	size_t					objects;			// sceneobjects size, ids must still point to same things
+};
+
+// Shades canvas from gbuf. If it wasn't filled for this canvas and camera, does full render filling it.
+void Relight(CanvasData &canv, GBuffer &gbuf);
+};
@@ -0,0 +1,713 @@
+#include "stdafx.h"
+
+#include "imageio.h"
+#include "parallel.h"
+#include "profile.h"
+
+#include <intrin.h>
+#include <tmmintrin.h> // SSSE3, pshufb
+
+using namespace raytracer;
+//---------------------------------------------------------------
+// Helpers
+//---------------------------------------------------------------
+static bool HasSSSE3()
+{
+	static int has = -1; // Benign race, same as GetWorkerCount
+	if (has<0)
+	{
+		int info[4];
+		__cpuid(info, 1);
+		has = (info[2] & (1<<9))?1:0; // ECX bit 9
+	}
+	return has==1;
+}
+
+static void PutLE32(unsigned char *p, unsigned int v)
+{
+	p[0] = (unsigned char)(v);		p[1] = (unsigned char)(v>>8);
+	p[2] = (unsigned char)(v>>16);	p[3] = (unsigned char)(v>>24);
+}
+
+static void PutBE32(unsigned char *p, unsigned int v)
+{
+	p[0] = (unsigned char)(v>>24);	p[1] = (unsigned char)(v>>16);
+	p[2] = (unsigned char)(v>>8);	p[3] = (unsigned char)(v);
+}
+
+ImageFormat raytracer::ImageFormatFromFilename(const std::string &file)
+{
+	std::string::size_type dot = file.find_last_of('.');
+	if (dot==std::string::npos) return IMAGE_BMP;
+
+	std::string ext = file.substr(dot+1);
+	for (unsigned int i = 0; i<ext.size(); i++)
+		if (ext[i]>='A' && ext[i]<='Z') ext[i] = ext[i]-'A'+'a';
+
+	if (ext == "png")					return IMAGE_PNG;
+	if (ext == "ppm" || ext == "pnm")	return IMAGE_PPM;
+	if (ext == "pfm")					return IMAGE_PFM;
+	if (ext == "exr")					return IMAGE_EXR;
+	return IMAGE_BMP;
+}
+
+//---------------------------------------------------------------
+// Pixel repacking
+//---------------------------------------------------------------
+// 16 pixels(64 bytes) in, 48 bytes out per iteration.
+// Each pshufb squeezes 4 pixels into low 12 bytes, then we stitch 4 of those into 3 registers.
+static void PackRow3SSSE3(const Pixel *src, unsigned char *dst, int w, __m128i shuf)
+{
+	int j = 0;
+	for (; j+16<=w; j+=16)
+	{
+		__m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src+j   )), shuf);
+		__m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src+j+4 )), shuf);
+		__m128i c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src+j+8 )), shuf);
+		__m128i d = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src+j+12)), shuf);
+
+		_mm_storeu_si128((__m128i*)(dst+j*3   ), _mm_or_si128(a, _mm_slli_si128(b,12)));
+		_mm_storeu_si128((__m128i*)(dst+j*3+16), _mm_or_si128(_mm_srli_si128(b,4), _mm_slli_si128(c,8)));
+		_mm_storeu_si128((__m128i*)(dst+j*3+32), _mm_or_si128(_mm_srli_si128(c,8), _mm_slli_si128(d,4)));
+	}
+	// Leftovers go the slow way. Byte order is given by first 3 entries of the shuffle mask.
+	const unsigned char *s = (const unsigned char*)src;
+	unsigned char order[16];
+	_mm_storeu_si128((__m128i*)order, shuf);
+	for (; j<w; j++)
+	{
+		dst[j*3  ] = s[j*4+order[0]];
+		dst[j*3+1] = s[j*4+order[1]];
+		dst[j*3+2] = s[j*4+order[2]];
+	}
+}
+
+void raytracer::PackRowBGR(const Pixel *src, unsigned char *dst, int w)
+{
+	if (HasSSSE3())
+	{
+		// -1(0x80) zeroes the byte, we don't care about upper 4 anyway
+		PackRow3SSSE3(src, dst, w, _mm_setr_epi8(0,1,2, 4,5,6, 8,9,10, 12,13,14, -1,-1,-1,-1));
+		return;
+	}
+	for (int j = 0; j<w; j++)
+	{
+		dst[j*3  ] = (unsigned char)((src[j]&0x000000FF));		// Blue
+		dst[j*3+1] = (unsigned char)((src[j]&0x0000FF00)>>8);	// Green
+		dst[j*3+2] = (unsigned char)((src[j]&0x00FF0000)>>16);	// Red
+	}
+}
+
+void raytracer::PackRowRGB(const Pixel *src, unsigned char *dst, int w)
+{
+	if (HasSSSE3())
+	{
+		PackRow3SSSE3(src, dst, w, _mm_setr_epi8(2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1));
+		return;
+	}
+	for (int j = 0; j<w; j++)
+	{
+		dst[j*3  ] = (unsigned char)((src[j]&0x00FF0000)>>16);	// Red
+		dst[j*3+1] = (unsigned char)((src[j]&0x0000FF00)>>8);	// Green
+		dst[j*3+2] = (unsigned char)((src[j]&0x000000FF));		// Blue
+	}
+}
+
+//---------------------------------------------------------------
+// BMP
+//---------------------------------------------------------------
+// Bmp is practically raw data
+// No compression, no loss, exceptionally simple to work with
+bool raytracer::EncodeBMP(FILE *fp, CanvasData &canv)
+{
+	int w			= canv.GetWidth();
+	int h			= canv.GetHeight();
+	int alignedw	= ((w * 3 + 3) & 0xfffffffc); // (sic!) measured in bytes!
+
+	BITMAPINFOHEADER BMIH;
+	memset(&BMIH, 0, sizeof(BMIH));
+	BMIH.biSize			= sizeof(BITMAPINFOHEADER);
+	BMIH.biSizeImage	= h * alignedw; // we must align rows to 4 bytes format
+	BMIH.biWidth		= w;
+	BMIH.biHeight		= h;
+	BMIH.biPlanes		= 1;
+	BMIH.biBitCount		= 24;
+	BMIH.biCompression	= BI_RGB;
+
+	BITMAPFILEHEADER bmfh;
+	int nBitsOffset		= sizeof(BITMAPFILEHEADER) + BMIH.biSize;
+	bmfh.bfType			= 'B'+('M' << 8 );	// BMP 'magic number'
+	bmfh.bfOffBits		= nBitsOffset;
+	bmfh.bfSize			= nBitsOffset + BMIH.biSizeImage;
+	bmfh.bfReserved1	= bmfh.bfReserved2 = 0;
+
+	if (fwrite(&bmfh, sizeof(BITMAPFILEHEADER), 1, fp)!=1) return false;
+	if (fwrite(&BMIH, sizeof(BITMAPINFOHEADER), 1, fp)!=1) return false;
+
+	// Bmp is stored bottom-up, so we simply walk source rows backwards while packing,
+	// no separate flip pass. Rows are batched so that fwrite gets sizeable chunks.
+	const int batch = 64;
+	std::vector<unsigned char> buf(alignedw*batch, 0);
+	std::vector<Pixel> src(w*batch);
+	for (int i = 0; i < h; i += batch)
+	{
+		int rows = min(batch, h-i);
+		if (!canv.ReadRows(h-i-rows, rows, &src[0])) return false;
+		for (int r = 0; r<rows; r++)
+		{
+			unsigned char *row = &buf[r*alignedw];
+			PackRowBGR(&src[(rows-1-r)*w], row, w);
+			for (int f = w*3; f < alignedw; f++) row[f] = 0; // Alignment padding
+		}
+		if (fwrite(&buf[0], alignedw, rows, fp)!=(size_t)rows) return false;
+	}
+	return true;
+}
+
+//---------------------------------------------------------------
+// PPM
+//---------------------------------------------------------------
+bool raytracer::EncodePPM(FILE *fp, CanvasData &canv)
+{
+	int w = canv.GetWidth();
+	int h = canv.GetHeight();
+	if (fprintf(fp, "P6\n%d %d\n255\n", w, h)<0) return false;
+
+	const int batch = 64;
+	std::vector<unsigned char> buf(w*3*batch);
+	std::vector<Pixel> src(w*batch);
+	for (int i = 0; i < h; i += batch)
+	{
+		int rows = min(batch, h-i);
+		if (!canv.ReadRows(i, rows, &src[0])) return false;
+		for (int r = 0; r<rows; r++)
+			PackRowRGB(&src[r*w], &buf[r*w*3], w);
+		if (fwrite(&buf[0], w*3, rows, fp)!=(size_t)rows) return false;
+	}
+	return true;
+}
+
+//---------------------------------------------------------------
+// PNG
+//---------------------------------------------------------------
+// Image is cut into horizontal bands, each band is filtered and deflated on its own core.
+// Every band ends with an empty stored block(aka zlib sync flush), so they can simply be
+// concatenated into one zlib stream. Adler-32 of bands is combined afterwards.
+// Compressor is greedy LZ77 with fixed Huffman codes: not as tight as zlib -9,
+// but it is an order of magnitude faster and still squeezes our flat-colored renders well.
+static unsigned int crctable[256];
+static bool crcready = false;
+
+static unsigned int Crc32(unsigned int crc, const unsigned char *data, size_t len)
+{
+	if (!crcready)
+	{
+		for (unsigned int n = 0; n<256; n++)
+		{
+			unsigned int c = n;
+			for (int k = 0; k<8; k++) c = (c&1)?0xEDB88320u^(c>>1):(c>>1);
+			crctable[n] = c;
+		}
+		crcready = true;
+	}
+	crc = ~crc;
+	for (size_t i = 0; i<len; i++) crc = crctable[(crc^data[i])&0xFF]^(crc>>8);
+	return ~crc;
+}
+
+#define ADLER_BASE 65521
+static unsigned int Adler32(const unsigned char *data, size_t len)
+{
+	unsigned int a = 1, b = 0;
+	while (len>0)
+	{
+		size_t n = min(len, (size_t)5552); // Largest n so that b doesn't overflow before modulo
+		len -= n;
+		while (n--) { a += *data++; b += a; }
+		a %= ADLER_BASE;
+		b %= ADLER_BASE;
+	}
+	return (b<<16)|a;
+}
+
+// Same math as zlib's adler32_combine
+static unsigned int Adler32Combine(unsigned int adler1, unsigned int adler2, size_t len2)
+{
+	unsigned int rem	= (unsigned int)(len2 % ADLER_BASE);
+	unsigned int sum1	= adler1 & 0xffff;
+	unsigned int sum2	= (rem * sum1) % ADLER_BASE;
+	sum1 += (adler2 & 0xffff) + ADLER_BASE - 1;
+	sum2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_BASE - rem;
+	if (sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+	if (sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+	if (sum2 >= (ADLER_BASE << 1)) sum2 -= (ADLER_BASE << 1);
+	if (sum2 >= ADLER_BASE) sum2 -= ADLER_BASE;
+	return sum1 | (sum2 << 16);
+}
+
+struct BitWriter
+{
+	std::string		&out;
+	unsigned int	buf;
+	int				cnt;
+
+	BitWriter(std::string &o):out(o),buf(0),cnt(0){}
+	// Deflate packs bits LSB first. n is at most 16 here.
+	void Put(unsigned int bits, int n)
+	{
+		buf |= bits << cnt;
+		cnt += n;
+		while (cnt>=8)
+		{
+			out.push_back((char)(buf&0xFF));
+			buf >>= 8;
+			cnt -= 8;
+		}
+	}
+	// Huffman codes go MSB first, so they have to be reversed
+	void PutCode(unsigned int code, int n)
+	{
+		unsigned int r = 0;
+		for (int i = 0; i<n; i++) { r = (r<<1)|(code&1); code >>= 1; }
+		Put(r, n);
+	}
+	void Align()
+	{
+		if (cnt>0) out.push_back((char)(buf&0xFF));
+		buf = 0;
+		cnt = 0;
+	}
+};
+
+static const unsigned short lenbase[29]	= {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const unsigned char  lenextra[29]= {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+static const unsigned short distbase[30]= {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+
+static void PutLiteral(BitWriter &bw, int sym) // Fixed Huffman table from RFC1951 3.2.6
+{
+	if		(sym<144)	bw.PutCode(0x30+sym,		8);
+	else if (sym<256)	bw.PutCode(0x190+sym-144,	9);
+	else if (sym<280)	bw.PutCode(sym-256,			7);
+	else				bw.PutCode(0xC0+sym-280,	8);
+}
+
+static void PutMatch(BitWriter &bw, int len, int dist)
+{
+	// Length, at most 29 codes, linear scan from the top is fine
+	int lc = 28;
+	while (lenbase[lc]>len) lc--;
+	PutLiteral(bw, 257+lc);
+	if (lenextra[lc]) bw.Put(len-lenbase[lc], lenextra[lc]);
+
+	// Distance code straight from bit length of dist-1
+	int dc;
+	if (dist<=4) dc = dist-1;
+	else
+	{
+		int d = dist-1, l = 0;
+		while ((d>>(l+1))!=0) l++; // l = floor(log2(d))
+		dc = 2*l + ((d>>(l-1))&1);
+	}
+	bw.PutCode(dc, 5);
+	int dextra = dc<4?0:(dc/2-1);
+	if (dextra) bw.Put(dist-distbase[dc], dextra);
+}
+
+#define LZ_WINDOW	32768
+#define LZ_HASHBITS	15
+#define LZ_MAXCHAIN	16
+#define LZ_NICELEN	128
+
+// One fixed-Huffman block, followed by a sync flush so that the output is byte aligned
+static void DeflateBand(const unsigned char *data, int len, std::string &out)
+{
+	out.reserve(len/2+64);
+	BitWriter bw(out);
+	bw.Put(0,1); // BFINAL = 0, final block is appended by the caller
+	bw.Put(1,2); // BTYPE = 01, fixed codes
+
+	std::vector<int> head(1<<LZ_HASHBITS, -1);
+	std::vector<int> prev(LZ_WINDOW, -1);
+
+	int i = 0;
+	while (i<len)
+	{
+		int bestlen = 0, bestdist = 0;
+		if (i+3<=len)
+		{
+			unsigned int hash = ((data[i]<<10)^(data[i+1]<<5)^data[i+2])&((1<<LZ_HASHBITS)-1);
+			int cand = head[hash];
+			int maxlen = min(258, len-i);
+			for (int chain = 0; chain<LZ_MAXCHAIN && cand>=0 && i-cand<=LZ_WINDOW; chain++)
+			{
+				if (bestlen<maxlen && data[cand+bestlen]==data[i+bestlen]) // Quick reject, nothing beats a full length match
+				{
+					int l = 0;
+					while (l<maxlen && data[cand+l]==data[i+l]) l++;
+					if (l>bestlen) { bestlen = l; bestdist = i-cand; if (l>=LZ_NICELEN) break; }
+				}
+				cand = prev[cand&(LZ_WINDOW-1)];
+			}
+			prev[i&(LZ_WINDOW-1)] = head[hash];
+			head[hash] = i;
+		}
+
+		if (bestlen>=3)
+		{
+			PutMatch(bw, bestlen, bestdist);
+			// Insert skipped positions into hash chains, so next matches can find them
+			int end = i+bestlen;
+			for (i++; i<end; i++)
+			{
+				if (i+3>len) continue;
+				unsigned int hash = ((data[i]<<10)^(data[i+1]<<5)^data[i+2])&((1<<LZ_HASHBITS)-1);
+				prev[i&(LZ_WINDOW-1)] = head[hash];
+				head[hash] = i;
+			}
+		}
+		else
+		{
+			PutLiteral(bw, data[i]);
+			i++;
+		}
+	}
+	PutLiteral(bw, 256); // End of block
+
+	// Sync flush: empty non-final stored block
+	bw.Put(0,1);
+	bw.Put(0,2);
+	bw.Align();
+	out.push_back((char)0x00); out.push_back((char)0x00);
+	out.push_back((char)0xFF); out.push_back((char)0xFF);
+}
+
+static inline unsigned char Paeth(int a, int b, int c)
+{
+	int p = a+b-c;
+	int pa = abs(p-a), pb = abs(p-b), pc = abs(p-c);
+	if (pa<=pb && pa<=pc) return (unsigned char)a;
+	if (pb<=pc) return (unsigned char)b;
+	return (unsigned char)c;
+}
+
+// Picks the filter that gives the smallest sum of absolute signed residuals. Standard heuristic.
+// scratch must hold 5 rows worth of bytes.
+static void FilterRow(const unsigned char *cur, const unsigned char *prv, unsigned char *out, int bytes, unsigned char *scratch)
+{
+	const int bpp = 3;
+	unsigned char *cand[5];
+	for (int f = 0; f<5; f++) cand[f] = scratch+f*bytes;
+
+	for (int x = 0; x<bytes; x++)
+	{
+		int a = x>=bpp?cur[x-bpp]:0;
+		int b = prv?prv[x]:0;
+		int c = (prv&&x>=bpp)?prv[x-bpp]:0;
+		cand[0][x] = cur[x];
+		cand[1][x] = (unsigned char)(cur[x]-a);
+		cand[2][x] = (unsigned char)(cur[x]-b);
+		cand[3][x] = (unsigned char)(cur[x]-((a+b)>>1));
+		cand[4][x] = (unsigned char)(cur[x]-Paeth(a,b,c));
+	}
+	int best = 0;
+	unsigned int bestsum = 0xFFFFFFFF;
+	for (int f = 0; f<5; f++)
+	{
+		unsigned int sum = 0;
+		for (int x = 0; x<bytes; x++) sum += abs((int)(signed char)cand[f][x]);
+		if (sum<bestsum) { bestsum = sum; best = f; }
+	}
+	out[0] = (unsigned char)best;
+	memcpy(out+1, cand[best], bytes);
+}
+
+struct PNGBand
+{
+	int				y0, y1;		// Rows, [y0,y1)
+	std::string		deflated;	// Compressed band
+	unsigned int	adler;		// Adler-32 of filtered band
+	size_t			rawlen;		// Length of filtered band
+	bool			ok;			// Did we manage to read the pixels?
+};
+
+struct PNGBandEncoder
+{
+	CanvasData				*canv;
+	std::vector<PNGBand>	*bands;
+
+	void operator()(int b)
+	{
+		PNGBand &band	= (*bands)[b];
+		int w			= canv->GetWidth();
+		int stride		= w*3;
+
+		int first		= max(0, band.y0-1); // Predecessor row is needed for filtering
+		std::vector<Pixel> src((band.y1-first)*w);
+		std::vector<unsigned char> raw((band.y1-band.y0+1)*stride);
+		std::vector<unsigned char> filtered((band.y1-band.y0)*(stride+1));
+		std::vector<unsigned char> scratch(stride*5);
+
+		band.ok = canv->ReadRows(first, band.y1-first, &src[0]);
+		if (!band.ok) return;
+		for (int y = first; y<band.y1; y++)
+			PackRowRGB(&src[(y-first)*w], &raw[(y-band.y0+1)*stride], w);
+
+		for (int y = band.y0; y<band.y1; y++)
+		{
+			const unsigned char *cur = &raw[(y-band.y0+1)*stride];
+			const unsigned char *prv = y>0?cur-stride:NULL;
+			FilterRow(cur, prv, &filtered[(y-band.y0)*(stride+1)], stride, &scratch[0]);
+		}
+		band.rawlen = filtered.size();
+		band.adler	= Adler32(&filtered[0], filtered.size());
+		DeflateBand(&filtered[0], (int)filtered.size(), band.deflated);
+	}
+};
+
+static bool WritePNGChunk(FILE *fp, const char *type, const unsigned char *data, size_t len)
+{
+	unsigned char hdr[8];
+	PutBE32(hdr, (unsigned int)len);
+	memcpy(hdr+4, type, 4);
+	unsigned int crc = Crc32(0, hdr+4, 4);
+	if (len) crc = Crc32(crc, data, len);
+	unsigned char tail[4];
+	PutBE32(tail, crc);
+
+	if (fwrite(hdr, 8, 1, fp)!=1) return false;
+	if (len && fwrite(data, len, 1, fp)!=1) return false;
+	return fwrite(tail, 4, 1, fp)==1;
+}
+
+bool raytracer::EncodePNG(FILE *fp, CanvasData &canv)
+{
+	int w = canv.GetWidth();
+	int h = canv.GetHeight();
+
+	static const unsigned char signature[8] = {137,80,78,71,13,10,26,10};
+	if (fwrite(signature, 8, 1, fp)!=1) return false;
+
+	unsigned char ihdr[13];
+	PutBE32(ihdr, w);
+	PutBE32(ihdr+4, h);
+	ihdr[8]		= 8;	// Bit depth
+	ihdr[9]		= 2;	// Truecolor RGB
+	ihdr[10]	= 0;	// Deflate
+	ihdr[11]	= 0;	// Adaptive filtering
+	ihdr[12]	= 0;	// No interlace
+	if (!WritePNGChunk(fp, "IHDR", ihdr, 13)) return false;
+
+	// Around 1MB of raw data per band. Bands are processed a few per core at a time,
+	// so memory use doesn't grow with image size.
+	int rowsperband = max(1, (1<<20)/(w*3+1));
+	int bandcount	= (h+rowsperband-1)/rowsperband;
+	int inflight	= GetWorkerCount()*2;
+
+	unsigned int adler	= 1;
+	bool first			= true;
+	for (int b0 = 0; b0<bandcount; b0+=inflight)
+	{
+		std::vector<PNGBand> bands(min(inflight, bandcount-b0));
+		for (unsigned int b = 0; b<bands.size(); b++)
+		{
+			bands[b].y0 = (b0+b)*rowsperband;
+			bands[b].y1 = min(h, bands[b].y0+rowsperband);
+		}
+		PNGBandEncoder enc;
+		enc.canv	= &canv;
+		enc.bands	= &bands;
+		ParallelFor((int)bands.size(), enc);
+
+		for (unsigned int b = 0; b<bands.size(); b++)
+		{
+			if (!bands[b].ok) return false;
+			std::string &data = bands[b].deflated;
+			if (first)
+			{
+				data.insert(0, "\x78\x01", 2); // zlib header: deflate, 32K window, fastest
+				first = false;
+			}
+			adler = Adler32Combine(adler, bands[b].adler, bands[b].rawlen);
+			if (!WritePNGChunk(fp, "IDAT", (const unsigned char*)data.data(), data.size())) return false;
+		}
+	}
+
+	// Final empty stored block and the checksum
+	unsigned char tail[9] = {0x01, 0x00, 0x00, 0xFF, 0xFF};
+	PutBE32(tail+5, adler);
+	if (!WritePNGChunk(fp, "IDAT", tail, 9)) return false;
+	return WritePNGChunk(fp, "IEND", NULL, 0);
+}
+
+//---------------------------------------------------------------
+// Float formats
+//---------------------------------------------------------------
+// Writers pull one row at a time, so canvases of any size are written without
+// a full float copy of them in memory.
+class CanvasRows
+{
+public:
+	CanvasRows(CanvasData &Canv):canv(Canv),src(Canv.GetWidth()){};
+	bool Row(int y, float *out) // w interleaved RGB triplets
+	{
+		if (!canv.ReadRows(y, 1, &src[0])) return false;
+		// Canvas is 8 bits per channel, so this is just a widening to [0..1]
+		for (unsigned int x = 0; x<src.size(); x++)
+		{
+			out[x*3  ] = ((src[x]>>16)&0xFF)/255.f;
+			out[x*3+1] = ((src[x]>>8 )&0xFF)/255.f;
+			out[x*3+2] = ((src[x]    )&0xFF)/255.f;
+		}
+		return true;
+	};
+private:
+	CanvasData &canv;
+	std::vector<Pixel> src;
+};
+
+static bool WritePFM(FILE *fp, CanvasRows &rows, int w, int h)
+{
+	// Negative scale means little-endian. Rows go bottom to top.
+	if (fprintf(fp, "PF\n%d %d\n-1.0\n", w, h)<0) return false;
+	std::vector<float> line(w*3);
+	for (int i = h-1; i>=0; i--)
+	{
+		if (!rows.Row(i, &line[0])) return false;
+		if (fwrite(&line[0], sizeof(float)*3, w, fp)!=(size_t)w) return false;
+	}
+	return true;
+}
+
+static void PutEXRAttribute(std::string &hdr, const char *name, const char *type, const void *data, int len)
+{
+	hdr.append(name, strlen(name)+1);
+	hdr.append(type, strlen(type)+1);
+	unsigned char l[4];
+	PutLE32(l, len);
+	hdr.append((const char*)l, 4);
+	hdr.append((const char*)data, len);
+}
+
+static bool WriteEXR(FILE *fp, CanvasRows &rows, int w, int h)
+{
+	// Bare minimum single-part scanline file: no compression, one scanline per block.
+	std::string hdr;
+	unsigned char magic[8];
+	PutLE32(magic, 20000630);
+	PutLE32(magic+4, 2); // Version 2, no flags
+	hdr.append((const char*)magic, 8);
+
+	// Channels must be sorted by name, hence B,G,R
+	std::string chlist;
+	const char *names[3] = {"B","G","R"};
+	for (int c = 0; c<3; c++)
+	{
+		unsigned char ch[16];
+		PutLE32(ch, 2);		// FLOAT
+		PutLE32(ch+4, 0);	// pLinear + reserved
+		PutLE32(ch+8, 1);	// xSampling
+		PutLE32(ch+12, 1);	// ySampling
+		chlist.append(names[c], 2);
+		chlist.append((const char*)ch, 16);
+	}
+	chlist.push_back('\0');
+	PutEXRAttribute(hdr, "channels", "chlist", chlist.data(), (int)chlist.size());
+
+	unsigned char zero = 0;
+	PutEXRAttribute(hdr, "compression", "compression", &zero, 1);
+
+	unsigned char box[16];
+	PutLE32(box, 0);	PutLE32(box+4, 0);
+	PutLE32(box+8, w-1);PutLE32(box+12, h-1);
+	PutEXRAttribute(hdr, "dataWindow", "box2i", box, 16);
+	PutEXRAttribute(hdr, "displayWindow", "box2i", box, 16);
+	PutEXRAttribute(hdr, "lineOrder", "lineOrder", &zero, 1); // Increasing Y
+
+	float one = 1.f;
+	float center[2] = {0.f, 0.f};
+	PutEXRAttribute(hdr, "pixelAspectRatio", "float", &one, 4);
+	PutEXRAttribute(hdr, "screenWindowCenter", "v2f", center, 8);
+	PutEXRAttribute(hdr, "screenWindowWidth", "float", &one, 4);
+	hdr.push_back('\0');
+
+	if (fwrite(hdr.data(), hdr.size(), 1, fp)!=1) return false;
+
+	// Offset table, one entry per scanline
+	unsigned int linesize	= 8 + w*3*4;
+	unsigned __int64 offset	= hdr.size() + (unsigned __int64)h*8;
+	for (int y = 0; y<h; y++)
+	{
+		unsigned char o[8];
+		PutLE32(o,   (unsigned int)(offset & 0xFFFFFFFF));
+		PutLE32(o+4, (unsigned int)(offset >> 32));
+		if (fwrite(o, 8, 1, fp)!=1) return false;
+		offset += linesize;
+	}
+
+	// Scanlines are planar: all B, then all G, then all R
+	std::vector<unsigned char> line(linesize);
+	std::vector<float> src(w*3);
+	for (int y = 0; y<h; y++)
+	{
+		if (!rows.Row(y, &src[0])) return false;
+		PutLE32(&line[0], y);
+		PutLE32(&line[4], w*3*4);
+		float *planes = (float*)&line[8];
+		for (int x = 0; x<w; x++)
+		{
+			planes[x]		= src[x*3+2];
+			planes[w+x]		= src[x*3+1];
+			planes[2*w+x]	= src[x*3];
+		}
+		if (fwrite(&line[0], linesize, 1, fp)!=1) return false;
+	}
+	return true;
+}
+
+bool raytracer::EncodePFM(FILE *fp, CanvasData &canv)
+{
+	CanvasRows rows(canv);
+	return WritePFM(fp, rows, canv.GetWidth(), canv.GetHeight());
+}
+
+bool raytracer::EncodeEXR(FILE *fp, CanvasData &canv)
+{
+	CanvasRows rows(canv);
+	return WriteEXR(fp, rows, canv.GetWidth(), canv.GetHeight());
+}
+
+//---------------------------------------------------------------
+// Entry points
+//---------------------------------------------------------------
+static void ReportSaveFailure(std::string &file)
+{
+	std::wstring err = L"Raytracer engine has failed to save image!\nUnable to access or open the file for writing: \"";
+	err+=std::wstring(file.begin(),file.end()); // Avoid using printf with something that user can mess around with!
+	err+=L"\"";
+	ShowError(err, L"File saving failed");
+}
+
+bool raytracer::SaveRenderImage(std::string file, CanvasData &canv)
+{
+	RAYTRACER_PROFILE_SCOPE("SaveRenderImage");
+	ImageFormat fmt = ImageFormatFromFilename(file);
+	FILE *fp;
+	fp=fopen(file.c_str(),"wb");		// Open file for writing
+	if (!fp)
+	{
+		ReportSaveFailure(file);
+		return false;
+	}
+	bool ok;
+	switch (fmt)
+	{
+	case IMAGE_PNG: ok = EncodePNG(fp, canv); break;
+	case IMAGE_PPM: ok = EncodePPM(fp, canv); break;
+	case IMAGE_PFM: ok = EncodePFM(fp, canv); break;
+	case IMAGE_EXR: ok = EncodeEXR(fp, canv); break;
+	default:		ok = EncodeBMP(fp, canv); break;
+	}
+	if (fclose(fp)!=0) ok = false;
+	if (!ok) ReportSaveFailure(file);
+	return ok;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "raytracer.h"
+
+#include <stdio.h>
+#include <string>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Image encoders
+//---------------------------------------------------------------
+// SaveRenderImage picks one of these by file extension, .bmp is the fallback.
+enum ImageFormat
+{
+	IMAGE_BMP,	// 24-bit uncompressed, bottom-up rows
+	IMAGE_PPM,	// Binary P6, the simplest thing that image tools understand
+	IMAGE_PNG,	// Deflated, compressed on all cores
+	IMAGE_PFM,	// Portable float map, 32-bit float RGB
+	IMAGE_EXR	// OpenEXR, uncompressed FLOAT scanlines
+};
+// Float formats are written from the canvas, which keeps 8 bits per channel after clamping, so they
+// hold exactly what .png does: no more range, just a layout that HDR tools open directly.
+
+ImageFormat ImageFormatFromFilename(const std::string &file);
+
+// Pixel repacking, SSSE3 when CPU has it, scalar otherwise
+// Our Pixel is 0x00RRGGBB, so in memory it is B,G,R,0
+void PackRowBGR(const Pixel *src, unsigned char *dst, int w);	// BMP order
+void PackRowRGB(const Pixel *src, unsigned char *dst, int w);	// PNG/PPM order
+
+// Encoders proper. All of them return false if writing failed midway.
+// Canvas is read row band by row band, so tiled canvases are fine too.
+bool EncodeBMP(FILE *fp, CanvasData &canv);
+bool EncodePPM(FILE *fp, CanvasData &canv);
+bool EncodePNG(FILE *fp, CanvasData &canv);
+// 8-bit channels widened to [0..1]
+bool EncodePFM(FILE *fp, CanvasData &canv);
+bool EncodeEXR(FILE *fp, CanvasData &canv);
+};
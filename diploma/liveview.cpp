@@ -0,0 +1,275 @@
+#include "stdafx.h"
+
+#include "liveview.h"
+
+#include <string.h>
+#include <vector>
+
+using namespace raytracer;
+
+//---------------------------------------------------------------
+// Segment layout
+//---------------------------------------------------------------
+static DWORD LiveViewTileOffset()
+{
+	return (sizeof(LiveViewHeader)+63)&~63;
+}
+
+static DWORD LiveViewPixelOffset()
+{
+	return (LiveViewTileOffset()+RAYTRACER_LIVEVIEW_MAXTILES*sizeof(LONG)+63)&~63;
+}
+
+static DWORD LiveViewBytes()
+{
+	return LiveViewPixelOffset()+RAYTRACER_LIVEVIEW_MAXPIXELS*sizeof(Pixel);
+}
+
+static std::wstring LiveViewName(std::string name, const char *suffix)
+{
+	std::string full = "Local\\raytracer."+name+suffix;
+	return std::wstring(full.begin(), full.end());
+}
+
+//---------------------------------------------------------------
+// Publishing side
+//---------------------------------------------------------------
+static volatile bool		sharing = false;
+static CRITICAL_SECTION		sharelock;	// Guards owner and the header, held while a tile is copied
+static HANDLE				sharemap = NULL, shareevent = NULL;
+static LiveViewHeader		*shareheader = NULL;
+static CanvasData			*shareowner = NULL;
+
+bool raytracer::StartSharing(std::string name)
+{
+	if (sharing) return true;
+	sharemap = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, LiveViewBytes(), LiveViewName(name, "").c_str());
+	if (sharemap) shareheader = (LiveViewHeader*)MapViewOfFile(sharemap, FILE_MAP_WRITE, 0, 0, 0);
+	if (shareheader) shareevent = CreateEvent(NULL, FALSE, FALSE, LiveViewName(name, ".tiles").c_str());
+	if (!shareevent)
+	{
+		std::wstring err = L"Raytracer engine has failed to create shared framebuffer: \"";
+		err+=std::wstring(name.begin(),name.end());
+		err+=L"\"";
+		ShowError(err, L"Sharing failed");
+		if (shareheader) UnmapViewOfFile(shareheader);
+		if (sharemap) CloseHandle(sharemap);
+		shareheader = NULL;
+		sharemap = NULL;
+		return false;
+	}
+	// Segment may be left over from an earlier run that a viewer still holds, generations go on from there
+	InitializeCriticalSection(&sharelock);
+	InterlockedIncrement(&shareheader->frame);
+	shareheader->magic			= RAYTRACER_LIVEVIEW_MAGIC;
+	shareheader->version		= RAYTRACER_LIVEVIEW_VERSION;
+	shareheader->tileoffset		= LiveViewTileOffset();
+	shareheader->pixeloffset	= LiveViewPixelOffset();
+	shareheader->format			= RAYTRACER_LIVEVIEW_XRGB8;
+	shareheader->width			= shareheader->height = 0;
+	shareheader->tilesize		= 1;
+	shareheader->tilesx			= shareheader->tilesy = 0;
+	InterlockedIncrement(&shareheader->frame);
+	sharing = true;
+	return true;
+}
+
+void raytracer::StopSharing()
+{
+	if (!sharing) return;
+	sharing = false;
+	EnterCriticalSection(&sharelock);
+	shareowner = NULL;
+	UnmapViewOfFile(shareheader);
+	CloseHandle(shareevent);
+	CloseHandle(sharemap);
+	shareheader	= NULL;
+	shareevent	= NULL;
+	sharemap	= NULL;
+	LeaveCriticalSection(&sharelock);
+	DeleteCriticalSection(&sharelock);
+}
+
+void raytracer::ShareCanvas(CanvasData *canv)
+{
+	if (!sharing) return;
+	EnterCriticalSection(&sharelock);
+	bool fits = (__int64)canv->GetWidth()*canv->GetHeight()<=RAYTRACER_LIVEVIEW_MAXPIXELS &&
+		canv->GetTilesX()*canv->GetTilesY()<=RAYTRACER_LIVEVIEW_MAXTILES;
+	shareowner = canv;
+	InterlockedIncrement(&shareheader->frame);
+	shareheader->width		= fits ? canv->GetWidth() : 0;
+	shareheader->height		= fits ? canv->GetHeight() : 0;
+	shareheader->tilesize	= canv->GetTileSize();
+	shareheader->tilesx		= fits ? canv->GetTilesX() : 0;
+	shareheader->tilesy		= fits ? canv->GetTilesY() : 0;
+	InterlockedIncrement(&shareheader->frame);
+	LeaveCriticalSection(&sharelock);
+	SetEvent(shareevent);
+}
+
+void raytracer::UnshareCanvas(CanvasData *canv)
+{
+	if (!sharing) return;
+	EnterCriticalSection(&sharelock);
+	if (shareowner==canv) shareowner = NULL; // Last picture stays for the viewer
+	LeaveCriticalSection(&sharelock);
+}
+
+void raytracer::ShareTile(CanvasData *canv, const CanvasTile &t)
+{
+	if (!sharing || !t.data) return;
+	EnterCriticalSection(&sharelock);
+	if (shareowner!=canv || !shareheader->width)
+	{
+		LeaveCriticalSection(&sharelock);
+		return;
+	}
+	int width = shareheader->width;
+	Pixel *pixels = (Pixel*)((char*)shareheader+shareheader->pixeloffset);
+	for (int y = 0; y<t.h; y++)
+		memcpy(pixels+(t.y0+y)*width+t.x0, t.data+y*t.stride, t.w*sizeof(Pixel));
+	LONG *generation = (LONG*)((char*)shareheader+shareheader->tileoffset);
+	InterlockedIncrement(&generation[(t.y0/shareheader->tilesize)*shareheader->tilesx+t.x0/shareheader->tilesize]);
+	LeaveCriticalSection(&sharelock);
+	SetEvent(shareevent);
+}
+
+//---------------------------------------------------------------
+// Viewer
+//---------------------------------------------------------------
+static const LiveViewHeader	*viewheader = NULL;
+static int					viewwidth = 0, viewheight = 0;	// Of the frame being shown
+static char					viewbitmap[sizeof(BITMAPINFO)+16];
+
+static LRESULT CALLBACK LiveViewProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+{
+	switch (message)
+	{
+	case WM_PAINT:
+		{
+		PAINTSTRUCT ps;
+		HDC dc = BeginPaint(hWnd, &ps);
+		if (viewwidth && viewheight)
+		{
+			BITMAPINFO *bh = (BITMAPINFO*)viewbitmap;
+			bh->bmiHeader.biWidth	= viewwidth;
+			bh->bmiHeader.biHeight	= -viewheight;
+			SetDIBitsToDevice(dc, 0, 0, viewwidth, viewheight, 0, 0, 0, viewheight,
+				(const char*)viewheader+viewheader->pixeloffset, bh, DIB_RGB_COLORS);
+		}
+		EndPaint(hWnd, &ps);
+		break;}
+	case WM_DESTROY:
+		PostQuitMessage(0);
+		break;
+	default:
+		return DefWindowProc(hWnd, message, wParam, lParam);
+	}
+	return 0;
+}
+
+// Consistent copy of the header, false while renderer is changing it
+static bool ReadLiveViewHeader(LiveViewHeader &h)
+{
+	LONG frame = viewheader->frame;
+	MemoryBarrier();
+	h = *viewheader;
+	MemoryBarrier();
+	return !(frame&1) && frame==viewheader->frame;
+}
+
+int raytracer::RunViewer(std::string name)
+{
+	std::wstring wname(name.begin(), name.end());
+	HANDLE map = OpenFileMapping(FILE_MAP_READ, FALSE, LiveViewName(name, "").c_str());
+	if (map) viewheader = (const LiveViewHeader*)MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+	HANDLE ev = viewheader ? OpenEvent(SYNCHRONIZE, FALSE, LiveViewName(name, ".tiles").c_str()) : NULL;
+	if (!ev || viewheader->magic!=RAYTRACER_LIVEVIEW_MAGIC || viewheader->version!=RAYTRACER_LIVEVIEW_VERSION)
+	{
+		std::wstring err = L"No render is shared as \"";
+		err+=wname;
+		err+=L"\", start one with /share first.";
+		ShowError(err, L"Live view failed");
+		if (ev) CloseHandle(ev);
+		if (viewheader) UnmapViewOfFile(viewheader);
+		if (map) CloseHandle(map);
+		return 1;
+	}
+
+	// Same bitmap setup as the main window
+	BITMAPINFO *bh = (BITMAPINFO*)viewbitmap;
+	memset(viewbitmap, 0, sizeof(viewbitmap));
+	bh->bmiHeader.biSize		= sizeof(BITMAPINFOHEADER);
+	bh->bmiHeader.biPlanes		= 1;
+	bh->bmiHeader.biBitCount	= 32;
+	bh->bmiHeader.biCompression	= BI_BITFIELDS;
+	((unsigned long*)bh->bmiColors)[0] = 255 << 16;
+	((unsigned long*)bh->bmiColors)[1] = 255 << 8;
+	((unsigned long*)bh->bmiColors)[2] = 255;
+
+	WNDCLASS wc;
+	ZeroMemory(&wc, sizeof(wc));
+	wc.lpfnWndProc		= LiveViewProc;
+	wc.hInstance		= GetModuleHandle(NULL);
+	wc.hCursor			= LoadCursor(NULL, IDC_ARROW);
+	wc.hbrBackground	= (HBRUSH)GetStockObject(BLACK_BRUSH);
+	wc.lpszClassName	= L"RaytracerLiveView";
+	RegisterClass(&wc);
+	std::wstring title = L"Live view: "+wname;
+	HWND hWnd = CreateWindow(wc.lpszClassName, title.c_str(), WS_OVERLAPPED | WS_CAPTION | WS_SYSMENU | WS_MINIMIZEBOX,
+		CW_USEDEFAULT, 0, 320, 240, NULL, NULL, wc.hInstance, NULL);
+	ShowWindow(hWnd, SW_SHOW);
+
+	LONG frame = -1;	// Shown frame, -1 forces first resize
+	std::vector<LONG> seen(RAYTRACER_LIVEVIEW_MAXTILES, 0);
+	const LONG *generation = (const LONG*)((const char*)viewheader+viewheader->tileoffset);
+	MSG msg;
+	msg.wParam = 0;
+	for (;;)
+	{
+		MsgWaitForMultipleObjects(1, &ev, FALSE, RAYTRACER_LIVEVIEW_POLLMS, QS_ALLINPUT);
+		bool quit = false;
+		while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+		{
+			if (msg.message==WM_QUIT) quit = true;
+			TranslateMessage(&msg);
+			DispatchMessage(&msg);
+		}
+		if (quit) break;
+
+		LiveViewHeader h;
+		if (!ReadLiveViewHeader(h)) continue; // Being changed, next wake up will do
+		if (h.frame!=frame)
+		{
+			// New canvas, resize to it and redraw everything
+			frame		= h.frame;
+			viewwidth	= h.width;
+			viewheight	= h.height;
+			RECT r = {0, 0, max(viewwidth, 320), max(viewheight, 240)};
+			AdjustWindowRect(&r, WS_OVERLAPPED | WS_CAPTION | WS_SYSMENU | WS_MINIMIZEBOX, FALSE);
+			SetWindowPos(hWnd, NULL, 0, 0, r.right-r.left, r.bottom-r.top, SWP_NOMOVE | SWP_NOZORDER);
+			for (int i = 0; i<h.tilesx*h.tilesy; i++) seen[i] = generation[i];
+			InvalidateRect(hWnd, NULL, TRUE);
+			continue;
+		}
+		for (int i = 0; i<h.tilesx*h.tilesy; i++)
+		{
+			LONG g = generation[i];
+			if (g==seen[i]) continue;
+			seen[i] = g;
+			RECT r;
+			r.left		= (i%h.tilesx)*h.tilesize;
+			r.top		= (i/h.tilesx)*h.tilesize;
+			r.right		= r.left+h.tilesize;
+			r.bottom	= r.top+h.tilesize;
+			InvalidateRect(hWnd, &r, FALSE);
+		}
+	}
+
+	CloseHandle(ev);
+	UnmapViewOfFile(viewheader);
+	CloseHandle(map);
+	viewheader = NULL;
+	return (int)msg.wParam;
+}
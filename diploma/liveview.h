@@ -0,0 +1,50 @@
+#pragma once
+
+#include "raytracer.h"
+
+#include <string>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Live view - framebuffer shared with other processes
+//---------------------------------------------------------------
+// `diploma.exe /share name [/render ...|/serve ...]` publishes the canvas being rendered into a named
+// shared memory segment, `diploma.exe /view name` maps it and shows it in a window as tiles come in.
+// Renderer copies each finished tile in when the tile is unlocked(see CanvasData::UnlockTile), that is
+// the only thing render threads do for it. Viewer draws straight from the mapping, without copies.
+// Segment is "Local\raytracer.<name>": LiveViewHeader, then one generation counter per tile, then
+// pixels. Header and counters never move, so any process that can map the segment can follow along.
+// Counter of a tile is bumped after its pixels are written, then "Local\raytracer.<name>.tiles"
+// (auto-reset event) is set. Only one waiting viewer wakes up on it, others see the counters when
+// they poll, every RAYTRACER_LIVEVIEW_POLLMS.
+// The most recently created canvas owns the segment: with several views(/render /views a,b) it is the last one.
+// Canvases over RAYTRACER_LIVEVIEW_MAXPIXELS pixels aren't published, header says 0x0 for them.
+#define RAYTRACER_LIVEVIEW_MAGIC		0x5654524C	// "LRTV"
+#define RAYTRACER_LIVEVIEW_VERSION		1
+#define RAYTRACER_LIVEVIEW_MAXPIXELS	(4096*4096)
+#define RAYTRACER_LIVEVIEW_MAXTILES		(RAYTRACER_LIVEVIEW_MAXPIXELS/(16*16))	// Enough for tiles down to 16x16
+#define RAYTRACER_LIVEVIEW_POLLMS		100
+#define RAYTRACER_LIVEVIEW_XRGB8		1			// Pixel format, as Pixel: 0x00RRGGBB, rows top to bottom
+
+struct LiveViewHeader
+{
+	DWORD			magic, version;
+	DWORD			tileoffset;		// From segment start: LONG generation per tile, RAYTRACER_LIVEVIEW_MAXTILES of them
+	DWORD			pixeloffset;	// From segment start: width*height pixels, row after row
+	volatile LONG	frame;			// Bumped twice when a new canvas takes over, odd while fields below change
+	DWORD			format;			// RAYTRACER_LIVEVIEW_XRGB8
+	int				width, height;	// 0x0 if nothing is published
+	int				tilesize, tilesx, tilesy;	// Tile ty*tilesx+tx covers pixels from (tx*tilesize, ty*tilesize)
+};
+
+// Creates segment and event, canvases created from now on are published. Call before any rendering starts.
+// Returns false if they couldn't be created, reported with ShowError.
+bool StartSharing(std::string name);
+void StopSharing();
+// Called by CanvasData: canvas takes the segment over / gives it back / finished writing tile t
+void ShareCanvas(CanvasData *canv);
+void UnshareCanvas(CanvasData *canv);
+void ShareTile(CanvasData *canv, const CanvasTile &t);
+// Window that follows segment name until closed. Returns process exit code.
+int RunViewer(std::string name);
+};
@@ -0,0 +1,426 @@
+#include "stdafx.h"
+
+#include "lodmesh.h"
+#include "profile.h"
+
+#include <math.h>
+#include <algorithm>
+#include <queue>
+
+using namespace raytracer;
+
+//---------------------------------------------------------------
+// Ray footprint
+//---------------------------------------------------------------
+static __declspec(thread) RayFootprint footprint = {0.f, 0.f};
+
+void raytracer::SetRayFootprint(float width, float spread)
+{
+	footprint.width		= width;
+	footprint.spread	= spread;
+}
+
+RayFootprint raytracer::GetRayFootprint()
+{
+	return footprint;
+}
+
+//---------------------------------------------------------------
+// Quadrics
+//---------------------------------------------------------------
+// Symmetric 4x4 matrix of plane equations, sum of squared distances to those planes is p^T Q p.
+// Kept as its upper triangle: aa ab ac ad bb bc bd cc cd dd.
+struct Quadric
+{
+	double m[10];
+	void Zero(){for (int i = 0; i<10; i++) m[i] = 0;};
+	void AddPlane(const double n[3], double d, double w)
+	{
+		m[0] += w*n[0]*n[0];	m[1] += w*n[0]*n[1];	m[2] += w*n[0]*n[2];	m[3] += w*n[0]*d;
+		m[4] += w*n[1]*n[1];	m[5] += w*n[1]*n[2];	m[6] += w*n[1]*d;
+		m[7] += w*n[2]*n[2];	m[8] += w*n[2]*d;
+		m[9] += w*d*d;
+	};
+	void Add(const Quadric &o){for (int i = 0; i<10; i++) m[i] += o.m[i];};
+	double Error(const double p[3]) const
+	{
+		double x = p[0], y = p[1], z = p[2];
+		double e =	m[0]*x*x + 2*m[1]*x*y + 2*m[2]*x*z + 2*m[3]*x
+				+	m[4]*y*y + 2*m[5]*y*z + 2*m[6]*y
+				+	m[7]*z*z + 2*m[8]*z
+				+	m[9];
+		return e>0 ? e : 0; // Rounding can take it a little below
+	};
+	// Point of least error, false if there is no single one(flat or straight neighbourhood)
+	bool Optimal(double p[3]) const
+	{
+		double c00 = m[4]*m[7]-m[5]*m[5], c01 = m[2]*m[5]-m[1]*m[7], c02 = m[1]*m[5]-m[2]*m[4];
+		double det = m[0]*c00+m[1]*c01+m[2]*c02;
+		double scale = m[0]+m[4]+m[7];
+		if (fabs(det)<=1e-9*scale*scale*scale) return false;
+		double c11 = m[0]*m[7]-m[2]*m[2], c12 = m[1]*m[2]-m[0]*m[5], c22 = m[0]*m[4]-m[1]*m[1];
+		p[0] = -(c00*m[3]+c01*m[6]+c02*m[8])/det;
+		p[1] = -(c01*m[3]+c11*m[6]+c12*m[8])/det;
+		p[2] = -(c02*m[3]+c12*m[6]+c22*m[8])/det;
+		return true;
+	};
+};
+
+static void Sub3(const double a[3], const double b[3], double r[3])
+{
+	r[0] = a[0]-b[0];	r[1] = a[1]-b[1];	r[2] = a[2]-b[2];
+}
+
+static void Cross3(const double a[3], const double b[3], double r[3])
+{
+	r[0] = a[1]*b[2]-a[2]*b[1];	r[1] = a[2]*b[0]-a[0]*b[2];	r[2] = a[0]*b[1]-a[1]*b[0];
+}
+
+static double Dot3(const double a[3], const double b[3])
+{
+	return a[0]*b[0]+a[1]*b[1]+a[2]*b[2];
+}
+
+// Unit normal of triangle, false if it has no area
+static bool TriangleNormal(const double *p0, const double *p1, const double *p2, double n[3])
+{
+	double e1[3], e2[3];
+	Sub3(p1, p0, e1);
+	Sub3(p2, p0, e2);
+	Cross3(e1, e2, n);
+	double len = sqrt(Dot3(n, n));
+	if (len<=0) return false;
+	n[0] /= len;	n[1] /= len;	n[2] /= len;
+	return true;
+}
+
+//---------------------------------------------------------------
+// Edge collapse
+//---------------------------------------------------------------
+struct Collapse
+{
+	double			cost;
+	int				a, b;		// b goes into a
+	unsigned int	sa, sb;		// Vertex stamps it was made with, stale once either changes
+	bool operator<(const Collapse &o) const {return cost>o.cost;}; // Cheapest on top
+};
+
+class Decimator
+{
+public:
+	Decimator(const std::vector<vector> &verts, const std::vector<int> &tris);
+	// Collapses cheapest edges until at most target triangles are left, false if none could go
+	bool Run(int target);
+	// Triangles left and their vertices, indices into verts
+	void Get(std::vector<vector> &verts, std::vector<int> &tris);
+	int GetTriangles(){return alivetris;};
+	// Square root of the costliest collapse so far: no vertex is farther than that from any plane of the
+	// faces it took over. It's the usual quadric estimate, not a bound on distance to the surface, as a
+	// vertex may still slide along those planes.
+	double GetError(){return sqrt(maxcost);};
+private:
+	void Push(int a, int b);
+	double Cost(int a, int b, double p[3]);
+	bool Flips(int v, int other, const double p[3]);
+
+	std::vector<double>				pos;		// 3 per vertex
+	std::vector<Quadric>			quadrics;
+	std::vector<unsigned int>		stamps;
+	std::vector<bool>				alive;
+	std::vector<int>				tris;		// 3 per triangle
+	std::vector<bool>				talive;
+	std::vector< std::vector<int> >	vtris;		// Triangles around every vertex, dead ones get dropped lazily
+	std::priority_queue<Collapse>	heap;
+	int								alivetris;
+	double							maxcost;
+};
+
+Decimator::Decimator(const std::vector<vector> &verts, const std::vector<int> &t)
+{
+	int vc = (int)verts.size(), tc = (int)t.size()/3;
+	pos.resize(vc*3);
+	for (int i = 0; i<vc; i++)
+	{
+		pos[i*3] = verts[i].x;	pos[i*3+1] = verts[i].y;	pos[i*3+2] = verts[i].z;
+	}
+	tris		= t;
+	talive.assign(tc, true);
+	alive.assign(vc, false);
+	stamps.assign(vc, 0);
+	vtris.resize(vc);
+	quadrics.resize(vc);
+	for (int i = 0; i<vc; i++) quadrics[i].Zero();
+	alivetris	= tc;
+	maxcost		= 0;
+
+	// Every vertex starts with planes of its triangles
+	for (int i = 0; i<tc; i++)
+	{
+		double n[3];
+		int *v = &tris[i*3];
+		for (int k = 0; k<3; k++)
+		{
+			vtris[v[k]].push_back(i);
+			alive[v[k]] = true;
+		}
+		if (!TriangleNormal(&pos[v[0]*3], &pos[v[1]*3], &pos[v[2]*3], n)) continue;
+		for (int k = 0; k<3; k++) quadrics[v[k]].AddPlane(n, -Dot3(n, &pos[v[0]*3]), 1.0);
+	}
+
+	// Open edges(used by one triangle) get a plane across them, so holes and borders keep their shape
+	std::vector<unsigned __int64> edges(tc*3);
+	for (int i = 0; i<tc; i++)
+		for (int k = 0; k<3; k++)
+		{
+			unsigned int a = tris[i*3+k], b = tris[i*3+(k+1)%3];
+			edges[i*3+k] = ((unsigned __int64)min(a,b)<<32)|max(a,b);
+		}
+	std::vector<unsigned __int64> sorted(edges);
+	std::sort(sorted.begin(), sorted.end());
+	for (int i = 0; i<tc; i++)
+	{
+		double n[3];
+		int *v = &tris[i*3];
+		if (!TriangleNormal(&pos[v[0]*3], &pos[v[1]*3], &pos[v[2]*3], n)) continue;
+		for (int k = 0; k<3; k++)
+		{
+			std::pair<std::vector<unsigned __int64>::iterator, std::vector<unsigned __int64>::iterator> r =
+				std::equal_range(sorted.begin(), sorted.end(), edges[i*3+k]);
+			if (r.second-r.first!=1) continue;
+			int a = v[k], b = v[(k+1)%3];
+			double e[3], bn[3];
+			Sub3(&pos[b*3], &pos[a*3], e);
+			Cross3(e, n, bn);
+			double len = sqrt(Dot3(bn, bn));
+			if (len<=0) continue;
+			bn[0] /= len;	bn[1] /= len;	bn[2] /= len;
+			double d = -Dot3(bn, &pos[a*3]);
+			quadrics[a].AddPlane(bn, d, 10.0);
+			quadrics[b].AddPlane(bn, d, 10.0);
+		}
+	}
+
+	// Each edge once
+	for (unsigned int i = 0; i<sorted.size(); i++)
+		if (i==0 || sorted[i]!=sorted[i-1])
+			Push((int)(sorted[i]>>32), (int)(sorted[i]&0xFFFFFFFF));
+}
+
+// Error of collapsing edge a-b, and where the vertex goes
+double Decimator::Cost(int a, int b, double p[3])
+{
+	Quadric q = quadrics[a];
+	q.Add(quadrics[b]);
+	const double *pa = &pos[a*3], *pb = &pos[b*3];
+	double mid[3] = {(pa[0]+pb[0])*0.5, (pa[1]+pb[1])*0.5, (pa[2]+pb[2])*0.5};
+	double e[3];
+	Sub3(pb, pa, e);
+	if (q.Optimal(p))
+	{
+		// Nearly flat neighbourhoods can put the optimum far away, don't let vertex wander off the edge
+		double off[3];
+		Sub3(p, mid, off);
+		if (Dot3(off, off)<=Dot3(e, e)) return q.Error(p);
+	}
+	const double *cand[3] = {pa, pb, mid};
+	double best = -1;
+	for (int i = 0; i<3; i++)
+	{
+		double c = q.Error(cand[i]);
+		if (best<0 || c<best)
+		{
+			best = c;
+			p[0] = cand[i][0];	p[1] = cand[i][1];	p[2] = cand[i][2];
+		}
+	}
+	return best;
+}
+
+void Decimator::Push(int a, int b)
+{
+	if (a==b) return;
+	Collapse c;
+	double p[3];
+	c.cost	= Cost(a, b, p);
+	c.a		= a;
+	c.b		= b;
+	c.sa	= stamps[a];
+	c.sb	= stamps[b];
+	heap.push(c);
+}
+
+// Would moving v to p turn any of its triangles that don't also have other over
+bool Decimator::Flips(int v, int other, const double p[3])
+{
+	for (unsigned int i = 0; i<vtris[v].size(); i++)
+	{
+		int t = vtris[v][i];
+		if (!talive[t]) continue;
+		const int *tv = &tris[t*3];
+		if (tv[0]==other || tv[1]==other || tv[2]==other) continue; // Goes away
+		const double *q[3], *moved[3];
+		for (int k = 0; k<3; k++)
+		{
+			q[k]		= &pos[tv[k]*3];
+			moved[k]	= tv[k]==v ? p : q[k];
+		}
+		double n0[3], n1[3];
+		if (!TriangleNormal(q[0], q[1], q[2], n0)) continue; // Had no direction to lose
+		if (!TriangleNormal(moved[0], moved[1], moved[2], n1)) return true;
+		if (Dot3(n0, n1)<0.2) return true;
+	}
+	return false;
+}
+
+bool Decimator::Run(int target)
+{
+	int before = alivetris;
+	while (alivetris>target && !heap.empty())
+	{
+		Collapse c = heap.top();
+		heap.pop();
+		if (!alive[c.a] || !alive[c.b] || stamps[c.a]!=c.sa || stamps[c.b]!=c.sb) continue; // Stale
+		double p[3];
+		Cost(c.a, c.b, p);
+		if (Flips(c.a, c.b, p) || Flips(c.b, c.a, p)) continue; // Neighbours change its stamp and bring it back
+
+		// b goes into a, triangles having both are gone
+		int a = c.a, b = c.b;
+		pos[a*3] = p[0];	pos[a*3+1] = p[1];	pos[a*3+2] = p[2];
+		quadrics[a].Add(quadrics[b]);
+		alive[b] = false;
+		stamps[a]++;
+		stamps[b]++;
+		for (unsigned int i = 0; i<vtris[b].size(); i++)
+		{
+			int t = vtris[b][i];
+			if (!talive[t]) continue;
+			int *tv = &tris[t*3];
+			if (tv[0]==a || tv[1]==a || tv[2]==a)
+			{
+				talive[t] = false;
+				alivetris--;
+				continue;
+			}
+			for (int k = 0; k<3; k++)
+				if (tv[k]==b) tv[k] = a;
+			vtris[a].push_back(t);
+		}
+		std::vector<int>().swap(vtris[b]);
+		maxcost = max(maxcost, c.cost);
+
+		// Drop dead triangles around a, then its edges get new costs
+		std::vector<int> &around = vtris[a];
+		unsigned int n = 0;
+		for (unsigned int i = 0; i<around.size(); i++)
+			if (talive[around[i]]) around[n++] = around[i];
+		around.resize(n);
+		for (unsigned int i = 0; i<around.size(); i++)
+		{
+			const int *tv = &tris[around[i]*3];
+			for (int k = 0; k<3; k++)
+				if (tv[k]!=a) Push(a, tv[k]); // Old ones have a's old stamp
+		}
+	}
+	return alivetris<before;
+}
+
+void Decimator::Get(std::vector<vector> &verts, std::vector<int> &out)
+{
+	verts.resize(pos.size()/3);
+	for (unsigned int i = 0; i<verts.size(); i++)
+		verts[i] = vector((float)pos[i*3], (float)pos[i*3+1], (float)pos[i*3+2]);
+	out.clear();
+	for (unsigned int i = 0; i<talive.size(); i++)
+		if (talive[i]) out.insert(out.end(), &tris[i*3], &tris[i*3]+3);
+}
+
+//---------------------------------------------------------------
+// LODMesh
+//---------------------------------------------------------------
+LODMesh::LODMesh(const std::vector<vector> &verts, const std::vector<int> &tris, vector Color, float Refl, float Refr, float Diff, float Spec)
+{
+	RAYTRACER_PROFILE_SCOPE("LODMesh");
+	pos		= vector(0,0,0);
+	color	= Color;	refl	= Refl;		refr	= Refr;
+	diff	= Diff;		spec	= Spec;
+	light	= false;
+	bmin	= vector(1e30f, 1e30f, 1e30f);
+	bmax	= vector(-1e30f, -1e30f, -1e30f);
+	AddLevel(verts, tris, 0.f);
+	Simplify(verts, tris);
+}
+
+LODMesh::~LODMesh()
+{
+	for (unsigned int i = 0; i<levels.size(); i++)
+		delete levels[i].accel;
+	// Triangles go with the arena
+}
+
+void LODMesh::AddLevel(const std::vector<vector> &verts, const std::vector<int> &tris, float error)
+{
+	Level l;
+	l.error = error;
+	l.tris.reserve(tris.size()/3);
+	for (unsigned int i = 0; i+2<tris.size(); i+=3)
+	{
+		Triangle *tri = new (arena) Triangle(verts[tris[i]], verts[tris[i+1]], verts[tris[i+2]], color, refl, refr, diff, spec);
+		tri->id		= (int)l.tris.size();	// Hierarchy breaks ties by id
+		tri->light	= false;
+		vector tmin, tmax;
+		tri->GetBounds(tmin, tmax);
+		bmin = vector(min(bmin.x, tmin.x), min(bmin.y, tmin.y), min(bmin.z, tmin.z));
+		bmax = vector(max(bmax.x, tmax.x), max(bmax.y, tmax.y), max(bmax.z, tmax.z));
+		l.tris.push_back(tri);
+	}
+	l.accel = new Accel();
+	l.accel->Build(l.tris, (AccelFormat)RAYTRACER_DEFAULT_ACCEL, ACCEL_BALANCED);
+	levels.push_back(l);
+}
+
+void LODMesh::Simplify(const std::vector<vector> &verts, const std::vector<int> &tris)
+{
+	RAYTRACER_PROFILE_SCOPE("LODMesh::Simplify");
+	Decimator d(verts, tris);
+	int target = d.GetTriangles();
+	std::vector<vector> lv;
+	std::vector<int> lt;
+	for (int i = 0; i<RAYTRACER_LOD_LEVELS; i++)
+	{
+		target /= RAYTRACER_LOD_RATIO;
+		if (target<RAYTRACER_LOD_MINLEVEL || !d.Run(target)) break;
+		d.Get(lv, lt);
+		AddLevel(lv, lt, (float)d.GetError());
+		if (d.GetTriangles()>target) break; // Couldn't get there, next level would be the same
+	}
+}
+
+// Rays per level, in the profile summary. One name per level, full mesh first.
+static const char *const lodcounters[RAYTRACER_LOD_LEVELS+1] = {
+	"lod level 0 rays", "lod level 1 rays", "lod level 2 rays", "lod level 3 rays",
+	"lod level 4 rays", "lod level 5 rays", "lod level 6 rays"
+};
+
+traceresp LODMesh::Draw(vector Or, vector Dir)
+{
+	int level = 0;
+	if (footprint.width>0 || footprint.spread>0)
+	{
+		// Ray is at least this wide where it reaches the box, nearest point of box is the worst case
+		vector closest(max(bmin.x, min(Or.x, bmax.x)), max(bmin.y, min(Or.y, bmax.y)), max(bmin.z, min(Or.z, bmax.z)));
+		float allowed = (footprint.width+footprint.spread*~(closest-Or))*RAYTRACER_LOD_ERROR;
+		while (level+1<(int)levels.size() && levels[level+1].error<=allowed) level++;
+	}
+	if (detail::profiling) ProfileCounter(lodcounters[level], 1);
+	traceresp r = levels[level].accel->Intersect(Or, Dir);
+	if (r.hit) r.obj = this; // Mesh is one object to the scene
+	return r;
+}
+
+bool LODMesh::GetBounds(vector &Bmin, vector &Bmax)
+{
+	Bmin = bmin;
+	Bmax = bmax;
+	return !levels.empty() && !levels[0].tris.empty();
+}
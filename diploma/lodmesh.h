@@ -0,0 +1,68 @@
+#pragma once
+
+#include "raytracer.h"
+#include "accel.h"
+
+#include <vector>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Mesh level of detail
+//---------------------------------------------------------------
+// Meshes loaded with the `lod` .scene token(plain `obj` otherwise) that have RAYTRACER_LOD_MINTRIS triangles
+// and more become one LODMesh instead of loose Triangles. Simplified levels are made at load time by quadric
+// error edge collapse(Garland-Heckbert), each has RAYTRACER_LOD_RATIO times fewer triangles than the one
+// before and a hierarchy of its own. That takes several times longer than loading the triangles, so it is
+// only worth it for meshes seen small or through wide secondary rays.
+// Every level has an estimate of how far it is from the full mesh. A ray takes the coarsest level whose
+// error is under RAYTRACER_LOD_ERROR of its width where it reaches the mesh box, see RayFootprint.
+// Rays of unknown width(zero footprint) always see the full mesh.
+// Primary rays pick levels too, so PrimaryRaster can't draw a LODMesh and leaves its pixels to the tracer.
+#ifndef RAYTRACER_LOD
+#define RAYTRACER_LOD			1
+#endif
+#define RAYTRACER_LOD_MINTRIS	4096	// Smaller meshes stay loose triangles
+#define RAYTRACER_LOD_LEVELS	6		// Simplified levels, at most
+#define RAYTRACER_LOD_RATIO		4		// Triangles of a level over triangles of the next one
+#define RAYTRACER_LOD_MINLEVEL	64		// No level is simplified further than that many triangles
+#define RAYTRACER_LOD_ERROR		0.5f	// Level error allowed, in ray widths
+#define RAYTRACER_LOD_BOUNCE	2.f		// Reflected and refracted rays spread this much faster than their parent
+
+// Width of the ray being traced on calling thread: width at its origin, and how much it grows per unit
+// of length(angle between neighbouring rays). Renderer sets it before tracing, 0,0 means full detail.
+struct RayFootprint
+{
+	float	width, spread;
+};
+void SetRayFootprint(float width, float spread);
+RayFootprint GetRayFootprint();
+
+class LODMesh: public Renderable
+{
+public:
+// Funcs
+	// Mesh as .obj has it: vertices, then 3 vertex indices per triangle
+	LODMesh(const std::vector<vector> &verts, const std::vector<int> &tris, vector Color, float Refl, float Refr, float Diff, float Spec);
+	virtual ~LODMesh();
+
+	virtual traceresp Draw(vector Or, vector Dir); //(sic!) Infinite ray!
+	virtual bool GetBounds(vector &bmin, vector &bmax);
+
+	int GetLevels(){return (int)levels.size();};
+	int GetTriangles(int level){return (int)levels[level].tris.size();};
+	float GetError(int level){return levels[level].error;};
+private:
+	struct Level
+	{
+		float						error;	// Estimated distance from the full mesh, see Decimator::GetError
+		std::vector<Renderable*>	tris;	// Triangles in arena
+		Accel						*accel;
+	};
+	void AddLevel(const std::vector<vector> &verts, const std::vector<int> &tris, float error);
+	void Simplify(const std::vector<vector> &verts, const std::vector<int> &tris);
+
+	SceneArena			arena;	// Triangles of all levels
+	std::vector<Level>	levels;	// Full mesh first
+	vector				bmin, bmax;	// Of all levels, simplified vertices may move out a bit
+};
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Morton(Z-order) codes
+//---------------------------------------------------------------
+// Interleaving bits of coordinates puts things that are close in space close in the code,
+// so sorting by it gives cheap spatial clustering.
+
+// Spreads lower 10 bits of v so there are two zero bits between each
+inline unsigned int MortonSpread3(unsigned int v)
+{
+	v &= 0x3FF;
+	v = (v | (v << 16)) & 0x030000FF;
+	v = (v | (v <<  8)) & 0x0300F00F;
+	v = (v | (v <<  4)) & 0x030C30C3;
+	v = (v | (v <<  2)) & 0x09249249;
+	return v;
+}
+
+// 30-bit code, coordinates are expected in [0,1]
+inline unsigned int Morton3D(float x, float y, float z)
+{
+	x = x<0.f?0.f:(x>1.f?1.f:x);
+	y = y<0.f?0.f:(y>1.f?1.f:y);
+	z = z<0.f?0.f:(z>1.f?1.f:z);
+	return	(MortonSpread3((unsigned int)(x*1023.f))<<2) |
+			(MortonSpread3((unsigned int)(y*1023.f))<<1) |
+			 MortonSpread3((unsigned int)(z*1023.f));
+}
+
+// Spreads lower 16 bits of v so there is a zero bit between each
+inline unsigned int MortonSpread2(unsigned int v)
+{
+	v &= 0xFFFF;
+	v = (v | (v << 8)) & 0x00FF00FF;
+	v = (v | (v << 4)) & 0x0F0F0F0F;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+}
+
+// 32-bit code of integer coordinates below 65536
+inline unsigned int Morton2D(unsigned int x, unsigned int y)
+{
+	return (MortonSpread2(y)<<1) | MortonSpread2(x);
+}
+
+//---------------------------------------------------------------
+// Hilbert curve
+//---------------------------------------------------------------
+// Unlike Z-order it never jumps, every next cell touches the previous one.
+// d-th cell of the curve over n*n grid, n is a power of two.
+inline void HilbertCell(unsigned int n, unsigned int d, unsigned int &x, unsigned int &y)
+{
+	x = y = 0;
+	for (unsigned int s = 1; s<n; s*=2)
+	{
+		unsigned int rx = 1&(d/2);
+		unsigned int ry = 1&(d^rx);
+		if (ry==0)
+		{
+			if (rx==1)
+			{
+				x = s-1-x;
+				y = s-1-y;
+			}
+			unsigned int t = x; x = y; y = t;
+		}
+		x += s*rx;
+		y += s*ry;
+		d /= 4;
+	}
+}
+};
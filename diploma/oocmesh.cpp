@@ -0,0 +1,476 @@
+#include "stdafx.h"
+
+#include "oocmesh.h"
+#include "morton.h"
+
+#include <algorithm>
+#include <new>
+
+using namespace raytracer;
+//---------------------------------------------------------------
+// Conversion .obj -> .rtm
+//---------------------------------------------------------------
+// Parses one index of a face token("12", "12/3", "12/3/4", "12//4"), handles negative(relative) ones
+static bool ParseFaceIndex(const char *&p, int vertcount, int &out)
+{
+	while (*p==' '||*p=='\t') p++;
+	if (*p=='\0'||*p=='\n'||*p=='\r') return false;
+	char *end;
+	long v = strtol(p, &end, 10);
+	if (end==p) return false;
+	p = end;
+	while (*p && *p!=' ' && *p!='\t' && *p!='\n' && *p!='\r') p++; // Skip uv/normal part
+	out = v<0?vertcount+(int)v:(int)v-1;
+	return out>=0 && out<vertcount;
+}
+
+struct OOCBuildCluster
+{
+	unsigned int first, count; // Range in Morton-sorted triangle order
+	std::vector<int> verts;     // Mesh vertex indices used by cluster
+	std::vector<unsigned char> tris;
+	float bmin[3], bmax[3];
+};
+
+static int BuildOOCNodes(std::vector<OOCNode> &nodes, std::vector<OOCBuildCluster> &clusters, int lo, int hi)
+{
+	int index = (int)nodes.size();
+	nodes.push_back(OOCNode());
+	for (int a = 0; a<3; a++)
+	{
+		nodes[index].bmin[a] = 1e30f;
+		nodes[index].bmax[a] = -1e30f;
+	}
+	for (int c = lo; c<hi; c++)
+		for (int a = 0; a<3; a++)
+		{
+			nodes[index].bmin[a] = min(nodes[index].bmin[a], clusters[c].bmin[a]);
+			nodes[index].bmax[a] = max(nodes[index].bmax[a], clusters[c].bmax[a]);
+		}
+	if (hi-lo==1)
+	{
+		nodes[index].left	= ~lo;
+		nodes[index].right	= ~lo;
+		return index;
+	}
+	// Clusters are already in Morton order, so halving the range is a spatial split
+	int mid = (lo+hi)/2;
+	int l = BuildOOCNodes(nodes, clusters, lo, mid);
+	int r = BuildOOCNodes(nodes, clusters, mid, hi);
+	nodes[index].left	= l;
+	nodes[index].right	= r;
+	return index;
+}
+
+// BuildOOCMesh without the out of memory handling
+static bool ConvertOOCMesh(std::string &objfile, std::string &meshfile, std::string &error)
+{
+	// Stream the .obj line by line, we never want the whole text in memory
+	FILE *fp = fopen(objfile.c_str(), "rb");
+	if (!fp)
+	{
+		error = "Unable to find or open .obj file";
+		return false;
+	}
+
+	std::vector<vector>	verts;
+	std::vector<int>	tris;	// 3 per triangle
+	char line[4096];
+	try
+	{
+		while (fgets(line, sizeof(line), fp))
+		{
+			if (line[0]=='v' && (line[1]==' '||line[1]=='\t'))
+			{
+				char *p = line+2;
+				float x = (float)strtod(p, &p);
+				float y = (float)strtod(p, &p);
+				float z = (float)strtod(p, &p);
+				verts.push_back(vector(x,y,z));
+			}
+			else if (line[0]=='f' && (line[1]==' '||line[1]=='\t'))
+			{
+				// Polygons are fanned into triangles
+				const char *p = line+2;
+				int first, prev, cur;
+				if (!ParseFaceIndex(p, (int)verts.size(), first)) continue;
+				if (!ParseFaceIndex(p, (int)verts.size(), prev)) continue;
+				while (ParseFaceIndex(p, (int)verts.size(), cur))
+				{
+					tris.push_back(first);
+					tris.push_back(prev);
+					tris.push_back(cur);
+					prev = cur;
+				}
+			}
+		}
+	}
+	catch (std::bad_alloc&)
+	{
+		fclose(fp);
+		throw;
+	}
+	fclose(fp);
+	unsigned int tricount = (unsigned int)tris.size()/3;
+	if (tricount==0)
+	{
+		error = "No triangles in .obj file";
+		return false;
+	}
+
+	// Sort triangles along Morton curve of their centroids
+	vector bmin(1e30f,1e30f,1e30f), bmax(-1e30f,-1e30f,-1e30f);
+	for (unsigned int i = 0; i<verts.size(); i++)
+	{
+		bmin = vector(min(bmin.x,verts[i].x), min(bmin.y,verts[i].y), min(bmin.z,verts[i].z));
+		bmax = vector(max(bmax.x,verts[i].x), max(bmax.y,verts[i].y), max(bmax.z,verts[i].z));
+	}
+	vector ext = bmax-bmin;
+	ext = vector(ext.x>0?ext.x:1.f, ext.y>0?ext.y:1.f, ext.z>0?ext.z:1.f);
+
+	std::vector< std::pair<unsigned int, unsigned int> > order(tricount);
+	for (unsigned int t = 0; t<tricount; t++)
+	{
+		vector c = (verts[tris[t*3]]+verts[tris[t*3+1]]+verts[tris[t*3+2]])/3.f - bmin;
+		order[t] = std::make_pair(Morton3D(c.x/ext.x, c.y/ext.y, c.z/ext.z), t);
+	}
+	std::sort(order.begin(), order.end());
+
+	// Greedily cut into clusters, limited both by triangles and by unique vertices
+	std::vector<OOCBuildCluster> clusters;
+	std::map<int, unsigned char> local;
+	for (unsigned int s = 0; s<tricount; )
+	{
+		OOCBuildCluster c;
+		c.first = s;
+		local.clear();
+		while (s<tricount && (s-c.first)<RAYTRACER_OOC_CLUSTERTRIS)
+		{
+			unsigned int t = order[s].second;
+			int fresh = 0;
+			for (int k = 0; k<3; k++) if (local.find(tris[t*3+k])==local.end()) fresh++;
+			if (c.verts.size()+fresh>RAYTRACER_OOC_CLUSTERVERTS) break;
+			for (int k = 0; k<3; k++)
+			{
+				std::map<int, unsigned char>::iterator it = local.find(tris[t*3+k]);
+				if (it==local.end())
+				{
+					it = local.insert(std::make_pair(tris[t*3+k], (unsigned char)c.verts.size())).first;
+					c.verts.push_back(tris[t*3+k]);
+				}
+				c.tris.push_back(it->second);
+			}
+			s++;
+		}
+		c.count = s-c.first;
+		for (int a = 0; a<3; a++) { c.bmin[a] = 1e30f; c.bmax[a] = -1e30f; }
+		for (unsigned int v = 0; v<c.verts.size(); v++)
+		{
+			const float *p = &verts[c.verts[v]].x;
+			for (int a = 0; a<3; a++) { c.bmin[a] = min(c.bmin[a], p[a]); c.bmax[a] = max(c.bmax[a], p[a]); }
+		}
+		clusters.push_back(c);
+	}
+
+	std::vector<OOCNode> nodes;
+	nodes.reserve(clusters.size()*2);
+	BuildOOCNodes(nodes, clusters, 0, (int)clusters.size());
+
+	// Layout: header, nodes, cluster table, then page-aligned payloads
+	OOCHeader hdr;
+	memcpy(hdr.magic, "RTMC", 4);
+	hdr.version			= 1;
+	hdr.nodecount		= (unsigned int)nodes.size();
+	hdr.clustercount	= (unsigned int)clusters.size();
+	hdr.nodesoffset		= sizeof(OOCHeader);
+	hdr.clustersoffset	= hdr.nodesoffset + sizeof(OOCNode)*nodes.size();
+	hdr.tricount		= tricount;
+
+	std::vector<OOCCluster> table(clusters.size());
+	unsigned __int64 offset = hdr.clustersoffset + sizeof(OOCCluster)*clusters.size();
+	for (unsigned int c = 0; c<clusters.size(); c++)
+	{
+		offset = (offset+RAYTRACER_OOC_PAGE-1)/RAYTRACER_OOC_PAGE*RAYTRACER_OOC_PAGE;
+		memcpy(table[c].bmin, clusters[c].bmin, sizeof(float)*3);
+		memcpy(table[c].bmax, clusters[c].bmax, sizeof(float)*3);
+		table[c].offset		= offset;
+		table[c].vertcount	= (unsigned short)clusters[c].verts.size();
+		table[c].tricount	= (unsigned short)clusters[c].count;
+		offset += clusters[c].verts.size()*6 + clusters[c].count*3;
+	}
+
+	fp = fopen(meshfile.c_str(), "wb");
+	if (!fp)
+	{
+		error = "Unable to create out-of-core mesh file";
+		return false;
+	}
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, fp)==1;
+	ok = ok && fwrite(&nodes[0], sizeof(OOCNode), nodes.size(), fp)==nodes.size();
+	ok = ok && fwrite(&table[0], sizeof(OOCCluster), table.size(), fp)==table.size();
+
+	unsigned __int64 pos = hdr.clustersoffset + sizeof(OOCCluster)*clusters.size();
+	std::vector<unsigned char> payload(RAYTRACER_OOC_CLUSTERVERTS*6 + RAYTRACER_OOC_CLUSTERTRIS*3);	// Biggest cluster, so loop below doesn't allocate
+	static const char zeros[RAYTRACER_OOC_PAGE] = {0};
+	for (unsigned int c = 0; c<clusters.size() && ok; c++)
+	{
+		// Pad up to page boundary
+		if (table[c].offset>pos) ok = fwrite(zeros, 1, (size_t)(table[c].offset-pos), fp)==(size_t)(table[c].offset-pos);
+		pos = table[c].offset;
+
+		OOCBuildCluster &cl = clusters[c];
+		payload.resize(cl.verts.size()*6 + cl.tris.size());
+		unsigned short *q = (unsigned short*)&payload[0];
+		for (unsigned int v = 0; v<cl.verts.size(); v++)
+		{
+			const float *p = &verts[cl.verts[v]].x;
+			for (int a = 0; a<3; a++)
+			{
+				float e = cl.bmax[a]-cl.bmin[a];
+				q[v*3+a] = (unsigned short)(e>0?floor((p[a]-cl.bmin[a])/e*65535.f+0.5f):0);
+			}
+		}
+		memcpy(&payload[cl.verts.size()*6], &cl.tris[0], cl.tris.size());
+		ok = ok && fwrite(&payload[0], 1, payload.size(), fp)==payload.size();
+		pos += payload.size();
+	}
+	if (fclose(fp)!=0) ok = false;
+	if (!ok)
+	{
+		DeleteFileA(meshfile.c_str());	// Half written file would look fresh next time
+		error = "Unable to write out-of-core mesh file";
+	}
+	return ok;
+}
+
+bool raytracer::BuildOOCMesh(std::string objfile, std::string meshfile, std::string &error)
+{
+	try
+	{
+		return ConvertOOCMesh(objfile, meshfile, error);
+	}
+	catch (std::bad_alloc&)
+	{
+		error = "Not enough memory to convert .obj file, convert it on a bigger machine";
+		return false;
+	}
+}
+
+//---------------------------------------------------------------
+// OOCMesh
+//---------------------------------------------------------------
+OOCMesh::OOCMesh(std::string meshfile, vector Color, float Refl, float Refr, float Diff, float Spec, size_t CacheLimit)
+{
+	pos		= vector(0,0,0);	ang		= vector(0,0,0);
+	color	= Color;	refl	= Refl;		refr	= Refr;
+	diff	= Diff;		spec	= Spec;		light	= false;
+
+	hits = misses	= 0;
+	cachebytes		= 0;
+	cachelimit		= CacheLimit;
+	filename		= meshfile;
+	lost			= 0;
+	nodes			= NULL;
+	clusters		= NULL;
+	headerview		= tableview = NULL;
+	mapping			= NULL;
+	InitializeCriticalSection(&cachelock);
+
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	granularity = si.dwAllocationGranularity;
+
+	file = CreateFileA(meshfile.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file==INVALID_HANDLE_VALUE) return;
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping) return;
+
+	headerview = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, sizeof(OOCHeader));
+	if (!headerview) return;
+	OOCHeader *hdr = (OOCHeader*)headerview;
+	if (memcmp(hdr->magic, "RTMC", 4)!=0 || hdr->version!=1) return;
+	nodecount		= hdr->nodecount;
+	clustercount	= hdr->clustercount;
+
+	// Hierarchy and cluster table are small compared to payload, map them in one go
+	unsigned __int64 start	= hdr->nodesoffset - hdr->nodesoffset%granularity;
+	unsigned __int64 end	= hdr->clustersoffset + sizeof(OOCCluster)*(unsigned __int64)clustercount;
+	tableview = MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)(start>>32), (DWORD)(start&0xFFFFFFFF), (SIZE_T)(end-start));
+	if (!tableview) return;
+	clusters	= (OOCCluster*)((char*)tableview + (hdr->clustersoffset-start));
+	nodes		= (OOCNode*)((char*)tableview + (hdr->nodesoffset-start));
+}
+
+OOCMesh::~OOCMesh()
+{
+	for (std::map<int, std::pair<DecodedCluster*, std::list<int>::iterator> >::iterator it = cache.begin(); it!=cache.end(); ++it)
+		delete it->second.first;
+	if (tableview)	UnmapViewOfFile(tableview);
+	if (headerview)	UnmapViewOfFile(headerview);
+	if (mapping)	CloseHandle(mapping);
+	if (file!=INVALID_HANDLE_VALUE) CloseHandle(file);
+	DeleteCriticalSection(&cachelock);
+}
+
+void OOCMesh::Evict()
+{
+	// Walk from least recently used end, skipping clusters somebody is tracing against right now
+	std::list<int>::iterator it = lru.end();
+	while (cachebytes>cachelimit && it!=lru.begin())
+	{
+		--it;
+		DecodedCluster *dc = cache[*it].first;
+		if (dc->users>0) continue;
+		cachebytes -= dc->bytes;
+		cache.erase(*it);
+		delete dc;
+		it = lru.erase(it);
+	}
+}
+
+OOCMesh::DecodedCluster* OOCMesh::Acquire(int cluster)
+{
+	EnterCriticalSection(&cachelock);
+	std::map<int, std::pair<DecodedCluster*, std::list<int>::iterator> >::iterator it = cache.find(cluster);
+	if (it!=cache.end())
+	{
+		lru.splice(lru.begin(), lru, it->second.second); // Move to front
+		it->second.first->users++;
+		hits++;
+		LeaveCriticalSection(&cachelock);
+		return it->second.first;
+	}
+	LeaveCriticalSection(&cachelock);
+
+	// Decode outside of the lock, so other threads keep tracing
+	OOCCluster &cl = clusters[cluster];
+	unsigned __int64 start	= cl.offset - cl.offset%granularity;
+	size_t len				= (size_t)(cl.offset-start) + cl.vertcount*6 + cl.tricount*3;
+	void *view = MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)(start>>32), (DWORD)(start&0xFFFFFFFF), len);
+	if (!view)
+	{
+		// Image would miss triangles, stop the render instead
+		InterlockedExchange(&sc.broken, 1);
+		if (InterlockedExchange(&lost, 1)==0)
+		{
+			std::wstring err = L"Raytracer engine has failed to read out-of-core mesh: \"";
+			err+=std::wstring(filename.begin(),filename.end()); // Avoid using printf with something that user can mess around with!
+			err+=L"\"\nRender is stopped, load the scene again to retry.";
+			ShowError(err, L"Mesh Loading Failed");
+		}
+		return NULL;
+	}
+
+	DecodedCluster *dc = new DecodedCluster;
+	const unsigned short *q = (const unsigned short*)((char*)view + (cl.offset-start));
+	float scale[3];
+	for (int a = 0; a<3; a++) scale[a] = (cl.bmax[a]-cl.bmin[a])/65535.f;
+	dc->verts.resize(cl.vertcount);
+	for (int v = 0; v<cl.vertcount; v++)
+		dc->verts[v] = vector(	cl.bmin[0]+q[v*3  ]*scale[0],
+								cl.bmin[1]+q[v*3+1]*scale[1],
+								cl.bmin[2]+q[v*3+2]*scale[2]);
+	const unsigned char *t = (const unsigned char*)(q+cl.vertcount*3);
+	dc->tris.assign(t, t+cl.tricount*3);
+	UnmapViewOfFile(view);
+	dc->recs.resize(cl.tricount);
+	for (int i = 0; i<cl.tricount; i++)
+		dc->recs[i].Setup(dc->verts[dc->tris[i*3]], dc->verts[dc->tris[i*3+1]], dc->verts[dc->tris[i*3+2]]);
+	dc->users = 1;
+	dc->bytes = sizeof(DecodedCluster) + dc->verts.size()*sizeof(vector) + dc->tris.size() + dc->recs.size()*sizeof(TriangleRecord);
+
+	EnterCriticalSection(&cachelock);
+	it = cache.find(cluster);
+	if (it!=cache.end()) // Somebody was faster, use theirs
+	{
+		delete dc;
+		dc = it->second.first;
+		dc->users++;
+		hits++;
+	}
+	else
+	{
+		lru.push_front(cluster);
+		cache[cluster] = std::make_pair(dc, lru.begin());
+		cachebytes += dc->bytes;
+		misses++;
+		Evict();
+	}
+	LeaveCriticalSection(&cachelock);
+	return dc;
+}
+
+void OOCMesh::Release(DecodedCluster *dc)
+{
+	EnterCriticalSection(&cachelock);
+	dc->users--;
+	if (cachebytes>cachelimit) Evict();
+	LeaveCriticalSection(&cachelock);
+}
+
+// Slab test, returns entry distance or -1 on miss
+static float RayBox(const float *bmin, const float *bmax, vector &Or, vector &inv)
+{
+	float t0 = 0.f, t1 = 1e30f;
+	const float *o = &Or.x, *id = &inv.x;
+	for (int a = 0; a<3; a++)
+	{
+		float tn = (bmin[a]-o[a])*id[a];
+		float tf = (bmax[a]-o[a])*id[a];
+		if (tn>tf) { float tmp = tn; tn = tf; tf = tmp; }
+		t0 = tn>t0?tn:t0;
+		t1 = tf<t1?tf:t1;
+		if (t0>t1*1.00001f+1e-4f) return -1.f; // A bit of slack for quantization rounding
+	}
+	return t0;
+}
+
+bool OOCMesh::GetBounds(vector &bmin, vector &bmax)
+{
+	if (!nodes) return false;
+	bmin = vector(nodes[0].bmin[0], nodes[0].bmin[1], nodes[0].bmin[2]);
+	bmax = vector(nodes[0].bmax[0], nodes[0].bmax[1], nodes[0].bmax[2]);
+	return true;
+}
+
+traceresp OOCMesh::Draw(vector Or, vector Dir)
+{
+	traceresp	BestR(false);
+	float		BestD = 1e9;
+	if (!nodes) return BestR;
+
+	vector	inv(1.f/Dir.x, 1.f/Dir.y, 1.f/Dir.z);
+	float	dirlen = ~Dir;
+	int		stack[64];
+	int		sp = 0;
+	stack[sp++] = 0;
+	while (sp>0)
+	{
+		OOCNode &n = nodes[stack[--sp]];
+		float tn = RayBox(n.bmin, n.bmax, Or, inv);
+		if (tn<0.f || tn*dirlen>BestD) continue;
+
+		if (n.left>=0)
+		{
+			stack[sp++] = n.right;
+			stack[sp++] = n.left;
+			continue;
+		}
+		DecodedCluster *dc = Acquire(~n.left);
+		if (!dc) continue;
+		for (unsigned int t = 0; t<dc->tris.size(); t+=3)
+		{
+			// Same record Triangle::Draw uses, so same intersection as in-core meshes
+			TriangleHit h;
+			if (!dc->recs[t/3].Hit(dc->verts[dc->tris[t]], dc->verts[dc->tris[t+1]], dc->verts[dc->tris[t+2]], Or, Dir, h)) continue;
+			float CurD = ~(h.hitpos-Or);
+			if (CurD<BestD)
+			{
+				BestD	= CurD;
+				BestR	= traceresp(true, h.hitpos, h.hitnormal, Dir, false, h.len, color, refl, refr, false, this);
+			}
+		}
+		Release(dc);
+	}
+	return BestR;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "raytracer.h"
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Out-of-core mesh
+//---------------------------------------------------------------
+// Meshes too big to be loaded as separate Triangles are converted once into a .rtm file:
+// triangles sorted along Morton curve and cut into small clusters, cluster vertices quantized
+// to 16 bits inside cluster box, plus a bounding box hierarchy over the clusters.
+// Every cluster starts on a page boundary, so a ray that reaches a leaf touches one or two pages.
+// Hierarchy and cluster table stay mapped, cluster payload is decoded on demand into an LRU cache,
+// that is kept under a memory cap. Renders get slower when the cap is tight, they don't fail.
+// If a cluster can't be mapped(file gone, address space used up) mesh would lose triangles,
+// so it tells once with ShowError and marks scene broken(Scene::broken), which stops renders.
+#define RAYTRACER_OOC_CLUSTERTRIS	128		// Max triangles per cluster
+#define RAYTRACER_OOC_CLUSTERVERTS	256		// Max vertices per cluster, so indices fit in a byte
+#define RAYTRACER_OOC_PAGE			4096	// Cluster alignment in file
+#define RAYTRACER_OOC_CACHE			((size_t)256*1024*1024) // Default decoded cluster cache cap, bytes
+
+#pragma pack(push, 1)
+struct OOCHeader
+{
+	char				magic[4];		// "RTMC"
+	unsigned int		version;
+	unsigned int		nodecount;
+	unsigned int		clustercount;
+	unsigned __int64	nodesoffset;	// OOCNode[nodecount], root is first
+	unsigned __int64	clustersoffset;	// OOCCluster[clustercount]
+	unsigned __int64	tricount;		// For statistics only
+};
+
+struct OOCNode
+{
+	float	bmin[3], bmax[3];
+	int		left, right;	// Children, for leaves left is ~cluster index and right is unused
+};
+
+struct OOCCluster
+{
+	float				bmin[3], bmax[3];	// Quantization box
+	unsigned __int64	offset;				// Page-aligned payload position
+	unsigned short		vertcount;
+	unsigned short		tricount;
+	// Payload: unsigned short[vertcount][3], then unsigned char[tricount][3]
+};
+#pragma pack(pop)
+
+// Converts .obj into .rtm. Conversion itself is done in memory(12 bytes per vertex, 20 per triangle),
+// so that huge meshes can be prepared once on a big machine and then rendered anywhere.
+// False with error set if it couldn't, running out of memory included.
+bool BuildOOCMesh(std::string objfile, std::string meshfile, std::string &error);
+
+class OOCMesh: public Renderable
+{
+public:
+// Funcs
+	OOCMesh(std::string meshfile, vector Color, float Refl, float Refr, float Diff, float Spec, size_t CacheLimit = RAYTRACER_OOC_CACHE);
+	virtual ~OOCMesh();
+
+	bool IsOpen(){return nodes!=NULL;};
+	virtual traceresp Draw(vector Or, vector Dir); //(sic!) Infinite ray!
+	virtual bool GetBounds(vector &bmin, vector &bmax);
+
+	// Cache statistics
+	unsigned int	hits, misses;
+private:
+	struct DecodedCluster
+	{
+		std::vector<vector>			verts;
+		std::vector<unsigned char>	tris;
+		std::vector<TriangleRecord>	recs;	// Per triangle, made when cluster is decoded
+		int							users;	// Threads currently tracing against it, can't evict while >0
+		size_t						bytes;
+	};
+
+	DecodedCluster* Acquire(int cluster);
+	void Release(DecodedCluster *dc);
+	void Evict();
+
+	std::string	filename;	// For the error message
+	volatile LONG lost;		// Some cluster couldn't be mapped, told already
+	HANDLE		file, mapping;
+	void		*headerview, *tableview;
+	OOCNode		*nodes;
+	OOCCluster	*clusters;
+	unsigned int nodecount, clustercount;
+	DWORD		granularity;
+
+	// LRU: most recently used at front
+	CRITICAL_SECTION cachelock;
+	std::list<int> lru;
+	std::map<int, std::pair<DecodedCluster*, std::list<int>::iterator> > cache;
+	size_t		cachebytes, cachelimit;
+};
+};
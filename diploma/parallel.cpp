@@ -0,0 +1,18 @@
+#include "stdafx.h"
+
+#include "parallel.h"
+
+int raytracer::GetWorkerCount()
+{
+	static int workers = 0; // Benign race: everyone computes the same value
+	if (workers==0)
+	{
+		SYSTEM_INFO si;
+		GetSystemInfo(&si);
+		int n = (int)si.dwNumberOfProcessors;
+		if (n<1) n = 1;
+		if (n>RAYTRACER_MAXWORKERS) n = RAYTRACER_MAXWORKERS;
+		workers = n;
+	}
+	return workers;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <windows.h>
+#include <process.h>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Tiny fork-join helper on top of plain Win32 threads
+//---------------------------------------------------------------
+// VS2010 has no std::thread, so we roll our own. Threads are spawned per call,
+// which costs some tens of microseconds - use it for coarse work only(rows, bands, tiles).
+#define RAYTRACER_MAXWORKERS 64 // WaitForMultipleObjects can't wait for more handles than that
+
+// Amount of logical cores we may use, cached after first call
+int GetWorkerCount();
+
+namespace detail{
+	template<class F> struct ParallelForContext
+	{
+		F*				fn;		// What to call
+		volatile LONG	next;	// Next index to hand out
+		LONG			count;	// Total amount of indices
+	};
+
+	template<class F> unsigned __stdcall ParallelForWorker(void *param)
+	{
+		ParallelForContext<F> *ctx = (ParallelForContext<F>*)param;
+		// Everyone grabs next free index until we run dry. Dynamic scheduling keeps
+		// cores busy even if some indices take far longer than others.
+		for(;;)
+		{
+			LONG i = InterlockedIncrement(&ctx->next)-1;
+			if (i >= ctx->count) break;
+			(*ctx->fn)((int)i);
+		}
+		return 0;
+	}
+};
+
+// Calls fn(i) for every i in [0,count), spread across all cores. Calling thread works too.
+// fn may be a functor or a lambda, but it must be safe to call concurrently!
+template<class F> void ParallelFor(int count, F &fn, int maxworkers = 0)
+{
+	int workers = GetWorkerCount();
+	if (maxworkers>0 && maxworkers<workers) workers = maxworkers;
+	if (workers>count) workers = count;
+
+	if (workers<=1) // Nothing to parallelize, don't pay for thread creation
+	{
+		for (int i = 0; i<count; i++) fn(i);
+		return;
+	}
+
+	detail::ParallelForContext<F> ctx;
+	ctx.fn		= &fn;
+	ctx.next	= 0;
+	ctx.count	= count;
+
+	HANDLE threads[RAYTRACER_MAXWORKERS];
+	int spawned = 0;
+	for (int t = 0; t<workers-1; t++)
+	{
+		HANDLE th = (HANDLE)_beginthreadex(NULL, 0, &detail::ParallelForWorker<F>, &ctx, 0, NULL);
+		if (th) threads[spawned++] = th; // If we fail to get a thread, the rest just do more work
+	}
+	detail::ParallelForWorker<F>(&ctx);
+
+	if (spawned>0) WaitForMultipleObjects(spawned, threads, TRUE, INFINITE);
+	for (int t = 0; t<spawned; t++) CloseHandle(threads[t]);
+}
+};
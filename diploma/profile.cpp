@@ -0,0 +1,248 @@
+#include "stdafx.h"
+
+#include "profile.h"
+#include "raytracer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+using namespace raytracer;
+
+volatile bool raytracer::detail::profiling = false;
+
+struct ProfileEvent
+{
+	const char	*name;
+	int			arg;
+	LONGLONG	start, end;
+};
+
+// Events of one thread. Only owning thread writes, so nothing here is locked.
+struct ProfileThread
+{
+	DWORD						tid;
+	const char					*name;
+	std::vector<ProfileEvent*>	blocks;		// RAYTRACER_PROFILE_CHUNK events each, never moved once recorded
+	int							count;
+	int							dropped;	// Over RAYTRACER_PROFILE_MAXEVENTS
+	std::vector< std::pair<const char*, LONGLONG> >	counters;	// Few of them, searched linearly
+};
+
+static CRITICAL_SECTION				proflock;	// Guards profthreads
+static std::vector<ProfileThread*>	profthreads;
+static DWORD						proftls = TLS_OUT_OF_INDEXES;
+static LONGLONG						profstart, proffreq;
+static std::string					proffile;
+
+static ProfileThread* GetProfileThread()
+{
+	ProfileThread *t = (ProfileThread*)TlsGetValue(proftls);
+	if (t) return t;
+	t = new ProfileThread;
+	t->tid		= GetCurrentThreadId();
+	t->name		= "worker";
+	t->count	= 0;
+	t->dropped	= 0;
+	EnterCriticalSection(&proflock);
+	profthreads.push_back(t);
+	LeaveCriticalSection(&proflock);
+	TlsSetValue(proftls, t);
+	return t;
+}
+
+void raytracer::StartProfiling(std::string tracefile)
+{
+	if (detail::profiling) return;
+	if (proftls==TLS_OUT_OF_INDEXES)
+	{
+		proftls = TlsAlloc();
+		if (proftls==TLS_OUT_OF_INDEXES) return; // No profiling then, job still runs
+		InitializeCriticalSection(&proflock);
+	}
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	proffreq	= freq.QuadPart;
+	profstart	= now.QuadPart;
+	proffile	= tracefile;
+	detail::profiling = true;
+	ProfileThreadName("main");
+}
+
+void raytracer::ProfileThreadName(const char *name)
+{
+	if (!detail::profiling) return;
+	GetProfileThread()->name = name;
+}
+
+void raytracer::ProfileCounter(const char *name, LONGLONG value)
+{
+	if (!detail::profiling) return;
+	ProfileThread *t = GetProfileThread();
+	for (unsigned int i = 0; i<t->counters.size(); i++)
+		if (t->counters[i].first==name)
+		{
+			t->counters[i].second += value;
+			return;
+		}
+	t->counters.push_back(std::make_pair(name, value));
+}
+
+void raytracer::detail::ProfileRecord(const char *name, int arg, LONGLONG start)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	if (!profiling) return; // Stopped while scope was open
+	ProfileThread *t = GetProfileThread();
+	if (t->count>=RAYTRACER_PROFILE_MAXEVENTS)
+	{
+		t->dropped++;
+		return;
+	}
+	if (t->count%RAYTRACER_PROFILE_CHUNK==0)
+		t->blocks.push_back(new ProfileEvent[RAYTRACER_PROFILE_CHUNK]);
+	ProfileEvent &e = t->blocks.back()[t->count%RAYTRACER_PROFILE_CHUNK];
+	e.name	= name;
+	e.arg	= arg;
+	e.start	= start;
+	e.end	= now.QuadPart;
+	t->count++;
+}
+
+//---------------------------------------------------------------
+// Output
+//---------------------------------------------------------------
+struct ProfilePhase
+{
+	int			calls;
+	LONGLONG	total, longest;
+	ProfilePhase():calls(0),total(0),longest(0){};
+};
+
+static bool ByStart(const ProfileEvent &a, const ProfileEvent &b)
+{
+	return a.start<b.start;
+}
+
+static double ProfileMs(LONGLONG ticks)
+{
+	return ticks*1000.0/proffreq;
+}
+
+static bool ByTotal(const std::pair<std::string, ProfilePhase> &a, const std::pair<std::string, ProfilePhase> &b)
+{
+	return a.second.total>b.second.total;
+}
+
+static bool WriteProfileSummary(std::string file, LONGLONG wall)
+{
+	FILE *fp = fopen(file.c_str(), "w");
+	if (!fp) return false;
+
+	std::map<std::string, ProfilePhase> phases; // Literals may or may not be merged, so key by text
+	fprintf(fp, "Wall time %.2f ms\n\n", ProfileMs(wall));
+	fprintf(fp, "%-12s %-12s %8s %12s %8s %8s\n", "thread", "name", "events", "busy ms", "busy %", "dropped");
+	for (unsigned int i = 0; i<profthreads.size(); i++)
+	{
+		ProfileThread *t = profthreads[i];
+		std::vector<ProfileEvent> ev;
+		ev.reserve(t->count);
+		for (int k = 0; k<t->count; k++)
+		{
+			ProfileEvent &e = t->blocks[k/RAYTRACER_PROFILE_CHUNK][k%RAYTRACER_PROFILE_CHUNK];
+			ev.push_back(e);
+			ProfilePhase &p = phases[e.name];
+			p.calls++;
+			p.total += e.end-e.start;
+			p.longest = max(p.longest, e.end-e.start);
+		}
+		// Scopes nest, so busy time is the union of intervals, not their sum
+		std::sort(ev.begin(), ev.end(), ByStart);
+		LONGLONG busy = 0, covered = profstart;
+		for (unsigned int k = 0; k<ev.size(); k++)
+		{
+			LONGLONG from = max(ev[k].start, covered);
+			if (ev[k].end>from)
+			{
+				busy += ev[k].end-from;
+				covered = ev[k].end;
+			}
+		}
+		fprintf(fp, "%-12lu %-12s %8d %12.2f %7.1f%% %8d\n", (unsigned long)t->tid, t->name, t->count,
+			ProfileMs(busy), wall>0?busy*100.0/wall:0.0, t->dropped);
+	}
+
+	std::map<std::string, LONGLONG> counters;
+	for (unsigned int i = 0; i<profthreads.size(); i++)
+		for (unsigned int k = 0; k<profthreads[i]->counters.size(); k++)
+			counters[profthreads[i]->counters[k].first] += profthreads[i]->counters[k].second;
+
+	std::vector< std::pair<std::string, ProfilePhase> > sorted(phases.begin(), phases.end());
+	std::sort(sorted.begin(), sorted.end(), ByTotal);
+	fprintf(fp, "\n%-24s %8s %12s %10s %10s\n", "phase", "calls", "total ms", "avg ms", "max ms");
+	for (unsigned int i = 0; i<sorted.size(); i++)
+	{
+		ProfilePhase &p = sorted[i].second;
+		fprintf(fp, "%-24s %8d %12.2f %10.3f %10.3f\n", sorted[i].first.c_str(), p.calls,
+			ProfileMs(p.total), ProfileMs(p.total)/p.calls, ProfileMs(p.longest));
+	}
+	if (!counters.empty())
+	{
+		fprintf(fp, "\n%-40s %16s\n", "counter", "total");
+		for (std::map<std::string, LONGLONG>::iterator it = counters.begin(); it!=counters.end(); ++it)
+			fprintf(fp, "%-40s %16lld\n", it->first.c_str(), (long long)it->second);
+	}
+	bool ok = !ferror(fp);
+	fclose(fp);
+	return ok;
+}
+
+static bool WriteProfileTrace(std::string file)
+{
+	FILE *fp = fopen(file.c_str(), "w");
+	if (!fp) return false;
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	const char *sep = "";
+	for (unsigned int i = 0; i<profthreads.size(); i++)
+	{
+		ProfileThread *t = profthreads[i];
+		fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}", sep, (unsigned long)t->tid, t->name);
+		sep = ",\n";
+		for (int k = 0; k<t->count; k++)
+		{
+			ProfileEvent &e = t->blocks[k/RAYTRACER_PROFILE_CHUNK][k%RAYTRACER_PROFILE_CHUNK];
+			// Names are literals from our own code, nothing to escape
+			fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f", sep, e.name,
+				(unsigned long)t->tid, ProfileMs(e.start-profstart)*1000.0, ProfileMs(e.end-e.start)*1000.0);
+			if (e.arg>=0) fprintf(fp, ",\"args\":{\"arg\":%d}", e.arg);
+			fprintf(fp, "}");
+		}
+	}
+	fprintf(fp, "\n]}\n");
+	bool ok = !ferror(fp);
+	fclose(fp);
+	return ok;
+}
+
+bool raytracer::StopProfiling()
+{
+	if (!detail::profiling) return true;
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	detail::profiling = false;
+	// Buffers are kept, a thread that is still winding down may hold on to its own
+	EnterCriticalSection(&proflock);
+	bool ok = WriteProfileTrace(proffile) && WriteProfileSummary(proffile+".txt", now.QuadPart-profstart);
+	LeaveCriticalSection(&proflock);
+	if (!ok)
+	{
+		std::wstring err = L"Raytracer engine has failed to write profile: \"";
+		err+=std::wstring(proffile.begin(),proffile.end()); // Avoid using printf with something that user can mess around with!
+		err+=L"\"";
+		ShowError(err, L"Profile Saving Failed");
+	}
+	return ok;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Phase profiler
+//---------------------------------------------------------------
+// Scoped timers around the phases of a job: scene and .obj parsing, hierarchy build, tiles,
+// image encoding. Every thread records into its own buffer, so there is no locking per event.
+// Started with `diploma.exe /profile trace.json ...`, the trace is written on exit in Chrome
+// trace-event format(open in chrome://tracing or ui.perfetto.dev), next to it goes
+// trace.json.txt with time per phase, how busy each thread was and counter totals.
+// When profiling is off a scope costs one test of a global flag. Building with
+// RAYTRACER_PROFILE 0 drops the scopes altogether.
+#ifndef RAYTRACER_PROFILE
+#define RAYTRACER_PROFILE			1
+#endif
+#define RAYTRACER_PROFILE_CHUNK		4096		// Events per buffer block
+#define RAYTRACER_PROFILE_MAXEVENTS	(1<<20)		// Per thread, past that events are only counted
+
+// Starts recording, trace goes to tracefile. Call before any worker threads are running.
+void StartProfiling(std::string tracefile);
+// Writes trace and summary, stops recording. Returns false if files couldn't be written.
+bool StopProfiling();
+// Name shown for calling thread in the trace, name must be a string literal
+void ProfileThreadName(const char *name);
+// Adds value to a named total that goes into the summary(ray counts and such). Name must be a
+// string literal. Costs one flag test when profiling is off.
+void ProfileCounter(const char *name, LONGLONG value);
+
+namespace detail{
+	extern volatile bool profiling;
+	void ProfileRecord(const char *name, int arg, LONGLONG start);
+};
+
+// Records time between construction and destruction, name must be a string literal.
+// arg shows up in the trace as event argument(tile index and such), -1 for none.
+class ProfileScope
+{
+	const char	*name;
+	int			arg;
+	LONGLONG	start;
+public:
+	ProfileScope(const char *n, int a = -1)
+	{
+		name = NULL;
+		if (!detail::profiling) return;
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		name	= n;
+		arg		= a;
+		start	= now.QuadPart;
+	};
+	~ProfileScope()
+	{
+		if (name) detail::ProfileRecord(name, arg, start);
+	};
+};
+
+#if RAYTRACER_PROFILE
+#define RAYTRACER_PROFILE_CAT2(a,b)	a##b
+#define RAYTRACER_PROFILE_CAT(a,b)	RAYTRACER_PROFILE_CAT2(a,b)
+#define RAYTRACER_PROFILE_SCOPE(name)			raytracer::ProfileScope RAYTRACER_PROFILE_CAT(profscope,__LINE__)(name)
+#define RAYTRACER_PROFILE_SCOPE_ARG(name, arg)	raytracer::ProfileScope RAYTRACER_PROFILE_CAT(profscope,__LINE__)(name, arg)
+#else
+#define RAYTRACER_PROFILE_SCOPE(name)
+#define RAYTRACER_PROFILE_SCOPE_ARG(name, arg)
+#endif
+};
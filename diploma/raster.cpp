@@ -0,0 +1,377 @@
+#include "stdafx.h"
+
+#include "raster.h"
+#include "profile.h"
+
+#include <algorithm>
+#include <float.h>
+#include <math.h>
+#include <typeinfo>
+
+using namespace raytracer;
+
+#define RASTER_NEAR	1e-5	// Closest image plane multiple a vertex may be projected from
+#define RASTER_FAR	1e8		// Scene::Draw takes nothing at 1e9 or farther, stay well clear of that
+
+//---------------------------------------------------------------
+// Setup
+//---------------------------------------------------------------
+static double DotD(const double a[3], const double b[3])
+{
+	return a[0]*b[0]+a[1]*b[1]+a[2]*b[2];
+}
+
+static void CrossD(const double a[3], const double b[3], double out[3])
+{
+	out[0] = a[1]*b[2]-a[2]*b[1];
+	out[1] = a[2]*b[0]-a[0]*b[2];
+	out[2] = a[0]*b[1]-a[1]*b[0];
+}
+
+// Point relative to camera, image plane coordinates (x,y) of it. False if it is behind the camera.
+bool PrimaryRaster::Project(const double p[3], double &x, double &y)
+{
+	double s = DotD(inv[0], p);
+	if (s<RASTER_NEAR) return false;
+	x = DotD(inv[1], p)/s;
+	y = DotD(inv[2], p)/s;
+	return true;
+}
+
+// Keeps primitive if it is on screen, binning waits until all are known
+void PrimaryRaster::Keep(RasterPrim &p)
+{
+	p.x0 = max(p.x0, 0);		p.y0 = max(p.y0, 0);
+	p.x1 = min(p.x1, width-1);	p.y1 = min(p.y1, height-1);
+	if (p.x0>p.x1 || p.y0>p.y1) return; // Off screen
+	prims.push_back(p);
+}
+
+bool PrimaryRaster::Closer(const RasterPrim &a, const RasterPrim &b)
+{
+	return a.zmin<b.zmin;
+}
+
+// Pixel bounds of projected points, clamped a bit outside the screen
+static void PixelBounds(const double *xs, const double *ys, int count, int W, int H, int &x0, int &y0, int &x1, int &y1)
+{
+	double xmin = xs[0], xmax = xs[0], ymin = ys[0], ymax = ys[0];
+	for (int i = 1; i<count; i++)
+	{
+		xmin = min(xmin, xs[i]); xmax = max(xmax, xs[i]);
+		ymin = min(ymin, ys[i]); ymax = max(ymax, ys[i]);
+	}
+	// Subsamples are up to 0.1 pixel off their pixel, margin covers that and rounding.
+	// Clamp before converting, points near the camera plane project very far.
+	x0 = (int)ceil(max(xmin, -2.0)-0.25);	x1 = (int)floor(min(xmax, W+1.0)+0.25);
+	y0 = (int)ceil(max(ymin, -2.0)-0.25);	y1 = (int)floor(min(ymax, H+1.0)+0.25);
+}
+
+bool PrimaryRaster::Setup(const Camera &c, int W, int H, int TileSize)
+{
+	RAYTRACER_PROFILE_SCOPE("raster setup");
+	cam			= c;
+	width		= W;
+	height		= H;
+	tilesize	= TileSize;
+	tilesx		= (W+TileSize-1)/TileSize;
+	tilesy		= (H+TileSize-1)/TileSize;
+	camscale	= max(abs(cam.pos.x), max(abs(cam.pos.y), abs(cam.pos.z)));
+
+	// Point q relative to camera is s*(LowLeftCorner + Right*x - Up*y), solve for s, s*x, s*y
+	double m[3][3] = {	{cam.LowLeftCorner.x, cam.Right.x, -cam.Up.x},
+						{cam.LowLeftCorner.y, cam.Right.y, -cam.Up.y},
+						{cam.LowLeftCorner.z, cam.Right.z, -cam.Up.z}};
+	double det =	m[0][0]*(m[1][1]*m[2][2]-m[1][2]*m[2][1])
+				-	m[0][1]*(m[1][0]*m[2][2]-m[1][2]*m[2][0])
+				+	m[0][2]*(m[1][0]*m[2][1]-m[1][1]*m[2][0]);
+	for (int r = 0; r<3; r++)
+		for (int k = 0; k<3; k++)
+		{
+			// Cofactor of m[k][r] over determinant
+			int r1 = (k+1)%3, r2 = (k+2)%3, c1 = (r+1)%3, c2 = (r+2)%3;
+			inv[r][k] = (m[r1][c1]*m[r2][c2]-m[r1][c2]*m[r2][c1])/det;
+		}
+
+	tris.clear();
+	prims.clear();
+	unbounded.clear();
+	bins.assign(tilesx*tilesy, std::vector<int>());
+	double o[3] = {cam.pos.x, cam.pos.y, cam.pos.z};
+	double llc[3] = {cam.LowLeftCorner.x, cam.LowLeftCorner.y, cam.LowLeftCorner.z};
+	double right[3] = {cam.Right.x, cam.Right.y, cam.Right.z};
+	double up[3] = {cam.Up.x, cam.Up.y, cam.Up.z};
+	for (unsigned int i = 0; i<sc.sceneobjects.size(); i++)
+	{
+		Renderable *obj = sc.sceneobjects[i];
+		vector bmin, bmax;
+		if (!obj->GetBounds(bmin, bmax))
+		{
+			unbounded.push_back(obj->id);
+			continue;
+		}
+		RasterPrim p;
+		p.index = obj->id;
+		// Distance from camera to bounds, nothing of it can be closer
+		double gap[3];
+		for (int a = 0; a<3; a++)
+		{
+			double lo = (&bmin.x)[a]-o[a], hi = o[a]-(&bmax.x)[a];
+			gap[a] = max(max(lo, hi), 0.0);
+		}
+		p.zmin = sqrt(DotD(gap, gap));
+		if (typeid(*obj)==typeid(Triangle))
+		{
+			Triangle *tr = (Triangle*)obj;
+			vector vs[3] = {tr->pos, tr->pos1, tr->pos2};
+			double v[3][3];
+			for (int k = 0; k<3; k++)
+			{
+				v[k][0] = vs[k].x-o[0]; v[k][1] = vs[k].y-o[1]; v[k][2] = vs[k].z-o[2];
+			}
+			// Bounds of the part in front of the camera: clip by image plane multiple RASTER_NEAR
+			double xs[4], ys[4], s[3];
+			int count = 0;
+			for (int k = 0; k<3; k++) s[k] = DotD(inv[0], v[k]);
+			for (int k = 0; k<3; k++)
+			{
+				int l = (k+1)%3;
+				if (s[k]>=RASTER_NEAR && Project(v[k], xs[count], ys[count])) count++;
+				if ((s[k]>=RASTER_NEAR)!=(s[l]>=RASTER_NEAR))
+				{
+					double f = (s[k]-RASTER_NEAR)/(s[k]-s[l]), q[3];
+					for (int a = 0; a<3; a++) q[a] = v[k][a]+(v[l][a]-v[k][a])*f;
+					double qs = DotD(inv[0], q);
+					xs[count] = DotD(inv[1], q)/qs;
+					ys[count] = DotD(inv[2], q)/qs;
+					count++;
+				}
+			}
+			if (count==0) continue; // Behind the camera
+			PixelBounds(xs, ys, count, W, H, p.x0, p.y0, p.x1, p.y1);
+
+			// Edge k goes from vertex k to k+1, plane through it and the camera has normal v[k]^v[k+1].
+			// Ray through (x,y) is on the inner side of it if d(x,y).normal has the sign of v0.(v1^v2).
+			RasterTriangle t;
+			double c12[3];
+			CrossD(v[1], v[2], c12);
+			double triple = DotD(v[0], c12);
+			bool ok = triple!=0;
+			for (int k = 0; k<3 && ok; k++)
+			{
+				double cn[3];
+				CrossD(v[k], v[(k+1)%3], cn);
+				double a = DotD(right, cn), b = -DotD(up, cn), cc = DotD(llc, cn);
+				double len = sqrt(a*a+b*b);
+				if (len==0) {ok = false; break;}
+				double sign = triple>0?1.0:-1.0;
+				t.e[k][0] = a*sign/len; t.e[k][1] = b*sign/len; t.e[k][2] = cc*sign/len;
+			}
+			if (ok)
+			{
+				double e1[3], e2[3];
+				for (int a = 0; a<3; a++)
+				{
+					t.o[a] = v[0][a];
+					e1[a] = v[1][a]-v[0][a];
+					e2[a] = v[2][a]-v[0][a];
+				}
+				CrossD(e1, e2, t.n);
+				t.on = DotD(t.o, t.n);
+				t.id = obj->id;
+				p.kind	= 0;
+				p.index	= (int)tris.size();
+				tris.push_back(t);
+			}
+			else p.kind = 2; // Seen edge on, leave it to the tracer
+		}
+		else
+		{
+			// Spheres are drawn exactly, anything else only marks where tracing is needed
+			p.kind = typeid(*obj)==typeid(Sphere) ? 1 : 2;
+			double xs[8], ys[8];
+			bool front = true;
+			for (int k = 0; k<8 && front; k++)
+			{
+				double q[3] = {(k&1?bmax.x:bmin.x)-o[0], (k&2?bmax.y:bmin.y)-o[1], (k&4?bmax.z:bmin.z)-o[2]};
+				front = Project(q, xs[k], ys[k]);
+			}
+			if (front) PixelBounds(xs, ys, 8, W, H, p.x0, p.y0, p.x1, p.y1);
+			else p.x0 = p.y0 = 0, p.x1 = W-1, p.y1 = H-1; // Camera is next to or inside it
+		}
+		Keep(p);
+	}
+
+	// Many primitives over the same pixels cost raster more than the hierarchy saves on primary rays
+	double covered = 0;
+	for (unsigned int i = 0; i<prims.size(); i++)
+		covered += (double)(prims[i].x1-prims[i].x0+1)*(prims[i].y1-prims[i].y0+1);
+	if (covered>RAYTRACER_RASTER_OVERDRAW*(double)W*H) return false;
+
+	// Front to back, then most of what is hidden fails the depth test before any real work
+	std::sort(prims.begin(), prims.end(), Closer);
+	for (unsigned int i = 0; i<prims.size(); i++)
+		for (int ty = prims[i].y0/tilesize; ty<=prims[i].y1/tilesize; ty++)
+			for (int tx = prims[i].x0/tilesize; tx<=prims[i].x1/tilesize; tx++)
+				bins[ty*tilesx+tx].push_back(i);
+	return true;
+}
+
+//---------------------------------------------------------------
+// Tiles
+//---------------------------------------------------------------
+// Surface that may or may not be there, no closer than depth
+static void RasterUnsure(RasterSample &rs, double depth)
+{
+	rs.udepth = min(rs.udepth, (float)max(depth, 0.0));
+}
+
+// Surface at depth that raster is sure about
+static void RasterSure(RasterSample &rs, double depth, int id, double tol)
+{
+	if (depth>=RASTER_FAR)
+	{
+		RasterUnsure(rs, depth);
+		return;
+	}
+	if (depth<rs.depth)
+	{
+		if (rs.depth-depth<=tol) rs.udepth = min(rs.udepth, rs.depth); // Too close to tell which one
+		rs.depth	= (float)depth;
+		rs.id		= id;
+	}
+	else if (depth-rs.depth<=tol) rs.udepth = min(rs.udepth, (float)depth);
+}
+
+void PrimaryRaster::RasterTriangleSamples(const RasterTriangle &t, const RasterPrim &p, int x0, int y0, int w, int h, int samples, const float *dx, const float *dy, const float *dz, RasterSample *out)
+{
+	int px0 = max(p.x0, x0), px1 = min(p.x1, x0+w-1);
+	int py0 = max(p.y0, y0), py1 = min(p.y1, y0+h-1);
+	// Edge functions at subsample offsets. Renderer rounds sample positions to float, which
+	// moves them by 1e-4 pixels at most, well inside RAYTRACER_RASTER_EDGE.
+	double off[3][RAYTRACER_SUBSAMPLES];
+	double reach = 0; // How far a subsample is from its pixel, at most
+	for (int s = 0; s<samples; s++)
+	{
+		for (int k = 0; k<3; k++) off[k][s] = t.e[k][0]*SubsampleX[s]+t.e[k][1]*SubsampleY[s];
+		reach = max(reach, sqrt(SubsampleX[s]*SubsampleX[s]+SubsampleY[s]*SubsampleY[s]));
+	}
+	for (int py = py0; py<=py1; py++)
+		for (int px = px0; px<=px1; px++)
+		{
+			double e0 = t.e[0][0]*px+t.e[0][1]*py+t.e[0][2];
+			double e1 = t.e[1][0]*px+t.e[1][1]*py+t.e[1][2];
+			double e2 = t.e[2][0]*px+t.e[2][1]*py+t.e[2][2];
+			if (min(e0, min(e1, e2))<=-RAYTRACER_RASTER_EDGE-reach) continue; // No subsample can be inside
+			for (int s = 0; s<samples; s++)
+			{
+				double e = min(e0+off[0][s], min(e1+off[1][s], e2+off[2][s]));
+				if (e<=-RAYTRACER_RASTER_EDGE) continue;
+				int i = ((py-y0)*w+(px-x0))*samples+s;
+				if (Hidden(out[i], p.zmin)) continue;
+				double d[3] = {dx[i], dy[i], dz[i]};
+				double dn = DotD(d, t.n)/sqrt(DotD(d, d));
+				double depth = dn!=0 ? t.on/dn : 0;
+				// Moller-Trumbore drops determinants under 1e-6(1e3*|dn|) and hits closer than 1e-3
+				if (e>=RAYTRACER_RASTER_EDGE && abs(dn)*1e3>=1e-5 && depth>1e-2)
+					RasterSure(out[i], depth, t.id, Tolerance(depth));
+				else
+					RasterUnsure(out[i], depth-Tolerance(depth));
+			}
+		}
+}
+
+void PrimaryRaster::RasterTile(int x0, int y0, int w, int h, int samples, const float *dx, const float *dy, const float *dz, RasterSample *out)
+{
+	RAYTRACER_PROFILE_SCOPE("raster tile");
+	int count = w*h*samples;
+	for (int i = 0; i<count; i++)
+	{
+		out[i].depth	= FLT_MAX;
+		out[i].id		= -1;
+		out[i].udepth	= FLT_MAX;
+	}
+	// Planes and such, for every sample. Their Draw is what Scene::Draw runs too.
+	for (unsigned int u = 0; u<unbounded.size(); u++)
+	{
+		Renderable *obj = sc.sceneobjects[unbounded[u]];
+		for (int i = 0; i<count; i++)
+		{
+			traceresp r = obj->Draw(cam.pos, !vector(dx[i], dy[i], dz[i]));
+			if (r.hit)
+			{
+				double depth = ~(r.hitpos-cam.pos);
+				RasterSure(out[i], depth, obj->id, Tolerance(depth));
+			}
+		}
+	}
+	std::vector<int> &bin = bins[(y0/tilesize)*tilesx+x0/tilesize];
+	for (unsigned int b = 0; b<bin.size(); b++)
+	{
+		RasterPrim &p = prims[bin[b]];
+		if (p.kind==0)
+		{
+			RasterTriangleSamples(tris[p.index], p, x0, y0, w, h, samples, dx, dy, dz, out);
+			continue;
+		}
+		int px0 = max(p.x0, x0), px1 = min(p.x1, x0+w-1);
+		int py0 = max(p.y0, y0), py1 = min(p.y1, y0+h-1);
+		Renderable *obj = sc.sceneobjects[p.index];
+		// Rays that surely miss the sphere skip Draw. Sphere::Draw goes through a float point 1e6
+		// along the ray, slack on the radius is far above its error.
+		double c[3] = {0, 0, 0}, reach2 = 0;
+		bool inside = true;
+		if (p.kind==1)
+		{
+			Sphere *sp = (Sphere*)obj;
+			c[0] = sp->pos.x-cam.pos.x; c[1] = sp->pos.y-cam.pos.y; c[2] = sp->pos.z-cam.pos.z;
+			double reach = sp->radius*1.001+1e-4*(1+sqrt(DotD(c, c)));
+			reach2 = reach*reach;
+			inside = DotD(c, c)<=reach2; // Camera is inside or next to it
+		}
+		for (int py = py0; py<=py1; py++)
+			for (int px = px0; px<=px1; px++)
+				for (int s = 0; s<samples; s++)
+				{
+					int i = ((py-y0)*w+(px-x0))*samples+s;
+					if (Hidden(out[i], p.zmin)) continue;
+					if (p.kind==2)
+					{
+						RasterUnsure(out[i], p.zmin-Tolerance(p.zmin));
+						continue;
+					}
+					if (!inside)
+					{
+						double d[3] = {dx[i], dy[i], dz[i]};
+						double dc = DotD(d, c);
+						if (dc<=0 || DotD(c, c)-dc*dc/DotD(d, d)>reach2) continue; // Behind, or center too far from the ray
+					}
+					// Impostor: exactly the test the ray would run
+					traceresp r = obj->Draw(cam.pos, !vector(dx[i], dy[i], dz[i]));
+					if (r.hit)
+					{
+						double depth = ~(r.hitpos-cam.pos);
+						RasterSure(out[i], depth, obj->id, Tolerance(depth));
+					}
+				}
+	}
+	if (detail::profiling)
+	{
+		LONGLONG traced = 0;
+		for (int i = 0; i<count; i++)
+			traced += out[i].id>=0 ? out[i].udepth<=out[i].depth+Tolerance(out[i].depth) : out[i].udepth<FLT_MAX;
+		ProfileCounter("raster samples", count);
+		ProfileCounter("raster samples traced", traced);
+	}
+}
+
+traceresp PrimaryRaster::FirstHit(const RasterSample &rs, vector Dir)
+{
+	if (rs.id<0 ? rs.udepth==FLT_MAX : rs.udepth>rs.depth+Tolerance(rs.depth))
+	{
+		if (rs.id<0) return GetBackground(cam.pos, Dir); // Nothing there at all
+		traceresp r = sc.sceneobjects[rs.id]->Draw(cam.pos, Dir);
+		if (r.hit) return r;
+	}
+	return GetIntersection(cam.pos, Dir);
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "raytracer.h"
+#include "camera.h"
+
+#include <vector>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Rasterized primary visibility
+//---------------------------------------------------------------
+// All primary rays start at the camera, so what they hit first can be found by scan converting
+// the scene instead of tracing it. Primitives are binned into render tiles once per frame, then
+// every tile fills a depth/id buffer with one entry per subsample: triangles by edge functions,
+// spheres and planes as impostors(their own Draw on the sample ray, which is exact).
+// Raster only answers where it can be sure: samples within RAYTRACER_RASTER_EDGE pixels of a
+// triangle edge, two surfaces closer than RAYTRACER_RASTER_DEPTHTOL, or primitives it can't draw
+// (out-of-core meshes) are left to GetIntersection. Sure samples run Draw of that one primitive,
+// or go straight to the background. First hits are exactly those of GetIntersection either way,
+// tracing starts at shadows, reflections and refractions.
+// Scenes of many small primitives over the same pixels(RAYTRACER_RASTER_OVERDRAW) aren't
+// rasterized at all, there drawing every one of them costs more than the hierarchy walk it saves.
+#ifndef RAYTRACER_RASTER
+#define RAYTRACER_RASTER			1
+#endif
+#define RAYTRACER_RASTER_EDGE		0.01	// Pixels, float error of ray/triangle test is ~1e-4
+#define RAYTRACER_RASTER_DEPTHTOL	1e-4	// Of distance plus camera distance from origin
+#define RAYTRACER_RASTER_OVERDRAW	8		// Summed primitive bounds over screen area, above it raster is skipped
+
+struct RasterSample
+{
+	float	depth;	// Closest surface raster is sure about
+	int		id;		// Its object, -1 for none
+	float	udepth;	// Closest surface it isn't sure about, ties included
+};
+
+class PrimaryRaster
+{
+public:
+	// Bins sc objects into tiles of W*H canvas, cam must be Setup for the same size.
+	// False if there is too much overdraw for raster to pay off, tracing is faster then.
+	bool Setup(const Camera &cam, int W, int H, int TileSize);
+	// Depth/id buffer of tile whose top left pixel is (x0,y0). Sample s of pixel (x,y) of the tile
+	// is out[(y*w+x)*samples+s], rays in dx,dy,dz are laid out the same and come from GenerateRays.
+	void RasterTile(int x0, int y0, int w, int h, int samples, const float *dx, const float *dy, const float *dz, RasterSample *out);
+	// Same as GetIntersection(cam.pos, Dir), Dir normalized
+	traceresp FirstHit(const RasterSample &rs, vector Dir);
+private:
+	struct RasterTriangle
+	{
+		int		id;
+		double	e[3][3];	// Edge functions a*x+b*y+c, positive inside, in pixels from the edge
+		double	o[3];		// First vertex relative to camera
+		double	n[3];		// Normal, e1^e2
+		double	on;			// o.n
+	};
+	struct RasterPrim
+	{
+		int		kind;		// 0 triangle(index into tris), 1 impostor, 2 unknown
+		int		index;		// tris index or object id
+		int		x0, y0, x1, y1;	// Pixel bounds, inclusive
+		double	zmin;			// Closest it can be to camera
+	};
+	bool Project(const double p[3], double &x, double &y);
+	void Keep(RasterPrim &p);
+	static bool Closer(const RasterPrim &a, const RasterPrim &b);
+	void RasterTriangleSamples(const RasterTriangle &t, const RasterPrim &p, int x0, int y0, int w, int h, int samples, const float *dx, const float *dy, const float *dz, RasterSample *out);
+	double Tolerance(double depth){return RAYTRACER_RASTER_DEPTHTOL*(depth+camscale);};
+	// Sure surface of sample is so much closer than zmin that nothing at zmin can change it
+	bool Hidden(const RasterSample &rs, double zmin){return rs.depth+Tolerance(rs.depth)<zmin-Tolerance(zmin);};
+
+	Camera						cam;
+	double						inv[3][3];	// Image plane basis(LowLeftCorner, Right, -Up) inverted
+	double						camscale;
+	int							width, height, tilesize, tilesx, tilesy;
+	std::vector<RasterTriangle>	tris;
+	std::vector<RasterPrim>		prims;
+	std::vector< std::vector<int> >	bins;		// Per tile, prims indices, closest first
+	std::vector<int>			unbounded;	// Object ids, tested on every sample
+};
+};
@@ -1,7 +1,21 @@
 #include "stdafx.h"
 
 #include "raytracer.h"
+#include "accel.h"
+#include "autotune.h"
+#include "camera.h"
+#include "checkpoint.h"
+#include "dirty.h"
+#include "gbuffer.h"
+#include "lodmesh.h"
+#include "morton.h"
+#include "oocmesh.h"
+#include "parallel.h"
+#include "profile.h"
+#include "raster.h"
+#include "renderjob.h"
 // headers needed for .obj reading
+#include <algorithm>
 #include <vector>
 #include <sstream>
 #include <fstream>
@@ -99,102 +113,160 @@ traceresp Plane::Draw(vector Or, vector Dir)
 // Implementation of Moller-Trumbore intersection algorithm
 traceresp Triangle::Draw(vector Or, vector Dir)
 {
-	vector dir(Dir);
-	Dir = Dir*1e3;	// Strangely enough, this produces cleaner results
-					// digging documentation yielded nothing?..
-					// Likely to be another case of floating point rounding errors
-
-	vector e1, e2;  //Edge1, Edge2	
-	vector P, Q, T;
-	double det, inv_det, u, v;
-	double t;
- 
-	//Find vectors for two edges sharing V1
-	e1 = pos1-pos;
-	e2 = pos2-pos;
-
-	//Begin calculating determinant - also used to calculate u parameter
-	P = Dir^e2;
-	//if determinant is near zero, ray lies in plane of triangle
-	det = e1%P;
-	// Culling
-	//if (det<EPSILON)
-	//NOT CULLING
-	if(det > -EPSILON && det < EPSILON) return traceresp(false);
-	
-	inv_det = 1.f / det;
- 
-	//calculate distance from V1 to ray origin
-	T = Or-pos;
- 
-	//Calculate u parameter and test bound
-	u = (T%P)*inv_det;
-	//The intersection lies outside of the triangle
-	if(u < 0.f || u > 1.f) return traceresp(false);
- 
-	//Prepare to test v parameter
-	Q = T^e1;
- 
-	//Calculate V parameter and test bound
-	v = (Dir%Q)*inv_det;
-	//The intersection lies outside of the triangle
-	if(v < 0.f || u + v  > 1.f) return traceresp(false);
- 
-	t = (e2%Q)*inv_det;
- 
-	if(t > EPSILON) { //ray intersection
-		// This algorithm finds t, which is supposed multiplier of (sic!)Dir
-		// that makes it touch surface.
-		traceresp result(false);
-		result.hit			= true;
-		result.normal		= dir;
-		result.hitpos		= Or+(Dir)*t;
-		result.hitnormal	= (((e1^e2))%Dir)<0?!(e1^e2):!(e2^e1);
-		result.len			= t*~Dir;//*1e6;
-		result.color		= color; // TODO: Half-Lambertian!
-		result.refl			= refl;
-		result.refr			= refr;
-		result.light		= light;
-		result.obj			= this;
+	TriangleHit h;
+	if (!rec.Hit(pos, pos1, pos2, Or, Dir, h)) return traceresp(false); // No hit, no win
 
-		return result;
-	}
- 
-	// No hit, no win
-	return traceresp(false);
+	traceresp result(false);
+	result.hit			= true;
+	result.normal		= Dir;
+	result.hitpos		= h.hitpos;
+	result.hitnormal	= h.hitnormal;
+	result.len			= h.len;
+	result.color		= color; // TODO: Half-Lambertian!
+	result.refl			= refl;
+	result.refr			= refr;
+	result.light		= light;
+	result.obj			= this;
+
+	return result;
 };
 
 
 //---------------------------------------------------------------
 // Scene
 //---------------------------------------------------------------
+Scene raytracer::sc;	// Current scene, one for the whole program
+static bool headless = false;	// See SetHeadless
+
+void raytracer::SetHeadless()
+{
+	headless = true;
+	// Windows subsystem program has no console. Redirected stderr works as it is, otherwise
+	// errors go to console of the command line that started us, if there is one.
+	HANDLE err = GetStdHandle(STD_ERROR_HANDLE);
+	if ((err==NULL || err==INVALID_HANDLE_VALUE) && AttachConsole(ATTACH_PARENT_PROCESS))
+		freopen("CONOUT$", "w", stderr);
+}
+
+void raytracer::ShowError(std::wstring text, std::wstring title)
+{
+	if (!headless)
+	{
+		MessageBox(NULL, text.c_str(), title.c_str(), MB_OK|MB_ICONWARNING);
+		return;
+	}
+	fprintf(stderr, "%ls: %ls\n", title.c_str(), text.c_str());
+	fflush(stderr);
+}
+
+Scene::Scene()
+{
+	accelformat	= RAYTRACER_DEFAULT_ACCEL;
+	accelbuild	= RAYTRACER_DEFAULT_ACCELBUILD;
+	campos		= vector(0,0,0);
+	camdir		= vector(0,1,0);
+	camfov		= RAYTRACER_DEFAULT_FOV;
+	camaspect	= 0.f;
+	accel		= new Accel();
+	shading		= SHADE_ALL;
+	broken		= 0;
+}
+Scene::~Scene()
+{
+	Clear();
+	delete accel;
+}
+void Scene::Clear()
+{
+	for (unsigned int i = 0; i<owned.size(); i++)
+	{
+		delete owned[i];	// Out-of-core meshes have files and caches to let go
+	}
+	owned.clear();
+	arena.Reset();			// Everything else was in the arena
+	sceneobjects.clear();	// And forget about them!
+	lights.clear();			// That technically should invalidate pointers too
+	unbounded.clear();
+	files.clear();
+	cameras.clear();
+	accel->Clear();
+	shading = SHADE_ALL;
+	broken	= 0;
+}
+void Scene::Swap(Scene &other)
+{
+	sceneobjects.swap(other.sceneobjects);
+	arena.Swap(other.arena);
+	owned.swap(other.owned);
+	lights.swap(other.lights);
+	unbounded.swap(other.unbounded);
+	files.swap(other.files);
+	std::swap(campos, other.campos);
+	std::swap(camdir, other.camdir);
+	std::swap(camfov, other.camfov);
+	std::swap(camaspect, other.camaspect);
+	cameras.swap(other.cameras);
+	std::swap(accelformat, other.accelformat);
+	std::swap(accelbuild, other.accelbuild);
+	std::swap(accel, other.accel);
+	std::swap(shading, other.shading);
+	LONG b = broken;
+	broken = other.broken;
+	other.broken = b;
+}
 void Scene::Init()
 {
-	for (std::map<int,Renderable*>::iterator ri = sc.sceneobjects.begin(); ri!=sc.sceneobjects.end() ; ri++)
+	RAYTRACER_PROFILE_SCOPE("Scene::Init");
+	std::vector< Renderable* > bounded;
+	lights.clear();		// Init is also called again after objects were edited
+	unbounded.clear();
+	for (unsigned int i = 0; i<sceneobjects.size(); i++)
 	{
-		if(ri->second->light)
+		Renderable *ri = sceneobjects[i];
+		ri->id = i;	// Hierarchy breaks ties by id, so results match plain id order scan
+		if(ri->light)
 		{
-			sc.lights.push_back(ri->second); // Add all lights into the acceleration list
+			sc.lights.push_back(ri); // Add all lights into the acceleration list
 		}
+		vector bmin, bmax;
+		if (ri->GetBounds(bmin, bmax))
+			bounded.push_back(ri);
+		else
+			unbounded.push_back(ri);
+	}
+	UpdateShading();
+	accel->Build(bounded, (AccelFormat)accelformat, (AccelBuild)accelbuild);
+}
+void Scene::UpdateShading()
+{
+	shading = 0;
+	// Stops as soon as every material bit is found, so big scenes with full materials cost next to nothing
+	for (unsigned int i = 0; i<sceneobjects.size() && (shading&SHADE_ALL)!=SHADE_ALL; i++)
+	{
+		Renderable *ri = sceneobjects[i];
+		if (ri->light) continue; // Lights are never shaded
+		if (ri->refr>0) shading |= SHADE_REFRACT;
+		if (ri->diff>0) shading |= SHADE_DIFFUSE;
+		if (ri->spec>0) shading |= SHADE_SPECULAR;
 	}
+	if (lights.size()==1) shading |= SHADE_ONELIGHT;
 }
 traceresp Scene::Draw(vector Or, vector Dir)
 {
-	// We're going to iterate through ALL objects,
-	// Pick best(closest to origin)
-	traceresp	BestR(false);	// Best Response
+	// Pick best(closest to origin): bounded objects come from hierarchy,
+	// then the few unbounded ones are checked against it
+	traceresp	BestR = accel->Intersect(Or,Dir);	// Best Response
 	traceresp	CurR(false);	// Current response
-	float		BestD = 1e9;	// Best Distance(So we don't calculate it every check!)
+	float		BestD = BestR.hit?~(BestR.hitpos-Or):1e9;	// Best Distance(So we don't calculate it every check!)
 	float		CurD;			// Current distance, so we avoid calculating it twice!
-	for (std::map<int,Renderable*>::iterator it = sceneobjects.begin(); it!=sceneobjects.end(); it++)
+	for (unsigned int i = 0; i<unbounded.size(); i++)
 	{
-		// TODO: Broadphase optimisation: BBOX, Dot Product
-		CurR = it->second->Draw(Or,Dir);
+		CurR = unbounded[i]->Draw(Or,Dir);
 		
 		if (CurR.hit)
 		{
 			CurD = ~(CurR.hitpos-Or);
-			if(CurD<BestD)
+			if(CurD<BestD || (CurD==BestD && BestR.obj && unbounded[i]->id<BestR.obj->id))
 			{
 				BestD = CurD;
 				BestR = CurR;
@@ -212,6 +284,12 @@ traceresp raytracer::GetIntersection(vector Or, vector Dir)
 	if (result.hit){
 		return result;
 	}
+	return GetBackground(Or,Dir);
+}
+
+traceresp raytracer::GetBackground(vector Or, vector Dir)
+{
+	traceresp result(false);
 
 	if (abs(Dir.z) !=0)//;//> 0.000001) // no division by zero
 	{	
@@ -242,95 +320,139 @@ traceresp raytracer::GetIntersection(vector Or, vector Dir)
 
 traceresp raytracer::ColorRaytraceSample(vector Origin, vector Direction, int Samples, float RefrIn) // Handles recursive raytracing
 {
-	vector	rcolor = vector(0,0,0);	// Base color
-	int		rsmplc = 1;				// Sample counter
-	vector  lcolor = vector(0,0,0);	// Light Color
-
 	Direction = !Direction; // ! normalized !
 
-	traceresp rez = GetIntersection(Origin, Direction);
-	if (rez.hit&&!rez.light){
-		// Light system
-		for(std::vector<Renderable*>::size_type i = 0; i != sc.lights.size(); i++) {
-			// Check if we can see this light
-			traceresp lighttest = GetIntersection(rez.hitpos+rez.hitnormal*EPSILON*100, !(sc.lights[i]->pos-(rez.hitpos+rez.hitnormal*EPSILON*100)));
-			if (lighttest.hit&&lighttest.obj!=NULL&&lighttest.obj==sc.lights[i])
-			{
-				float odiff	= 0.0f; // Floor hack
-				float ospec	= 0.0f;
-				
-				if(rez.obj!=NULL){
-					odiff	= rez.obj->diff;
-					ospec	= rez.obj->spec;
-				}
-				double dot = rez.hitnormal%!(sc.lights[i]->pos-rez.hitpos);
-				// Calculate diffuse light
-				if (odiff>0.f)
-				{	// Apply diffuse light to surface
-					//_asm{nop}; // Dark magic related to recompiling, use sparingly and only when sure that you know what you are doing!
-					if(dot>0){
-						lcolor =lcolor + (lighttest.color)/255
-						*odiff
-						*dot;
-					}
-				}
-				// Calculate specular light
+	return ShadeHit(GetIntersection(Origin, Direction), Direction, Samples, RefrIn);
+}
 
-				if (ospec>0.f)
-				{	// Apply diffuse light tint. Notice - no original color!
-					// Reflected light
-					vector refll = !(rez.hitpos-sc.lights[i]->pos);
-					refll = !(rez.hitnormal*-2*(rez.hitnormal%refll)+refll);
-					dot = (-Direction)%!refll;
+//---------------------------------------------------------------
+// Shading
+//---------------------------------------------------------------
+// A hit is shaded in three steps: direct light, secondary rays it spawns, and the final mix once
+// those are traced. Recursive ShadeHit and sorted ShadeBatch below run the very same steps,
+// so they give the same picture.
+struct SecondaryRay
+{
+	vector	org, dir;	// dir normalized, same as ColorRaytraceSample would
+	int		samples;
+	float	refrin;
+	float	width, spread;	// Footprint, see lodmesh.h. Only sorted batches keep it.
+};
+#define SECONDARY_REFL	1
+#define SECONDARY_REFR	2
 
-					if(dot>0.f) lcolor = lcolor + (lighttest.color)/255*ospec*powf(dot,5); // Phong explonent was 20
-				}
-			}
-		}
-		lcolor = lcolor * rez.color;
+// Phong term, x to integer power N by squaring
+template<int N> inline float PowInt(float x){return PowInt<N/2>(x*x)*(N&1?x:1.f);}
+template<> inline float PowInt<0>(float x){return 1.f;}
 
-		// Work with reflections
-		if (rez.hit&&rez.refl>0&&Samples<RAYTRACER_MAXSAMPLES) {
-			// Pre-light
+// Helpers below are templates on SHADE_* bits of the scene, branches on features it doesn't have
+// are dropped at compile time. Every table made with SHADE_TABLE holds all variants of a function.
+#define SHADE_TABLE(f)	{f<0>, f<1>, f<2>, f<3>, f<4>, f<5>, f<6>, f<7>, f<8>, f<9>, f<10>, f<11>, f<12>, f<13>, f<14>, f<15>}
 
-			rcolor=			rcolor + lcolor*(1-rez.refl) + 
+// Light that reaches a hit directly, times its color. Shadow rays are traced from here.
+template<int Shading> static vector ShadeDirect(const traceresp &rez, const vector &Direction, unsigned __int64 &touched)
+{
+	vector  lcolor = vector(0,0,0);	// Light Color
+	if (!(Shading&(SHADE_DIFFUSE|SHADE_SPECULAR))) return lcolor; // Nothing is lit, shadows don't matter
+	std::vector<Renderable*>::size_type lights = Shading&SHADE_ONELIGHT ? 1 : sc.lights.size();
+	for(std::vector<Renderable*>::size_type i = 0; i != lights; i++) {
+		// Check if we can see this light
+		traceresp lighttest = GetIntersection(rez.hitpos+rez.hitnormal*EPSILON*100, !(sc.lights[i]->pos-(rez.hitpos+rez.hitnormal*EPSILON*100)));
+		if (lighttest.obj) touched |= TouchBit(lighttest.obj->id); // Light itself or whatever shadows it
+		if (lighttest.hit&&lighttest.obj!=NULL&&lighttest.obj==sc.lights[i])
+		{
+			float odiff	= 0.0f; // Floor hack
+			float ospec	= 0.0f;
+			
+			if(rez.obj!=NULL){
+				odiff	= rez.obj->diff;
+				ospec	= rez.obj->spec;
+			}
+			float dot = rez.hitnormal%!(sc.lights[i]->pos-rez.hitpos);
+			// Calculate diffuse light
+			if ((Shading&SHADE_DIFFUSE) && odiff>0.f)
+			{	// Apply diffuse light to surface
+				//_asm{nop}; // Dark magic related to recompiling, use sparingly and only when sure that you know what you are doing!
+				if(dot>0){
+					lcolor =lcolor + (lighttest.color)/255
+					*odiff
+					*dot;
+				}
+			}
+			// Calculate specular light
 
-							ColorRaytraceSample(	rez.hitpos+rez.hitnormal*EPSILON*100, // Precision errors ahoy!
+			if ((Shading&SHADE_SPECULAR) && ospec>0.f)
+			{	// Apply diffuse light tint. Notice - no original color!
+				// Reflected light
+				vector refll = !(rez.hitpos-sc.lights[i]->pos);
+				refll = !(rez.hitnormal*-2*(rez.hitnormal%refll)+refll);
+				dot = (-Direction)%!refll;
 
-							!(rez.hitnormal*-2*(rez.hitnormal%rez.normal)+rez.normal),
+				if(dot>0.f) lcolor = lcolor + (lighttest.color)/255*ospec*PowInt<RAYTRACER_PHONG>(dot); // Phong explonent was 20
+			}
+		}
+	}
+	return lcolor * rez.color;
+}
 
-							Samples+1,RefrIn).color * rez.refl;
+// Reflection and refraction rays of a lit hit. Returns SECONDARY_* bits of rays that were made,
+// ray[0] is reflection, ray[1] refraction.
+template<int Shading> static int SpawnSecondary(const traceresp &rez, const vector &Direction, int Samples, float RefrIn, SecondaryRay ray[2])
+{
+	int spawned = 0;
+	// Work with reflections
+	if (rez.refl>0&&Samples<RAYTRACER_MAXSAMPLES) {
+		ray[0].org		= rez.hitpos+rez.hitnormal*EPSILON*100; // Precision errors ahoy!
+		ray[0].dir		= !!(rez.hitnormal*-2*(rez.hitnormal%rez.normal)+rez.normal);
+		ray[0].samples	= Samples+1;
+		ray[0].refrin	= RefrIn;
+		spawned |= SECONDARY_REFL;
+	}
+	// Work with REFRACTIONS!
+	if ((Shading&SHADE_REFRACT) && rez.refr>0&&Samples<RAYTRACER_MAXSAMPLES) {
+		float refrc = RefrIn/rez.refr;
+		vector norm = rez.hitnormal;
+		if (rez.intout) // hit from inside!
+			norm = -norm;
+		// Put Snell's law to the action!
+		float cosint	= -(norm%Direction);
+		float cosrefr	= 1.f - refrc*refrc*(1.f-cosint*cosint); // Calculate cosine of angle in which we must bounce off
+		if (cosrefr>0.0f) // Total internal reflection avoided!
+		{
+			// Oh man... Without Jacco Bikker's example, this would've been a mess!
+			vector ndir = (Direction*refrc)+norm*(refrc*cosint-sqrt(cosrefr));
+			// Magic number EPSILON*100 is handpicked to remove noise related to rounding errors
+			ray[1].org		= rez.hitpos+ndir*EPSILON*100;
+			ray[1].dir		= !ndir;
+			ray[1].samples	= Samples+1;
+			ray[1].refrin	= refrc;
+			spawned |= SECONDARY_REFR;
 		}
+	}
+	return spawned;
+}
+
+// Final color of a hit once rays from SpawnSecondary are traced: their colors, and refraction
+// hit distance for Beer's law. Rounded and clamped.
+template<int Shading> static vector ComposeShade(const traceresp &rez, const vector &lcolor, int spawned, const vector childcolor[2], float refrlen)
+{
+	vector	rcolor = vector(0,0,0);	// Base color
+	if (rez.hit&&!rez.light){
+		if (spawned&SECONDARY_REFL)
+			rcolor = rcolor + lcolor*(1-rez.refl) + childcolor[0]*rez.refl;
 		else
-		{
 			rcolor = lcolor;
-		}
-		// Work with REFRACTIONS!
-		if (rez.hit&&rez.refr>0&&Samples<RAYTRACER_MAXSAMPLES) {
-			//rcolor = vector(0,255,0);
-			float refrc = RefrIn/rez.refr;
-			vector norm = rez.hitnormal;
-			if (rez.intout) // hit from inside!
-				norm = -norm;
-			// Put Snell's law to the action!
-			float cosint	= -(norm%Direction);
-			float cosrefr	= 1.f - refrc*refrc*(1.f-cosint*cosint); // Calculate cosine of angle in which we must bounce off
-			if (cosrefr>0.0f) // Total internal reflection avoided!
-			{
-				// Oh man... Without Jacco Bikker's example, this would've been a mess!
-				vector ndir = (Direction*refrc)+norm*(refrc*cosint-sqrt(cosrefr));
-				// Even better, Beer law is now also in effect!
-				// Magic number EPSILON*100 is handpicked to remove noise related to rounding errors
-				traceresp refrrez = ColorRaytraceSample(rez.hitpos+ndir*EPSILON*100,ndir,Samples+1,refrc);
-				vector btr(1.f,1.f,1.f);
-				if (rez.intout){
-					vector bla = (rez.obj->color/255.f)*0.15f*refrrez.len;// Beer's law absorbance
-					btr = vector(	expf(bla.x),
-									expf(bla.y),
-									expf(bla.z));
-				}
-				rcolor = rcolor + refrrez.color*btr;
+		if ((Shading&SHADE_REFRACT) && (spawned&SECONDARY_REFR))
+		{
+			// Even better, Beer law is now also in effect!
+			vector btr(1.f,1.f,1.f);
+			if (rez.intout){
+				vector bla = (rez.obj->color/255.f)*0.15f*refrlen;// Beer's law absorbance
+				btr = vector(	expf(bla.x),
+								expf(bla.y),
+								expf(bla.z));
 			}
+			rcolor = rcolor + childcolor[1]*btr;
 		}
 	}
 	else
@@ -338,9 +460,9 @@ traceresp raytracer::ColorRaytraceSample(vector Origin, vector Direction, int Sa
 		rcolor = rez.color;
 	}
 	// Clamp color, as light may easily go outta bounds
-	rcolor.x = floor(rcolor.x+0.5);
-	rcolor.y = floor(rcolor.y+0.5);
-	rcolor.z = floor(rcolor.z+0.5);
+	rcolor.x = floorf(rcolor.x+0.5f);
+	rcolor.y = floorf(rcolor.y+0.5f);
+	rcolor.z = floorf(rcolor.z+0.5f);
 
 	if (rcolor.x>255) rcolor.x=255;
 	if (rcolor.y>255) rcolor.y=255;
@@ -350,157 +472,566 @@ traceresp raytracer::ColorRaytraceSample(vector Origin, vector Direction, int Sa
 	if (rcolor.y<0) rcolor.y=0;
 	if (rcolor.z<0) rcolor.z=0;
 
-	rez.color = rcolor;
+	return rcolor;
+}
+
+template<int Shading> static traceresp ShadeHitShaded(traceresp rez, vector Direction, int Samples, float RefrIn)
+{
+	unsigned __int64 touched = rez.obj?TouchBit(rez.obj->id):0; // Floor isn't an object and never changes
+	vector	lcolor = vector(0,0,0);
+	vector	childcolor[2];
+	float	refrlen = 0;
+	int		spawned = 0;
+	if (rez.hit&&!rez.light){
+		lcolor = ShadeDirect<Shading>(rez, Direction, touched);
+		SecondaryRay ray[2];
+		spawned = SpawnSecondary<Shading>(rez, Direction, Samples, RefrIn, ray);
+		if (spawned&SECONDARY_REFL)
+		{
+			traceresp reflrez = ShadeHitShaded<Shading>(GetIntersection(ray[0].org, ray[0].dir), ray[0].dir, ray[0].samples, ray[0].refrin);
+			childcolor[0]	= reflrez.color;
+			touched			|= reflrez.touched;
+		}
+		if ((Shading&SHADE_REFRACT) && (spawned&SECONDARY_REFR))
+		{
+			traceresp refrrez = ShadeHitShaded<Shading>(GetIntersection(ray[1].org, ray[1].dir), ray[1].dir, ray[1].samples, ray[1].refrin);
+			childcolor[1]	= refrrez.color;
+			refrlen			= refrrez.len;
+			touched			|= refrrez.touched;
+		}
+	}
+	rez.color	= ComposeShade<Shading>(rez, lcolor, spawned, childcolor, refrlen);
+	rez.touched	= touched; // Everything the path below this hit has seen
 
 	return rez;
 }
 
+traceresp raytracer::ShadeHit(traceresp rez, vector Direction, int Samples, float RefrIn)
+{
+	typedef traceresp (*ShadeHitFunc)(traceresp, vector, int, float);
+	static const ShadeHitFunc variants[SHADE_VARIANTS] = SHADE_TABLE(ShadeHitShaded);
+	return variants[sc.shading](rez, Direction, Samples, RefrIn);
+}
 
-void raytracer::DrawRaytraced(CanvasData &canv)
+
+//---------------------------------------------------------------
+// Sorted secondary rays
+//---------------------------------------------------------------
+// Reflections and refractions scatter everywhere, traced one after another each walks its own cold
+// part of the hierarchy. ShadeBatch takes primary rays of a batch of pixels and traces the whole
+// ray tree bounce by bounce instead: secondary rays of a bounce are collected, sorted by direction
+// octant and Morton code of origin, and then traced, so neighbouring rays walk the same nodes.
+// Colors are mixed bottom-up at the end, in the same way recursive ShadeHit does.
+// RAYTRACER_SORTSECONDARY 0 keeps bounces but not the sorting, for comparison.
+// When profiling, every bounce is timed and counters show how many neighbouring rays share
+// octant and Morton cell(RAYTRACER_SORTCELLBITS top bits of code) before and after sorting.
+#ifndef RAYTRACER_SORTSECONDARY
+#define RAYTRACER_SORTSECONDARY	1
+#endif
+#define RAYTRACER_SORTCELLBITS	15	// 5 levels of octree over origins of a bounce
+
+class ShadeBatch
 {
-	int w = canv.GetWidth();
-	int h = canv.GetHeight();
-	// Camera stuffs
-	vector CamPos	= sc.campos;
-	vector CamDir	= sc.camdir;
-
-	vector CamRight	= -!(vector(0,0,1)^CamDir)/w; // Getting step for frustrum's down side
-	vector CamUp	= !(CamDir^(-CamRight))/h; // Getting step for frustrum's left side
-
-	// technically we could define our fov here by moving scan grid we just set up
-	// certain distance away from camerapoint
-	vector LowLeftCorner	= (-CamRight*w)/2 // We want to step LEFT!
-							+ (CamUp*h)	 /2 
-							+ CamDir; 
-
-    // For every "pixel"
-    for (int i=0; i < w * h; ++i) {
-
-		vector Color(0,0,0);
-		// Naive supersampling antialiasing. Could be optimized with edge detection, but will mess with gradients otherwise!
-		Color = Color + ColorRaytraceSample(CamPos, LowLeftCorner + CamRight*(i%w) + CamUp*(-floor(i/float(w)))).color;
-		Color = Color + ColorRaytraceSample(CamPos, LowLeftCorner + CamRight*((i%w)-.1) + CamUp*(-floor(i/float(w))-.1)).color;
-		Color = Color + ColorRaytraceSample(CamPos, LowLeftCorner + CamRight*((i%w)-.1) + CamUp*(-floor(i/float(w))+.1)).color;
-		Color = Color + ColorRaytraceSample(CamPos, LowLeftCorner + CamRight*((i%w)+.1) + CamUp*(-floor(i/float(w))-.1)).color;
-		Color = Color + ColorRaytraceSample(CamPos, LowLeftCorner + CamRight*((i%w)+.1) + CamUp*(-floor(i/float(w))+.1)).color;
-		Color = Color/5.f;
-
-		canv.pixels[i] = (int(Color.x) << 16) + (int(Color.y) << 8) + int(Color.z);
-    }
+public:
+	ShadeBatch(){raster = NULL; rsamples = NULL; spread = 0;};
+	void Clear(){nodes.clear(); wave.clear(); rootstart.clear();};
+	// First hits of primary rays that have a raster sample are taken from raster, see raster.h
+	void SetRaster(PrimaryRaster *r, const RasterSample *samples){raster = r; rsamples = samples;};
+	// Angle between neighbouring primary rays, for mesh levels of detail. 0 traces everything at full detail.
+	void SetSpread(float s){spread = s;};
+	// Queues primary ray, returns index of its result
+	int AddPrimary(const vector &org, const vector &dir, int sample = -1)
+	{
+		PendingRay p;
+		p.ray.org		= org;
+		p.ray.dir		= !dir; // Same as ColorRaytraceSample does
+		p.ray.samples	= 0;
+		p.ray.refrin	= 1.f;
+		p.ray.width		= 0;
+		p.ray.spread	= spread;
+		p.parent		= -1;
+		p.slot			= 0;
+		p.sample		= sample;
+		wave.push_back(p);
+		return (int)wave.size()-1;
+	};
+	// Traces everything queued, to the last bounce, with shading variant of sc
+	void Trace()
+	{
+		static void (ShadeBatch::*const variants[SHADE_VARIANTS])() = SHADE_TABLE(&ShadeBatch::TraceShaded);
+		(this->*variants[sc.shading])();
+	};
+	// Same as ColorRaytraceSample would return for primary ray
+	const traceresp& Result(int primary){return nodes[primary].rez;};
+	// Reflected and refracted rays traced for primary ray go to the end of out, see dirty.h
+	void GetSegments(int primary, std::vector<TouchSegment> &out);
+private:
+	struct PendingRay
+	{
+		SecondaryRay	ray;
+		int				parent;	// Node that spawned it, -1 for primary
+		int				slot;	// 0 reflection, 1 refraction
+		int				sample;	// Raster sample of primary ray, -1 to trace
+	};
+	struct Node
+	{
+		traceresp			rez;
+		vector				org, dir;	// Of the ray
+		vector				lcolor;
+		vector				childcolor[2];
+		float				refrlen;
+		int					spawned;
+		unsigned __int64	touched;
+		int					parent, slot;
+		int					root;	// Primary ray of the tree
+	};
+	struct SortKey
+	{
+		unsigned int	key, ray;
+		bool operator<(const SortKey &o) const {return key<o.key;};
+	};
+	void SortWave();
+	template<int Shading> void TraceShaded();
+
+	std::vector<Node>		nodes;	// Parents always come before their children
+	std::vector<int>		byroot, rootstart;	// Secondary nodes grouped by root, made by GetSegments
+	std::vector<PendingRay>	wave, next, sorted;
+	std::vector<SortKey>	keys;
+	PrimaryRaster			*raster;
+	const RasterSample		*rsamples;
+	float					spread;
+};
+
+// Counts neighbours that fall into the same octant and Morton cell
+static LONGLONG CoherentPairs(const std::vector<unsigned int> &keys)
+{
+	LONGLONG pairs = 0;
+	for (unsigned int i = 1; i<keys.size(); i++)
+		if ((keys[i]>>(30-RAYTRACER_SORTCELLBITS))==(keys[i-1]>>(30-RAYTRACER_SORTCELLBITS))) pairs++;
+	return pairs;
 }
 
-// Load .scene file
-// Format:
-// obj r g b refl refr diff spec PATH/FILENAME - loads triangles from obj file
-// t x y z x1 y1 z1 x2 y2 z2 r g b refl refr diff spec - Creates triangle
-// s x y z r g b refl refr diff spec radius	[light] - sphere, [light] may be anything, if found, mark this sphere as point light source
-// c x y z dirx diry dirz - camera
-// p x y z dirx diry dirz r g b refl refr diff spec - plane
-void raytracer::LoadScene(std::string file)
+void ShadeBatch::SortWave()
 {
-	if(file.empty()||file.compare(std::string(""))==0){
-		MessageBox(NULL,  L"No scene filename specified!", L"Scene Loading Failed", MB_OK|MB_ICONWARNING);
-		return;
+	if (wave.size()<2 || (!RAYTRACER_SORTSECONDARY && !detail::profiling)) return;
+	// Origins are scaled to box of this bounce, floor hits can be far away from any object
+	vector bmin = wave[0].ray.org, bmax = wave[0].ray.org;
+	for (unsigned int i = 1; i<wave.size(); i++)
+	{
+		const vector &o = wave[i].ray.org;
+		bmin = vector(min(bmin.x, o.x), min(bmin.y, o.y), min(bmin.z, o.z));
+		bmax = vector(max(bmax.x, o.x), max(bmax.y, o.y), max(bmax.z, o.z));
+	}
+	vector ext = bmax-bmin;
+	vector scale(ext.x>0?1.f/ext.x:0.f, ext.y>0?1.f/ext.y:0.f, ext.z>0?1.f/ext.z:0.f);
+	keys.resize(wave.size());
+	for (unsigned int i = 0; i<wave.size(); i++)
+	{
+		const SecondaryRay &r = wave[i].ray;
+		unsigned int octant = (r.dir.x<0?4:0)|(r.dir.y<0?2:0)|(r.dir.z<0?1:0);
+		keys[i].key = (octant<<30)|Morton3D((r.org.x-bmin.x)*scale.x, (r.org.y-bmin.y)*scale.y, (r.org.z-bmin.z)*scale.z);
+		keys[i].ray = i;
 	}
-	// Wipe scene and acceleration structures, in case we have something loaded
-	for(std::map<int,Renderable*>::iterator sci = sc.sceneobjects.begin(); sci != sc.sceneobjects.end(); ++sci)
+	if (detail::profiling)
 	{
-		delete (*sci).second;	// Nuke all objects
+		std::vector<unsigned int> k(keys.size());
+		for (unsigned int i = 0; i<keys.size(); i++) k[i] = keys[i].key;
+		ProfileCounter("secondary pairs coherent unsorted", CoherentPairs(k));
+#if RAYTRACER_SORTSECONDARY
+		std::sort(k.begin(), k.end());
+#endif
+		ProfileCounter("secondary pairs coherent sorted", CoherentPairs(k));
+		ProfileCounter("secondary pairs", (LONGLONG)k.size()-1);
 	}
-	sc.sceneobjects.clear();	// And forget about them!
-	sc.lights.clear();			// That technically should invalidate pointers too
+#if RAYTRACER_SORTSECONDARY
+	std::sort(keys.begin(), keys.end());
+	sorted.resize(wave.size());
+	for (unsigned int i = 0; i<wave.size(); i++) sorted[i] = wave[keys[i].ray];
+	wave.swap(sorted);
+#endif
+}
 
-	std::ifstream scenefile (file);
-	if (scenefile.is_open()){
-		int oindex = 0;
-		// Attempting better code practice...
-		for(std::string line; std::getline(scenefile, line); )   //read stream line by line
+template<int Shading> void ShadeBatch::TraceShaded()
+{
+	for (int bounce = 0; !wave.empty(); bounce++)
+	{
+		if (bounce>0) SortWave(); // Primary rays come in curve order already
+		RAYTRACER_PROFILE_SCOPE_ARG(bounce?"secondary":"primary", bounce);
+		if (bounce>0) ProfileCounter("secondary rays", (LONGLONG)wave.size());
+		next.clear();
+		for (unsigned int i = 0; i<wave.size(); i++)
 		{
-			std::istringstream in(line);      //make a stream for the line itself
-
-			std::string type;
-			in >> type;                  //and read the first whitespace-separated token
-
-			if(type == "obj")       //and check its value
+			const PendingRay &p = wave[i];
+			int idx = (int)nodes.size();
+			nodes.push_back(Node());
+			Node &n = nodes.back();
+			SetRayFootprint(p.ray.width, p.ray.spread);
+			n.rez		= p.sample>=0 ? raster->FirstHit(rsamples[p.sample], p.ray.dir) : GetIntersection(p.ray.org, p.ray.dir);
+			n.org		= p.ray.org;
+			n.dir		= p.ray.dir;
+			n.parent	= p.parent;
+			n.slot		= p.slot;
+			n.root		= p.parent<0 ? idx : nodes[p.parent].root;
+			n.spawned	= 0;
+			n.refrlen	= 0;
+			n.lcolor	= vector(0,0,0);
+			n.touched	= n.rez.obj?TouchBit(n.rez.obj->id):0; // Floor isn't an object and never changes
+			if (n.rez.hit&&!n.rez.light)
 			{
-			    float r, g, b, refl, refr, diff, spec;
-			    in >> r >> g >> b >> refl >> refr >> diff >> spec;       //now read the whitespace-separated floats
+				// Shadow and secondary rays start where this one is already that wide
+				float width = p.ray.width+p.ray.spread*n.rez.len;
+				SetRayFootprint(width, p.ray.spread);
+				n.lcolor = ShadeDirect<Shading>(n.rez, p.ray.dir, n.touched);
+				PendingRay child[2];
+				SecondaryRay ray[2];
+				n.spawned = SpawnSecondary<Shading>(n.rez, p.ray.dir, p.ray.samples, p.ray.refrin, ray);
+				for (int s = 0; s<2; s++)
+					if (n.spawned&(1<<s))
+					{
+						child[s].ray	= ray[s];
+						child[s].ray.width	= width;
+						child[s].ray.spread	= p.ray.spread*RAYTRACER_LOD_BOUNCE; // Curved surfaces spread it out
+						child[s].parent	= idx;
+						child[s].slot	= s;
+						child[s].sample	= -1;
+						next.push_back(child[s]);
+					}
+			}
+		}
+		wave.swap(next);
+	}
+	wave.clear();
+	SetRayFootprint(0, 0); // Rays traced outside of batches don't know their width
 
-				std::string objfilename = in.str().substr((unsigned int)in.tellg()+1); 
-				// Get the string from here and to end of line. WARNING - THIS GETS FIRST SPACE SO WE ADD 1, BUT WE MAY NOT HAVE NAME AT ALL!
+	// Children were made after their parents, so backwards every node has all it needs
+	for (int i = (int)nodes.size()-1; i>=0; i--)
+	{
+		Node &n = nodes[i];
+		n.rez.color		= ComposeShade<Shading>(n.rez, n.lcolor, n.spawned, n.childcolor, n.refrlen);
+		n.rez.touched	= n.touched;
+		if (n.parent<0) continue;
+		nodes[n.parent].childcolor[n.slot] = n.rez.color;
+		nodes[n.parent].touched |= n.touched;
+		if (n.slot==1) nodes[n.parent].refrlen = n.rez.len;
+	}
+}
 
-				InsertOBJ( objfilename, vector(r,g,b), refl, refr, diff, spec, oindex);
-			}
-			else 
-			if (type == "t")
-			{
-				float x, y, z, x1, y1, z1, x2, y2, z2, r, g, b, refl, refr, diff, spec;
-			    in >> x >> y >> z >> x1 >> y1 >> z1 >> x2 >> y2 >> z2 >> r >> g >> b >> refl >> refr >> diff >> spec;       //now read the whitespace-separated floats
+void ShadeBatch::GetSegments(int primary, std::vector<TouchSegment> &out)
+{
+	if (rootstart.empty())
+	{
+		// Primary rays are the first nodes, counting sort of the rest by their root
+		int primaries = 0;
+		while (primaries<(int)nodes.size() && nodes[primaries].parent<0) primaries++;
+		rootstart.assign(primaries+1, 0);
+		for (unsigned int i = primaries; i<nodes.size(); i++) rootstart[nodes[i].root+1]++;
+		for (int i = 0; i<primaries; i++) rootstart[i+1] += rootstart[i];
+		byroot.resize(nodes.size()-primaries);
+		std::vector<int> pos(rootstart.begin(), rootstart.end()-1);
+		for (unsigned int i = primaries; i<nodes.size(); i++) byroot[pos[nodes[i].root]++] = i;
+	}
+	for (int k = rootstart[primary]; k<rootstart[primary+1]; k++)
+	{
+		const Node &n = nodes[byroot[k]];
+		TouchSegment g;
+		g.org	= n.org;
+		g.dir	= n.dir;
+		g.len	= n.rez.hit ? ~(n.rez.hitpos-n.org) : 1e30f; // rez.len isn't a distance for every primitive
+		g.lit	= n.rez.hit && !n.rez.light;
+		out.push_back(g);
+	}
+}
 
-				sc.sceneobjects[oindex] = new Triangle(vector(x,y,z),vector(x1,y1,z1),vector(x2,y2,z2),vector(r, g, b),refl,refr,diff,spec);
-				sc.sceneobjects[oindex]->light = false;
-				oindex++;
-			}
-			else
-			if (type == "s")
-			{
-				float x, y, z, r, g, b, refl, refr, diff, spec, radius;
-			    in >> x >> y >> z >> r >> g >> b >> refl >> refr >> diff >> spec >> radius;       //now read the whitespace-separated floats
 
-				bool light = (in.peek()==EOF)?false:true;  // peek character
+// Renders tiles of the canvas, one tile per call. Tiles are independent, so this runs on all cores.
+#define RAYTRACER_RAYBATCH 64 // Pixels whose primary rays are generated at once
+struct TileRenderer
+{
+	CanvasData		*canv;
+	Camera			cam;
+	unsigned int	*order;		// Pixel order inside tile, see BuildPixelOrder
+	int				ordersize;
+	TouchBuffer		*touch;		// If set, objects seen by each pixel are recorded there
+	DirtyRegion		*dirty;		// If set, only pixels it Needs are traced, rest are kept
+	GBuffer			*gbuf;		// If set, primary hits are cached there
+	bool			relight;	// Shade from gbuf instead of tracing primary rays
+	RenderJob		*job;		// If set, gets finished tiles and may cancel the rest
+	int				samples;	// Per pixel, RAYTRACER_SUBSAMPLES or less for drafts
+	PrimaryRaster	*raster;	// If set, first hits of primary rays are rasterized
+	Checkpoint		*checkpoint;	// If set, gets finished tiles and already has some
+	volatile LONG	traced;		// Pixels traced, for RedrawDirty
+
+	void operator()(int tile)
+	{
+		if (job && job->IsCancelled()) return;
+		if (sc.broken) return;	// Told why already
+		if (checkpoint && checkpoint->IsTileDone(tile)) return; // Restored into canvas
+		RAYTRACER_PROFILE_SCOPE_ARG("tile", tile);
+		CanvasTile t = canv->LockTile(tile%canv->GetTilesX(), tile/canv->GetTilesX());
+		if (!t.data) return; // Couldn't page it in, leave it black
+
+		// Depth/id buffer of the whole tile, row by row, samples of a pixel next to each other
+		ShadeBatch trees;
+		trees.SetSpread(~cam.Right/~(cam.LowLeftCorner+cam.Right*(canv->GetWidth()*0.5f)-cam.Up*(canv->GetHeight()*0.5f))); // At image center
+		std::vector<RasterSample> rs;
+		if (raster && !relight)
+		{
+			int count = t.w*t.h*samples;
+			std::vector<float> rx(count), ry(count), rdx(count), rdy(count), rdz(count);
+			for (int ty = 0; ty<t.h; ty++)
+				for (int tx = 0; tx<t.w; tx++)
+					for (int s = 0; s<samples; s++)
+					{
+						rx[(ty*t.w+tx)*samples+s] = t.x0+tx+SubsampleX[s];
+						ry[(ty*t.w+tx)*samples+s] = t.y0+ty+SubsampleY[s];
+					}
+			cam.GenerateRays(&rx[0], &ry[0], count, &rdx[0], &rdy[0], &rdz[0]);
+			rs.resize(count);
+			raster->RasterTile(t.x0, t.y0, t.w, t.h, samples, &rdx[0], &rdy[0], &rdz[0], &rs[0]);
+			trees.SetRaster(raster, &rs[0]);
+		}
 
-				sc.sceneobjects[oindex] = new Sphere(vector(x,y,z),vector(0,0,0),vector(r,g,b),refl,refr,diff,spec,radius);
-				sc.sceneobjects[oindex]->light = light;
-				oindex++;
-			}
-			else
-			if (type == "c")
+		// Rays of a whole batch of pixels are made at once, then traced in curve order
+		float	x[RAYTRACER_RAYBATCH*RAYTRACER_SUBSAMPLES], y[RAYTRACER_RAYBATCH*RAYTRACER_SUBSAMPLES];
+		float	dx[RAYTRACER_RAYBATCH*RAYTRACER_SUBSAMPLES], dy[RAYTRACER_RAYBATCH*RAYTRACER_SUBSAMPLES], dz[RAYTRACER_RAYBATCH*RAYTRACER_SUBSAMPLES];
+		Pixel*	out[RAYTRACER_RAYBATCH];
+		unsigned __int64* seen[RAYTRACER_RAYBATCH];
+		int		px[RAYTRACER_RAYBATCH], py[RAYTRACER_RAYBATCH];
+		int		sample[RAYTRACER_RAYBATCH];	// First raster sample of pixel, -1 if there is no raster
+		LONG	count = 0;
+		std::vector<TouchSegment> tilesegs, segs;	// Secondary rays for touch, of tile and of pixel
+		for (int k = 0; k<ordersize; )
+		{
+			int n = 0;
+			for (; k<ordersize && n<RAYTRACER_RAYBATCH; k++)
 			{
-				float x, y, z, dx, dy, dz;
-			    in >> x >> y >> z >> dx >> dy >> dz;       //now read the whitespace-separated floats
-
-				sc.campos = vector(x,y,z);
-				sc.camdir = !vector(dx,dy,dz);
-				// Camera is not a real element, so do not increment oindex here!
+				int tx = order[k]&0xFFFF, ty = order[k]>>16;
+				if (tx>=t.w || ty>=t.h) continue; // Partial tile
+				out[n] = &t.data[ty*t.stride+tx];
+				px[n] = t.x0+tx;
+				py[n] = t.y0+ty;
+				seen[n] = touch ? &touch->At(px[n], py[n]) : NULL;
+				sample[n] = rs.empty() ? -1 : (ty*t.w+tx)*samples;
+				for (int s = 0; s<samples; s++)
+				{
+					x[n*samples+s] = t.x0+tx+SubsampleX[s];
+					y[n*samples+s] = t.y0+ty+SubsampleY[s];
+				}
+				n++;
 			}
-			else
-			if (type == "p")
-			{
-				float x, y, z, nx, ny, nz, r, g, b, refl, refr, diff, spec;
-			    in >> x >> y >> z >> nx >> ny >> nz >> r >> g >> b >> refl >> refr >> diff >> spec;       //now read the whitespace-separated floats
-
-				sc.sceneobjects[oindex] = new Plane(vector(x,y,z),vector(nx,ny,nz),vector(r,g,b),refl,refr,diff,spec);
-				sc.sceneobjects[oindex]->light = false;
+			cam.GenerateRays(x, y, n*samples, dx, dy, dz);
 
-				oindex++;
+			// Whole ray trees of pixels that need it are traced first, see ShadeBatch
+			bool need[RAYTRACER_RAYBATCH];
+			int first[RAYTRACER_RAYBATCH];
+			trees.Clear();
+			for (int p = 0; p<n; p++)
+			{
+				int s0 = p*samples;
+				vector *hits = seen[p] ? touch->Hits(px[p], py[p]) : NULL;
+				int segcount = 0;
+				const TouchSegment *oldseg = dirty&&seen[p] ? touch->Segments(px[p], py[p], segcount) : NULL;
+				need[p] = !dirty || dirty->Needs(*seen[p], hits, oldseg, segcount, cam.pos, dx+s0, dy+s0, dz+s0, samples);
+				if (!need[p] && seen[p]) touch->KeepSegments(px[p], py[p], tilesegs);
+				if (!need[p] || relight) continue;
+				first[p] = trees.AddPrimary(cam.pos, vector(dx[s0], dy[s0], dz[s0]), sample[p]);
+				for (int s = s0+1; s<s0+samples; s++)
+					trees.AddPrimary(cam.pos, vector(dx[s], dy[s], dz[s]), sample[p]<0 ? -1 : sample[p]+s-s0);
 			}
-			else
+			if (!relight) trees.Trace();
+
+			for (int p = 0; p<n; p++)
 			{
-				std::wstring err = L"Error during .scene file parsing. Unknown token:\"";
-				err+=std::wstring(type.begin(),type.end()); // Avoid using printf with something that user can mess around with!
-				err+=L"\"";
-				MessageBox(NULL, err.c_str(), L".scene file failed to parse!", MB_OK|MB_ICONWARNING);
-				return;
+				if (!need[p]) continue; // Nothing it saw has changed
+				int s0 = p*samples;
+				vector *hits = seen[p] ? touch->Hits(px[p], py[p]) : NULL;
+				GSample *cache = gbuf ? gbuf->At(px[p], py[p]) : NULL;
+				vector Color(0,0,0);
+				unsigned __int64 touched = 0;
+				// Naive supersampling antialiasing. Could be optimized with edge detection, but will mess with gradients otherwise!
+				for (int s = s0; s<s0+samples; s++)
+				{
+					traceresp rez;
+					if (relight) rez = gbuf->Shade(cache[s-s0], cam.pos, vector(dx[s], dy[s], dz[s]));
+					else
+					{
+						rez = trees.Result(first[p]+s-s0);
+						if (cache) gbuf->Store(cache[s-s0], rez);
+					}
+					Color = Color + rez.color;
+					touched |= rez.touched;
+					if (hits) hits[s-s0] = rez.hit&&!rez.light ? rez.hitpos : TouchBuffer::NoHit();
+				}
+				Color = Color/(float)samples;
+
+				*out[p] = (int(Color.x) << 16) + (int(Color.y) << 8) + int(Color.z);
+				if (seen[p])
+				{
+					*seen[p] = touched;
+					segs.clear();
+					if (!relight)
+						for (int s = s0; s<s0+samples; s++) trees.GetSegments(first[p]+s-s0, segs);
+					touch->SetSegments(px[p], py[p], tilesegs, segs.empty() ? NULL : &segs[0], (int)segs.size());
+				}
+				count++;
 			}
 		}
+		if (touch) touch->EndTile(tile, tilesegs);
+		if (sc.broken)	// Tile may miss objects, it must not look finished
+		{
+			canv->UnlockTile(t);
+			return;
+		}
+		if (checkpoint) checkpoint->SaveTile(tile, t);
+		canv->UnlockTile(t);
+		InterlockedExchangeAdd(&traced, count);
+		if (job) job->TileFinished(tile);
 	}
-	else
+};
+
+static int RunTileRenderer(CanvasData &canv, TouchBuffer *touch, DirtyRegion *dirty, GBuffer *gbuf = NULL, bool relight = false, RenderJob *job = NULL)
+{
+	RAYTRACER_PROFILE_SCOPE("render");
+	sc.UpdateShading(); // Materials may have been edited since Init, see gbuffer.h
+	// Camera stuffs
+	TileRenderer tr;
+	tr.canv	= &canv;
+	tr.cam	= Camera(sc.campos, sc.camdir, sc.camfov, sc.camaspect);
+	tr.cam.Setup(canv.GetWidth(), canv.GetHeight());
+	tr.touch	= touch;
+	tr.dirty	= dirty;
+	tr.gbuf		= gbuf;
+	tr.relight	= relight;
+	tr.job		= job;
+	tr.samples	= job ? job->GetSamples() : RAYTRACER_SUBSAMPLES;
+	if (tr.samples!=RAYTRACER_SUBSAMPLES)
+		tr.touch = NULL, tr.gbuf = NULL, tr.relight = false; // They keep all samples of every pixel
+	tr.checkpoint	= NULL;
+	tr.traced	= 0;
+	// Not worth binning the whole scene for a few dirty pixels
+	PrimaryRaster raster;
+	tr.raster	= NULL;
+	if (RAYTRACER_RASTER && !relight && !dirty && raster.Setup(tr.cam, canv.GetWidth(), canv.GetHeight(), canv.GetTileSize()))
+		tr.raster = &raster;
+
+	std::vector<unsigned int> order;
+	BuildPixelOrder(canv.GetTileSize(), RAYTRACER_DEFAULT_PIXELORDER, order);
+	tr.order		= &order[0];
+	tr.ordersize	= (int)order.size();
+
+	// For every tile. Only tiles being rendered are paged in, so out-of-core canvas
+	// needs as much memory as there are cores, not as the image is big.
+	ParallelFor(canv.GetTilesX()*canv.GetTilesY(), tr, job ? job->GetThreads() : 0);
+	if (gbuf && !relight && !(job && job->IsCancelled())) gbuf->Fill(tr.cam);
+	return tr.traced;
+}
+
+void raytracer::DrawRaytraced(CanvasData &canv, TouchBuffer *touch, GBuffer *gbuf, RenderJob *job)
+{
+	if (touch && (touch->GetWidth()!=canv.GetWidth() || touch->GetHeight()!=canv.GetHeight() || touch->GetTileSize()!=canv.GetTileSize()))
+		touch = NULL; // Stale buffer from other resolution, don't record into it
+	if (gbuf && (gbuf->GetWidth()!=canv.GetWidth() || gbuf->GetHeight()!=canv.GetHeight()))
+		gbuf = NULL;
+	RunTileRenderer(canv, touch, NULL, gbuf, false, job);
+}
+
+void raytracer::Relight(CanvasData &canv, GBuffer &gbuf)
+{
+	if (gbuf.GetWidth()!=canv.GetWidth() || gbuf.GetHeight()!=canv.GetHeight())
+		gbuf = GBuffer(canv.GetWidth(), canv.GetHeight());
+	Camera cam(sc.campos, sc.camdir, sc.camfov, sc.camaspect);
+	RunTileRenderer(canv, NULL, NULL, &gbuf, gbuf.Matches(cam));
+}
+
+int raytracer::RedrawDirty(CanvasData &canv, TouchBuffer &touch, DirtyRegion &dirty)
+{
+	if (touch.GetWidth()!=canv.GetWidth() || touch.GetHeight()!=canv.GetHeight() || touch.GetTileSize()!=canv.GetTileSize())
 	{
-		// We can fail to load the file, which is unlikely actually
-		std::wstring err = L"Raytracer engine has failed to load scene!\nUnable to find or open the file: \"";
-		err+=std::wstring(file.begin(),file.end()); // Avoid using printf with something that user can mess around with!
-		err+=L"\"";
-		MessageBox(NULL, err.c_str(), L"Scene Loading Failed", MB_OK|MB_ICONWARNING);
-		return;
+		// Nothing is known about this canvas, start over
+		touch = TouchBuffer(canv.GetWidth(), canv.GetHeight(), canv.GetTileSize());
+		RunTileRenderer(canv, &touch, NULL);
+		dirty.Clear();
+		return canv.GetWidth()*canv.GetHeight();
 	}
-	sc.Init();
+	if (dirty.IsEmpty()) return 0;
+	int traced = RunTileRenderer(canv, &touch, &dirty);
+	dirty.Clear();
+	return traced;
+}
+
+// Global tile index -> view and tile inside it
+struct ViewsRenderer
+{
+	TileRenderer	*views;
+	int				*first;	// First global tile of every view, plus total at the end
+	int				count;
+
+	void operator()(int tile)
+	{
+		int v = (int)(std::upper_bound(first, first+count+1, tile)-first)-1;
+		views[v](tile-first[v]);
+	}
+};
+
+void raytracer::DrawViews(std::vector<RenderView> &views, const RenderSettings *settings)
+{
+	RAYTRACER_PROFILE_SCOPE("render");
+	if (views.empty()) return;
+	RenderSettings defaults;
+	const RenderSettings &s = settings ? *settings : defaults;
+	sc.UpdateShading();
+	std::vector<TileRenderer> tr(views.size());
+	std::vector<PrimaryRaster> rasters(s.raster ? views.size() : 0);
+	std::vector<int> first(views.size()+1, 0);
+	std::vector< std::vector<unsigned int> > orders(views.size());
+	for (unsigned int v = 0; v<views.size(); v++)
+	{
+		CanvasData &canv = *views[v].canv;
+		TileRenderer &t = tr[v];
+		t.canv		= &canv;
+		t.cam		= Camera(views[v].pos, views[v].dir, views[v].fov, views[v].aspect);
+		t.cam.Setup(canv.GetWidth(), canv.GetHeight());
+		t.touch		= NULL;
+		t.dirty		= NULL;
+		t.gbuf		= NULL;
+		t.relight	= false;
+		t.job		= NULL;
+		t.samples	= RAYTRACER_SUBSAMPLES;
+		t.raster	= NULL;
+		t.checkpoint	= views[v].checkpoint;
+		if (s.raster)
+		{
+			if (rasters[v].Setup(t.cam, canv.GetWidth(), canv.GetHeight(), canv.GetTileSize()))
+				t.raster = &rasters[v];
+		}
+		t.traced	= 0;
+		BuildPixelOrder(canv.GetTileSize(), (PixelOrder)s.pixelorder, orders[v]);
+		t.order		= &orders[v][0];
+		t.ordersize	= (int)orders[v].size();
+		first[v+1]	= first[v]+canv.GetTilesX()*canv.GetTilesY();
+	}
+	ViewsRenderer vr;
+	vr.views	= &tr[0];
+	vr.first	= &first[0];
+	vr.count	= (int)views.size();
+	ParallelFor(first[views.size()], vr, s.threads);
+}
+
+// Triangles of one .obj go into arena one after another, so they end up contiguous
+static void AddOBJTriangle(vector &a, vector &b, vector &c, vector &color, float refl, float refr, float diff, float spec, int &oindex)
+{
+	Triangle *tri = new (sc.arena) Triangle(a,b,c,color,refl,refr,diff,spec);
+	tri->light = false;
+	sc.sceneobjects.push_back(tri);
+	oindex++;
 }
 
-void raytracer::InsertOBJ(std::string file, vector color, float refl, float refr, float diff, float spec, int &oindex)
+bool raytracer::InsertOBJ(std::string file, vector color, float refl, float refr, float diff, float spec, int &oindex, bool lod, std::string &error)
 {
+	RAYTRACER_PROFILE_SCOPE("InsertOBJ");
 	if(file.empty()||file.compare(std::string(""))==0){
-		MessageBox(NULL,  L"No .obj filename specified!", L"Obj Loading Failed", MB_OK|MB_ICONWARNING);
-		return;
+		error = "No .obj filename specified";
+		return false;
 	}
 	// Load all of that .obj goodness
 	// .obj parser
@@ -523,11 +1054,8 @@ void raytracer::InsertOBJ(std::string file, vector color, float refl, float refr
 	else
 	{	
 		// We can fail to load the file, which is unlikely actually
-		std::wstring err = L"Raytracer engine has failed to load obj!\nUnable to find or open the file: \"";
-		err+=std::wstring(file.begin(),file.end()); // Avoid using printf with something that user can mess around with!
-		err+=L"\"";
-		MessageBox(NULL, err.c_str(), L"Obj Loading Failed", MB_OK|MB_ICONWARNING);
-		return;
+		error = "Unable to find or open .obj file: \""+file+"\"";
+		return false;
 	} 
 
 	// This is one of most horrendous, unloved pieces of code I produced
@@ -539,7 +1067,7 @@ void raytracer::InsertOBJ(std::string file, vector color, float refl, float refr
 	int rm = 0;				// Reading mode
 	int vc = 0;				// Vertex count(vector of vertices)
 	//int oc = 0;				// Object count(scene)
-	std::vector<vector*> vv;	// Vectices in a vector
+	std::vector<vector> vv;	// Vectices in a vector
 	// 0 - Expecting defining token(v,vn,vp,f)
 	// 1,4,7 - reading face, expecting first, 4 for UV, 7 for normal
 	// 2,5,8 - -//- second
@@ -547,6 +1075,7 @@ void raytracer::InsertOBJ(std::string file, vector color, float refl, float refr
 	// 10 - reading vertex, first number of vector
 	// 11 - reading v2
 	// 12 - v3
+	std::vector<int> faces;	// Vertex indices, 3 per triangle, 0-based
 	int		i1,i2,i3; // Numbers corresponding to triangles
 	int		u1,u2,u3; // Numbers corresponding to UV coords - DEPREC
 	int		n1,n2,n3; // Numbers corresponding to normals   - DEPREC
@@ -589,17 +1118,17 @@ void raytracer::InsertOBJ(std::string file, vector color, float refl, float refr
 				case 3:
 					sscanf(smallstr.c_str(),"%i",&i3);
 					if (str[i]=='/') rm=6; 
-					else{sc.sceneobjects[oindex] = new Triangle(*vv[i1-1],*vv[i2-1],*vv[i3-1],color,refl,refr,diff,spec);sc.sceneobjects[oindex]->light = false;oindex++;rm=0;};
+					else{faces.push_back(i1-1);faces.push_back(i2-1);faces.push_back(i3-1);rm=0;};
 					break;
 				case 6:
 					if (!smallstr.empty()) sscanf(smallstr.c_str(),"%i",&u3);
 					if (str[i]=='/') rm=9;
-					else{sc.sceneobjects[oindex] = new Triangle(*vv[i1-1],*vv[i2-1],*vv[i3-1],color,refl,refr,diff,spec);sc.sceneobjects[oindex]->light = false;oindex++;rm=0;}; 
+					else{faces.push_back(i1-1);faces.push_back(i2-1);faces.push_back(i3-1);rm=0;}; 
 					break;
 				case 9:
 					if (!smallstr.empty()) sscanf(smallstr.c_str(),"%i",&n3);
 					if (str[i]=='/') rm=0;
-					else{sc.sceneobjects[oindex] = new Triangle(*vv[i1-1],*vv[i2-1],*vv[i3-1],color,refl,refr,diff,spec);sc.sceneobjects[oindex]->light = false;oindex++;rm=0;};
+					else{faces.push_back(i1-1);faces.push_back(i2-1);faces.push_back(i3-1);rm=0;};
 					break;
 				case 10:
 					sscanf(smallstr.c_str(),"%f",&p1); rm=11;break;
@@ -607,7 +1136,7 @@ void raytracer::InsertOBJ(std::string file, vector color, float refl, float refr
 					sscanf(smallstr.c_str(),"%f",&p2); rm=12;break;
 				case 12:
 					sscanf(smallstr.c_str(),"%f",&p3); 
-					vc++; vv.push_back(new vector(p1,p2,p3));
+					vc++; vv.push_back(vector(p1,p2,p3));
 					rm=0; break;
 				};
 
@@ -620,69 +1149,67 @@ void raytracer::InsertOBJ(std::string file, vector color, float refl, float refr
 		}
            
     }
+
+	// Big meshes asked for it become one object with simplified levels, see lodmesh.h
+	if (RAYTRACER_LOD && lod && faces.size()/3>=RAYTRACER_LOD_MINTRIS)
+	{
+		LODMesh *mesh = new LODMesh(vv, faces, color, refl, refr, diff, spec);
+		sc.owned.push_back(mesh);
+		sc.sceneobjects.push_back(mesh);
+		oindex++;
+		return true;
+	}
+	for (unsigned int f = 0; f<faces.size(); f+=3)
+		AddOBJTriangle(vv[faces[f]],vv[faces[f+1]],vv[faces[f+2]],color,refl,refr,diff,spec,oindex);
+	return true;
 };
 
-// Bmp is practically raw data
-// No compression, no loss, exceptionally simple to work with
-void raytracer::SaveRenderImage(std::string file, CanvasData &canv)
+// Is file a missing or older than file b?
+static bool IsStale(std::string a, std::string b)
 {
-	int w			= canv.GetWidth();
-	int h			= canv.GetHeight();
-	int alignedw	= ((w * 3 + 3) & 0xfffffffc); // (sic!) measured in bytes!
+	WIN32_FILE_ATTRIBUTE_DATA fa, fb;
+	if (!GetFileAttributesExA(a.c_str(), GetFileExInfoStandard, &fa)) return true;
+	if (!GetFileAttributesExA(b.c_str(), GetFileExInfoStandard, &fb)) return false;
+	return CompareFileTime(&fa.ftLastWriteTime, &fb.ftLastWriteTime)<0;
+}
 
-	FILE *fp;
-	fp=fopen(file.c_str(),"wb");		// Open file for reading
-    if (fp){							// if file opened successfully
-        BITMAPINFOHEADER BMIH;
-        BMIH.biSize			= sizeof(BITMAPINFOHEADER);
-        BMIH.biSizeImage	= h * alignedw; // we must align rows to 4 bytes format
-        // Create the bitmap for this OpenGL context
-        BMIH.biSize			= sizeof(BITMAPINFOHEADER);
-        BMIH.biWidth		= w;
-        BMIH.biHeight		= h;
-        BMIH.biPlanes		= 1;
-        BMIH.biBitCount		= 24;
-        BMIH.biCompression = BI_RGB;
-
-        BITMAPFILEHEADER bmfh;
-        int nBitsOffset = sizeof(BITMAPFILEHEADER) + BMIH.biSize;
-        LONG lImageSize = BMIH.biSizeImage;
-        LONG lFileSize = nBitsOffset + lImageSize;
-        bmfh.bfType = 'B'+('M' << 8 );	// BMP 'magic number'
-        bmfh.bfOffBits = nBitsOffset;
-        bmfh.bfSize = lFileSize;
-        bmfh.bfReserved1 = bmfh.bfReserved2 = 0;
-
-        //Write the bitmap file header
-        UINT nWrittenFileHeaderSize = fwrite(&bmfh, 1, sizeof(BITMAPFILEHEADER), fp);
-        //And then the bitmap info header
-        UINT nWrittenInfoHeaderSize = fwrite(&BMIH, 1, sizeof(BITMAPINFOHEADER), fp);
-        //Finally, write the image data itself
-		// Dirty tactics!
-		std::string BGR_BMP = "";
-		BGR_BMP.resize(h*alignedw);
-
-		for(int i = 0; i < h; i++) 
+bool raytracer::InsertOOCMesh(std::string file, vector color, float refl, float refr, float diff, float spec, float cachemb, int &oindex, std::string &error)
+{
+	RAYTRACER_PROFILE_SCOPE("InsertOOCMesh");
+	if(file.empty()){
+		error = "No mesh filename specified";
+		return false;
+	}
+	std::string meshfile = file;
+	if (file.size()>4 && _stricmp(file.substr(file.size()-4).c_str(), ".obj")==0)
+	{
+		// Convert once, reuse .rtm afterwards until .obj changes
+		meshfile = file+".rtm";
+		std::string why;
+		if (IsStale(meshfile, file) && !BuildOOCMesh(file, meshfile, why))
 		{
-			for(int j = 0; j < w; j++)
-			{
-				BGR_BMP[i*alignedw+j*3  ] = unsigned char((canv.pixels[(h-1-i)*w+j]&0x000000FF));		// Blue
-				BGR_BMP[i*alignedw+j*3+1] = unsigned char((canv.pixels[(h-1-i)*w+j]&0x0000FF00)>>8);	// Green
-				BGR_BMP[i*alignedw+j*3+2] = unsigned char((canv.pixels[(h-1-i)*w+j]&0x00FF0000)>>16);	// Red		
-			}
-			for (int f = 0; f < alignedw-w*3; f++)	// For anything out of picture size, but before end of alignment
-				BGR_BMP[i*alignedw+w*3+f]=0;
+			error = why+": \""+file+"\"";
+			return false;
 		}
-		fwrite((BGR_BMP.c_str()), h*alignedw, sizeof(unsigned char), fp);
-        fclose(fp);
-    }
-	else
-	{	
-		// We can fail to load the file, which is unlikely actually
-		std::wstring err = L"Raytracer engine has failed to save image!\nUnable to access or open the file for writing: \"";
-		err+=std::wstring(file.begin(),file.end()); // Avoid using printf with something that user can mess around with!
-		err+=L"\"";
-		MessageBox(NULL, err.c_str(), L"File saving failed", MB_OK|MB_ICONWARNING);
-		return;
-	} 
-}
\ No newline at end of file
+	}
+
+	// 32-bit build can't cache 4 GB and more, it wouldn't have the address space anyway
+	double cachebytes = (double)cachemb*1024*1024;
+	if (cachebytes>=(double)(size_t)-1)
+	{
+		error = "Cache size is too big for this build";
+		return false;
+	}
+	size_t cachelimit = cachemb>0?(size_t)cachebytes:RAYTRACER_OOC_CACHE;
+	OOCMesh *mesh = new OOCMesh(meshfile, color, refl, refr, diff, spec, cachelimit);
+	if (!mesh->IsOpen())
+	{
+		delete mesh;
+		error = "Unable to open out-of-core mesh: \""+meshfile+"\"";
+		return false;
+	}
+	sc.owned.push_back(mesh);
+	sc.sceneobjects.push_back(mesh);
+	oindex++;
+	return true;
+}
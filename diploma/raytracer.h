@@ -3,51 +3,26 @@
 #include <math.h>
 #include <windows.h>
 
+#include "arena.h"
+#include "trirecord.h"
+#include "vecmath.h"
+
 #include <map>
+#include <string>
 #include <vector>
 
 #define RAYTRACER_MAXSAMPLES 16
+#define RAYTRACER_TILESIZE 64						// Render and framebuffer tile side, in pixels
+#define RAYTRACER_INCORE_LIMIT (512u*1024u*1024u)	// Bigger canvases go out-of-core
+#define RAYTRACER_PHONG 5							// Phong exponent, integer so it's a few multiplications
 
 namespace raytracer{
-// Vector struct for dealing with 3D vectors
-struct vector{
-	float x,y,z;
-
-	vector(){}
-	vector(float l, float m, float n){x=l;y=m;z=n;}
-
-	// Addition and subtraction
-	vector operator+(vector r){return vector(x + r.x, y + r.y, z + r.z);}
-	vector operator-(vector r){return vector(x - r.x, y - r.y, z - r.z);}
-	// Unary minus
-	vector operator-(){return vector(-x, -y, -z );}
-	// Multiplication and division
-	vector operator*(double r){return vector(x * r, y * r, z * r);}
-	vector operator/(double r){return vector(x / r, y / r, z / r);}
-
-	// Color trickery
-	vector operator*(vector r){return vector(x * r.x, y * r.y, z * r.z);}
-	vector operator/(vector r){return vector(x / r.x, y / r.y, z / r.z);}
-
-
-	// Vector dot product
-	double operator%(vector r){return x * r.x + y * r.y + z * r.z;}
-	// Cross product
-	vector operator^(vector r){return vector(y * r.z - z * r.y,
-											 z * r.x - x * r.z,
-											 x * r.y - y * r.x);}
-	// Normalizing
-	vector operator!(){ return *this/sqrt(*this%*this); }
-	// Get length
-	float operator~(){ return sqrt(*this%*this); }
-};
-
 // Declare Renderable for traceresp use
 class Renderable;
 
 struct traceresp // Trace response
 {
-	traceresp(){};
+	traceresp(){touched = 0;};
 	traceresp(	bool	Phit,
 				vector	Phitpos		= vector(0,0,0),
 				vector	Phitnormal	= vector(0,0,0),
@@ -71,6 +46,7 @@ struct traceresp // Trace response
 		refr		= Prefr;
 		light		= Plight;
 		obj			= Pobj;
+		touched		= 0;
 	};
 	
 	bool	hit;			// Did we hit
@@ -90,10 +66,15 @@ struct traceresp // Trace response
 	float	refr;			// Refraction coefficient
 	bool	light;			// Is this a point light?
 	Renderable* obj;		// Pointer to hit object
+	unsigned __int64 touched;	// Hash set of objects this ray, rays spawned below it and their shadow rays have hit. See TouchBit.
 };
 
 traceresp GetIntersection(vector Or, vector Dir);
+// Floor or sky, whatever ray gets to when it misses every object
+traceresp GetBackground(vector Or, vector Dir);
 traceresp ColorRaytraceSample(vector Origin, vector Direction, int Samples = 0, float RefrIn=1.f);
+// Lights and colors hit found by GetIntersection, Direction normalized. Shadow and secondary rays are traced from here.
+traceresp ShadeHit(traceresp rez, vector Direction, int Samples = 0, float RefrIn=1.f);
 //---------------------------------------------------------------
 // Convenience typedefs!
 //---------------------------------------------------------------
@@ -102,39 +83,79 @@ typedef unsigned int Pixel;
 //---------------------------------------------------------------
 // CanvasData class - Inspired heavily by Jacco Bikker
 //---------------------------------------------------------------
+// Canvas lives either in one W*H array(GetPixels works), or, for images that won't fit
+// in memory, in a TileStore on disk(see framebuffer.h) where only locked tiles are paged in.
+// Renderer and encoders talk to both through tiles and rows only.
+class TileStore;
+
+struct CanvasTile
+{
+	Pixel*	data;		// First pixel of the tile
+	int		stride;		// Distance between rows, in pixels
+	int		x0, y0;		// Where the tile sits in the image
+	int		w, h;		// Tile size, smaller on right/bottom edges
+	void*	view;		// Mapping to give back, NULL for in-memory canvas
+};
+
 class CanvasData
 {
 public:
 // Functions
 	//Ctor/Dtor
-	CanvasData(int W,int H){
-		Width = W; 
-		Height = H;
-		pixels = new Pixel[W*H];
-	};
-	~CanvasData()
-	{
-		delete [] pixels;
-	};
+	CanvasData(int W,int H,int TileSize = RAYTRACER_TILESIZE);
+	// Out-of-core canvas, empty swapfile means anonymous temporary file
+	CanvasData(int W,int H,std::string swapfile,int TileSize = RAYTRACER_TILESIZE);
+	~CanvasData();
 
 	int GetWidth(){return Width;};
 	int GetHeight(){return Height;};
-	Pixel* GetPixels(){return pixels;};
-	void Clear(Pixel Color)
-	{
-		for (int i = 0; i<Width*Height; i++)
-		{
-			pixels[i] = Color;
-		};
-	};
+	Pixel* GetPixels(){return pixels;};	// NULL for tiled canvas!
+	bool IsTiled(){return store!=NULL;};
+
+	int GetTileSize(){return tilesize;};
+	int GetTilesX(){return (Width+tilesize-1)/tilesize;};
+	int GetTilesY(){return (Height+tilesize-1)/tilesize;};
+	// Tile access, safe to use from several threads as long as tiles differ
+	// data is NULL if tile could not be paged in
+	CanvasTile LockTile(int tx, int ty);
+	void UnlockTile(CanvasTile &tile);
+	// Copy rows [y0,y0+rows) into row-major out, works for both kinds of canvas
+	bool ReadRows(int y0, int rows, Pixel *out);
+
+	void Clear(Pixel Color);
 // Vars
-	Pixel* pixels;		// Pointer to RGBA info
+	Pixel* pixels;		// Pointer to RGBA info, NULL if tiled
 private:
 	int Width,	Height;	// Width, Height, in pixels
-
+	int tilesize;
+	TileStore *store;	// Backing file for tiled canvas
 };
-// Render to canvas
-void DrawRaytraced(CanvasData &canv);
+// In-memory canvas up to RAYTRACER_INCORE_LIMIT bytes, tiled one above that
+CanvasData* CreateCanvas(int W, int H, std::string swapfile = "", int TileSize = RAYTRACER_TILESIZE);
+// Render to canvas. With touch buffer, objects seen by every pixel are recorded too, see dirty.h.
+// With gbuf, primary hits are cached for Relight, see gbuffer.h.
+class TouchBuffer;
+class DirtyRegion;
+// With job, tiles are reported to it and skipped once it's cancelled, see renderjob.h.
+class GBuffer;
+class RenderJob;
+void DrawRaytraced(CanvasData &canv, TouchBuffer *touch = NULL, GBuffer *gbuf = NULL, RenderJob *job = NULL);
+// Re-traces only pixels affected by edits in dirty, returns how many were re-traced
+int RedrawDirty(CanvasData &canv, TouchBuffer &touch, DirtyRegion &dirty);
+// One image of a multi-view render
+class Checkpoint;
+struct RenderView
+{
+	CanvasData	*canv;
+	vector		pos, dir;
+	float		fov, aspect;
+	Checkpoint	*checkpoint;	// If set, finished tiles go there and tiles it has are skipped, see checkpoint.h
+};
+// Renders several views of sc at once. Tiles of all views share one queue, so cores don't idle
+// waiting for the slowest tile of one view before the next view starts.
+// Without settings defaults are used, see autotune.h. Tile size and hierarchy are up to the caller.
+struct RenderSettings;
+void DrawViews(std::vector<RenderView> &views, const RenderSettings *settings = NULL);
 //---------------------------------------------------------------
 // Rendering classes
 //---------------------------------------------------------------
@@ -144,7 +165,10 @@ class Renderable
 {
 public:
 // Funcs
+	virtual ~Renderable(){};
 	virtual traceresp Draw(vector Or, vector Dir) = 0; //(sic!) Infinite ray!
+	// Axis aligned box, false for unbounded things that can't go into acceleration structure
+	virtual bool GetBounds(vector &bmin, vector &bmax){return false;};
 // Vars
 	int id; // Scene id for quick reverse-lookup
 	// Object parameters!
@@ -164,30 +188,79 @@ private:
 
 };
 
+// Named viewpoint, `cam` line of .scene
+struct SceneCamera
+{
+	std::string	name;
+	vector		pos, dir;	// dir normalized
+	float		fov;		// Horizontal, degrees
+	float		aspect;		// 0 for image aspect
+};
+
+// Shading features objects of a scene use, Scene::UpdateShading finds them before every render. Shading is
+// compiled once for every combination(see ShadeHit), a scene runs the one that has no branches or code for
+// what it doesn't use.
+// Reflection has no bit: floor always reflects.
+#define SHADE_REFRACT	1	// Some object refracts
+#define SHADE_DIFFUSE	2	// Some object has diffuse term
+#define SHADE_SPECULAR	4	// Some object has specular term
+#define SHADE_ONELIGHT	8	// Exactly one light, loop over lights is gone
+#define SHADE_VARIANTS	16
+#define SHADE_ALL		(SHADE_REFRACT|SHADE_DIFFUSE|SHADE_SPECULAR)	// Safe for any scene
+
 // The scene itself
+class Accel;	// See accel.h
+
 class Scene 
 {
 public:
 // Funcs
+	Scene();
+	~Scene();
 	traceresp Draw(vector Or, vector Dir); //(sic!) Infinite ray!
 // Init function that enables some optimisation efforts!
 	void Init();
-// Todo: Wipe scene, Load scene, Model Precache!
+// Shading bits from materials as they are now. Init and every render call it, material edits need no Init.
+	void UpdateShading();
+// Wipe scene: arena goes in one step, only owned objects are deleted one by one
+	void Clear();
+// Trade whole contents with other scene in O(1), objects don't move. Used to keep several scenes loaded.
+	void Swap(Scene &other);
+// Todo: Model Precache!
 // Vars
-	std::map<int,Renderable*> sceneobjects;
+	std::vector<Renderable*> sceneobjects;	// Indexed by id, ids are dense
+	SceneArena arena;						// Primitives live here, new (sc.arena) Sphere(...)
+	std::vector<Renderable*> owned;			// Objects holding files/caches, made with plain new
 	vector campos;
 	vector camdir;
+	float camfov;		// Horizontal, degrees
+	float camaspect;	// Frame width/height, 0 for image aspect(square pixels)
+	std::vector<SceneCamera> cameras;	// Extra named views, main camera above is not among them
+	std::vector<std::string> files;	// Files scene was loaded from, .scene first, then meshes
 // Accel: light list
 	std::vector< Renderable* > lights;	// Additional list of lights that are in sceneobjects, but since amt of lights << amt of objects...
+// Accel: bounded objects go into hierarchy, planes are checked one by one
+	int		accelformat;	// AccelFormat to build on Init, RAYTRACER_DEFAULT_ACCEL unless changed
+	int		accelbuild;		// AccelBuild quality preset, RAYTRACER_DEFAULT_ACCELBUILD unless changed
+	Accel*	accel;
+	std::vector< Renderable* > unbounded;
+	int		shading;	// SHADE_* bits, set by UpdateShading
+	volatile LONG broken;	// Object can't be traced right anymore and told why(see oocmesh.h), renders stop until Clear
 };
 
+// Bit of object id in traceresp::touched. 64 bits is a hash set: false positives only cost extra work.
+inline unsigned __int64 TouchBit(int id)
+{
+	return (unsigned __int64)1<<(((unsigned int)id*2654435761u)>>26); // Fibonacci hashing, top 6 bits
+}
+
 // Perfect sphere
 class Sphere: public Renderable
 {
 public:
 // Funcs
 	Sphere();	// Do not call this
-	~Sphere();
+	~Sphere(){};
 	Sphere(vector Pos, vector Ang, vector Color, float Refl, float Refr, float Diff, float Spec, float Radius)
 	{
 		pos		= Pos;		ang		= Ang;
@@ -197,6 +270,12 @@ public:
 	};
 
 	virtual traceresp Draw(vector Or, vector Dir); //(sic!) Infinite ray!
+	virtual bool GetBounds(vector &bmin, vector &bmax)
+	{
+		bmin = pos-vector(radius,radius,radius);
+		bmax = pos+vector(radius,radius,radius);
+		return true;
+	};
 // Vars
 	float	radius; // Radius
 };
@@ -206,7 +285,7 @@ class Plane: public Renderable
 public:
 // Funcs
 	Plane();	// Do not call this
-	~Plane();
+	~Plane(){};
 	// Pos is point, Norm is a NORMAL FROM SURFACE!
 	Plane(vector Pos, vector Norm, vector Color, float Refl, float Refr, float Diff, float Spec)
 	{
@@ -226,26 +305,54 @@ class Triangle: public Renderable
 public:
 // Funcs
 	Triangle();	// Do not call this
-	~Triangle();
+	~Triangle(){};
 	// Pos is point, Norm is a NORMAL FROM SURFACE!
 	Triangle(vector Pos, vector Pos1, vector Pos2, vector Color, float Refl, float Refr, float Diff, float Spec)
 	{
 		pos		= Pos;		pos1	= Pos1;		pos2	= Pos2;
 		color	= Color;	refl	= Refl;		refr	= Refr;
 		diff	= Diff;		spec	= Spec;
+		rec.Setup(pos, pos1, pos2);
 	};
-	// Implementation of http://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
+	// Test itself is in TriangleRecord, see trirecord.h
 	virtual traceresp Draw(vector Or, vector Dir); //(sic!) Infinite ray!
+	virtual bool GetBounds(vector &bmin, vector &bmax)
+	{
+		bmin = vector(min(pos.x,min(pos1.x,pos2.x)), min(pos.y,min(pos1.y,pos2.y)), min(pos.z,min(pos1.z,pos2.z)));
+		bmax = vector(max(pos.x,max(pos1.x,pos2.x)), max(pos.y,max(pos1.y,pos2.y)), max(pos.z,max(pos1.z,pos2.z)));
+		return true;
+	};
 // Vars
 	vector pos1,pos2; // second and third vertices respectively
+	TriangleRecord rec; // Precomputed from vertices, RAYTRACER_TRIANGLE_LAYOUT picks what is kept
 };
 
 
 //---------------------------------------------------------------
 // Current Scene
 //---------------------------------------------------------------
-static Scene sc;
-void LoadScene(std::string file);
-void InsertOBJ(std::string file, vector color, float refl, float refr, float diff, float spec, int &oindex);
-void SaveRenderImage(std::string file, CanvasData &canv);
+extern Scene sc;	// Lives in raytracer.cpp
+// Parses .scene into sc, see sceneparser.h. Bad lines are skipped and reported, the rest of the scene still loads.
+// With errors==NULL problems are shown with ShowError. Returns false if file could not be read or had errors,
+// .obj/.ooc meshes that failed to load count as errors of their line.
+// Hierarchy is built once at the end, with settings' format and preset if given(they win over scene's accel line).
+struct SceneError;
+struct RenderSettings;	// See autotune.h
+bool LoadScene(std::string file, std::vector<SceneError> *errors = NULL, const RenderSettings *settings = NULL);
+// Mesh loaders of .scene lines. False with error set if nothing was added, LoadScene reports it with the line.
+// With lod, meshes of RAYTRACER_LOD_MINTRIS triangles and more become one LODMesh, see lodmesh.h
+bool InsertOBJ(std::string file, vector color, float refl, float refr, float diff, float spec, int &oindex, bool lod, std::string &error);
+// Out-of-core mesh, see oocmesh.h. .obj files are converted to .rtm next to them on first use.
+bool InsertOOCMesh(std::string file, vector color, float refl, float refr, float diff, float spec, float cachemb, int &oindex, std::string &error);
+// False if image couldn't be written, that is shown with ShowError too
+bool SaveRenderImage(std::string file, CanvasData &canv);
+
+//---------------------------------------------------------------
+// Errors
+//---------------------------------------------------------------
+// Problems are shown in a message box. Modes without a window(/render, /tune, /serve, /bench, /selftest)
+// call SetHeadless first, then problems go to stderr instead, so scripts see them and nobody has to click OK.
+// Those modes return a nonzero exit code on failure.
+void SetHeadless();
+void ShowError(std::wstring text, std::wstring title);
 };
\ No newline at end of file
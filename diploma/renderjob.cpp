@@ -0,0 +1,83 @@
+#include "stdafx.h"
+
+#include "renderjob.h"
+#include "profile.h"
+
+#include <process.h>
+
+using namespace raytracer;
+//---------------------------------------------------------------
+// RenderJob
+//---------------------------------------------------------------
+RenderJob::RenderJob(CanvasData &Canv, const RenderOptions &Opts)
+{
+	canv		= &Canv;
+	opts		= Opts;
+	if (opts.samples<1 || opts.samples>RAYTRACER_SUBSAMPLES) opts.samples = RAYTRACER_SUBSAMPLES;
+	thread		= NULL;
+	cancelled	= 0;
+	state		= RENDER_RUNNING;
+	tilesdone	= 0;
+	tilecount	= canv->GetTilesX()*canv->GetTilesY();
+	done.assign(tilecount, 0);
+	InitializeCriticalSection(&lock);
+}
+
+RenderJob::~RenderJob()
+{
+	if (thread)
+	{
+		Cancel();
+		WaitForSingleObject(thread, INFINITE);
+		CloseHandle(thread);
+	}
+	DeleteCriticalSection(&lock);
+}
+
+bool RenderJob::Wait(DWORD timeoutms)
+{
+	return WaitForSingleObject(thread, timeoutms)==WAIT_OBJECT_0;
+}
+
+int RenderJob::TakeFinishedTiles(std::vector<int> &out)
+{
+	EnterCriticalSection(&lock);
+	int n = (int)finished.size();
+	out.insert(out.end(), finished.begin(), finished.end());
+	finished.clear();
+	LeaveCriticalSection(&lock);
+	return n;
+}
+
+void RenderJob::TileFinished(int tile)
+{
+	done[tile] = 1;
+	EnterCriticalSection(&lock);
+	finished.push_back(tile);
+	LeaveCriticalSection(&lock);
+	InterlockedIncrement(&tilesdone);
+	if (opts.ontile) opts.ontile(*this, tile, opts.user);
+}
+
+unsigned __stdcall RenderJob::Run(void *param)
+{
+	RenderJob *job = (RenderJob*)param;
+	ProfileThreadName("render job");
+	DrawRaytraced(*job->canv, job->opts.touch, job->opts.gbuf, job);
+	InterlockedExchange(&job->state, job->tilesdone==job->tilecount ? RENDER_DONE : RENDER_CANCELLED);
+	if (job->opts.ondone) job->opts.ondone(*job, job->opts.user);
+	return 0;
+}
+
+RenderJob* raytracer::StartRender(Scene &scene, CanvasData &canv, const RenderOptions &opts)
+{
+	if (&scene!=&sc) return NULL; // See declaration
+	RenderJob *job = new RenderJob(canv, opts);
+	job->thread = (HANDLE)_beginthreadex(NULL, 0, &RenderJob::Run, job, 0, NULL);
+	if (!job->thread)
+	{
+		delete job;
+		return NULL;
+	}
+	return job;
+}
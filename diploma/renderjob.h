@@ -0,0 +1,96 @@
+#pragma once
+
+#include "raytracer.h"
+#include "camera.h"
+
+#include <windows.h>
+#include <vector>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Background render jobs
+//---------------------------------------------------------------
+// StartRender returns at once, tiles are rendered by a job thread and ParallelFor workers.
+// Cancel is cooperative: tiles already being traced are finished, the rest are skipped.
+// Scene(sc) and canvas must stay untouched until the job is finished - Cancel and Wait first.
+//
+// Usage:
+//	RenderJob *job = StartRender(sc, canv, opts);
+//	while (!job->Wait(100)) ShowProgress(job->GetProgress());
+//	delete job;
+class RenderJob;
+
+typedef void (*RenderTileCallback)(RenderJob &job, int tile, void *user);
+typedef void (*RenderDoneCallback)(RenderJob &job, void *user);
+
+struct RenderOptions
+{
+	RenderOptions(){threads = 0; samples = RAYTRACER_SUBSAMPLES; touch = NULL; gbuf = NULL; ontile = NULL; ondone = NULL; user = NULL;};
+
+	int					threads;	// Max cores to use, 0 - all of them
+	int					samples;	// Per pixel, 1..RAYTRACER_SUBSAMPLES. Less than all for drafts, touch and gbuf are ignored then.
+	TouchBuffer			*touch;		// Passed to DrawRaytraced, only complete if job wasn't cancelled
+	GBuffer				*gbuf;
+	// Called from worker threads right after tile is finished, must be thread-safe and quick
+	RenderTileCallback	ontile;
+	// Called from job thread once, after the last tile or after cancel took effect
+	RenderDoneCallback	ondone;
+	void				*user;		// Given back to callbacks
+};
+
+enum RenderState
+{
+	RENDER_RUNNING,
+	RENDER_DONE,
+	RENDER_CANCELLED
+};
+
+class RenderJob
+{
+public:
+	// Cancels and waits, so it's always safe to delete
+	~RenderJob();
+
+	// Finished tiles/all tiles, 0..1
+	float		GetProgress(){return tilecount ? (float)tilesdone/tilecount : 1.f;};
+	int			GetTilesDone(){return tilesdone;};
+	int			GetTileCount(){return tilecount;};
+	RenderState	GetState(){return (RenderState)state;};
+	CanvasData*	GetCanvas(){return canv;};
+
+	// Ask workers to stop after their current tiles. Returns immediately.
+	void Cancel(){InterlockedExchange(&cancelled, 1);};
+	bool IsCancelled(){return cancelled!=0;};
+	// True once job has finished(either way), false on timeout. INFINITE waits for good.
+	bool Wait(DWORD timeoutms = INFINITE);
+
+	// Partial results: tile index is ty*TilesX+tx, as in CanvasData
+	bool IsTileDone(int tile){return tile>=0 && tile<tilecount && done[tile]!=0;};
+	// Moves tiles finished since last call into out, returns how many were added
+	int  TakeFinishedTiles(std::vector<int> &out);
+
+	// Used by tile renderer
+	void TileFinished(int tile);
+	int  GetThreads(){return opts.threads;};
+	int  GetSamples(){return opts.samples;};
+private:
+	friend RenderJob* StartRender(Scene &scene, CanvasData &canv, const RenderOptions &opts);
+	RenderJob(CanvasData &canv, const RenderOptions &opts);
+	static unsigned __stdcall Run(void *param);
+
+	CanvasData			*canv;
+	RenderOptions		opts;
+	HANDLE				thread;
+	volatile LONG		cancelled;
+	volatile LONG		state;		// RenderState
+	volatile LONG		tilesdone;
+	int					tilecount;
+	std::vector<char>	done;		// Per tile, written once by one worker
+	CRITICAL_SECTION	lock;		// Guards finished
+	std::vector<int>	finished;	// Not yet taken by TakeFinishedTiles
+};
+
+// Starts rendering scene into canv in background. Only the global sc can be rendered for now,
+// the renderer reads it directly. Returns NULL if job thread could not be started.
+RenderJob* StartRender(Scene &scene, CanvasData &canv, const RenderOptions &opts = RenderOptions());
+};
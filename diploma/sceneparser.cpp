@@ -0,0 +1,609 @@
+#include "stdafx.h"
+
+#include "sceneparser.h"
+#include "accel.h"
+#include "autotune.h"
+#include "camera.h"
+#include "parallel.h"
+#include "profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace raytracer;
+//---------------------------------------------------------------
+// Numbers
+//---------------------------------------------------------------
+static const double pow10tab[23] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+bool raytracer::ParseSceneFloat(const char *s, int len, float &out)
+{
+	const char *p = s, *e = s+len;
+	bool neg = false;
+	if (p<e && (*p=='+' || *p=='-')) { neg = *p=='-'; p++; }
+
+	// Up to 19 significant digits go into integer mantissa, the rest only move the exponent
+	unsigned __int64 m = 0;
+	int digits = 0, exp10 = 0;
+	bool any = false;
+	for (; p<e && *p>='0' && *p<='9'; p++, any = true)
+	{
+		if (digits<19) { m = m*10+(*p-'0'); if (m) digits++; }
+		else exp10++;
+	}
+	if (p<e && *p=='.')
+	{
+		for (p++; p<e && *p>='0' && *p<='9'; p++, any = true)
+		{
+			if (digits<19) { m = m*10+(*p-'0'); if (m) digits++; exp10--; }
+		}
+	}
+	if (!any) return false;
+	if (p<e && (*p=='e' || *p=='E'))
+	{
+		p++;
+		bool eneg = false;
+		if (p<e && (*p=='+' || *p=='-')) { eneg = *p=='-'; p++; }
+		if (p>=e || *p<'0' || *p>'9') return false;
+		int ex = 0;
+		for (; p<e && *p>='0' && *p<='9'; p++)
+			if (ex<100000) ex = ex*10+(*p-'0');
+		exp10 += eneg?-ex:ex;
+	}
+	if (p!=e) return false; // Trailing garbage, like "12abc"
+
+	double v;
+	if (m<((unsigned __int64)1<<53) && exp10>=-22 && exp10<=22)
+	{
+		// Both operands exact, so the result is correctly rounded
+		v = exp10<0?(double)m/pow10tab[-exp10]:(double)m*pow10tab[exp10];
+	}
+	else
+	{
+		// Rare, let CRT do the hard work. Mapped text isn't zero-terminated, so copy it out.
+		char buf[64];
+		if (len>=(int)sizeof(buf)) return false;
+		memcpy(buf, s, len);
+		buf[len] = 0;
+		v = strtod(buf, NULL);
+		neg = false; // Sign was in the text
+	}
+	out = (float)(neg?-v:v);
+	return true;
+}
+
+//---------------------------------------------------------------
+// Fingerprint
+//---------------------------------------------------------------
+void raytracer::HashBytes(unsigned __int64 &h, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char*)data;
+	for (size_t i = 0; i<len; i++)
+	{
+		h ^= p[i];
+		h *= 1099511628211ull;
+	}
+}
+
+unsigned __int64 raytracer::HashSceneFile(std::string file)
+{
+	unsigned __int64 h = RAYTRACER_SCENE_HASHBASIS;
+	FILE *fp = fopen(file.c_str(), "rb");
+	if (!fp) return h;
+	char buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp))>0) HashBytes(h, buf, n);
+	fclose(fp);
+	return h;
+}
+
+//---------------------------------------------------------------
+// Tokenizer
+//---------------------------------------------------------------
+// Works right on mapped memory and never reads past end
+struct SceneCursor
+{
+	const char	*p, *end;
+	const char	*linestart;
+	int			line;	// Local to chunk, 0-based
+
+	static bool IsBlank(char c){return c==' ' || c=='\t' || c=='\r' || c=='\v' || c=='\f';}
+
+	bool AtEnd(){return p>=end;};
+	void SkipBlanks(){while (p<end && IsBlank(*p)) p++;};
+	// Next whitespace separated token on this line, false if line has no more
+	bool Token(const char *&tok, int &len)
+	{
+		SkipBlanks();
+		if (p>=end || *p=='\n') return false;
+		tok = p;
+		while (p<end && *p!='\n' && !IsBlank(*p)) p++;
+		len = (int)(p-tok);
+		return true;
+	}
+	// Rest of the line, without surrounding blanks
+	void Rest(const char *&tok, int &len)
+	{
+		SkipBlanks();
+		tok = p;
+		while (p<end && *p!='\n') p++;
+		const char *e = p;
+		while (e>tok && IsBlank(e[-1])) e--;
+		len = (int)(e-tok);
+	}
+	void NextLine()
+	{
+		while (p<end && *p!='\n') p++;
+		if (p<end) p++;
+		linestart = p;
+		line++;
+	}
+	int Col(const char *at){return (int)(at-linestart)+1;};
+};
+
+// One parsed line. Objects are created later, in file order.
+enum SceneRecordType
+{
+	REC_TRIANGLE,
+	REC_SPHERE,
+	REC_PLANE,
+	REC_CAMERA,
+	REC_NAMEDCAMERA,
+	REC_OBJ,
+	REC_LOD,
+	REC_OOC,
+	REC_ACCEL
+};
+
+struct SceneRecord
+{
+	SceneRecordType	type;
+	int				line;
+	float			v[16];
+	bool			light;
+	const char		*path;	// obj/ooc file name or camera name, points into mapped file
+	int				pathlen;
+};
+
+struct SceneChunk
+{
+	const char					*begin, *end;
+	int							lines;		// Lines in this chunk, to number the next ones
+	std::vector<SceneRecord>	records;
+	std::vector<SceneError>		errors;		// Line numbers local until merged
+};
+
+static void SceneFail(SceneChunk &ch, SceneCursor &cur, const char *at, std::string msg)
+{
+	SceneError err;
+	err.line	= cur.line;
+	err.col		= cur.Col(at);
+	err.message	= msg;
+	ch.errors.push_back(err);
+}
+
+static bool TokenIs(const char *tok, int len, const char *word)
+{
+	int i = 0;
+	for (; i<len; i++) if (word[i]!=tok[i]) return false; // Stops on word's 0 too
+	return word[i]==0;
+}
+
+// Plain decimal like -12.345 read right while scanning, so the common token is walked once.
+// False, with cursor untouched, for anything else: ParseSceneFloat on the whole token decides then.
+static bool ScanSceneDecimal(SceneCursor &cur, float &out)
+{
+	const char *p = cur.p, *e = cur.end;
+	bool neg = p<e && *p=='-';
+	if (neg) p++;
+	unsigned __int64 m = 0;
+	const char *digits = p;
+	for (; p<e && (unsigned int)(*p-'0')<10; p++) m = m*10+(*p-'0');
+	int count = (int)(p-digits), frac = 0;
+	if (p<e && *p=='.')
+	{
+		const char *f = ++p;
+		for (; p<e && (unsigned int)(*p-'0')<10; p++) m = m*10+(*p-'0');
+		frac = (int)(p-f);
+		count += frac;
+	}
+	// Up to 15 digits the mantissa and the power of ten are exact, as in ParseSceneFloat's fast path
+	if (!count || count>15 || (p<e && *p!='\n' && !SceneCursor::IsBlank(*p))) return false;
+	double d = frac?(double)m/pow10tab[frac]:(double)m;
+	out = (float)(neg?-d:d);
+	cur.p = p;
+	return true;
+}
+
+// Reads count numbers into v, reports first problem
+static bool SceneNumbers(SceneChunk &ch, SceneCursor &cur, const char *what, float *v, int count)
+{
+	for (int i = 0; i<count; i++)
+	{
+		cur.SkipBlanks();
+		if (ScanSceneDecimal(cur, v[i])) continue;
+		const char *tok;
+		int len;
+		if (!cur.Token(tok, len))
+		{
+			char msg[128];
+			sprintf(msg, "\"%s\" needs %d numbers, found %d", what, count, i);
+			SceneFail(ch, cur, cur.p, msg);
+			return false;
+		}
+		if (!ParseSceneFloat(tok, len, v[i]))
+		{
+			SceneFail(ch, cur, tok, "Not a number: \""+std::string(tok, len)+"\"");
+			return false;
+		}
+	}
+	return true;
+}
+
+// Position, direction, then optional fov and aspect into v[0..7]
+static bool SceneCameraNumbers(SceneChunk &ch, SceneCursor &cur, const char *what, float *v)
+{
+	bool ok = SceneNumbers(ch, cur, what, v, 6);
+	v[6] = RAYTRACER_DEFAULT_FOV;
+	v[7] = 0.f;
+	for (int i = 6; ok && i<8; i++)
+	{
+		const char *opt;
+		int optlen;
+		if (!cur.Token(opt, optlen)) break;
+		if (!ParseSceneFloat(opt, optlen, v[i]) || v[i]<0.f || (i==6 && (v[i]<=0.f || v[i]>=180.f)))
+		{
+			SceneFail(ch, cur, opt, "Bad camera "+std::string(i==6?"fov":"aspect")+": \""+std::string(opt, optlen)+"\"");
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+static void ParseSceneChunk(SceneChunk &ch)
+{
+	SceneCursor cur;
+	cur.p = cur.linestart = ch.begin;
+	cur.end		= ch.end;
+	cur.line	= 0;
+	ch.records.reserve((ch.end-ch.begin)/48+1); // Typical line is ~50-80 chars
+
+	for (; !cur.AtEnd(); cur.NextLine())
+	{
+		const char *tok;
+		int len;
+		if (!cur.Token(tok, len) || tok[0]=='#') continue; // Blank line or comment
+
+		SceneRecord r;
+		r.line	= cur.line;
+		r.light	= false;
+		r.path	= NULL;
+		r.pathlen = 0;
+
+		bool ok;
+		if (TokenIs(tok, len, "t"))
+		{
+			r.type = REC_TRIANGLE;
+			ok = SceneNumbers(ch, cur, "t", r.v, 16);
+		}
+		else
+		if (TokenIs(tok, len, "s"))
+		{
+			r.type = REC_SPHERE;
+			ok = SceneNumbers(ch, cur, "s", r.v, 11);
+			// Anything after radius marks a light. Trailing blanks and \r don't count.
+			const char *flag;
+			int flaglen;
+			r.light = ok && cur.Token(flag, flaglen);
+		}
+		else
+		if (TokenIs(tok, len, "p"))
+		{
+			r.type = REC_PLANE;
+			ok = SceneNumbers(ch, cur, "p", r.v, 13);
+		}
+		else
+		if (TokenIs(tok, len, "c"))
+		{
+			r.type = REC_CAMERA;
+			ok = SceneCameraNumbers(ch, cur, "c", r.v);
+		}
+		else
+		if (TokenIs(tok, len, "cam"))
+		{
+			r.type = REC_NAMEDCAMERA;
+			ok = cur.Token(r.path, r.pathlen);
+			if (!ok) SceneFail(ch, cur, cur.p, "\"cam\" needs a name");
+			else ok = SceneCameraNumbers(ch, cur, "cam", r.v);
+		}
+		else
+		if (TokenIs(tok, len, "obj") || TokenIs(tok, len, "lod") || TokenIs(tok, len, "ooc"))
+		{
+			bool ooc = TokenIs(tok, len, "ooc"), lod = TokenIs(tok, len, "lod");
+			r.type = ooc?REC_OOC:lod?REC_LOD:REC_OBJ;
+			ok = SceneNumbers(ch, cur, ooc?"ooc":lod?"lod":"obj", r.v, ooc?8:7);
+			if (ok)
+			{
+				cur.Rest(r.path, r.pathlen);
+				if (r.pathlen==0)
+				{
+					SceneFail(ch, cur, r.path, "Missing file name");
+					ok = false;
+				}
+			}
+		}
+		else
+		if (TokenIs(tok, len, "accel"))
+		{
+			r.type = REC_ACCEL;
+			const char *preset;
+			int plen;
+			ok = cur.Token(preset, plen);
+			if (!ok)							SceneFail(ch, cur, cur.p, "\"accel\" needs a preset name");
+			else if (TokenIs(preset, plen, "fastbuild"))	r.v[0] = ACCEL_FASTBUILD;
+			else if (TokenIs(preset, plen, "balanced"))		r.v[0] = ACCEL_BALANCED;
+			else if (TokenIs(preset, plen, "fasttrace"))	r.v[0] = ACCEL_FASTTRACE;
+			else
+			{
+				SceneFail(ch, cur, preset, "Unknown acceleration preset: \""+std::string(preset, plen)+"\"");
+				ok = false;
+			}
+		}
+		else
+		{
+			SceneFail(ch, cur, tok, "Unknown token: \""+std::string(tok, len)+"\"");
+			ok = false;
+		}
+
+		if (ok) ch.records.push_back(r);
+	}
+	ch.lines = cur.line;
+}
+
+struct SceneChunkJob
+{
+	SceneChunk *chunks;
+	void operator()(int c)
+	{
+		RAYTRACER_PROFILE_SCOPE_ARG("parse chunk", c);
+		ParseSceneChunk(chunks[c]);
+	};
+};
+
+//---------------------------------------------------------------
+// Loading
+//---------------------------------------------------------------
+// Creates objects from parsed lines, in file order
+// False with error set if a mesh couldn't be loaded
+static bool ApplySceneRecord(SceneRecord &r, int &oindex, std::string &error)
+{
+	float *v = r.v;
+	Renderable *obj = NULL;
+	switch (r.type)
+	{
+	case REC_TRIANGLE:
+		obj = new (sc.arena) Triangle(vector(v[0],v[1],v[2]),vector(v[3],v[4],v[5]),vector(v[6],v[7],v[8]),vector(v[9],v[10],v[11]),v[12],v[13],v[14],v[15]);
+		break;
+	case REC_SPHERE:
+		obj = new (sc.arena) Sphere(vector(v[0],v[1],v[2]),vector(0,0,0),vector(v[3],v[4],v[5]),v[6],v[7],v[8],v[9],v[10]);
+		break;
+	case REC_PLANE:
+		obj = new (sc.arena) Plane(vector(v[0],v[1],v[2]),vector(v[3],v[4],v[5]),vector(v[6],v[7],v[8]),v[9],v[10],v[11],v[12]);
+		break;
+	case REC_CAMERA:
+		sc.campos = vector(v[0],v[1],v[2]);
+		sc.camdir = !vector(v[3],v[4],v[5]);
+		sc.camfov = v[6];
+		sc.camaspect = v[7];
+		// Camera is not a real element, so do not increment oindex here!
+		break;
+	case REC_NAMEDCAMERA:
+		{
+		SceneCamera cam;
+		cam.name	= std::string(r.path, r.pathlen);
+		cam.pos		= vector(v[0],v[1],v[2]);
+		cam.dir		= !vector(v[3],v[4],v[5]);
+		cam.fov		= v[6];
+		cam.aspect	= v[7];
+		unsigned int i = 0;
+		while (i<sc.cameras.size() && sc.cameras[i].name!=cam.name) i++;
+		if (i<sc.cameras.size()) sc.cameras[i] = cam; // Same name again replaces the view
+		else sc.cameras.push_back(cam);
+		break;}
+	case REC_OBJ:
+	case REC_LOD:
+		sc.files.push_back(std::string(r.path, r.pathlen));
+		return InsertOBJ(std::string(r.path, r.pathlen), vector(v[0],v[1],v[2]), v[3], v[4], v[5], v[6], oindex, r.type==REC_LOD, error);
+	case REC_OOC:
+		sc.files.push_back(std::string(r.path, r.pathlen));
+		return InsertOOCMesh(std::string(r.path, r.pathlen), vector(v[0],v[1],v[2]), v[3], v[4], v[5], v[6], v[7], oindex, error);
+	case REC_ACCEL:
+		sc.accelbuild = (int)v[0];
+		break;
+	}
+	if (obj)
+	{
+		obj->light = r.light;
+		sc.sceneobjects.push_back(obj);
+		oindex++;
+	}
+	return true;
+}
+
+static void ShowSceneErrors(std::string file, std::vector<SceneError> &errors)
+{
+	std::wstring err = L"Problems found in \"";
+	err+=std::wstring(file.begin(),file.end()); // Avoid using printf with something that user can mess around with!
+	err+=L"\", these lines were skipped:\n";
+	for (unsigned int i = 0; i<errors.size() && i<RAYTRACER_SCENE_MAXSHOWN; i++)
+	{
+		wchar_t pos[64];
+		swprintf(pos, 64, L"\n%d:%d: ", errors[i].line, errors[i].col);
+		err+=pos;
+		err+=std::wstring(errors[i].message.begin(),errors[i].message.end());
+	}
+	if (errors.size()>RAYTRACER_SCENE_MAXSHOWN)
+	{
+		wchar_t more[64];
+		swprintf(more, 64, L"\n...and %d more", (int)errors.size()-RAYTRACER_SCENE_MAXSHOWN);
+		err+=more;
+	}
+	ShowError(err, L".scene file failed to parse!");
+}
+
+// Whole file couldn't be read, caller wants errors listed instead of shown
+static bool SceneFileError(std::vector<SceneError> *errors, const char *message)
+{
+	SceneError e;
+	e.line		= 0;
+	e.col		= 0;
+	e.message	= message;
+	errors->clear();
+	errors->push_back(e);
+	return false;
+}
+
+// Load .scene file
+// Format, one object per line, lines starting with # are comments:
+// obj r g b refl refr diff spec PATH/FILENAME - loads triangles from obj file
+// lod r g b refl refr diff spec PATH/FILENAME - same, big meshes get levels of detail, see lodmesh.h
+// ooc r g b refl refr diff spec cacheMB PATH/FILENAME - out-of-core mesh from .rtm or .obj, decoded clusters kept under cacheMB
+// t x y z x1 y1 z1 x2 y2 z2 r g b refl refr diff spec - Creates triangle
+// s x y z r g b refl refr diff spec radius	[light] - sphere, [light] may be anything, if found, mark this sphere as point light source
+// c x y z dirx diry dirz [fov [aspect]] - camera, fov is horizontal in degrees, aspect is frame width/height(default is image's)
+// cam name x y z dirx diry dirz [fov [aspect]] - extra named camera for multi-view renders, same name again replaces it
+// p x y z dirx diry dirz r g b refl refr diff spec - plane
+// accel fastbuild|balanced|fasttrace - hierarchy build preset, see accel.h
+bool raytracer::LoadScene(std::string file, std::vector<SceneError> *errors, const RenderSettings *settings)
+{
+	RAYTRACER_PROFILE_SCOPE("LoadScene");
+	if(file.empty()){
+		ShowError(L"No scene filename specified!", L"Scene Loading Failed");
+		return false;
+	}
+	// Wipe scene and acceleration structures, in case we have something loaded
+	sc.Clear();
+	sc.accelbuild = RAYTRACER_DEFAULT_ACCELBUILD;	// Scene may ask for another one
+	sc.files.push_back(file);
+
+	HANDLE fh = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (fh==INVALID_HANDLE_VALUE)
+	{
+		if (errors) return SceneFileError(errors, "unable to find or open the file");
+		// We can fail to load the file, which is unlikely actually
+		std::wstring err = L"Raytracer engine has failed to load scene!\nUnable to find or open the file: \"";
+		err+=std::wstring(file.begin(),file.end()); // Avoid using printf with something that user can mess around with!
+		err+=L"\"";
+		ShowError(err, L"Scene Loading Failed");
+		return false;
+	}
+	// Whole file is mapped at once, 32-bit address space still fits a scene of several hundred MB
+	LARGE_INTEGER fsize;
+	if (!GetFileSizeEx(fh, &fsize) || fsize.QuadPart>0x7FFFFFFF)	// Chunks and lines are counted in int
+	{
+		CloseHandle(fh);
+		if (errors) return SceneFileError(errors, "file is bigger than 2 GB");
+		std::wstring err = L"Raytracer engine has failed to load scene!\nFile is bigger than 2 GB: \"";
+		err+=std::wstring(file.begin(),file.end()); // Avoid using printf with something that user can mess around with!
+		err+=L"\"";
+		ShowError(err, L"Scene Loading Failed");
+		return false;
+	}
+	DWORD size = (DWORD)fsize.QuadPart;
+	HANDLE mapping = size?CreateFileMappingA(fh, NULL, PAGE_READONLY, 0, 0, NULL):NULL;
+	const char *text = mapping?(const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0):NULL;
+	if (size && !text)
+	{
+		if (mapping) CloseHandle(mapping);
+		CloseHandle(fh);
+		if (errors) return SceneFileError(errors, "unable to map the file into memory");
+		std::wstring err = L"Raytracer engine has failed to map scene file into memory: \"";
+		err+=std::wstring(file.begin(),file.end()); // Avoid using printf with something that user can mess around with!
+		err+=L"\"";
+		ShowError(err, L"Scene Loading Failed");
+		return false;
+	}
+
+	// Cut into line-aligned chunks
+	std::vector<SceneChunk> chunks;
+	int want = 1;
+	if (size>RAYTRACER_SCENE_PARALLEL)
+		want = min((int)(size/RAYTRACER_SCENE_CHUNK), GetWorkerCount()*4);
+	const char *pos = text, *end = text+size;
+	for (int c = 0; c<want && pos<end; c++)
+	{
+		const char *cut = c==want-1?end:pos+(end-pos)/(want-c);
+		while (cut<end && cut[-1]!='\n') cut++;
+		SceneChunk ch;
+		ch.begin	= pos;
+		ch.end		= cut;
+		ch.lines	= 0;
+		chunks.push_back(ch);
+		pos = cut;
+	}
+	if (!chunks.empty())
+	{
+		SceneChunkJob job;
+		job.chunks = &chunks[0];
+		ParallelFor((int)chunks.size(), job);
+	}
+
+	// Objects are made in file order, so ids match single threaded parse
+	std::vector<SceneError> found;
+	int oindex = 0, firstline = 1;
+	size_t records = 0;
+	for (unsigned int c = 0; c<chunks.size(); c++) records += chunks[c].records.size();
+	sc.sceneobjects.reserve(records);	// obj lines add more, vector will cope
+	for (unsigned int c = 0; c<chunks.size(); c++)
+	{
+		RAYTRACER_PROFILE_SCOPE_ARG("create objects", c);
+		// Mesh failures go in between parse errors, so the list stays in line order
+		std::vector<SceneError> &parsed = chunks[c].errors;
+		unsigned int e = 0;
+		for (unsigned int i = 0; i<chunks[c].records.size(); i++)
+		{
+			SceneRecord &r = chunks[c].records[i];
+			for (; e<parsed.size() && parsed[e].line<r.line; e++)
+			{
+				found.push_back(parsed[e]);
+				found.back().line += firstline;
+			}
+			std::string meshfail;
+			if (ApplySceneRecord(r, oindex, meshfail)) continue;
+			const char *linestart = r.path;
+			while (linestart>text && linestart[-1]!='\n') linestart--;
+			SceneError err;
+			err.line	= r.line+firstline;
+			err.col		= (int)(r.path-linestart)+1;
+			err.message	= meshfail;
+			found.push_back(err);
+		}
+		for (; e<parsed.size(); e++)
+		{
+			found.push_back(parsed[e]);
+			found.back().line += firstline;
+		}
+		firstline += chunks[c].lines;
+	}
+
+	// obj paths point into the view, so it goes only after everything is applied
+	if (text) UnmapViewOfFile(text);
+	if (mapping) CloseHandle(mapping);
+	CloseHandle(fh);
+
+	if (settings)	// Tuned profile, so the hierarchy isn't built twice
+	{
+		sc.accelformat	= settings->accelformat;
+		sc.accelbuild	= settings->accelbuild;
+	}
+	sc.Init();
+
+	if (errors)
+		errors->swap(found);
+	else if (!found.empty())
+		ShowSceneErrors(file, found);
+	return errors?errors->empty():found.empty();
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "raytracer.h"
+
+#include <string>
+#include <vector>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// .scene parser
+//---------------------------------------------------------------
+// File is memory-mapped and tokenized in place, nothing is allocated per line or per number.
+// Big files are cut into line-aligned chunks that are parsed on all cores, objects are then
+// created in file order, so ids come out the same as with one thread.
+#define RAYTRACER_SCENE_PARALLEL	(1u*1024u*1024u)	// Files bigger than that are parsed in parallel
+#define RAYTRACER_SCENE_CHUNK		(256u*1024u)		// Smallest chunk worth a thread
+#define RAYTRACER_SCENE_MAXSHOWN	20					// Errors listed by ShowError, rest are counted
+
+struct SceneError
+{
+	int			line;	// 1-based, 0 if the file itself couldn't be read
+	int			col;	// 1-based, points at offending token
+	std::string	message;
+};
+
+// Fast float parse of [s,s+len). Whole token must be a number. Plain decimals take the fast path,
+// long mantissas and huge exponents fall back to strtod.
+bool ParseSceneFloat(const char *s, int len, float &out);
+// FNV-1a of scene file contents, to tell whether things made for a scene(checkpoints, tuning) still fit it.
+// Files the scene pulls in aren't part of it. Unreadable file hashes as empty.
+#define RAYTRACER_SCENE_HASHBASIS	14695981039346656037ull
+unsigned __int64 HashSceneFile(std::string file);
+// Adds bytes to FNV-1a hash h
+void HashBytes(unsigned __int64 &h, const void *data, size_t len);
+// LoadScene itself is declared in raytracer.h
+};
@@ -0,0 +1,133 @@
+#include "stdafx.h"
+
+#include "selftest.h"
+#include "dirty.h"
+#include "gbuffer.h"
+
+#include <stdio.h>
+#include <vector>
+
+using namespace raytracer;
+//---------------------------------------------------------------
+// Scenes
+//---------------------------------------------------------------
+// 4x4 spheres standing on the floor, in turn dull, mirror and glass, one light above
+static void BuildSpheresScene()
+{
+	sc.Clear();
+	for (int i = 0; i<16; i++)
+	{
+		float refl = i%3==1 ? 0.5f : 0.f;
+		float refr = i%3==2 ? 1.2f : 0.f;
+		vector pos(-15.f+(i%4)*10.f, (i/4)*10.f, 4.f);
+		vector color((float)(40+i*13), (float)(200-i*9), (float)(90+i*7));
+		sc.sceneobjects.push_back(new (sc.arena) Sphere(pos, vector(0,0,0), color, refl, refr, 0.5f, 0.5f, 4.f));
+	}
+	Sphere *light = new (sc.arena) Sphere(vector(0,10,60), vector(0,0,0), vector(255,255,255), 0, 0, 0.2f, 0.2f, 2.f);
+	light->light = true;
+	sc.sceneobjects.push_back(light);
+	sc.campos		= vector(0,-55,30);
+	sc.camdir		= !vector(0,1,-0.4f);
+	sc.camfov		= RAYTRACER_DEFAULT_FOV;
+	sc.camaspect	= 0;
+	sc.Init();
+}
+
+static std::vector<Pixel> Pixels(CanvasData &canv)
+{
+	std::vector<Pixel> p((size_t)canv.GetWidth()*canv.GetHeight());
+	canv.ReadRows(0, canv.GetHeight(), &p[0]);
+	return p;
+}
+
+//---------------------------------------------------------------
+// Checks
+//---------------------------------------------------------------
+// Edits object id of the spheres scene with edit, redraws dirty pixels and compares with a fresh render
+template<class Edit> static bool CheckDirtyEdit(FILE *fp, const char *name, int id, Edit edit)
+{
+	BuildSpheresScene();
+	const int W = RAYTRACER_SELFTEST_W, H = RAYTRACER_SELFTEST_H;
+	CanvasData canv(W, H), fresh(W, H);
+	TouchBuffer touch(W, H, canv.GetTileSize());
+	DrawRaytraced(canv, &touch);
+	std::vector<Pixel> before = Pixels(canv);
+
+	DirtyRegion dirty;
+	Renderable *obj = sc.sceneobjects[id];
+	dirty.Add(obj);
+	edit(obj);
+	dirty.Commit();
+	int traced = RedrawDirty(canv, touch, dirty);
+	DrawRaytraced(fresh);
+
+	// Wrong pixels are ones redraw missed, changed pixels are what it had to trace at least
+	std::vector<Pixel> got = Pixels(canv), want = Pixels(fresh);
+	int wrong = 0, changed = 0;
+	for (unsigned int i = 0; i<got.size(); i++)
+	{
+		wrong	+= got[i]!=want[i];
+		changed	+= before[i]!=want[i];
+	}
+	bool ok = wrong==0 && changed>0 && traced>=changed && traced<=W*H*RAYTRACER_SELFTEST_DIRTYMAX;
+	fprintf(fp, "%-6s dirty %-26s changed %6d traced %6d of %6d wrong %6d\n", ok ? "PASS" : "FAIL", name, changed, traced, W*H, wrong);
+	return ok;
+}
+
+// Spheres scene without specular highlights, then one sphere gets them and the frame is relit. The
+// shading variant picked before the edit has no specular code, so Relight has to pick it anew.
+static bool CheckRelightFeature(FILE *fp)
+{
+	BuildSpheresScene();
+	for (unsigned int i = 0; i<sc.sceneobjects.size(); i++) sc.sceneobjects[i]->spec = 0;
+	sc.Init();
+	const int W = RAYTRACER_SELFTEST_W, H = RAYTRACER_SELFTEST_H;
+	CanvasData canv(W, H), fresh(W, H);
+	GBuffer gbuf(W, H);
+	DrawRaytraced(canv, NULL, &gbuf);
+	std::vector<Pixel> before = Pixels(canv);
+
+	sc.sceneobjects[0]->spec = 0.8f;
+	Relight(canv, gbuf);
+	DrawRaytraced(fresh);
+
+	std::vector<Pixel> got = Pixels(canv), want = Pixels(fresh);
+	int wrong = 0, changed = 0;
+	for (unsigned int i = 0; i<got.size(); i++)
+	{
+		wrong	+= got[i]!=want[i];
+		changed	+= before[i]!=want[i];
+	}
+	bool ok = wrong==0 && changed>0;
+	fprintf(fp, "%-6s relight %-24s changed %6d wrong %6d\n", ok ? "PASS" : "FAIL", "specular turned on", changed, wrong);
+	return ok;
+}
+
+struct MoveSide
+{
+	void operator()(Renderable *obj){obj->pos = obj->pos+vector(3,0,0);};
+};
+struct Recolor
+{
+	void operator()(Renderable *obj){obj->color = vector(255,20,20);};
+};
+
+int raytracer::RunSelfTest(std::string report)
+{
+	FILE *fp = fopen(report.c_str(), "w");
+	if (!fp)
+	{
+		fprintf(stderr, "Self test failed!\nCan't write %s\n", report.c_str());
+		return 1;
+	}
+	bool ok = true;
+	// Dull corner sphere, seen in mirrors and the floor, and a mirror in the middle
+	ok &= CheckDirtyEdit(fp, "move dull sphere", 0, MoveSide());
+	ok &= CheckDirtyEdit(fp, "move mirror sphere", 4, MoveSide());
+	ok &= CheckDirtyEdit(fp, "recolor glass sphere", 5, Recolor());
+	ok &= CheckRelightFeature(fp);
+	sc.Clear();
+	ok &= !ferror(fp);
+	fclose(fp);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "raytracer.h"
+
+#include <string>
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Self test
+//---------------------------------------------------------------
+// diploma.exe /selftest [report.txt] - renders small built-in scenes and checks what can go wrong
+// quietly, without anyone looking at the image. Every check is a line of the report, PASS or FAIL
+// with numbers. The loaded scene is replaced.
+// Checks:
+//	dirty		Spheres on the reflective floor, some of them mirrors or glass. After one sphere is moved
+//				or recolored, RedrawDirty must give exactly a fresh render, and trace under
+//				RAYTRACER_SELFTEST_DIRTYMAX of the frame.
+//	relight		Same spheres without specular. After one of them gets it, Relight must give a fresh render.
+#define RAYTRACER_SELFTEST_W		160
+#define RAYTRACER_SELFTEST_H		120
+#define RAYTRACER_SELFTEST_DIRTYMAX	0.25	// Redraw share of pixels above which dirty tracking isn't worth having
+
+// Runs all checks, writes report. Returns process exit code: 0 if everything passed.
+int RunSelfTest(std::string report = "selftest.txt");
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include "vecmath.h"
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Triangle intersection records
+//---------------------------------------------------------------
+// Everything Triangle::Draw can work out without a ray is done once, when triangle is made,
+// and kept next to its vertices. Layout is a trade of memory per triangle against work per test:
+//  TRIANGLE_VERTICES	- nothing kept, edges, cross products and normal are redone every test. +0 bytes.
+//  TRIANGLE_EDGES		- both edges and unit normal, Moller-Trumbore skips two subtractions, a cross
+//						  product and a normalize. +36 bytes. Same arithmetic, so same picture as before.
+//  TRIANGLE_WOOP		- affine transform that takes triangle to unit one(Sven Woop's layout). Test is
+//						  three plane dots and a division, no cross products. +48 bytes. Hit points
+//						  differ from Moller-Trumbore at rounding level.
+// Vertices stay in Triangle either way, bounds, hierarchy and meshes use them.
+// All three records are always compiled, so /bench can time them against each other.
+#define TRIANGLE_VERTICES	0
+#define TRIANGLE_EDGES		1
+#define TRIANGLE_WOOP		2
+#ifndef RAYTRACER_TRIANGLE_LAYOUT
+#define RAYTRACER_TRIANGLE_LAYOUT	TRIANGLE_EDGES
+#endif
+#define RAYTRACER_TRIANGLE_EPSILON	0.000001
+
+struct TriangleHit
+{
+	vector	hitpos, hitnormal;	// Normal faces the ray
+	float	len;
+};
+
+// http://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm on given edges.
+// t comes in units of Dir, which is dir*1e3: strangely enough, this produces cleaner results,
+// likely to be another case of floating point rounding errors.
+inline bool MollerTrumbore(const vector &p0, const vector &e1, const vector &e2, const vector &Or, const vector &dir, vector &Dir, double &t)
+{
+	Dir = dir*1e3;
+	//Begin calculating determinant - also used to calculate u parameter
+	vector P = Dir^e2;
+	//if determinant is near zero, ray lies in plane of triangle
+	double det = e1%P;
+	//NOT CULLING
+	if(det > -RAYTRACER_TRIANGLE_EPSILON && det < RAYTRACER_TRIANGLE_EPSILON) return false;
+	double inv_det = 1.f / det;
+	//calculate distance from V1 to ray origin
+	vector T = Or-p0;
+	//Calculate u parameter and test bound
+	double u = (T%P)*inv_det;
+	if(u < 0.f || u > 1.f) return false;
+	//Prepare to test v parameter
+	vector Q = T^e1;
+	double v = (Dir%Q)*inv_det;
+	if(v < 0.f || u + v  > 1.f) return false;
+	t = (e2%Q)*inv_det;
+	return t > RAYTRACER_TRIANGLE_EPSILON;
+}
+
+struct TriangleVertices
+{
+	void Setup(const vector &p0, const vector &p1, const vector &p2){};
+	bool Hit(const vector &p0, const vector &p1, const vector &p2, const vector &Or, const vector &dir, TriangleHit &h) const
+	{
+		vector e1 = p1-p0, e2 = p2-p0, Dir;
+		double t;
+		if (!MollerTrumbore(p0, e1, e2, Or, dir, Dir, t)) return false;
+		h.hitpos	= Or+(Dir)*t;
+		h.hitnormal	= (((e1^e2))%Dir)<0?!(e1^e2):!(e2^e1);
+		h.len		= t*~Dir;
+		return true;
+	};
+};
+
+struct TriangleEdges
+{
+	vector e1, e2;	// pos1-pos, pos2-pos
+	vector n;		// !(e1^e2)
+	void Setup(const vector &p0, const vector &p1, const vector &p2)
+	{
+		e1	= p1-p0;
+		e2	= p2-p0;
+		n	= !(e1^e2);
+	};
+	bool Hit(const vector &p0, const vector &p1, const vector &p2, const vector &Or, const vector &dir, TriangleHit &h) const
+	{
+		vector Dir;
+		double t;
+		if (!MollerTrumbore(p0, e1, e2, Or, dir, Dir, t)) return false;
+		h.hitpos	= Or+(Dir)*t;
+		h.hitnormal	= (n%Dir)<0?n:-n;
+		h.len		= t*~Dir;
+		return true;
+	};
+};
+
+// Inverse of the transform that takes unit triangle (0,0,0),(1,0,0),(0,1,0) to this one, with
+// e1^e2 as its z axis. For a point, first two rows give u and v, third one the distance from
+// the plane in units of |e1^e2|. Each is a dot and an add.
+struct TriangleWoop
+{
+	float m[3][4];
+	void Setup(const vector &p0, const vector &p1, const vector &p2)
+	{
+		// Done in double, error of the transform goes into every hit
+		double a[3] = {p1.x-p0.x, p1.y-p0.y, p1.z-p0.z};
+		double b[3] = {p2.x-p0.x, p2.y-p0.y, p2.z-p0.z};
+		double c[3] = {a[1]*b[2]-a[2]*b[1], a[2]*b[0]-a[0]*b[2], a[0]*b[1]-a[1]*b[0]};
+		double det = c[0]*c[0]+c[1]*c[1]+c[2]*c[2]; // det[a b c] = c.c, as c = a x b
+		double p[3] = {p0.x, p0.y, p0.z};
+		double r[3][3];
+		if (det==0)
+		{
+			memset(m, 0, sizeof(m)); // Degenerate, never hit: distance along normal is always 0
+			return;
+		}
+		// Rows of inverse are (b x c, c x a, a x b)/det
+		r[0][0] = b[1]*c[2]-b[2]*c[1]; r[0][1] = b[2]*c[0]-b[0]*c[2]; r[0][2] = b[0]*c[1]-b[1]*c[0];
+		r[1][0] = c[1]*a[2]-c[2]*a[1]; r[1][1] = c[2]*a[0]-c[0]*a[2]; r[1][2] = c[0]*a[1]-c[1]*a[0];
+		r[2][0] = c[0]; r[2][1] = c[1]; r[2][2] = c[2];
+		for (int i = 0; i<3; i++)
+		{
+			double w = 0;
+			for (int k = 0; k<3; k++)
+			{
+				m[i][k] = (float)(r[i][k]/det);
+				w -= r[i][k]/det*p[k];
+			}
+			m[i][3] = (float)w;
+		}
+	};
+	bool Hit(const vector &p0, const vector &p1, const vector &p2, const vector &Or, const vector &dir, TriangleHit &h) const
+	{
+		float dz = m[2][0]*dir.x+m[2][1]*dir.y+m[2][2]*dir.z;
+		if (dz==0) return false; // Parallel to plane
+		float oz = m[2][0]*Or.x+m[2][1]*Or.y+m[2][2]*Or.z+m[2][3];
+		float t = -oz/dz;
+		// Moller-Trumbore takes t over epsilon in units of dir*1e3, keep the same near limit
+		if (!(t > RAYTRACER_TRIANGLE_EPSILON*1e3)) return false;
+		float u = m[0][0]*Or.x+m[0][1]*Or.y+m[0][2]*Or.z+m[0][3] + t*(m[0][0]*dir.x+m[0][1]*dir.y+m[0][2]*dir.z);
+		if (u < 0.f || u > 1.f) return false;
+		float v = m[1][0]*Or.x+m[1][1]*Or.y+m[1][2]*Or.z+m[1][3] + t*(m[1][0]*dir.x+m[1][1]*dir.y+m[1][2]*dir.z);
+		if (v < 0.f || u + v > 1.f) return false;
+		vector n = !vector(m[2][0], m[2][1], m[2][2]);
+		h.hitpos	= Or+dir*t;
+		h.hitnormal	= (n%dir)<0?n:-n;
+		h.len		= t*~dir;
+		return true;
+	};
+};
+
+#if RAYTRACER_TRIANGLE_LAYOUT==TRIANGLE_WOOP
+typedef TriangleWoop		TriangleRecord;
+#elif RAYTRACER_TRIANGLE_LAYOUT==TRIANGLE_EDGES
+typedef TriangleEdges		TriangleRecord;
+#else
+typedef TriangleVertices	TriangleRecord;
+#endif
+};
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <math.h>
+#include <string.h>
+#include <windows.h>	// min/max
+#include <xmmintrin.h>	// SSE
+#include <emmintrin.h>	// SSE2
+
+#ifndef RAYTRACER_SSE
+#define RAYTRACER_SSE	1	// 0 - plain C++ everywhere, for checking SIMD paths against
+#endif
+#ifndef RAYTRACER_AVX
+#define RAYTRACER_AVX	0	// float8 in one ymm register, needs /arch:AVX and an AVX CPU
+#endif
+#ifndef RAYTRACER_FMA
+#define RAYTRACER_FMA	0	// Fused multiply-add, needs FMA3 CPU and a compiler that has _mm_fmadd_ps(VS2012+)
+#endif
+#if RAYTRACER_AVX || RAYTRACER_FMA
+#include <immintrin.h>
+#endif
+
+namespace raytracer{
+//---------------------------------------------------------------
+// Vector maths
+//---------------------------------------------------------------
+// vector stays three plain floats. It is passed by value all over the place, and MSVC on x86
+// can't pass 16-byte aligned types by value(C2719), so a __m128 inside it is not an option.
+// All of its maths is float though: no trips through double, normalizing is rsqrt estimate
+// plus one Newton step. Hot code works on batches of eight in vector8(SoA, one lane per ray
+// or per primitive), passed by reference.
+
+// 1/sqrt(x) from the hardware estimate(12 bits) and one Newton-Raphson step(~22 bits)
+inline float RcpSqrt(float x)
+{
+#if RAYTRACER_SSE
+	__m128 v = _mm_set_ss(x);
+	__m128 r = _mm_rsqrt_ss(v);
+	// r*(1.5-0.5*x*r*r)
+	r = _mm_mul_ss(r, _mm_sub_ss(_mm_set_ss(1.5f), _mm_mul_ss(_mm_mul_ss(_mm_set_ss(0.5f), v), _mm_mul_ss(r, r))));
+	return _mm_cvtss_f32(r);
+#else
+	return 1.f/sqrtf(x);
+#endif
+}
+
+// Vector struct for dealing with 3D vectors
+struct vector{
+	float x,y,z;
+
+	vector(){}
+	vector(float l, float m, float n){x=l;y=m;z=n;}
+
+	// Addition and subtraction
+	vector operator+(const vector &r) const {return vector(x + r.x, y + r.y, z + r.z);}
+	vector operator-(const vector &r) const {return vector(x - r.x, y - r.y, z - r.z);}
+	// Unary minus
+	vector operator-() const {return vector(-x, -y, -z );}
+	// Multiplication and division
+	vector operator*(float r) const {return vector(x * r, y * r, z * r);}
+	vector operator/(float r) const {return vector(x / r, y / r, z / r);}
+
+	// Color trickery
+	vector operator*(const vector &r) const {return vector(x * r.x, y * r.y, z * r.z);}
+	vector operator/(const vector &r) const {return vector(x / r.x, y / r.y, z / r.z);}
+
+
+	// Vector dot product
+	float operator%(const vector &r) const {return x * r.x + y * r.y + z * r.z;}
+	// Cross product
+	vector operator^(const vector &r) const {return vector(y * r.z - z * r.y,
+														   z * r.x - x * r.z,
+														   x * r.y - y * r.x);}
+	// Normalizing
+	vector operator!() const { return *this*RcpSqrt(*this%*this); }
+	// Get length
+	float operator~() const { return sqrtf(*this%*this); }
+};
+
+//---------------------------------------------------------------
+// float8/vector8 - eight lanes, structure of arrays
+//---------------------------------------------------------------
+// One ymm with RAYTRACER_AVX, two xmm otherwise. Comparisons give lane masks(all bits set or clear)
+// that go into Select, And/Or, or MoveMask for a bit per lane. Load/Store want 32-byte aligned memory,
+// LoadU takes any.
+#define RAYTRACER_LANES 8
+
+#if !RAYTRACER_SSE
+// Lane mask as float bits, scalar fallback only
+inline float MaskLane(bool b)
+{
+	unsigned int u = b ? 0xFFFFFFFFu : 0u;
+	float f;
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+inline bool LaneSet(float f)
+{
+	unsigned int u;
+	memcpy(&u, &f, sizeof(u));
+	return u!=0;
+}
+#endif
+
+struct float8
+{
+#if RAYTRACER_AVX
+	__m256 v;
+	float8(){}
+	float8(__m256 m){v = m;}
+	explicit float8(float s){v = _mm256_set1_ps(s);}
+	static float8 Load(const float *p){return _mm256_load_ps(p);}
+	static float8 LoadU(const float *p){return _mm256_loadu_ps(p);}
+	void Store(float *p) const {_mm256_store_ps(p, v);}
+	float8 operator+(const float8 &r) const {return _mm256_add_ps(v, r.v);}
+	float8 operator-(const float8 &r) const {return _mm256_sub_ps(v, r.v);}
+	float8 operator*(const float8 &r) const {return _mm256_mul_ps(v, r.v);}
+	float8 operator/(const float8 &r) const {return _mm256_div_ps(v, r.v);}
+	float8 operator<(const float8 &r) const {return _mm256_cmp_ps(v, r.v, _CMP_LT_OQ);}
+	float8 operator<=(const float8 &r) const {return _mm256_cmp_ps(v, r.v, _CMP_LE_OQ);}
+	float8 operator>(const float8 &r) const {return _mm256_cmp_ps(v, r.v, _CMP_GT_OQ);}
+	float8 operator>=(const float8 &r) const {return _mm256_cmp_ps(v, r.v, _CMP_GE_OQ);}
+	float8 operator&(const float8 &r) const {return _mm256_and_ps(v, r.v);}
+	float8 operator|(const float8 &r) const {return _mm256_or_ps(v, r.v);}
+#elif RAYTRACER_SSE
+	__m128 lo, hi;
+	float8(){}
+	float8(__m128 l, __m128 h){lo = l; hi = h;}
+	explicit float8(float s){lo = hi = _mm_set1_ps(s);}
+	static float8 Load(const float *p){return float8(_mm_load_ps(p), _mm_load_ps(p+4));}
+	static float8 LoadU(const float *p){return float8(_mm_loadu_ps(p), _mm_loadu_ps(p+4));}
+	void Store(float *p) const {_mm_store_ps(p, lo); _mm_store_ps(p+4, hi);}
+	float8 operator+(const float8 &r) const {return float8(_mm_add_ps(lo, r.lo), _mm_add_ps(hi, r.hi));}
+	float8 operator-(const float8 &r) const {return float8(_mm_sub_ps(lo, r.lo), _mm_sub_ps(hi, r.hi));}
+	float8 operator*(const float8 &r) const {return float8(_mm_mul_ps(lo, r.lo), _mm_mul_ps(hi, r.hi));}
+	float8 operator/(const float8 &r) const {return float8(_mm_div_ps(lo, r.lo), _mm_div_ps(hi, r.hi));}
+	float8 operator<(const float8 &r) const {return float8(_mm_cmplt_ps(lo, r.lo), _mm_cmplt_ps(hi, r.hi));}
+	float8 operator<=(const float8 &r) const {return float8(_mm_cmple_ps(lo, r.lo), _mm_cmple_ps(hi, r.hi));}
+	float8 operator>(const float8 &r) const {return float8(_mm_cmpgt_ps(lo, r.lo), _mm_cmpgt_ps(hi, r.hi));}
+	float8 operator>=(const float8 &r) const {return float8(_mm_cmpge_ps(lo, r.lo), _mm_cmpge_ps(hi, r.hi));}
+	float8 operator&(const float8 &r) const {return float8(_mm_and_ps(lo, r.lo), _mm_and_ps(hi, r.hi));}
+	float8 operator|(const float8 &r) const {return float8(_mm_or_ps(lo, r.lo), _mm_or_ps(hi, r.hi));}
+#else
+	float f[RAYTRACER_LANES];
+	float8(){}
+	explicit float8(float s){for (int i = 0; i<RAYTRACER_LANES; i++) f[i] = s;}
+	static float8 Load(const float *p){float8 r; memcpy(r.f, p, sizeof(r.f)); return r;}
+	static float8 LoadU(const float *p){return Load(p);}
+	void Store(float *p) const {memcpy(p, f, sizeof(f));}
+#define RAYTRACER_LANEWISE(op, expr) float8 op(const float8 &r) const {float8 o; for (int i = 0; i<RAYTRACER_LANES; i++) o.f[i] = (expr); return o;}
+	RAYTRACER_LANEWISE(operator+, f[i]+r.f[i])
+	RAYTRACER_LANEWISE(operator-, f[i]-r.f[i])
+	RAYTRACER_LANEWISE(operator*, f[i]*r.f[i])
+	RAYTRACER_LANEWISE(operator/, f[i]/r.f[i])
+	RAYTRACER_LANEWISE(operator<, MaskLane(f[i]<r.f[i]))
+	RAYTRACER_LANEWISE(operator<=, MaskLane(f[i]<=r.f[i]))
+	RAYTRACER_LANEWISE(operator>, MaskLane(f[i]>r.f[i]))
+	RAYTRACER_LANEWISE(operator>=, MaskLane(f[i]>=r.f[i]))
+	RAYTRACER_LANEWISE(operator&, MaskLane(LaneSet(f[i]) && LaneSet(r.f[i])))
+	RAYTRACER_LANEWISE(operator|, MaskLane(LaneSet(f[i]) || LaneSet(r.f[i])))
+#undef RAYTRACER_LANEWISE
+#endif
+};
+
+inline float8 MulAdd(const float8 &a, const float8 &b, const float8 &c)
+{
+#if RAYTRACER_AVX && RAYTRACER_FMA
+	return _mm256_fmadd_ps(a.v, b.v, c.v);
+#elif RAYTRACER_SSE && RAYTRACER_FMA
+	return float8(_mm_fmadd_ps(a.lo, b.lo, c.lo), _mm_fmadd_ps(a.hi, b.hi, c.hi));
+#else
+	return a*b+c;
+#endif
+}
+
+inline float8 Min(const float8 &a, const float8 &b)
+{
+#if RAYTRACER_AVX
+	return _mm256_min_ps(a.v, b.v);
+#elif RAYTRACER_SSE
+	return float8(_mm_min_ps(a.lo, b.lo), _mm_min_ps(a.hi, b.hi));
+#else
+	float8 o;
+	for (int i = 0; i<RAYTRACER_LANES; i++) o.f[i] = min(a.f[i], b.f[i]);
+	return o;
+#endif
+}
+
+inline float8 Max(const float8 &a, const float8 &b)
+{
+#if RAYTRACER_AVX
+	return _mm256_max_ps(a.v, b.v);
+#elif RAYTRACER_SSE
+	return float8(_mm_max_ps(a.lo, b.lo), _mm_max_ps(a.hi, b.hi));
+#else
+	float8 o;
+	for (int i = 0; i<RAYTRACER_LANES; i++) o.f[i] = max(a.f[i], b.f[i]);
+	return o;
+#endif
+}
+
+inline float8 Sqrt(const float8 &a)
+{
+#if RAYTRACER_AVX
+	return _mm256_sqrt_ps(a.v);
+#elif RAYTRACER_SSE
+	return float8(_mm_sqrt_ps(a.lo), _mm_sqrt_ps(a.hi));
+#else
+	float8 o;
+	for (int i = 0; i<RAYTRACER_LANES; i++) o.f[i] = sqrtf(a.f[i]);
+	return o;
+#endif
+}
+
+inline float8 Abs(const float8 &a)
+{
+#if RAYTRACER_AVX
+	return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a.v);
+#elif RAYTRACER_SSE
+	__m128 sign = _mm_set1_ps(-0.f);
+	return float8(_mm_andnot_ps(sign, a.lo), _mm_andnot_ps(sign, a.hi));
+#else
+	float8 o;
+	for (int i = 0; i<RAYTRACER_LANES; i++) o.f[i] = fabsf(a.f[i]);
+	return o;
+#endif
+}
+
+// Estimate plus one Newton step, same as RcpSqrt
+inline float8 RcpSqrt(const float8 &a)
+{
+#if RAYTRACER_AVX
+	float8 r = _mm256_rsqrt_ps(a.v);
+#elif RAYTRACER_SSE
+	float8 r(_mm_rsqrt_ps(a.lo), _mm_rsqrt_ps(a.hi));
+#else
+	float8 r;
+	for (int i = 0; i<RAYTRACER_LANES; i++) r.f[i] = 1.f/sqrtf(a.f[i]);
+	return r;
+#endif
+	return r*(float8(1.5f)-float8(0.5f)*a*r*r);
+}
+
+// mask ? a : b, per lane
+inline float8 Select(const float8 &mask, const float8 &a, const float8 &b)
+{
+#if RAYTRACER_AVX
+	return _mm256_blendv_ps(b.v, a.v, mask.v);
+#elif RAYTRACER_SSE
+	return float8(_mm_or_ps(_mm_and_ps(mask.lo, a.lo), _mm_andnot_ps(mask.lo, b.lo)),
+				  _mm_or_ps(_mm_and_ps(mask.hi, a.hi), _mm_andnot_ps(mask.hi, b.hi)));
+#else
+	float8 o;
+	for (int i = 0; i<RAYTRACER_LANES; i++) o.f[i] = LaneSet(mask.f[i]) ? a.f[i] : b.f[i];
+	return o;
+#endif
+}
+
+// Bit i set if lane i of mask is set
+inline int MoveMask(const float8 &mask)
+{
+#if RAYTRACER_AVX
+	return _mm256_movemask_ps(mask.v);
+#elif RAYTRACER_SSE
+	return _mm_movemask_ps(mask.lo) | (_mm_movemask_ps(mask.hi)<<4);
+#else
+	int m = 0;
+	for (int i = 0; i<RAYTRACER_LANES; i++) if (LaneSet(mask.f[i])) m |= 1<<i;
+	return m;
+#endif
+}
+
+struct vector8
+{
+	float8 x, y, z;
+
+	vector8(){}
+	vector8(const float8 &l, const float8 &m, const float8 &n){x = l; y = m; z = n;}
+	explicit vector8(const vector &a){x = float8(a.x); y = float8(a.y); z = float8(a.z);}	// Same vector in all lanes
+
+	vector8 operator+(const vector8 &r) const {return vector8(x+r.x, y+r.y, z+r.z);}
+	vector8 operator-(const vector8 &r) const {return vector8(x-r.x, y-r.y, z-r.z);}
+	vector8 operator*(const float8 &r) const {return vector8(x*r, y*r, z*r);}
+};
+
+inline float8 Dot(const vector8 &a, const vector8 &b)
+{
+	return MulAdd(a.x, b.x, MulAdd(a.y, b.y, a.z*b.z));
+}
+
+inline vector8 Cross(const vector8 &a, const vector8 &b)
+{
+	return vector8(a.y*b.z-a.z*b.y, a.z*b.x-a.x*b.z, a.x*b.y-a.y*b.x);
+}
+
+inline vector8 Normalize(const vector8 &a)
+{
+	return a*RcpSqrt(Dot(a, a));
+}
+};